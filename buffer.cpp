@@ -0,0 +1,123 @@
+#include "buffer.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  //---------------------------------------------------------------------------
+  template <typename T>
+  void UpdatePlane(vector<T>* plane, size_t numPixels, u32 mask, u32 oldMask, u32 aov, T value)
+  {
+    if (mask & aov)
+    {
+      if (!(oldMask & aov))
+        plane->assign(numPixels, value);
+    }
+    else
+    {
+      vector<T>().swap(*plane);
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+Buffer::Buffer(int width, int height, int tileSize)
+    : width(width)
+    , height(height)
+    , tileSize(tileSize)
+    , numTilesX((width + tileSize - 1) / tileSize)
+    , numTilesY((height + tileSize - 1) / tileSize)
+    , buffer(new Color[width * height])
+{
+}
+
+//---------------------------------------------------------------------------
+Buffer::~Buffer()
+{
+  delete[] buffer;
+}
+
+//---------------------------------------------------------------------------
+Tile Buffer::GetTile(int tileIdx) const
+{
+  Tile tile;
+  tile.x0 = (tileIdx % numTilesX) * tileSize;
+  tile.y0 = (tileIdx / numTilesX) * tileSize;
+  tile.x1 = min(tile.x0 + tileSize, width);
+  tile.y1 = min(tile.y0 + tileSize, height);
+  return tile;
+}
+
+//---------------------------------------------------------------------------
+void Buffer::EnableAovs(u32 mask)
+{
+  // allocates the newly enabled planes, with the miss values, and frees the rest
+  size_t numPixels = (size_t)width * height;
+  AovSample miss;
+  UpdatePlane(&depth, numPixels, mask, aovs, AOV_DEPTH, miss.depth);
+  for (int i = 0; i < 3; ++i)
+  {
+    UpdatePlane(&normal[i], numPixels, mask, aovs, AOV_NORMAL, miss.normal[i]);
+    UpdatePlane(&albedo[i], numPixels, mask, aovs, AOV_ALBEDO, miss.albedo[i]);
+  }
+  UpdatePlane(&materialId, numPixels, mask, aovs, AOV_MATERIAL_ID, miss.materialId);
+  UpdatePlane(&objectId, numPixels, mask, aovs, AOV_OBJECT_ID, miss.objectId);
+  UpdatePlane(&sampleCount, numPixels, mask, aovs, AOV_SAMPLE_COUNT, miss.sampleCount);
+
+  aovs = mask;
+}
+
+//---------------------------------------------------------------------------
+void Buffer::SetAovs(int x, int y, const AovSample& sample)
+{
+  size_t idx = (size_t)y * width + x;
+  if (aovs & AOV_DEPTH)
+    depth[idx] = sample.depth;
+
+  if (aovs & AOV_NORMAL)
+  {
+    for (int i = 0; i < 3; ++i)
+      normal[i][idx] = sample.normal[i];
+  }
+
+  if (aovs & AOV_ALBEDO)
+  {
+    for (int i = 0; i < 3; ++i)
+      albedo[i][idx] = sample.albedo[i];
+  }
+
+  if (aovs & AOV_MATERIAL_ID)
+    materialId[idx] = sample.materialId;
+  if (aovs & AOV_OBJECT_ID)
+    objectId[idx] = sample.objectId;
+  if (aovs & AOV_SAMPLE_COUNT)
+    sampleCount[idx] = sample.sampleCount;
+}
+
+//---------------------------------------------------------------------------
+void Buffer::AddAovs(int x, int y, const AovSample& sample, u32 n)
+{
+  AovSample mean = sample;
+  if (n > 1)
+  {
+    size_t idx = (size_t)y * width + x;
+    float w = 1.f / n;
+    if (aovs & AOV_DEPTH)
+      mean.depth = depth[idx] + (sample.depth - depth[idx]) * w;
+    for (int i = 0; i < 3; ++i)
+    {
+      if (aovs & AOV_NORMAL)
+        mean.normal[i] = normal[i][idx] + (sample.normal[i] - normal[i][idx]) * w;
+      if (aovs & AOV_ALBEDO)
+        mean.albedo[i] = albedo[i][idx] + (sample.albedo[i] - albedo[i][idx]) * w;
+    }
+  }
+  SetAovs(x, y, mean);
+}
+
+//---------------------------------------------------------------------------
+void Buffer::TileDone(int tileIdx)
+{
+  for (TileListener* listener : listeners)
+    listener->TileDone(*this, tileIdx);
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "pbr_math.hpp"
+
+namespace pbr
+{
+  struct Buffer;
+
+  // Told when the renderer has finished writing a tile. Called from the render
+  // threads, so several tiles can be reported at the same time.
+  struct TileListener
+  {
+    virtual ~TileListener() {}
+    virtual void TileDone(const Buffer& buffer, int tileIdx) = 0;
+  };
+
+  enum AovFlags : u32
+  {
+    // distance along the camera ray to the first hit, 0 on a miss
+    AOV_DEPTH = 1 << 0,
+    // first hit normal, 0 on a miss
+    AOV_NORMAL = 1 << 1,
+    // diffuse color of the first hit material, 1 on a miss
+    AOV_ALBEDO = 1 << 2,
+    // Material::id and Geo::id of the first hit, INVALID_ID on a miss. The object id
+    // is per Geo, not per triangle; the triangle meshes only report a distance, so
+    // their hits have none
+    AOV_MATERIAL_ID = 1 << 3,
+    AOV_OBJECT_ID = 1 << 4,
+    // number of samples that went into the pixel
+    AOV_SAMPLE_COUNT = 1 << 5,
+
+    // what the denoiser uses as guides
+    AOV_DENOISE_GUIDES = AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO,
+  };
+
+  const u32 INVALID_ID = ~0u;
+
+  // first hit values for a pixel, the defaults are the values for a miss
+  struct AovSample
+  {
+    float depth = 0;
+    Vector3 normal = Vector3(0, 0, 0);
+    Color albedo = Color(1, 1, 1);
+    u32 materialId = INVALID_ID;
+    u32 objectId = INVALID_ID;
+    u32 sampleCount = 0;
+  };
+
+  // pixel rect [x0, x1) x [y0, y1)
+  struct Tile
+  {
+    int x0, y0, x1, y1;
+  };
+
+  //---------------------------------------------------------------------------
+  // Linear framebuffer, that the renderers fill a tile at a time. The tiles are only
+  // a grid on top of the rows, so anything that reads whole rows still works.
+  struct Buffer
+  {
+    static const int DEFAULT_TILE_SIZE = 32;
+
+    Buffer(int width, int height, int tileSize = DEFAULT_TILE_SIZE);
+    ~Buffer();
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(Buffer&) = delete;
+
+    int NumTiles() const { return numTilesX * numTilesY; }
+    Tile GetTile(int tileIdx) const;
+    Color* Row(int y) const { return buffer + (size_t)y * width; }
+
+    // tells the listeners that the tile has been written
+    void TileDone(int tileIdx);
+
+    // Optional outputs besides the color (AOVs), enabled with a mask of AOV_ flags.
+    // Only the enabled ones are allocated, and the integrators skip the writes
+    // entirely when none are. They're planar, so filters can load a lane's worth of
+    // neighbours at a time.
+    void EnableAovs(u32 mask);
+    bool HasAov(u32 aov) const { return (aovs & aov) == aov; }
+    void SetAovs(int x, int y, const AovSample& sample);
+    // Folds the sample's depth, normal and albedo into the mean of the n - 1 before
+    // it, for a pixel rendered in passes, and sets the rest. Guides that are just
+    // the last pass' first hit don't match the averaged color along edges
+    void AddAovs(int x, int y, const AovSample& sample, u32 n);
+
+    int width, height;
+    int tileSize;
+    int numTilesX, numTilesY;
+    Color* buffer;
+    vector<TileListener*> listeners;
+
+    u32 aovs = 0;
+    vector<float> depth;
+    vector<float> normal[3];
+    vector<float> albedo[3];
+    vector<u32> materialId;
+    vector<u32> objectId;
+    vector<u32> sampleCount;
+  };
+}
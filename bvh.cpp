@@ -0,0 +1,188 @@
+#include "bvh.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  const u32 NUM_BINS = 16;
+  const float TRAVERSAL_COST = 1.0f;
+  const float INTERSECT_COST = 1.0f;
+  // past this depth only median splits are made, which keeps the tree within the
+  // traversal stack size
+  const u32 MAX_SAH_DEPTH = 64;
+}
+
+//---------------------------------------------------------------------------
+float Aabb::SurfaceArea() const
+{
+  if (IsEmpty())
+    return 0;
+  Vector3 d = mx - mn;
+  return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+//---------------------------------------------------------------------------
+bool Aabb::Intersect(const Vector3& o, const Vector3& invDir, float tMax, float* tNear) const
+{
+  float t0 = 0;
+  float t1 = tMax;
+  for (int i = 0; i < 3; ++i)
+  {
+    float tA = ((&mn.x)[i] - (&o.x)[i]) * (&invDir.x)[i];
+    float tB = ((&mx.x)[i] - (&o.x)[i]) * (&invDir.x)[i];
+    t0 = max(t0, min(tA, tB));
+    t1 = min(t1, max(tA, tB));
+  }
+
+  *tNear = t0;
+  return t0 <= t1;
+}
+
+//---------------------------------------------------------------------------
+void Bvh::Build(const vector<Aabb>& primBounds, u32 maxLeafSize)
+{
+  nodes.clear();
+  primIndices.resize(primBounds.size());
+  if (primBounds.empty())
+    return;
+
+  vector<Vector3> centroids(primBounds.size());
+  for (u32 i = 0; i < (u32)primBounds.size(); ++i)
+  {
+    primIndices[i] = i;
+    centroids[i] = primBounds[i].Center();
+  }
+
+  nodes.reserve(2 * primBounds.size());
+  BuildRecursive(primBounds, centroids, 0, (u32)primBounds.size(), min(maxLeafSize, 0xffffu), 0);
+}
+
+//---------------------------------------------------------------------------
+u32 Bvh::BuildRecursive(const vector<Aabb>& primBounds,
+    const vector<Vector3>& centroids,
+    u32 start,
+    u32 end,
+    u32 maxLeafSize,
+    u32 depth)
+{
+  u32 nodeIdx = (u32)nodes.size();
+  nodes.push_back(BvhNode());
+  u32 count = end - start;
+
+  Aabb bounds, centroidBounds;
+  for (u32 i = start; i < end; ++i)
+  {
+    bounds.Grow(primBounds[primIndices[i]]);
+    centroidBounds.Grow(centroids[primIndices[i]]);
+  }
+
+  nodes[nodeIdx].bounds = bounds;
+  nodes[nodeIdx].axis = 0;
+
+  auto makeLeaf = [&]()
+  {
+    nodes[nodeIdx].offset = start;
+    nodes[nodeIdx].count = (u16)count;
+    return nodeIdx;
+  };
+
+  if (count <= 1)
+    return makeLeaf();
+
+  // split along the axis with the largest centroid extent
+  Vector3 extent = centroidBounds.mx - centroidBounds.mn;
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+  float axisMin = (&centroidBounds.mn.x)[axis];
+  float axisExtent = (&extent.x)[axis];
+
+  if (axisExtent <= 0)
+  {
+    // all centroids are in the same spot, so there is nothing to split on
+    if (count <= 0xffff)
+      return makeLeaf();
+  }
+
+  u32 mid = start;
+  if (axisExtent > 0 && depth < MAX_SAH_DEPTH)
+  {
+    // bin the centroids, and evaluate the SAH cost at each bin boundary
+    Aabb binBounds[NUM_BINS];
+    u32 binCounts[NUM_BINS] = { 0 };
+    float binScale = NUM_BINS / axisExtent * 0.9999f;
+    for (u32 i = start; i < end; ++i)
+    {
+      u32 b = (u32)(((&centroids[primIndices[i]].x)[axis] - axisMin) * binScale);
+      binCounts[b]++;
+      binBounds[b].Grow(primBounds[primIndices[i]]);
+    }
+
+    float rightArea[NUM_BINS];
+    u32 rightCount[NUM_BINS];
+    Aabb acc;
+    u32 accCount = 0;
+    for (u32 i = NUM_BINS - 1; i > 0; --i)
+    {
+      acc.Grow(binBounds[i]);
+      accCount += binCounts[i];
+      rightArea[i] = acc.SurfaceArea();
+      rightCount[i] = accCount;
+    }
+
+    float bestCost = FLT_MAX;
+    u32 bestSplit = 0;
+    acc = Aabb();
+    accCount = 0;
+    for (u32 i = 1; i < NUM_BINS; ++i)
+    {
+      acc.Grow(binBounds[i - 1]);
+      accCount += binCounts[i - 1];
+      if (accCount == 0 || rightCount[i] == 0)
+        continue;
+      float cost = acc.SurfaceArea() * accCount + rightArea[i] * rightCount[i];
+      if (cost < bestCost)
+      {
+        bestCost = cost;
+        bestSplit = i;
+      }
+    }
+
+    float invArea = 1 / max(bounds.SurfaceArea(), 1e-20f);
+    float leafCost = INTERSECT_COST * count;
+    float splitCost = TRAVERSAL_COST + INTERSECT_COST * bestCost * invArea;
+    if (bestSplit == 0 || (count <= maxLeafSize && leafCost <= splitCost))
+    {
+      if (count <= maxLeafSize)
+        return makeLeaf();
+    }
+    else
+    {
+      mid = (u32)(std::partition(&primIndices[start],
+                      &primIndices[0] + end,
+                      [&](u32 idx)
+                      {
+                        return (u32)(((&centroids[idx].x)[axis] - axisMin) * binScale) < bestSplit;
+                      })
+                  - &primIndices[0]);
+    }
+  }
+
+  if (mid == start || mid == end)
+  {
+    // SAH didn't give a usable split, so fall back to a median split
+    mid = start + count / 2;
+    std::nth_element(&primIndices[start],
+        &primIndices[mid],
+        &primIndices[0] + end,
+        [&](u32 a, u32 b)
+        {
+          return (&centroids[a].x)[axis] < (&centroids[b].x)[axis];
+        });
+  }
+
+  nodes[nodeIdx].axis = (u16)axis;
+  BuildRecursive(primBounds, centroids, start, mid, maxLeafSize, depth + 1);
+  u32 right = BuildRecursive(primBounds, centroids, mid, end, maxLeafSize, depth + 1);
+  nodes[nodeIdx].offset = right;
+  nodes[nodeIdx].count = 0;
+  return nodeIdx;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include "pbr_math.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  struct Aabb
+  {
+    Aabb() : mn(FLT_MAX, FLT_MAX, FLT_MAX), mx(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+    Aabb(const Vector3& mn, const Vector3& mx) : mn(mn), mx(mx) {}
+
+    void Grow(const Vector3& p)
+    {
+      mn = Min(mn, p);
+      mx = Max(mx, p);
+    }
+
+    void Grow(const Aabb& b)
+    {
+      mn = Min(mn, b.mn);
+      mx = Max(mx, b.mx);
+    }
+
+    bool IsEmpty() const { return mn.x > mx.x; }
+    Vector3 Center() const { return 0.5f * (mn + mx); }
+    float SurfaceArea() const;
+
+    // slab test against [0, tMax]. invDir is 1 / ray direction
+    bool Intersect(const Vector3& o, const Vector3& invDir, float tMax, float* tNear) const;
+
+    Vector3 mn, mx;
+  };
+
+  //---------------------------------------------------------------------------
+  struct BvhNode
+  {
+    Aabb bounds;
+    // for leaves, the first primitive in Bvh::primIndices, otherwise the index of the
+    // right child. The left child always directly follows its parent.
+    u32 offset;
+    // number of primitives, 0 for interior nodes
+    u16 count;
+    u16 axis;
+  };
+
+  //---------------------------------------------------------------------------
+  // Binned SAH bounding volume hierarchy over a set of primitive bounds. The
+  // primitives themselves are owned by the user, and are referred to by index.
+  struct Bvh
+  {
+    void Build(const vector<Aabb>& primBounds, u32 maxLeafSize = 4);
+
+    // Calls fn(primIdx, tMax) for the primitives in each leaf the ray passes through.
+    // fn returns the new closest hit distance, which is used to cull the remaining nodes.
+    template <typename Fn>
+    void Traverse(const Ray& ray, float tMax, Fn fn) const;
+
+    // Same as Traverse, but calls fn(slot, tMax) with the primitive's position in
+    // primIndices, for users that keep their primitive data in leaf order
+    template <typename Fn>
+    void TraverseSlots(const Ray& ray, float tMax, Fn fn) const;
+
+    Aabb Bounds() const { return nodes.empty() ? Aabb() : nodes[0].bounds; }
+
+    vector<BvhNode> nodes;
+    vector<u32> primIndices;
+
+  private:
+    u32 BuildRecursive(const vector<Aabb>& primBounds,
+        const vector<Vector3>& centroids,
+        u32 start,
+        u32 end,
+        u32 maxLeafSize,
+        u32 depth);
+  };
+
+  //---------------------------------------------------------------------------
+  template <typename Fn>
+  void Bvh::Traverse(const Ray& ray, float tMax, Fn fn) const
+  {
+    TraverseSlots(ray, tMax, [&](u32 slot, float closest) { return fn(primIndices[slot], closest); });
+  }
+
+  //---------------------------------------------------------------------------
+  template <typename Fn>
+  void Bvh::TraverseSlots(const Ray& ray, float tMax, Fn fn) const
+  {
+    if (nodes.empty())
+      return;
+
+    Vector3 invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    bool dirNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+    u32 stack[128];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+      u32 nodeIdx = stack[--stackSize];
+      const BvhNode& node = nodes[nodeIdx];
+      float tNear;
+      if (!node.bounds.Intersect(ray.o, invDir, tMax, &tNear))
+        continue;
+
+      if (node.count > 0)
+      {
+        for (u32 i = 0; i < node.count; ++i)
+          tMax = fn(node.offset + i, tMax);
+      }
+      else
+      {
+        // visit the near child first
+        if (dirNeg[node.axis])
+        {
+          stack[stackSize++] = nodeIdx + 1;
+          stack[stackSize++] = node.offset;
+        }
+        else
+        {
+          stack[stackSize++] = node.offset;
+          stack[stackSize++] = nodeIdx + 1;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,519 @@
+#include "cluster.hpp"
+#include "mesh.hpp"
+#include <tbb/parallel_for.h>
+
+#pragma warning(disable: 4996)
+
+using namespace pbr;
+
+namespace
+{
+  // on disk layout. Everything is plain floats, so the page file doesn't depend on
+  // how the math types are laid out.
+  struct PageFileHeader
+  {
+    char id[4];
+    u32 version;
+    u64 tableOffset;
+    u32 numClusters;
+    u32 pad;
+  };
+
+  struct DiskClusterInfo
+  {
+    float mn[3], mx[3];
+    u64 fileOffset;
+    u64 size;
+  };
+
+  struct DiskPageHeader
+  {
+    u32 numVerts;
+    u32 numTris;
+    u32 numNodes;
+    u32 pad;
+  };
+
+  struct DiskNode
+  {
+    float mn[3], mx[3];
+    u32 offset;
+    u16 count;
+    u16 axis;
+  };
+
+  const float EPS = 0.00001f;
+
+  //---------------------------------------------------------------------------
+  void ToDisk(const Aabb& b, float* mn, float* mx)
+  {
+    mn[0] = b.mn.x, mn[1] = b.mn.y, mn[2] = b.mn.z;
+    mx[0] = b.mx.x, mx[1] = b.mx.y, mx[2] = b.mx.z;
+  }
+
+  //---------------------------------------------------------------------------
+  Aabb FromDisk(const float* mn, const float* mx)
+  {
+    return Aabb(Vector3(mn[0], mn[1], mn[2]), Vector3(mx[0], mx[1], mx[2]));
+  }
+
+  //---------------------------------------------------------------------------
+  bool Seek(FILE* f, u64 ofs)
+  {
+#ifdef _WIN32
+    return _fseeki64(f, (s64)ofs, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)ofs, SEEK_SET) == 0;
+#endif
+  }
+
+  //---------------------------------------------------------------------------
+  u64 Tell(FILE* f)
+  {
+#ifdef _WIN32
+    return (u64)_ftelli64(f);
+#else
+    return (u64)ftello(f);
+#endif
+  }
+
+  //---------------------------------------------------------------------------
+  // Recursively split the triangles at the centroid median until each part fits
+  // in a cluster
+  void Partition(const vector<Vector3>& centroids,
+      u32* tris,
+      u32 numTris,
+      u32 maxTris,
+      vector<std::pair<u32, u32>>* parts,
+      u32 base)
+  {
+    if (numTris <= maxTris)
+    {
+      parts->push_back({ base, numTris });
+      return;
+    }
+
+    Aabb centroidBounds;
+    for (u32 i = 0; i < numTris; ++i)
+      centroidBounds.Grow(centroids[tris[i]]);
+
+    Vector3 extent = centroidBounds.mx - centroidBounds.mn;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    u32 mid = numTris / 2;
+    std::nth_element(tris, tris + mid, tris + numTris, [&](u32 a, u32 b)
+    {
+      return (&centroids[a].x)[axis] < (&centroids[b].x)[axis];
+    });
+
+    Partition(centroids, tris, mid, maxTris, parts, base);
+    Partition(centroids, tris + mid, numTris - mid, maxTris, parts, base + mid);
+  }
+
+  //---------------------------------------------------------------------------
+  // Partitions one mesh's triangles into clusters, and appends them to the page
+  // file, with their entries in the table
+  void WriteMeshClusters(const float* mtx,
+      const float* srcVerts,
+      u32 numVerts,
+      const u32* indices,
+      u32 numIndices,
+      u32 maxTris,
+      FILE* f,
+      vector<DiskClusterInfo>* table)
+  {
+    vector<Vector3> verts(numVerts);
+    for (u32 i = 0; i < numVerts; ++i)
+    {
+      const float* v = &srcVerts[i * 3];
+      verts[i] = TransformPoint(mtx, Vector3(v[0], v[1], v[2]));
+    }
+
+    u32 numTris = numIndices / 3;
+    vector<u32> tris(numTris);
+    vector<Vector3> centroids(numTris);
+    for (u32 i = 0; i < numTris; ++i)
+    {
+      tris[i] = i;
+      centroids[i] = (verts[indices[i * 3 + 0]] + verts[indices[i * 3 + 1]] + verts[indices[i * 3 + 2]]) / 3;
+    }
+
+    vector<std::pair<u32, u32>> parts;
+    if (numTris > 0)
+      Partition(centroids, tris.data(), numTris, maxTris, &parts, 0);
+
+    // build the BVH for each cluster in parallel, and then write them out in order
+    vector<Bvh> bvhs(parts.size());
+    tbb::parallel_for(size_t(0), parts.size(), [&](size_t i)
+    {
+      vector<Aabb> triBounds(parts[i].second);
+      for (u32 j = 0; j < parts[i].second; ++j)
+      {
+        const u32* idx = &indices[tris[parts[i].first + j] * 3];
+        triBounds[j] = Aabb(Min(verts[idx[0]], Min(verts[idx[1]], verts[idx[2]])),
+            Max(verts[idx[0]], Max(verts[idx[1]], verts[idx[2]])));
+      }
+      bvhs[i].Build(triBounds);
+    });
+
+    vector<u32> remap(numVerts, ~0u);
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+      const Bvh& bvh = bvhs[i];
+      const u32* clusterTris = &tris[parts[i].first];
+
+      // give the cluster its own compact vertex buffer, and store the triangles in
+      // BVH order
+      vector<float> clusterVerts;
+      vector<u32> clusterIndices;
+      vector<u32> used;
+      for (u32 j = 0; j < parts[i].second; ++j)
+      {
+        const u32* idx = &indices[clusterTris[bvh.primIndices[j]] * 3];
+        for (u32 k = 0; k < 3; ++k)
+        {
+          u32& local = remap[idx[k]];
+          if (local == ~0u)
+          {
+            local = (u32)used.size();
+            used.push_back(idx[k]);
+            const Vector3& v = verts[idx[k]];
+            clusterVerts.insert(clusterVerts.end(), { v.x, v.y, v.z });
+          }
+          clusterIndices.push_back(local);
+        }
+      }
+
+      for (u32 v : used)
+        remap[v] = ~0u;
+
+      DiskClusterInfo info;
+      ToDisk(bvh.Bounds(), info.mn, info.mx);
+      info.fileOffset = Tell(f);
+
+      DiskPageHeader page = { (u32)used.size(), parts[i].second, (u32)bvh.nodes.size(), 0 };
+      fwrite(&page, sizeof(page), 1, f);
+      fwrite(clusterVerts.data(), sizeof(float), clusterVerts.size(), f);
+      fwrite(clusterIndices.data(), sizeof(u32), clusterIndices.size(), f);
+
+      for (const BvhNode& node : bvh.nodes)
+      {
+        DiskNode diskNode;
+        ToDisk(node.bounds, diskNode.mn, diskNode.mx);
+        diskNode.offset = node.offset;
+        diskNode.count = node.count;
+        diskNode.axis = node.axis;
+        fwrite(&diskNode, sizeof(diskNode), 1, f);
+      }
+
+      info.size = Tell(f) - info.fileOffset;
+      table->push_back(info);
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+bool Cluster::Intersect(const Ray& ray, float tMax, float* t) const
+{
+  bool hit = false;
+  bvh.Traverse(ray, tMax, [&](u32 triIdx, float closest)
+  {
+    float tt, u, v;
+    IsectTri tri = FetchTri(verts.data(), indices.data(), triIdx);
+    if (RayTriIntersect(ray, tri, &tt, &u, &v) && tt >= EPS && tt < closest)
+    {
+      hit = true;
+      closest = tt;
+      *t = tt;
+    }
+    return closest;
+  });
+
+  return hit;
+}
+
+//---------------------------------------------------------------------------
+size_t Cluster::MemorySize() const
+{
+  return sizeof(Cluster) + verts.size() * sizeof(float) + indices.size() * sizeof(u32)
+         + bvh.nodes.size() * sizeof(BvhNode) + bvh.primIndices.size() * sizeof(u32);
+}
+
+//---------------------------------------------------------------------------
+ClusterCache::~ClusterCache()
+{
+  if (_file)
+    fclose(_file);
+}
+
+//---------------------------------------------------------------------------
+bool ClusterCache::Open(const char* filename, const vector<ClusterInfo>* clusters, size_t budget)
+{
+  _file = fopen(filename, "rb");
+  if (!_file)
+    return false;
+
+  _clusters = clusters;
+  _entries.reset(new Entry[clusters->size()]);
+  memoryBudget = budget;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+std::shared_ptr<const Cluster> ClusterCache::Find(u32 idx)
+{
+  Entry& e = _entries[idx];
+  std::shared_ptr<const Cluster> cluster = std::atomic_load(&e.cluster);
+  if (cluster)
+    e.lastUse.store(++_clock, std::memory_order_relaxed);
+  return cluster;
+}
+
+//---------------------------------------------------------------------------
+std::shared_ptr<const Cluster> ClusterCache::Acquire(u32 idx)
+{
+  std::shared_ptr<const Cluster> cluster = Find(idx);
+  if (cluster)
+    return cluster;
+
+  // load outside of the cache lock, so lookups and other loads don't stall
+  std::shared_ptr<const Cluster> loaded = Load(idx);
+  if (!loaded)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  Entry& e = _entries[idx];
+  if (e.cluster)
+  {
+    // someone else loaded it while we were reading
+    e.lastUse.store(++_clock, std::memory_order_relaxed);
+    return e.cluster;
+  }
+
+  std::atomic_store(&e.cluster, loaded);
+  e.lastUse.store(++_clock, std::memory_order_relaxed);
+  _resident.push_back(idx);
+  memoryUsed += loaded->MemorySize();
+  ++numLoads;
+
+  // evict the least recently used until we're within budget, but always keep the
+  // new cluster. Users holding an evicted cluster keep it alive until they're done
+  while (memoryUsed > memoryBudget && _resident.size() > 1)
+  {
+    size_t oldest = 0;
+    u64 oldestUse = ~0ull;
+    for (size_t i = 0; i < _resident.size(); ++i)
+    {
+      u64 lastUse = _entries[_resident[i]].lastUse.load(std::memory_order_relaxed);
+      if (_resident[i] != idx && lastUse < oldestUse)
+      {
+        oldest = i;
+        oldestUse = lastUse;
+      }
+    }
+
+    Entry& victim = _entries[_resident[oldest]];
+    memoryUsed -= victim.cluster->MemorySize();
+    std::atomic_store(&victim.cluster, std::shared_ptr<const Cluster>());
+    _resident[oldest] = _resident.back();
+    _resident.pop_back();
+    ++numEvictions;
+  }
+
+  return loaded;
+}
+
+//---------------------------------------------------------------------------
+std::shared_ptr<Cluster> ClusterCache::Load(u32 idx)
+{
+  const ClusterInfo& info = (*_clusters)[idx];
+  vector<char> page((size_t)info.size);
+  {
+    std::lock_guard<std::mutex> lock(_fileMutex);
+    if (!Seek(_file, info.fileOffset) || fread(page.data(), 1, page.size(), _file) != page.size())
+      return nullptr;
+  }
+
+  const DiskPageHeader* header = (const DiskPageHeader*)page.data();
+  const float* srcVerts = (const float*)(header + 1);
+  const u32* srcIndices = (const u32*)(srcVerts + header->numVerts * 3);
+  const DiskNode* diskNodes = (const DiskNode*)(srcIndices + header->numTris * 3);
+
+  std::shared_ptr<Cluster> cluster = std::make_shared<Cluster>();
+  cluster->verts.assign(srcVerts, srcVerts + header->numVerts * 3);
+  cluster->indices.assign(srcIndices, srcIndices + header->numTris * 3);
+
+  // the triangles are stored in BVH order
+  cluster->bvh.nodes.resize(header->numNodes);
+  for (u32 i = 0; i < header->numNodes; ++i)
+  {
+    BvhNode& node = cluster->bvh.nodes[i];
+    node.bounds = FromDisk(diskNodes[i].mn, diskNodes[i].mx);
+    node.offset = diskNodes[i].offset;
+    node.count = diskNodes[i].count;
+    node.axis = diskNodes[i].axis;
+  }
+
+  cluster->bvh.primIndices.resize(header->numTris);
+  for (u32 i = 0; i < header->numTris; ++i)
+    cluster->bvh.primIndices[i] = i;
+
+  return cluster;
+}
+
+//---------------------------------------------------------------------------
+bool ClusterScene::Build(const char* meshFile, const char* pageFile, u32 maxTrisPerCluster)
+{
+  // v2 files are read a mesh at a time, so only one mesh worth of vertices is ever
+  // in memory. v1 files can't be more than 4GB, and are loaded in full
+  MeshStreamer streamer;
+  MeshLoader loader;
+  bool streamed = streamer.Open(meshFile);
+  if (!streamed && !loader.Load(meshFile))
+    return false;
+
+  FILE* f = fopen(pageFile, "wb");
+  if (!f)
+    return false;
+
+  PageFileHeader header = { { 'c', 'l', 's', 't' }, 2, 0, 0, 0 };
+  fwrite(&header, sizeof(header), 1, f);
+
+  vector<DiskClusterInfo> table;
+  bool ok = true;
+  if (streamed)
+  {
+    vector<float> verts;
+    vector<u32> indices;
+    for (u32 i = 0; i < streamer.meshes.size() && ok; ++i)
+    {
+      const protocol::MeshBlob& blob = streamer.meshes[i];
+      ok = streamer.ReadMesh(i, &verts, &indices);
+      if (ok)
+        WriteMeshClusters(blob.mtx, verts.data(), blob.numVerts, indices.data(), blob.numIndices, maxTrisPerCluster, f, &table);
+    }
+  }
+  else
+  {
+    for (const protocol::MeshBlob* blob : loader.meshes)
+      WriteMeshClusters(blob->mtx, blob->verts, blob->numVerts, blob->indices, blob->numIndices, maxTrisPerCluster, f, &table);
+  }
+
+  header.tableOffset = Tell(f);
+  header.numClusters = (u32)table.size();
+  if (!table.empty())
+    fwrite(table.data(), sizeof(DiskClusterInfo), table.size(), f);
+
+  ok &= !ferror(f);
+  ok &= Seek(f, 0) && fwrite(&header, sizeof(header), 1, f) == 1;
+  fclose(f);
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+bool ClusterScene::Open(const char* pageFile, size_t memoryBudget)
+{
+  FILE* f = fopen(pageFile, "rb");
+  if (!f)
+    return false;
+
+  PageFileHeader header;
+  bool ok = fread(&header, sizeof(header), 1, f) == 1 && strncmp(header.id, "clst", 4) == 0
+            && header.version == 2 && Seek(f, header.tableOffset);
+
+  vector<DiskClusterInfo> table(ok ? header.numClusters : 0);
+  if (ok && !table.empty())
+    ok = fread(table.data(), sizeof(DiskClusterInfo), table.size(), f) == table.size();
+  fclose(f);
+
+  if (!ok)
+    return false;
+
+  clusters.resize(table.size());
+  vector<Aabb> bounds(table.size());
+  for (size_t i = 0; i < table.size(); ++i)
+  {
+    clusters[i].bounds = FromDisk(table[i].mn, table[i].mx);
+    clusters[i].fileOffset = table[i].fileOffset;
+    clusters[i].size = table[i].size;
+    bounds[i] = clusters[i].bounds;
+  }
+
+  topLevel.Build(bounds, 1);
+  return cache.Open(pageFile, &clusters, memoryBudget);
+}
+
+//---------------------------------------------------------------------------
+bool ClusterScene::IntersectClosest(const Ray& ray, float* t)
+{
+  bool hit = false;
+  topLevel.Traverse(ray, FLT_MAX, [&](u32 clusterIdx, float closest)
+  {
+    std::shared_ptr<const Cluster> cluster = cache.Acquire(clusterIdx);
+    if (cluster && cluster->Intersect(ray, closest, t))
+    {
+      hit = true;
+      closest = *t;
+    }
+    return closest;
+  });
+
+  return hit;
+}
+
+//---------------------------------------------------------------------------
+void ClusterScene::IntersectBatch(const Ray* rays, u32 numRays, float* t)
+{
+  struct Deferred
+  {
+    u32 clusterIdx;
+    u32 rayIdx;
+  };
+
+  // trace against the resident clusters, and queue the rays for the rest
+  vector<Deferred> deferred;
+  for (u32 rayIdx = 0; rayIdx < numRays; ++rayIdx)
+  {
+    const Ray& ray = rays[rayIdx];
+    t[rayIdx] = FLT_MAX;
+    topLevel.Traverse(ray, FLT_MAX, [&](u32 clusterIdx, float closest)
+    {
+      std::shared_ptr<const Cluster> cluster = cache.Find(clusterIdx);
+      if (!cluster)
+        deferred.push_back({ clusterIdx, rayIdx });
+      else if (cluster->Intersect(ray, closest, &t[rayIdx]))
+        closest = t[rayIdx];
+      return closest;
+    });
+  }
+
+  // then page in each missing cluster once, and trace its queue
+  std::sort(deferred.begin(), deferred.end(), [](const Deferred& a, const Deferred& b)
+  {
+    return a.clusterIdx < b.clusterIdx || (a.clusterIdx == b.clusterIdx && a.rayIdx < b.rayIdx);
+  });
+
+  for (size_t start = 0, end; start < deferred.size(); start = end)
+  {
+    u32 clusterIdx = deferred[start].clusterIdx;
+    for (end = start; end < deferred.size() && deferred[end].clusterIdx == clusterIdx; ++end)
+      ;
+
+    std::shared_ptr<const Cluster> cluster = cache.Acquire(clusterIdx);
+    if (!cluster)
+      continue;
+
+    const Aabb& bounds = clusters[clusterIdx].bounds;
+    for (size_t i = start; i < end; ++i)
+    {
+      u32 rayIdx = deferred[i].rayIdx;
+      const Ray& ray = rays[rayIdx];
+
+      // skip the cluster if a closer hit has been found since the ray was queued
+      Vector3 invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+      float tNear;
+      if (bounds.Intersect(ray.o, invDir, t[rayIdx], &tNear))
+        cluster->Intersect(ray, t[rayIdx], &t[rayIdx]);
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "bvh.hpp"
+#include "mesh_loader.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // A spatially coherent chunk of world space triangles with its own BVH. Clusters
+  // are written to a page file, and paged in on demand by the ClusterCache. The
+  // triangles are indexed into the cluster's own vertices, and stored in BVH order.
+  struct Cluster
+  {
+    bool Intersect(const Ray& ray, float tMax, float* t) const;
+    size_t MemorySize() const;
+
+    vector<float> verts;
+    vector<u32> indices;
+    Bvh bvh;
+  };
+
+  //---------------------------------------------------------------------------
+  struct ClusterInfo
+  {
+    Aabb bounds;
+    u64 fileOffset;
+    u64 size;
+  };
+
+  //---------------------------------------------------------------------------
+  // LRU cache of resident clusters, with a memory budget. Clusters handed out stay
+  // alive until the last user drops them, even if they are evicted in the meantime.
+  // Lookups of resident clusters only touch their own slot; the lock is taken when
+  // a cluster is added, and for the evictions that makes room for it.
+  struct ClusterCache
+  {
+    ~ClusterCache();
+    bool Open(const char* filename, const vector<ClusterInfo>* clusters, size_t memoryBudget);
+
+    // returns the cluster if it's resident, and nullptr otherwise
+    std::shared_ptr<const Cluster> Find(u32 idx);
+    // returns the cluster, loading it (and evicting others) if needed
+    std::shared_ptr<const Cluster> Acquire(u32 idx);
+
+    size_t memoryBudget = 0;
+    size_t memoryUsed = 0;
+    u64 numLoads = 0;
+    u64 numEvictions = 0;
+
+  private:
+    std::shared_ptr<Cluster> Load(u32 idx);
+
+    struct Entry
+    {
+      Entry() : lastUse(0) {}
+      // read with std::atomic_load, and only written under the lock
+      std::shared_ptr<const Cluster> cluster;
+      std::atomic<u64> lastUse;
+    };
+
+    const vector<ClusterInfo>* _clusters = nullptr;
+    std::unique_ptr<Entry[]> _entries;
+    // indices of the clusters with an entry, in no particular order
+    vector<u32> _resident;
+    std::atomic<u64> _clock{0};
+    std::mutex _mutex;
+    std::mutex _fileMutex;
+    FILE* _file = nullptr;
+  };
+
+  //---------------------------------------------------------------------------
+  // Out-of-core triangle geometry. Only the cluster bounds and the top-level BVH
+  // over them are resident; the clusters themselves are paged in from disk.
+  struct ClusterScene
+  {
+    // Partition the meshes in a .boba file into clusters of at most
+    // maxTrisPerCluster triangles, and write them to a page file. This only has to
+    // be done once per scene. v2 files are streamed a mesh at a time, so the scene
+    // only has to fit on disk, but its largest mesh has to fit in memory.
+    static bool Build(const char* meshFile, const char* pageFile, u32 maxTrisPerCluster);
+
+    // Open a page file built by Build, without loading any of the clusters.
+    bool Open(const char* pageFile, size_t memoryBudget);
+
+    // Closest hit, paging in clusters as needed. Blocks while loading.
+    bool IntersectClosest(const Ray& ray, float* t);
+
+    // Closest hits for a batch of rays, like a tile's. Clusters that aren't resident
+    // aren't loaded while tracing; the rays that need them are queued per cluster,
+    // and each missing cluster is then paged in once for its whole queue. t is set
+    // to FLT_MAX for rays that miss. Runs on the calling thread.
+    void IntersectBatch(const Ray* rays, u32 numRays, float* t);
+
+    vector<ClusterInfo> clusters;
+    Bvh topLevel;
+    ClusterCache cache;
+  };
+}
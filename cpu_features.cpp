@@ -0,0 +1,145 @@
+#include "cpu_features.hpp"
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PBR_X86 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define PBR_X86 1
+#endif
+
+using namespace pbr;
+
+namespace
+{
+#if PBR_X86
+  //---------------------------------------------------------------------------
+  void Cpuid(u32 leaf, u32 subLeaf, u32* regs)
+  {
+#ifdef _MSC_VER
+    __cpuidex((int*)regs, (int)leaf, (int)subLeaf);
+#else
+    __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+  }
+
+  //---------------------------------------------------------------------------
+  u64 Xgetbv(u32 idx)
+  {
+#ifdef _MSC_VER
+    return _xgetbv(idx);
+#else
+    u32 lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(idx));
+    return ((u64)hi << 32) | lo;
+#endif
+  }
+#endif
+
+  struct IsaDesc
+  {
+    Isa isa;
+    const char* name;
+  };
+
+  const IsaDesc ISA_NAMES[] = {
+      {Isa::Scalar, "scalar"}, {Isa::SSE42, "sse4.2"}, {Isa::AVX2, "avx2"}, {Isa::AVX512, "avx512"},
+  };
+}
+
+//---------------------------------------------------------------------------
+CpuFeatures pbr::DetectCpuFeatures()
+{
+  CpuFeatures res;
+#if PBR_X86
+  u32 regs[4];
+  Cpuid(0, 0, regs);
+  u32 maxLeaf = regs[0];
+  if (maxLeaf < 1)
+    return res;
+
+  Cpuid(1, 0, regs);
+  res.sse42 = !!(regs[2] & (1 << 20));
+  res.fma = !!(regs[2] & (1 << 12));
+  bool osxsave = !!(regs[2] & (1 << 27));
+  bool avx = !!(regs[2] & (1 << 28));
+
+  // the cpu supporting avx isn't enough, the OS also has to save the ymm/zmm state
+  u64 xcr0 = osxsave ? Xgetbv(0) : 0;
+  bool osYmm = (xcr0 & 0x6) == 0x6;
+  bool osZmm = (xcr0 & 0xe6) == 0xe6;
+
+  res.avx = avx && osYmm;
+  res.fma = res.fma && res.avx;
+
+  if (maxLeaf >= 7)
+  {
+    Cpuid(7, 0, regs);
+    res.avx2 = res.avx && !!(regs[1] & (1 << 5));
+    res.avx512f = osZmm && !!(regs[1] & (1 << 16));
+    res.avx512dq = res.avx512f && !!(regs[1] & (1 << 17));
+    res.avx512bw = res.avx512f && !!(regs[1] & (1 << 30));
+    res.avx512vl = res.avx512f && !!(regs[1] & (1u << 31));
+  }
+#endif
+  return res;
+}
+
+//---------------------------------------------------------------------------
+bool pbr::IsaSupported(Isa isa, const CpuFeatures& features)
+{
+  switch (isa)
+  {
+    case Isa::Scalar: return true;
+    case Isa::SSE42: return features.sse42;
+    case Isa::AVX2: return features.avx2 && features.fma;
+    case Isa::AVX512:
+      return features.avx512f && features.avx512dq && features.avx512bw && features.avx512vl
+             && features.avx2 && features.fma;
+  }
+  return false;
+}
+
+//---------------------------------------------------------------------------
+Isa pbr::BestIsa(const CpuFeatures& features)
+{
+  for (Isa isa : {Isa::AVX512, Isa::AVX2, Isa::SSE42})
+  {
+    if (IsaSupported(isa, features))
+      return isa;
+  }
+  return Isa::Scalar;
+}
+
+//---------------------------------------------------------------------------
+const char* pbr::IsaName(Isa isa)
+{
+  for (const IsaDesc& desc : ISA_NAMES)
+  {
+    if (desc.isa == isa)
+      return desc.name;
+  }
+  return "unknown";
+}
+
+//---------------------------------------------------------------------------
+bool pbr::ParseIsa(const char* str, Isa* isa)
+{
+  for (const IsaDesc& desc : ISA_NAMES)
+  {
+    if (strcmp(desc.name, str) == 0)
+    {
+      *isa = desc.isa;
+      return true;
+    }
+  }
+
+  // allow "sse42" as well
+  if (strcmp(str, "sse42") == 0)
+  {
+    *isa = Isa::SSE42;
+    return true;
+  }
+  return false;
+}
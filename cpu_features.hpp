@@ -0,0 +1,33 @@
+#pragma once
+
+namespace pbr
+{
+  // The instruction set levels the hot kernels are compiled for, in increasing order
+  enum class Isa
+  {
+    Scalar,
+    SSE42,
+    AVX2,
+    AVX512,
+  };
+
+  struct CpuFeatures
+  {
+    bool sse42 = false;
+    bool avx = false;
+    bool avx2 = false;
+    bool fma = false;
+    bool avx512f = false;
+    bool avx512dq = false;
+    bool avx512bw = false;
+    bool avx512vl = false;
+  };
+
+  // queries cpuid, and checks that the OS saves the wider registers
+  CpuFeatures DetectCpuFeatures();
+  bool IsaSupported(Isa isa, const CpuFeatures& features);
+  Isa BestIsa(const CpuFeatures& features);
+
+  const char* IsaName(Isa isa);
+  bool ParseIsa(const char* str, Isa* isa);
+}
@@ -0,0 +1,99 @@
+#include "denoise.hpp"
+#include "kernel_table.hpp"
+#include <tbb/parallel_for.h>
+
+using namespace pbr;
+
+namespace
+{
+  // keeps the albedo division finite for black surfaces
+  const float MIN_ALBEDO = 1e-3f;
+
+  // log2(e), to turn the exp() in the weights into an Exp2
+  const float LOG2_E = 1.44269504f;
+}
+
+//---------------------------------------------------------------------------
+void Denoiser::Run(const Buffer& src, Buffer* dst)
+{
+  assert(src.width == dst->width && src.height == dst->height);
+
+  int width = src.width;
+  int height = src.height;
+  size_t numPixels = (size_t)width * height;
+  bool hasAlbedo = src.HasAov(AOV_ALBEDO);
+  bool hasNormal = src.HasAov(AOV_NORMAL);
+  bool hasDepth = src.HasAov(AOV_DEPTH);
+
+  for (vector<float>& plane : planes)
+    plane.resize(numPixels);
+
+  // missing guides are replaced by a constant plane, and get a zero weight
+  if (!hasNormal || !hasDepth)
+    flat.assign(numPixels, 0.f);
+
+  const float* normal[3];
+  for (int i = 0; i < 3; ++i)
+    normal[i] = hasNormal ? src.normal[i].data() : flat.data();
+  const float* depth = hasDepth ? src.depth.data() : flat.data();
+
+  // demodulate the albedo, and split into planes
+  for (int i = 0; i < 3; ++i)
+    albedo[i].resize(numPixels);
+
+  tbb::parallel_for(0, height, [&](int y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      size_t idx = (size_t)y * width + x;
+      const Color& c = src.buffer[idx];
+      for (int i = 0; i < 3; ++i)
+      {
+        float a = hasAlbedo ? max(src.albedo[i][idx], MIN_ALBEDO) : 1.f;
+        albedo[i][idx] = a;
+        planes[i][idx] = c[i] / a;
+      }
+    }
+  });
+
+  const KernelTable& kernels = Kernels();
+  AtrousPass pass;
+  pass.width = width;
+  pass.height = height;
+  for (int i = 0; i < 3; ++i)
+    pass.normal[i] = normal[i];
+  pass.depth = depth;
+
+  int cur = 0;
+  for (int iter = 0; iter < iterations; ++iter)
+  {
+    pass.step = 1 << iter;
+    for (int i = 0; i < 3; ++i)
+    {
+      pass.in[i] = planes[cur * 3 + i].data();
+      pass.out[i] = planes[(1 - cur) * 3 + i].data();
+    }
+
+    // the color sigma halves every pass, as the noise has been smoothed out more
+    float sigmaC = sigmaColor / (1 << iter);
+    pass.colorWeight = LOG2_E / (sigmaC * sigmaC);
+    pass.normalWeight = hasNormal ? LOG2_E / (sigmaNormal * sigmaNormal) : 0;
+    pass.depthWeight = hasDepth ? LOG2_E / (sigmaDepth * sigmaDepth) : 0;
+
+    tbb::parallel_for(0, height, [&](int y) { kernels.atrousRow(pass, y); });
+    cur = 1 - cur;
+  }
+
+  // remodulate into the destination
+  tbb::parallel_for(0, height, [&](int y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      size_t idx = (size_t)y * width + x;
+      dst->buffer[idx] = Color(planes[cur * 3 + 0][idx] * albedo[0][idx],
+          planes[cur * 3 + 1][idx] * albedo[1][idx],
+          planes[cur * 3 + 2][idx] * albedo[2][idx],
+          src.buffer[idx].w);
+    }
+  });
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "buffer.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each pass is a 5x5
+  // B3 spline with the taps spread out by 2^i, weighted by how similar the
+  // neighbour's color, normal and depth are. The color is divided by the first hit
+  // albedo before filtering and multiplied back after, so texture detail isn't
+  // blurred away with the noise.
+  struct Denoiser
+  {
+    // filters src into dst, which must be the same size. Without guides only the
+    // color is used to find edges
+    void Run(const Buffer& src, Buffer* dst);
+
+    int iterations = 5;
+    float sigmaColor = 1.0f;
+    float sigmaNormal = 0.3f;
+    float sigmaDepth = 0.05f;
+
+    // reused between runs: two sets of color planes, plus stand-in guides
+    vector<float> planes[6];
+    vector<float> albedo[3];
+    vector<float> flat;
+  };
+}
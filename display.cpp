@@ -0,0 +1,98 @@
+#include "display.hpp"
+#include <tbb/parallel_for.h>
+
+using namespace pbr;
+
+//---------------------------------------------------------------------------
+void DirtyTiles::Init(const Buffer& buffer)
+{
+  tbb::spin_mutex::scoped_lock lock(mutex);
+  isDirty.assign(buffer.NumTiles(), 0);
+  dirty.clear();
+  dirty.reserve(buffer.NumTiles());
+}
+
+//---------------------------------------------------------------------------
+void DirtyTiles::TileDone(const Buffer&, int tileIdx)
+{
+  tbb::spin_mutex::scoped_lock lock(mutex);
+  if (!isDirty[tileIdx])
+  {
+    isDirty[tileIdx] = 1;
+    dirty.push_back(tileIdx);
+  }
+}
+
+//---------------------------------------------------------------------------
+void DirtyTiles::MarkAll()
+{
+  tbb::spin_mutex::scoped_lock lock(mutex);
+  dirty.clear();
+  for (int i = 0; i < (int)isDirty.size(); ++i)
+  {
+    isDirty[i] = 1;
+    dirty.push_back(i);
+  }
+}
+
+//---------------------------------------------------------------------------
+void DirtyTiles::Take(vector<int>* tiles)
+{
+  tiles->clear();
+  tbb::spin_mutex::scoped_lock lock(mutex);
+  // swap, so neither side allocates once the capacity is there
+  tiles->swap(dirty);
+  for (int tileIdx : *tiles)
+    isDirty[tileIdx] = 0;
+}
+
+//---------------------------------------------------------------------------
+void DisplayEncoder::Init(int w, int h, float gamma)
+{
+  width = w;
+  height = h;
+  lut.Init(gamma);
+  pixels.resize(width * height);
+  scale = -1;
+}
+
+//---------------------------------------------------------------------------
+bool DisplayEncoder::Update(
+    const Buffer& buffer, DirtyTiles* dirtyTiles, float newScale, Tile* changed)
+{
+  assert(buffer.width == width && buffer.height == height);
+
+  // a new scale changes every pixel
+  if (newScale != scale)
+  {
+    dirtyTiles->MarkAll();
+    scale = newScale;
+  }
+
+  dirtyTiles->Take(&tiles);
+  if (tiles.empty())
+    return false;
+
+  const KernelTable& kernels = Kernels();
+  tbb::parallel_for(0, (int)tiles.size(), [&](int i)
+  {
+    Tile tile = buffer.GetTile(tiles[i]);
+    for (int y = tile.y0; y < tile.y1; ++y)
+    {
+      Color32* dest = pixels.data() + (size_t)y * width + tile.x0;
+      kernels.toneMapRow(buffer.Row(y) + tile.x0, dest, tile.x1 - tile.x0, scale, lut.table);
+    }
+  });
+
+  *changed = buffer.GetTile(tiles[0]);
+  for (int tileIdx : tiles)
+  {
+    Tile tile = buffer.GetTile(tileIdx);
+    changed->x0 = min(changed->x0, tile.x0);
+    changed->y0 = min(changed->y0, tile.y0);
+    changed->x1 = max(changed->x1, tile.x1);
+    changed->y1 = max(changed->y1, tile.y1);
+  }
+
+  return true;
+}
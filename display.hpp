@@ -0,0 +1,46 @@
+#pragma once
+#include "buffer.hpp"
+#include "postprocess.hpp"
+#include <tbb/spin_mutex.h>
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // Collects the tiles that have been written since the last Take. Safe to call from
+  // the render threads while the display thread is taking tiles.
+  struct DirtyTiles : public TileListener
+  {
+    void Init(const Buffer& buffer);
+    virtual void TileDone(const Buffer& buffer, int tileIdx);
+    void MarkAll();
+
+    // moves the dirty tiles into tiles (which is cleared first), and resets them
+    void Take(vector<int>* tiles);
+
+    vector<u8> isDirty;
+    vector<int> dirty;
+    tbb::spin_mutex mutex;
+  };
+
+  //---------------------------------------------------------------------------
+  // Keeps the display encoded copy of a buffer up to date, re-encoding only the tiles
+  // that changed. Doesn't know about OpenGL, it just says which rect of pixels is new.
+  struct DisplayEncoder
+  {
+    void Init(int width, int height, float gamma);
+
+    // Re-encodes the dirty tiles, or all of them if the scale has changed. Returns
+    // false if nothing changed, otherwise sets changed to the bounds of the new pixels.
+    bool Update(const Buffer& buffer, DirtyTiles* dirtyTiles, float scale, Tile* changed);
+
+    int width = 0;
+    int height = 0;
+    GammaLut lut;
+    vector<Color32> pixels;
+    // scale the pixels were encoded with, negative before the first update
+    float scale = -1;
+
+    // reused between updates
+    vector<int> tiles;
+  };
+}
@@ -1,184 +1,527 @@
+#include <chrono>
+#include <complex>
+#include <functional>
+#include <memory>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 #include "pbr_math.hpp"
+#include "kernel_table.hpp"
+#include "sample_patterns.hpp"
+#include "warp.hpp"
+
+// Headless quality and speed report for the samplers, and a chi-square check of
+// the sample warps against their pdfs. Built as the dist_test target:
+//
+//  dist_test [--freq=<max spectrum frequency>] [--spectrum] [--isa=<name>]
+//
+// Exits with 1 if any warp fails its check.
 
 using namespace pbr;
-//extern Vector2u windowSize;
 
-#if 0
-//---------------------------------------------------------------------------
-void DisplaySamples(const vector<Vector2>& samples, sf::Texture* texture)
+namespace
 {
-  int w = windowSize.x;
-  int h = windowSize.y;
+  // sizes the general samplers are measured at, the baked ones only have their own
+  const u32 SAMPLE_COUNTS[] = { 16, 64, 256, 1024, 4096 };
 
-  vector<sf::Color> buf(w*h);
-  memset(buf.data(), 0, w*h*4);
+  //---------------------------------------------------------------------------
+  double Now()
+  {
+    using namespace std::chrono;
+    return duration<double>(high_resolution_clock::now().time_since_epoch()).count();
+  }
 
-  for (const Vector2& v : samples)
+  //---------------------------------------------------------------------------
+  struct NearestStats
+  {
+    float mean, deviation, minDist;
+  };
+
+  //---------------------------------------------------------------------------
+  // Distance from each point to its nearest neighbour. The points are bucketed on a
+  // grid with about one point per cell, and each search walks rings of cells out
+  // from the point's own until no unvisited cell can be closer than the best so far,
+  // so the whole thing is linear in the point count.
+  NearestStats CalcDistribution(const vector<Vector2>& points)
   {
-    // convert from [-1, +1], [-1, +1] to window size
-    int x = w/2 + w/2 * v.x;
-    int y = h/2 + h/2 * v.y;
+    u32 numSamples = (u32)points.size();
+    int gridSize = max(1, (int)sqrtf((float)numSamples));
+    float cellSize = 2.f / gridSize;
+
+    auto cellCoord = [&](float v) { return min(gridSize - 1, max(0, (int)((v + 1) / cellSize))); };
+
+    // counting sort of the points into the cells
+    vector<u32> cellStart(gridSize * gridSize + 1, 0);
+    vector<u32> cellOf(numSamples);
+    for (u32 i = 0; i < numSamples; ++i)
+    {
+      cellOf[i] = cellCoord(points[i].x) + cellCoord(points[i].y) * gridSize;
+      cellStart[cellOf[i] + 1]++;
+    }
+    for (int i = 0; i < gridSize * gridSize; ++i)
+      cellStart[i + 1] += cellStart[i];
+    vector<u32> sorted(numSamples);
+    vector<u32> fill(cellStart.begin(), cellStart.end() - 1);
+    for (u32 i = 0; i < numSamples; ++i)
+      sorted[fill[cellOf[i]]++] = i;
+
+    vector<float> distances(numSamples);
+    tbb::parallel_for(tbb::blocked_range<u32>(0, numSamples), [&](const tbb::blocked_range<u32>& r)
+    {
+      for (u32 i = r.begin(); i != r.end(); ++i)
+      {
+        const Vector2& p = points[i];
+        int cx = cellCoord(p.x);
+        int cy = cellCoord(p.y);
+        float best = FLT_MAX;
+
+        // the cells in ring r are at least r - 1 cells away from the point
+        for (int ring = 0; ring < gridSize; ++ring)
+        {
+          if (ring > 0 && best <= Sq((ring - 1) * cellSize))
+            break;
+
+          for (int y = max(0, cy - ring); y <= min(gridSize - 1, cy + ring); ++y)
+          {
+            bool edgeRow = y == cy - ring || y == cy + ring;
+            for (int x = max(0, cx - ring); x <= min(gridSize - 1, cx + ring); ++x)
+            {
+              if (!edgeRow && x != cx - ring && x != cx + ring)
+                continue;
+
+              int cell = x + y * gridSize;
+              for (u32 k = cellStart[cell]; k < cellStart[cell + 1]; ++k)
+              {
+                u32 j = sorted[k];
+                if (j != i)
+                  best = min(best, (p - points[j]).LengthSquared());
+              }
+            }
+          }
+        }
+        distances[i] = sqrtf(best);
+      }
+    });
+
+    double sum = 0;
+    float minDist = FLT_MAX;
+    for (float d : distances)
+    {
+      sum += d;
+      minDist = min(minDist, d);
+    }
 
-    buf[y * w + x] = sf::Color::White;
+    NearestStats res;
+    res.mean = (float)(sum / numSamples);
+    res.minDist = minDist;
+
+    double d = 0;
+    for (float dist : distances)
+      d += Sq(dist - res.mean);
+    res.deviation = sqrtf((float)(d / numSamples));
+    return res;
   }
-  texture->update((const sf::Uint8*)buf.data());
-}
 
-//---------------------------------------------------------------------------
-void CalcDistribution(const vector<Vector2> points, float* mean, float* deviation)
-{
-  u32 numSamples = (u32)points.size();
-  vector<float> distances(points.size());
-  double sum = 0;
+  //---------------------------------------------------------------------------
+  // L2 star discrepancy of the points mapped to [0, 1]^2, with Warnock's formula
+  double L2Discrepancy(const vector<Vector2>& points)
+  {
+    size_t n = points.size();
+    vector<double> xs(n), ys(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      xs[i] = points[i].x * 0.5 + 0.5;
+      ys[i] = points[i].y * 0.5 + 0.5;
+    }
 
-  for (u32 i = 0; i < numSamples; ++i)
+    double single = 0;
+    for (size_t i = 0; i < n; ++i)
+      single += (1 - xs[i] * xs[i]) * (1 - ys[i] * ys[i]);
+
+    double pairs = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, n), 0.0,
+        [&](const tbb::blocked_range<size_t>& r, double sum)
+        {
+          for (size_t i = r.begin(); i != r.end(); ++i)
+          {
+            for (size_t j = 0; j < n; ++j)
+              sum += (1 - max(xs[i], xs[j])) * (1 - max(ys[i], ys[j]));
+          }
+          return sum;
+        },
+        [](double a, double b) { return a + b; });
+
+    double t2 = 1.0 / 9 - single / (2.0 * n) + pairs / ((double)n * n);
+    return sqrt(max(0.0, t2));
+  }
+
+  //---------------------------------------------------------------------------
+  // Periodogram |sum exp(-2 pi i f.p)|^2 / n of the points on the unit torus, for the
+  // integer frequencies f in [-maxFreq, maxFreq]^2, averaged over rings of |f|. Entry
+  // k is the ring around |f| = k; white noise is 1 everywhere, blue noise has little
+  // power below its principal frequency, around sqrt(n).
+  vector<double> RadialSpectrum(const vector<Vector2>& points, int maxFreq)
   {
-    // find distance to closest point
-    float dist = FLT_MAX;
-    u32 idx;
-    for (u32 j = 0; j < numSamples; ++j)
+    typedef std::complex<double> Complex;
+    size_t n = points.size();
+    int side = 2 * maxFreq + 1;
+
+    // per point steps along x, and the phase at u = -maxFreq. The rows are done in
+    // parallel, so each one works out its own y phase
+    vector<Complex> stepX(n), startX(n);
+    for (size_t i = 0; i < n; ++i)
     {
-      if (i == j)
-        continue;
+      double x = points[i].x * 0.5 + 0.5;
+      stepX[i] = std::polar(1.0, -2 * M_PI * x);
+      startX[i] = std::polar(1.0, 2 * M_PI * x * maxFreq);
+    }
 
-      float tmp = (points[i] - points[j]).LengthSquared();
-      if (tmp < dist)
+    vector<double> power(side * side);
+    tbb::parallel_for(0, side, [&](int row)
+    {
+      int v = row - maxFreq;
+      vector<Complex> sums(side);
+      for (size_t i = 0; i < n; ++i)
       {
-        dist = tmp;
-        idx = j;
+        double y = points[i].y * 0.5 + 0.5;
+        Complex z = std::polar(1.0, -2 * M_PI * y * v) * startX[i];
+        for (int u = 0; u < side; ++u)
+        {
+          sums[u] += z;
+          z *= stepX[i];
+        }
+      }
+      for (int u = 0; u < side; ++u)
+        power[row * side + u] = std::norm(sums[u]) / n;
+    });
+
+    vector<double> radial(maxFreq + 1, 0);
+    vector<int> counts(maxFreq + 1, 0);
+    for (int row = 0; row < side; ++row)
+    {
+      for (int u = 0; u < side; ++u)
+      {
+        int fx = u - maxFreq;
+        int fy = row - maxFreq;
+        int k = (int)(sqrtf((float)(fx * fx + fy * fy)) + 0.5f);
+        // skip the dc term, and the corners that only some rings reach
+        if (k == 0 || k > maxFreq)
+          continue;
+        radial[k] += power[row * side + u];
+        counts[k]++;
       }
     }
 
-    float d = sqrtf(dist);
-    distances[i] = d;
-    sum += d;
+    for (int k = 1; k <= maxFreq; ++k)
+      radial[k] /= max(1, counts[k]);
+    return radial;
   }
 
-  // find mean
-  *mean = (float)(sum / numSamples);
-
-  // find standard deviation
-  double d = 0;
-  for (u32 i = 0; i < numSamples; ++i)
+  //---------------------------------------------------------------------------
+  struct SamplerDesc
+  {
+    const char* name;
+    std::function<Sampler*()> create;
+    // 0 for samplers that take any count
+    u32 fixedCount;
+  };
+
+  //---------------------------------------------------------------------------
+  vector<SamplerDesc> AllSamplers()
   {
-    float dx = distances[i] - *mean;
-    d += dx * dx;
+    return {
+      { "random", [] { return new RandomSampler(); }, 0 },
+      { "uniform", [] { return new UniformSampler(); }, 0 },
+      { "poisson", [] { return new PoissonSampler(); }, 0 },
+      { "stratified", [] { return new BakedSampler<PatternType::Stratified, 16>(); }, 16 },
+      { "stratified", [] { return new BakedSampler<PatternType::Stratified, 64>(); }, 64 },
+      { "stratified", [] { return new BakedSampler<PatternType::Stratified, 256>(); }, 256 },
+      { "multijittered", [] { return new BakedSampler<PatternType::MultiJittered, 16>(); }, 16 },
+      { "multijittered", [] { return new BakedSampler<PatternType::MultiJittered, 64>(); }, 64 },
+      { "multijittered", [] { return new BakedSampler<PatternType::MultiJittered, 256>(); }, 256 },
+      { "bluenoise", [] { return new BakedSampler<PatternType::BlueNoise, 16>(); }, 16 },
+      { "bluenoise", [] { return new BakedSampler<PatternType::BlueNoise, 64>(); }, 64 },
+    };
   }
 
-  *deviation = sqrtf((float)(d / numSamples));
-}
-
+  //---------------------------------------------------------------------------
+  // Quality of n points from the sampler, and the cost of making them: Init, one
+  // NextSample call per point, and a single NextSamples call
+  void Analyze(const SamplerDesc& desc, u32 n, int maxFreq, bool showSpectrum)
+  {
+    std::unique_ptr<Sampler> sampler(desc.create());
+    double start = Now();
+    sampler->Init(n);
+    double initTime = Now() - start;
 
-//---------------------------------------------------------------------------
-// Poisson distributed samples, from "Antialiased Images at Low Sampling Densities"
-void PoissonSamples(u32 numSamples, sf::Texture* texture, vector<Vector2f>* samples)
-{
-  int w = windowSize.x;
-  int h = windowSize.y;
+    vector<float> xs(n), ys(n);
+    const int NUM_RUNS = max(1, (1 << 20) / (int)n);
+    float checksum = 0;
 
-  vector<sf::Color> buf(w*h);
-  memset(buf.data(), 0, w*h*4);
+    start = Now();
+    for (int run = 0; run < NUM_RUNS; ++run)
+    {
+      for (u32 i = 0; i < n; ++i)
+      {
+        Vector2 s = sampler->NextSample();
+        xs[i] = s.x;
+        ys[i] = s.y;
+      }
+      checksum += xs[run % n];
+    }
+    double singleTime = (Now() - start) / ((double)NUM_RUNS * n);
 
-  int f = sqrt(numSamples);
+    start = Now();
+    for (int run = 0; run < NUM_RUNS; ++run)
+    {
+      sampler->NextSamples(n, xs.data(), ys.data());
+      checksum += xs[run % n];
+    }
+    double batchTime = (Now() - start) / ((double)NUM_RUNS * n);
+
+    // a fresh sampler, so the analyzed set starts at the beginning of the sequence
+    sampler.reset(desc.create());
+    sampler->Init(n);
+    sampler->NextSamples(n, xs.data(), ys.data());
+    vector<Vector2> points(n);
+    for (u32 i = 0; i < n; ++i)
+      points[i] = Vector2(xs[i], ys[i]);
+
+    NearestStats nn = CalcDistribution(points);
+    // the mean nearest neighbour distance for random points in the [-1, 1] square
+    float randomMean = 0.5f * sqrtf(4.f / n);
+    double disc = L2Discrepancy(points);
+    vector<double> spectrum = RadialSpectrum(points, maxFreq);
+
+    // power below half the principal frequency, where blue noise should be empty
+    int lowEnd = min(maxFreq, max(1, (int)(sqrtf((float)n) / 2)));
+    double lowPower = 0;
+    for (int k = 1; k <= lowEnd; ++k)
+      lowPower += spectrum[k];
+    lowPower /= lowEnd;
+
+    // only there to keep the timed loops alive
+    volatile float sink = checksum;
+    (void)sink;
+
+    printf("%-14s %5u %10.3f %9.2f %9.2f %8.3f %8.3f %8.3f %10.5f %8.3f\n",
+        desc.name,
+        n,
+        initTime * 1e3,
+        singleTime * 1e9,
+        batchTime * 1e9,
+        nn.mean / randomMean,
+        nn.deviation / randomMean,
+        nn.minDist / randomMean,
+        disc,
+        lowPower);
+
+    if (showSpectrum)
+    {
+      printf("  spectrum:");
+      for (int k = 1; k <= maxFreq; ++k)
+        printf(" %.2f", spectrum[k]);
+      printf("\n");
+    }
+  }
 
-  int cellsX = w / f;
-  int cellsY = h / f;
+  //---------------------------------------------------------------------------
+  // Upper tail of the chi-square distribution, with the Wilson-Hilferty approximation
+  double ChiSquareTail(double x, int dof)
+  {
+    double k = dof;
+    double z = (pow(x / k, 1.0 / 3) - (1 - 2 / (9 * k))) / sqrt(2 / (9 * k));
+    return 0.5 * erfc(z / sqrt(2.0));
+  }
 
-  int subCellsX = cellsX * 4;
-  int subCellsY = cellsY * 4;
+  //---------------------------------------------------------------------------
+  struct WarpCheck
+  {
+    const char* name;
+    Warp warp;
+    float cosMax;
+    // the histogram cell of a sample, or -1 if it's outside the domain
+    std::function<int(const Vector3& v)> cell;
+    // expected fraction of the samples in a cell, from integrating the pdf
+    std::function<double(int cell)> expected;
+    int numCells;
+    // the scalar warp
+    std::function<Vector3(const Vector2& u)> scalar;
+  };
+
+  const int WARP_BINS = 16;
+  const u32 WARP_SAMPLES = 1 << 20;
+
+  //---------------------------------------------------------------------------
+  // cell of a direction, in WARP_BINS steps of z over [zMin, 1] and of the azimuth
+  int DirectionCell(const Vector3& v, float zMin)
+  {
+    float phi = atan2f(v.y, v.x);
+    int iz = (int)((v.z - zMin) / (1 - zMin) * WARP_BINS);
+    int iphi = (int)((phi + Pi) / (2 * Pi) * WARP_BINS);
+    if (iz < -1 || iz > WARP_BINS || fabsf(v.Length() - 1) > 1e-3f)
+      return -1;
+    return min(WARP_BINS - 1, max(0, iz)) + WARP_BINS * min(WARP_BINS - 1, max(0, iphi));
+  }
 
-  // 2d space is divided into sqrt(numSamples) grid cells, and each grid cell further
-  // divided into 4x4 cells
-  vector<float> d(subCellsX*subCellsY);
+  //---------------------------------------------------------------------------
+  vector<WarpCheck> WarpChecks()
+  {
+    const float cosMax = 0.8f;
+    const double azimuth = 1.0 / WARP_BINS;
+    return {
+      { "concentric disk", Warp::ConcentricDisk, 0,
+          [](const Vector3& v)
+          {
+            float r2 = v.x * v.x + v.y * v.y;
+            if (r2 > 1 + 1e-5f)
+              return -1;
+            // equal area rings
+            int ir = min(WARP_BINS - 1, (int)(r2 * WARP_BINS));
+            int iphi = min(WARP_BINS - 1, (int)((atan2f(v.y, v.x) + Pi) / (2 * Pi) * WARP_BINS));
+            return ir + WARP_BINS * iphi;
+          },
+          // pdf 1/pi, over cells of area pi / bins^2
+          [](int) { return ConcentricDiskPdf() * Pi / (WARP_BINS * WARP_BINS); },
+          WARP_BINS * WARP_BINS,
+          [](const Vector2& u) { Vector2 d = ConcentricDisk(u); return Vector3(d.x, d.y, 0); } },
+      { "cosine hemisphere", Warp::CosineHemisphere, 0,
+          [](const Vector3& v) { return DirectionCell(v, 0); },
+          // integral of cos(theta) / pi over the cell, d(omega) = dz dphi
+          [=](int cell)
+          {
+            double z0 = (double)(cell % WARP_BINS) / WARP_BINS;
+            double z1 = z0 + 1.0 / WARP_BINS;
+            return (z1 * z1 - z0 * z0) / 2 * 2 * azimuth;
+          },
+          WARP_BINS * WARP_BINS,
+          [](const Vector2& u) { return CosineHemisphere(u); } },
+      { "uniform sphere", Warp::UniformSphere, 0,
+          [](const Vector3& v) { return DirectionCell(v, -1); },
+          [=](int) { return UniformSpherePdf() * (2.0 / WARP_BINS) * 2 * Pi * azimuth; },
+          WARP_BINS * WARP_BINS,
+          [](const Vector2& u) { return UniformSphere(u); } },
+      { "uniform cone", Warp::UniformCone, cosMax,
+          [=](const Vector3& v) { return v.z < cosMax - 1e-5f ? -1 : DirectionCell(v, cosMax); },
+          [=](int) { return UniformConePdf(cosMax) * ((1 - cosMax) / WARP_BINS) * 2 * Pi * azimuth; },
+          WARP_BINS * WARP_BINS,
+          [=](const Vector2& u) { return UniformCone(u, cosMax); } },
+      { "uniform triangle", Warp::UniformTriangle, 0,
+          [](const Vector3& b)
+          {
+            if (b.x < -1e-5f || b.y < -1e-5f || b.z < -1e-5f || fabsf(b.x + b.y + b.z - 1) > 1e-4f)
+              return -1;
+            int i = min(WARP_BINS - 1, (int)(b.x * WARP_BINS));
+            int j = min(WARP_BINS - 1, (int)(b.y * WARP_BINS));
+            return i + WARP_BINS * j;
+          },
+          // the cells below the diagonal are inside, the ones on it half inside.
+          // The pdf is per unit area of the triangle, which is 1/2 in (b0, b1)
+          [](int cell)
+          {
+            int i = cell % WARP_BINS;
+            int j = cell / WARP_BINS;
+            double area = i + j < WARP_BINS - 1 ? 1 : i + j == WARP_BINS - 1 ? 0.5 : 0;
+            return UniformTrianglePdf(0.5f) * area / (WARP_BINS * WARP_BINS);
+          },
+          WARP_BINS * WARP_BINS,
+          [](const Vector2& u) { return UniformTriangle(u); } },
+    };
+  }
 
-  for (u32 i = 1; i < subCellsY; ++i)
+  //---------------------------------------------------------------------------
+  // Histograms the batch warp's output against the integrated pdf, and checks the
+  // batch and scalar warps agree
+  bool CheckWarp(const WarpCheck& check, double significance)
   {
-    for (u32 j = 1; j < subCellsX; ++j)
+    vector<float> u0(WARP_SAMPLES), u1(WARP_SAMPLES);
+    vector<float> x(WARP_SAMPLES), y(WARP_SAMPLES), z(WARP_SAMPLES, 0);
+    Pcg32 rng(check.numCells, (u64)check.warp);
+    for (u32 i = 0; i < WARP_SAMPLES; ++i)
     {
-      // calc T value for current cell
-      float t = (4 * d[(j - 1) + (i) * subCellsX] + d[(j - 1) + (i - 1) * subCellsX] + 2 * d[(j) + (i - 1) * subCellsX] + d[(j + 1) + (i - 1) * subCellsX]) / 8;
-      t += randf(1.f / 16 - 1.f / 64, 1.f / 16 + 1.f / 64);
+      u0[i] = rng.NextFloat();
+      u1[i] = rng.NextFloat();
+    }
+    Kernels().warpBatch(check.warp, check.cosMax, u0.data(), u1.data(), WARP_SAMPLES, x.data(), y.data(), z.data());
 
-      // determine if the current cell should have a pixel
-      float s = t < 0.5f ? 0 : 1;
-      d[j + i * subCellsX] = t - s;
+    vector<u32> counts(check.numCells, 0);
+    u32 outside = 0;
+    float maxDiff = 0;
+    for (u32 i = 0; i < WARP_SAMPLES; ++i)
+    {
+      Vector3 v(x[i], y[i], z[i]);
+      int cell = check.cell(v);
+      if (cell < 0)
+        ++outside;
+      else
+        counts[cell]++;
+
+      Vector3 ref = check.scalar(Vector2(u0[i], u1[i]));
+      maxDiff = max(maxDiff, max(fabsf(ref.x - v.x), max(fabsf(ref.y - v.y), fabsf(ref.z - v.z))));
+    }
 
-      if (s > 0)
+    double chi2 = 0;
+    int dof = -1;
+    bool ok = outside == 0;
+    for (int i = 0; i < check.numCells; ++i)
+    {
+      double expected = check.expected(i) * WARP_SAMPLES;
+      if (expected == 0)
       {
-        float x = j * (f/4);
-        float y = i * (f/4);
-        samples->push_back({x, y});
-        buf[y * w + x] = sf::Color::White;
+        ok &= counts[i] == 0;
+        continue;
       }
+      double diff = counts[i] - expected;
+      chi2 += diff * diff / expected;
+      ++dof;
     }
-  }
 
-  texture->update((const sf::Uint8*)buf.data());
+    double p = ChiSquareTail(chi2, dof);
+    // the batch warps use polynomials for sin and cos, so they match closely but not
+    // exactly. Near the rim of the hemisphere z is a square root of 1 - r^2, which
+    // magnifies the difference
+    ok &= p > significance && maxDiff < 1e-3f;
+    printf("%-18s chi2 %8.1f (%d dof) p %.3f, outside %u, max batch error %.2g  %s\n",
+        check.name, chi2, dof, p, outside, maxDiff, ok ? "ok" : "FAILED");
+    return ok;
+  }
 }
 
-
 //---------------------------------------------------------------------------
-void RandomSamples(u32 numSamples, sf::Texture* texture, vector<Vector2f>* samples)
+int main(int argc, char** argv)
 {
-  int w = windowSize.x;
-  int h = windowSize.y;
+  SelectKernels(argc, argv);
 
-  vector<sf::Color> buf(w*h);
-  samples->resize(numSamples);
-  memset(buf.data(), 0, w*h*4);
-
-  for (u32 i = 0; i < numSamples; ++i)
+  int maxFreq = 64;
+  bool showSpectrum = false;
+  for (int i = 1; i < argc; ++i)
   {
-    float x = rand() % windowSize.x;
-    float y = rand() % windowSize.y;
-    (*samples)[i] = {x, y};
-    buf[y*w+x] = sf::Color::White;
+    if (strncmp(argv[i], "--freq=", 7) == 0)
+      maxFreq = max(1, atoi(argv[i] + 7));
+    else if (strcmp(argv[i], "--spectrum") == 0)
+      showSpectrum = true;
   }
 
-  texture->update((const sf::Uint8*)buf.data());
-}
-
-//---------------------------------------------------------------------------
-void UniformSamples(u32 numSamples, sf::Texture* texture, vector<Vector2f>* samples)
-{
-  int w = windowSize.x;
-  int h = windowSize.y;
-
-  vector<sf::Color> buf(w*h);
-  samples->resize(numSamples);
-  memset(buf.data(), 0, w*h*4);
-
-  int f = sqrt(numSamples);
-
-  for (u32 i = 0; i < numSamples; ++i)
+  // nearest neighbour distances are relative to the expected mean for random points
+  printf("%-14s %5s %10s %9s %9s %8s %8s %8s %10s %8s\n",
+      "sampler", "n", "init ms", "ns/one", "ns/batch", "nn mean", "nn dev", "nn min", "L2 disc", "low pwr");
+  for (const SamplerDesc& desc : AllSamplers())
   {
-    float x = rand() % windowSize.x;
-    float y = rand() % windowSize.y;
-    x = w / f * (i % f);
-    y = h / f * (i / f);
-    (*samples)[i] = {x, y};
-    buf[y*w+x] = sf::Color::White;
+    if (desc.fixedCount)
+    {
+      Analyze(desc, desc.fixedCount, maxFreq, showSpectrum);
+      continue;
+    }
+    for (u32 n : SAMPLE_COUNTS)
+      Analyze(desc, n, maxFreq, showSpectrum);
   }
 
-  texture->update((const sf::Uint8*)buf.data());
-}
-
-//---------------------------------------------------------------------------
-void ShowDistribution(Texture& texture)
-{
-  Sampler* sampler = new PoissonSampler();
-  int s = 1 << 12;
-  sampler->Init(s);
-
-  vector<Vector2> samples;
-  samples.resize(s);
-
-  for (int i = 0; i < s; ++i)
-    samples[i] = sampler->NextSample();
+  printf("\n");
+  // a 1% chance of a false failure over all the checks (Sidak correction)
+  vector<WarpCheck> checks = WarpChecks();
+  double significance = 1 - pow(0.99, 1.0 / checks.size());
+  bool ok = true;
+  for (const WarpCheck& check : checks)
+    ok &= CheckWarp(check, significance);
 
-  float mean, dev;
-  CalcDistribution(samples, &mean, &dev);
-  printf("mean: %.3f, stddev: %.3f\n", mean, dev);
-  DisplaySamples(samples, &texture);
+  return ok ? 0 : 1;
 }
-#endif
\ No newline at end of file
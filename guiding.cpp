@@ -0,0 +1,311 @@
+#include "guiding.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  const float ONE_MINUS_EPSILON = 0.99999994f;
+
+  //---------------------------------------------------------------------------
+  // cylindrical mapping, (cos theta, phi) to the unit square
+  Vector2 DirToSquare(const Vector3& dir)
+  {
+    float cosTheta = min(1.f, max(-1.f, dir.z));
+    float phi = atan2f(dir.y, dir.x);
+    if (phi < 0)
+      phi += 2 * Pi;
+    return Vector2(min((cosTheta + 1) * 0.5f, ONE_MINUS_EPSILON), min(phi / (2 * Pi), ONE_MINUS_EPSILON));
+  }
+
+  //---------------------------------------------------------------------------
+  Vector3 SquareToDir(const Vector2& p)
+  {
+    float cosTheta = 2 * p.x - 1;
+    float sinTheta = sqrtf(max(0.f, 1 - cosTheta * cosTheta));
+    float phi = 2 * Pi * p.y;
+    return Vector3(cosf(phi) * sinTheta, sinf(phi) * sinTheta, cosTheta);
+  }
+
+  //---------------------------------------------------------------------------
+  // the quadrant p is in, with p moved to the quadrant's own unit square
+  int Descend(Vector2* p)
+  {
+    int qx = p->x >= 0.5f ? 1 : 0;
+    int qy = p->y >= 0.5f ? 1 : 0;
+    p->x = p->x * 2 - qx;
+    p->y = p->y * 2 - qy;
+    return qx + 2 * qy;
+  }
+}
+
+//---------------------------------------------------------------------------
+DTree::Node::Node()
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    sum[i] = 0;
+    children[i] = 0;
+  }
+}
+
+//---------------------------------------------------------------------------
+DTree::Node::Node(const Node& rhs)
+{
+  *this = rhs;
+}
+
+//---------------------------------------------------------------------------
+DTree::Node& DTree::Node::operator=(const Node& rhs)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    sum[i] = rhs.sum[i].load(std::memory_order_relaxed);
+    children[i] = rhs.children[i];
+  }
+  return *this;
+}
+
+//---------------------------------------------------------------------------
+void DTree::Node::Add(int quadrant, float value)
+{
+  float cur = sum[quadrant].load(std::memory_order_relaxed);
+  while (!sum[quadrant].compare_exchange_weak(cur, cur + value, std::memory_order_relaxed))
+    ;
+}
+
+//---------------------------------------------------------------------------
+float DTree::Total() const
+{
+  const Node& root = nodes[0];
+  return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+}
+
+//---------------------------------------------------------------------------
+Vector3 DTree::Sample(const Vector2& u, float* pdf) const
+{
+  // nothing recorded yet is uniform over the sphere
+  Vector2 p = u;
+  Vector2 origin(0, 0);
+  float size = 1;
+  float pdfSquare = 1;
+  u32 nodeIdx = 0;
+  for (;;)
+  {
+    const Node& node = nodes[nodeIdx];
+    float s[4];
+    for (int i = 0; i < 4; ++i)
+      s[i] = node.sum[i];
+    float total = s[0] + s[1] + s[2] + s[3];
+    if (total <= 0)
+      break;
+
+    // the column, then the quadrant in it, reusing u for the rest of the way down
+    float left = (s[0] + s[2]) / total;
+    int qx = p.x < left ? 0 : 1;
+    p.x = min(qx == 0 ? p.x / left : (p.x - left) / (1 - left), ONE_MINUS_EPSILON);
+    float column = s[qx] + s[qx + 2];
+    float bottom = s[qx] / column;
+    int qy = p.y < bottom ? 0 : 1;
+    p.y = min(qy == 0 ? p.y / bottom : (p.y - bottom) / (1 - bottom), ONE_MINUS_EPSILON);
+
+    int q = qx + 2 * qy;
+    pdfSquare *= 4 * s[q] / total;
+    size *= 0.5f;
+    origin = origin + Vector2(qx * size, qy * size);
+    if (!node.children[q])
+      break;
+    nodeIdx = node.children[q];
+  }
+
+  *pdf = pdfSquare / (4 * Pi);
+  return SquareToDir(origin + p * size);
+}
+
+//---------------------------------------------------------------------------
+float DTree::Pdf(const Vector3& dir) const
+{
+  Vector2 p = DirToSquare(dir);
+  float pdfSquare = 1;
+  u32 nodeIdx = 0;
+  for (;;)
+  {
+    const Node& node = nodes[nodeIdx];
+    float s[4];
+    for (int i = 0; i < 4; ++i)
+      s[i] = node.sum[i];
+    float total = s[0] + s[1] + s[2] + s[3];
+    if (total <= 0)
+      break;
+
+    int q = Descend(&p);
+    pdfSquare *= 4 * s[q] / total;
+    if (!node.children[q] || s[q] == 0)
+      break;
+    nodeIdx = node.children[q];
+  }
+  return pdfSquare / (4 * Pi);
+}
+
+//---------------------------------------------------------------------------
+void DTree::Record(const Vector3& dir, float value)
+{
+  // into every quadrant on the way down, so each node's sums cover its children
+  Vector2 p = DirToSquare(dir);
+  u32 nodeIdx = 0;
+  for (;;)
+  {
+    int q = Descend(&p);
+    nodes[nodeIdx].Add(q, value);
+    if (!nodes[nodeIdx].children[q])
+      break;
+    nodeIdx = nodes[nodeIdx].children[q];
+  }
+}
+
+//---------------------------------------------------------------------------
+DTree DTree::Refined(float threshold, int maxDepth) const
+{
+  // quadrants that were leaves spread their energy evenly over any new children
+  const u32 NONE = ~0u;
+  struct Pending
+  {
+    u32 oldNode;
+    u32 newNode;
+    float energy;
+    int depth;
+  };
+
+  DTree res;
+  float total = Total();
+  vector<Pending> stack;
+  stack.push_back({0, 0, total, 1});
+  while (!stack.empty())
+  {
+    Pending cur = stack.back();
+    stack.pop_back();
+    for (int q = 0; q < 4; ++q)
+    {
+      float energy = cur.oldNode != NONE ? nodes[cur.oldNode].sum[q].load() : cur.energy / 4;
+      if (total <= 0 || energy / total <= threshold || cur.depth >= maxDepth)
+        continue;
+
+      u32 child = (u32)res.nodes.size();
+      res.nodes.push_back(Node());
+      res.nodes[cur.newNode].children[q] = child;
+      u32 oldChild = cur.oldNode != NONE && nodes[cur.oldNode].children[q] ? nodes[cur.oldNode].children[q] : NONE;
+      stack.push_back({oldChild, child, energy, cur.depth + 1});
+    }
+  }
+  return res;
+}
+
+//---------------------------------------------------------------------------
+void SDTree::Init(const Aabb& bounds)
+{
+  _bounds = bounds;
+  _nodes.assign(1, Node());
+  _leaves.assign(1, LeafData());
+  _iteration = 0;
+  _pass = 0;
+}
+
+//---------------------------------------------------------------------------
+u32 SDTree::Leaf(const Vector3& pos) const
+{
+  // pos in the bounds' unit cube, rescaled to each child's on the way down
+  Vector3 extent = _bounds.mx - _bounds.mn;
+  Vector3 p;
+  for (int i = 0; i < 3; ++i)
+    p[i] = min(1.f, max(0.f, (pos[i] - _bounds.mn[i]) / extent[i]));
+
+  u32 nodeIdx = 0;
+  while (_nodes[nodeIdx].children)
+  {
+    const Node& node = _nodes[nodeIdx];
+    float& c = p[node.axis];
+    if (c < 0.5f)
+    {
+      c *= 2;
+      nodeIdx = node.children;
+    }
+    else
+    {
+      c = c * 2 - 1;
+      nodeIdx = node.children + 1;
+    }
+  }
+  return _nodes[nodeIdx].leaf;
+}
+
+//---------------------------------------------------------------------------
+Vector3 SDTree::Sample(u32 leaf, const Vector2& u, float* pdf) const
+{
+  return _leaves[leaf].sampling.Sample(u, pdf);
+}
+
+//---------------------------------------------------------------------------
+float SDTree::Pdf(u32 leaf, const Vector3& dir) const
+{
+  return _leaves[leaf].sampling.Pdf(dir);
+}
+
+//---------------------------------------------------------------------------
+void SDTree::Record(u32 leaf, const Vector3& dir, float value)
+{
+  if (!Training() || !(value >= 0 && value < FLT_MAX))
+    return;
+  _leaves[leaf].building.Record(dir, value);
+  ++_leaves[leaf].numSamples;
+}
+
+//---------------------------------------------------------------------------
+void SDTree::EndPass()
+{
+  if (!Training() || ++_pass < (1 << _iteration))
+    return;
+
+  // the paths per leaf grow with the passes, so the threshold does too, to keep
+  // the leaves' directional trees well fed
+  _pass = 0;
+  u32 threshold = (u32)(spatialThreshold * sqrtf((float)(1 << _iteration)));
+  u32 numNodes = (u32)_nodes.size();
+  for (u32 i = 0; i < numNodes; ++i)
+  {
+    if (!_nodes[i].children)
+      Split(i, threshold);
+  }
+
+  for (LeafData& leaf : _leaves)
+  {
+    leaf.sampling = leaf.building;
+    leaf.building = leaf.building.Refined(energyThreshold, maxDirectionalDepth);
+    leaf.numSamples = 0;
+  }
+  ++_iteration;
+}
+
+//---------------------------------------------------------------------------
+void SDTree::Split(u32 nodeIdx, u32 threshold)
+{
+  u32 leafIdx = _nodes[nodeIdx].leaf;
+  u32 numSamples = _leaves[leafIdx].numSamples;
+  if (numSamples <= threshold)
+    return;
+
+  // both halves start out with the parent's trees, and half its paths
+  _leaves[leafIdx].numSamples = numSamples / 2;
+  LeafData copy(_leaves[leafIdx]);
+  _leaves.push_back(copy);
+
+  u32 first = (u32)_nodes.size();
+  int axis = (_nodes[nodeIdx].axis + 1) % 3;
+  _nodes.resize(first + 2);
+  _nodes[nodeIdx].children = first;
+  _nodes[first].axis = axis;
+  _nodes[first].leaf = leafIdx;
+  _nodes[first + 1].axis = axis;
+  _nodes[first + 1].leaf = (u32)_leaves.size() - 1;
+
+  Split(first, threshold);
+  Split(first + 1, threshold);
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "bvh.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // Quadtree over the directions, mapped to the unit square by cos theta and phi,
+  // which keeps areas equal. Each node holds the energy in its 4 quadrants, and the
+  // index of the node that subdivides each one, or 0 if it's a leaf.
+  struct DTree
+  {
+    struct Node
+    {
+      Node();
+      Node(const Node& rhs);
+      Node& operator=(const Node& rhs);
+
+      // summed from any thread while rendering
+      void Add(int quadrant, float value);
+
+      std::atomic<float> sum[4];
+      u32 children[4];
+    };
+
+    DTree() : nodes(1) {}
+
+    // a direction picked in proportion to the energy, with its pdf by solid angle
+    Vector3 Sample(const Vector2& u, float* pdf) const;
+    float Pdf(const Vector3& dir) const;
+    void Record(const Vector3& dir, float value);
+    float Total() const;
+
+    // A tree with the same energy, but subdivided where a quadrant has more than
+    // threshold of it, and merged where it has less, with the sums reset
+    DTree Refined(float threshold, int maxDepth) const;
+
+    vector<Node> nodes;
+  };
+
+  //---------------------------------------------------------------------------
+  // Muller et al. 2017, "Practical path guiding for efficient light-transport
+  // simulation". A binary tree over space, splitting the axes in turn, with a
+  // directional tree in each leaf that learns the incoming light there. Training
+  // goes in iterations of 1, 2, 4... passes: during one, the paths record the light
+  // they find into the building trees, while sampling from the distributions the
+  // previous one learnt. At its end, leaves that saw enough paths are split, and
+  // the directional trees are refined to put their resolution where the energy is.
+  struct SDTree
+  {
+    void Init(const Aabb& bounds);
+
+    // the leaf whose distribution guides paths from pos
+    u32 Leaf(const Vector3& pos) const;
+    Vector3 Sample(u32 leaf, const Vector2& u, float* pdf) const;
+    float Pdf(u32 leaf, const Vector3& dir) const;
+    // value is the light found along dir, divided by the pdf it was picked with.
+    // Ignored once training is done
+    void Record(u32 leaf, const Vector3& dir, float value);
+
+    // call between passes. Finishes the iteration once it has had its passes
+    void EndPass();
+    bool Training() const { return _iteration < numIterations; }
+    bool IsEmpty() const { return _nodes.empty(); }
+
+    // training iterations, 2^numIterations - 1 passes in all
+    int numIterations = 6;
+    // the chance of sampling the cosine lobe instead of the tree
+    float bsdfFraction = 0.5f;
+    // leaves are split once they get more than this times sqrt(2^iteration) paths
+    float spatialThreshold = 12000;
+    // directional quadrants with more than this fraction of the energy are split
+    float energyThreshold = 0.01f;
+    int maxDirectionalDepth = 20;
+
+  private:
+    struct Node
+    {
+      // index of the first of the 2 children, or 0 for a leaf
+      u32 children = 0;
+      int axis = 0;
+      // for leaves
+      u32 leaf = 0;
+    };
+
+    struct LeafData
+    {
+      LeafData() : numSamples(0) {}
+      LeafData(const LeafData& rhs) : sampling(rhs.sampling), building(rhs.building), numSamples(rhs.numSamples.load()) {}
+      LeafData& operator=(const LeafData& rhs)
+      {
+        sampling = rhs.sampling;
+        building = rhs.building;
+        numSamples = rhs.numSamples.load();
+        return *this;
+      }
+
+      DTree sampling;
+      DTree building;
+      std::atomic<u32> numSamples;
+    };
+
+    void Split(u32 nodeIdx, u32 threshold);
+
+    Aabb _bounds;
+    vector<Node> _nodes;
+    vector<LeafData> _leaves;
+    int _iteration = 0;
+    int _pass = 0;
+  };
+}
@@ -0,0 +1,138 @@
+#include "image_io.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  //---------------------------------------------------------------------------
+  bool Seek(FILE* f, u64 ofs)
+  {
+#ifdef _WIN32
+    return _fseeki64(f, (s64)ofs, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)ofs, SEEK_SET) == 0;
+#endif
+  }
+}
+
+//---------------------------------------------------------------------------
+PfmWriter::~PfmWriter()
+{
+  Close();
+}
+
+//---------------------------------------------------------------------------
+bool PfmWriter::Open(const char* filename, int w, int h)
+{
+  Close();
+
+  file = fopen(filename, "wb");
+  if (!file)
+    return false;
+
+  width = w;
+  height = h;
+  failed = false;
+
+  // a negative scale means little endian, which all the targets are
+  int headerLen = fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+  if (headerLen < 0)
+  {
+    Close();
+    return false;
+  }
+  dataOffset = (u64)headerLen;
+
+  // write the last byte, so the file has its full size and the tiles can go
+  // anywhere in it
+  u64 fileSize = dataOffset + (u64)width * height * 3 * sizeof(float);
+  u8 zero = 0;
+  if (!Seek(file, fileSize - 1) || fwrite(&zero, 1, 1, file) != 1)
+  {
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+//---------------------------------------------------------------------------
+bool PfmWriter::Close()
+{
+  if (!file)
+    return !failed;
+
+  failed |= fclose(file) != 0;
+  file = nullptr;
+  return !failed;
+}
+
+//---------------------------------------------------------------------------
+void PfmWriter::TileDone(const Buffer& buffer, int tileIdx)
+{
+  assert(buffer.width == width && buffer.height == height);
+  if (!file)
+    return;
+
+  // convert to rgb outside of the lock, so only the writes are serialized
+  Tile tile = buffer.GetTile(tileIdx);
+  int tileWidth = tile.x1 - tile.x0;
+  vector<float> rgb((size_t)tileWidth * (tile.y1 - tile.y0) * 3);
+  float* dst = rgb.data();
+  for (int y = tile.y0; y < tile.y1; ++y)
+  {
+    const Color* src = buffer.Row(y) + tile.x0;
+    for (int x = 0; x < tileWidth; ++x)
+    {
+      *dst++ = src[x].r;
+      *dst++ = src[x].g;
+      *dst++ = src[x].b;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t rowSize = (size_t)tileWidth * 3;
+  for (int y = tile.y0; y < tile.y1; ++y)
+  {
+    // pfm rows go from the bottom up
+    u64 ofs = dataOffset + ((u64)(height - 1 - y) * width + tile.x0) * 3 * sizeof(float);
+    const float* row = rgb.data() + (y - tile.y0) * rowSize;
+    if (!Seek(file, ofs) || fwrite(row, sizeof(float), rowSize, file) != rowSize)
+      failed = true;
+  }
+}
+
+//---------------------------------------------------------------------------
+void PfmWriter::WriteAll(const Buffer& buffer)
+{
+  for (int i = 0; i < buffer.NumTiles(); ++i)
+    TileDone(buffer, i);
+}
+
+//---------------------------------------------------------------------------
+bool pbr::WritePpm(const char* filename, const Buffer& buffer, float scale, const GammaLut& lut)
+{
+  FILE* f = fopen(filename, "wb");
+  if (!f)
+    return false;
+
+  bool ok = fprintf(f, "P6\n%d %d\n255\n", buffer.width, buffer.height) > 0;
+
+  const KernelTable& kernels = Kernels();
+  vector<Color32> encoded(buffer.width);
+  vector<u8> rgb((size_t)buffer.width * 3);
+  for (int y = 0; y < buffer.height && ok; ++y)
+  {
+    kernels.toneMapRow(buffer.Row(y), encoded.data(), buffer.width, scale, lut.table);
+    for (int x = 0; x < buffer.width; ++x)
+    {
+      rgb[x * 3 + 0] = encoded[x].r;
+      rgb[x * 3 + 1] = encoded[x].g;
+      rgb[x * 3 + 2] = encoded[x].b;
+    }
+    ok = fwrite(rgb.data(), 1, rgb.size(), f) == rgb.size();
+  }
+
+  ok &= fclose(f) == 0;
+  return ok;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "buffer.hpp"
+#include "postprocess.hpp"
+#include <mutex>
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // Streams a buffer to a linear HDR PFM file (RGB floats, bottom row first) as its
+  // tiles finish. The file is sized when it's opened, and each tile is written in
+  // place at its rows' offsets, so only a tile's worth of pixels is ever copied.
+  // Add it to the listeners of a buffer with the same size.
+  struct PfmWriter : public TileListener
+  {
+    ~PfmWriter();
+    bool Open(const char* filename, int width, int height);
+    // returns false if any of the writes failed
+    bool Close();
+
+    virtual void TileDone(const Buffer& buffer, int tileIdx);
+    // for buffers that were filled while the writer wasn't listening
+    void WriteAll(const Buffer& buffer);
+
+    int width = 0;
+    int height = 0;
+    u64 dataOffset = 0;
+    FILE* file = nullptr;
+    bool failed = false;
+    std::mutex mutex;
+  };
+
+  // Writes an 8-bit binary PPM, with the pixels scaled and gamma encoded the same way
+  // as for the display. Only a row is encoded at a time.
+  bool WritePpm(const char* filename, const Buffer& buffer, float scale, const GammaLut& lut);
+}
@@ -0,0 +1,313 @@
+#include "irradiance_cache.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  // nodes stop splitting here, whatever the size of the records
+  const int MAX_DEPTH = 16;
+
+  //---------------------------------------------------------------------------
+  // seeds a record's rays from where it is, so a record is the same whichever pixel
+  // asked for it first
+  u64 RecordSeed(const Vector3& pos, const Vector3& n)
+  {
+    u32 bits[6];
+    memcpy(bits, &pos.x, 4);
+    memcpy(bits + 1, &pos.y, 4);
+    memcpy(bits + 2, &pos.z, 4);
+    memcpy(bits + 3, &n.x, 4);
+    memcpy(bits + 4, &n.y, 4);
+    memcpy(bits + 5, &n.z, 4);
+    u64 seed = 0;
+    for (u32 b : bits)
+      seed = MixBits(seed ^ b);
+    return seed;
+  }
+
+  //---------------------------------------------------------------------------
+  bool Overlaps(const Aabb& a, const Aabb& b)
+  {
+    return a.mn.x <= b.mx.x && a.mx.x >= b.mn.x && a.mn.y <= b.mx.y && a.mx.y >= b.mn.y && a.mn.z <= b.mx.z
+           && a.mx.z >= b.mn.z;
+  }
+
+  //---------------------------------------------------------------------------
+  Aabb Octant(const Aabb& parent, int octant)
+  {
+    Vector3 c = parent.Center();
+    return Aabb(Vector3(octant & 1 ? c.x : parent.mn.x, octant & 2 ? c.y : parent.mn.y, octant & 4 ? c.z : parent.mn.z),
+        Vector3(octant & 1 ? parent.mx.x : c.x, octant & 2 ? parent.mx.y : c.y, octant & 4 ? parent.mx.z : c.z));
+  }
+}
+
+//---------------------------------------------------------------------------
+void IrradianceCache::Init(const Aabb& bounds)
+{
+  tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+  _nodes.clear();
+  _records.clear();
+  _nodes.push_back(Node());
+  _nodes[0].bounds = bounds;
+  _size = (bounds.mx - bounds.mn).Length();
+}
+
+//---------------------------------------------------------------------------
+Color IrradianceCache::Irradiance(const Vector3& pos, const Vector3& n, const IncomingRadiance& radiance)
+{
+  Color res;
+  if (Lookup(pos, n, &res))
+    return res;
+
+  // Computed without holding the lock, as it takes a few hundred rays. Threads
+  // shading nearby points at the same time can add records that overlap, which
+  // costs a little time but doesn't change the result much
+  IrradianceRecord record = Compute(pos, n, radiance);
+  Add(record);
+  return record.irradiance;
+}
+
+//---------------------------------------------------------------------------
+bool IrradianceCache::Lookup(const Vector3& pos, const Vector3& n, Color* irradiance) const
+{
+  tbb::spin_rw_mutex::scoped_lock lock(_mutex, false);
+  if (_nodes.empty())
+    return false;
+
+  float sum[3] = {0, 0, 0};
+  float weightSum = 0;
+  float invAccuracy = 1 / accuracy;
+
+  // records are stored where they're about the size of the nodes, so only the
+  // nodes on the way down to pos have any that reach it
+  u32 nodeIdx = 0;
+  for (;;)
+  {
+    const Node& node = _nodes[nodeIdx];
+    for (u32 recordIdx : node.records)
+    {
+      const IrradianceRecord& r = _records[recordIdx];
+      Vector3 d = pos - r.pos;
+      float cosNormal = Dot(n, r.normal);
+      float err = d.Length() / r.radius + sqrtf(max(0.f, 1 - cosNormal));
+      if (err >= accuracy)
+        continue;
+
+      // skip records in front of pos, their surroundings aren't pos'
+      if (Dot(d, n + r.normal) * 0.5f < -0.05f * r.radius)
+        continue;
+
+      // Ward's weight, less its value at the edge, so records fade out instead of
+      // popping as they're added
+      float w = 1 / max(err, 1e-4f) - invAccuracy;
+      Vector3 rotation = Cross(r.normal, n);
+      for (int c = 0; c < 3; ++c)
+        sum[c] += w * max(0.f, r.irradiance[c] + Dot(rotation, r.rotGrad[c]) + Dot(d, r.transGrad[c]));
+      weightSum += w;
+    }
+
+    if (!node.children)
+      break;
+
+    Vector3 c = node.bounds.Center();
+    nodeIdx = node.children + (pos.x >= c.x ? 1 : 0) + (pos.y >= c.y ? 2 : 0) + (pos.z >= c.z ? 4 : 0);
+  }
+
+  if (weightSum <= 0)
+    return false;
+
+  *irradiance = Color(sum[0] / weightSum, sum[1] / weightSum, sum[2] / weightSum);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+IrradianceRecord IrradianceCache::Compute(const Vector3& pos, const Vector3& n, const IncomingRadiance& radiance) const
+{
+  // thetaStrata x phiStrata cells of equal projected solid angle, a jittered ray
+  // through each, so the irradiance is their mean times pi
+  int numTheta = thetaStrata;
+  int numPhi = phiStrata;
+  vector<Color> incoming(numTheta * numPhi);
+  vector<float> dist(numTheta * numPhi);
+
+  Vector3 u, v;
+  CreateCoordinateSystem(n, &u, &v);
+
+  // The record's rays, and the paths behind them, draw from the thread's generator.
+  // It's seeded from the record for them, and the pixel's sequence put back after
+  Pcg32& rng = ThreadRng();
+  Pcg32 pixelRng = rng;
+  rng.Seed(RecordSeed(pos, n), 0);
+
+  float sum[3] = {0, 0, 0};
+  float invDistSum = 0;
+  for (int j = 0; j < numTheta; ++j)
+  {
+    for (int k = 0; k < numPhi; ++k)
+    {
+      float sinTheta = sqrtf((j + rng.NextFloat()) / numTheta);
+      float cosTheta = sqrtf(max(0.f, 1 - sinTheta * sinTheta));
+      float phi = 2 * Pi * (k + rng.NextFloat()) / numPhi;
+      Vector3 d = u * (cosf(phi) * sinTheta) + v * (sinf(phi) * sinTheta) + n * cosTheta;
+
+      float hitDist = 0;
+      Color l = radiance(Ray(pos, d), &hitDist);
+      int idx = j * numPhi + k;
+      incoming[idx] = l;
+      dist[idx] = hitDist > 0 ? hitDist : FLT_MAX;
+      invDistSum += hitDist > 0 ? 1 / hitDist : 0;
+      for (int c = 0; c < 3; ++c)
+        sum[c] += l[c];
+    }
+  }
+  rng = pixelRng;
+
+  IrradianceRecord res;
+  res.pos = pos;
+  res.normal = n;
+  float scale = Pi / (numTheta * numPhi);
+  res.irradiance = Color(sum[0] * scale, sum[1] * scale, sum[2] * scale);
+
+  // The gradients, from how the incoming light changes between neighbouring cells
+  // (Ward and Heckbert 1992, "Irradiance gradients")
+  for (int c = 0; c < 3; ++c)
+  {
+    res.rotGrad[c] = Vector3(0, 0, 0);
+    res.transGrad[c] = Vector3(0, 0, 0);
+  }
+
+  for (int k = 0; k < numPhi; ++k)
+  {
+    // the direction through the middle of the column of cells, its perpendicular,
+    // and the perpendicular of the column's edge to the previous one
+    float phi = 2 * Pi * (k + 0.5f) / numPhi;
+    float phiEdge = 2 * Pi * k / numPhi;
+    Vector3 uk = u * cosf(phi) + v * sinf(phi);
+    Vector3 vk = u * -sinf(phi) + v * cosf(phi);
+    Vector3 vkEdge = u * -sinf(phiEdge) + v * cosf(phiEdge);
+    int prevK = (k + numPhi - 1) % numPhi;
+
+    float rot[3] = {0, 0, 0};
+    float transU[3] = {0, 0, 0};
+    float transV[3] = {0, 0, 0};
+    for (int j = 0; j < numTheta; ++j)
+    {
+      float sinCenter = sqrtf((j + 0.5f) / numTheta);
+      float tanCenter = sinCenter / sqrtf(1 - sinCenter * sinCenter);
+      float sinLower = sqrtf((float)j / numTheta);
+      float sinUpper = sqrtf((float)(j + 1) / numTheta);
+      const Color& l = incoming[j * numPhi + k];
+
+      // Across the edge to the previous column. This is the projected solid angle
+      // form of the edge's length (Krivanek et al. 2008), Ward and Heckbert's is for
+      // plain solid angle
+      const Color& lPrev = incoming[j * numPhi + prevK];
+      float wV = (sinUpper - sinLower) / min(dist[j * numPhi + k], dist[j * numPhi + prevK]);
+
+      // and across the edge to the cell below
+      float wU = 0;
+      Color lBelow = l;
+      if (j > 0)
+      {
+        float cosLowerSq = 1 - sinLower * sinLower;
+        wU = sinLower * cosLowerSq / min(dist[j * numPhi + k], dist[(j - 1) * numPhi + k]);
+        lBelow = incoming[(j - 1) * numPhi + k];
+      }
+
+      for (int c = 0; c < 3; ++c)
+      {
+        rot[c] += tanCenter * l[c];
+        transU[c] += wU * (l[c] - lBelow[c]);
+        transV[c] += wV * (l[c] - lPrev[c]);
+      }
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+      res.rotGrad[c] += vk * (rot[c] * scale);
+      res.transGrad[c] += uk * (transU[c] * 2 * Pi / numPhi) + vkEdge * transV[c];
+    }
+  }
+
+  // The radius is the harmonic mean distance, but no larger than the distance over
+  // which the gradient would take the irradiance to 0, and clamped to the
+  // bounds' scale
+  float radius = invDistSum > 0 ? numTheta * numPhi / invDistSum : FLT_MAX;
+  for (int c = 0; c < 3; ++c)
+  {
+    float grad = res.transGrad[c].Length();
+    if (grad > 0)
+      radius = min(radius, res.irradiance[c] / grad);
+  }
+  res.radius = min(max(radius, minRadius * _size), maxRadius * _size);
+  return res;
+}
+
+//---------------------------------------------------------------------------
+void IrradianceCache::Add(const IrradianceRecord& record)
+{
+  tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+  if (_nodes.empty())
+    return;
+
+  u32 recordIdx = (u32)_records.size();
+  _records.push_back(record);
+
+  float extent = accuracy * record.radius;
+  Aabb influence(record.pos - Vector3(extent, extent, extent), record.pos + Vector3(extent, extent, extent));
+  if (Overlaps(influence, _nodes[0].bounds))
+    Insert(0, recordIdx, influence);
+  else
+    _nodes[0].records.push_back(recordIdx);
+}
+
+//---------------------------------------------------------------------------
+void IrradianceCache::Insert(u32 nodeIdx, u32 recordIdx, const Aabb& influence)
+{
+  // stored in the first nodes no bigger than the area of influence, or at the
+  // deepest level
+  struct Pending
+  {
+    u32 node;
+    int depth;
+  };
+  Pending stack[MAX_DEPTH * 8 + 1];
+  int stackSize = 0;
+  stack[stackSize++] = {nodeIdx, 0};
+  Vector3 influenceSize = influence.mx - influence.mn;
+
+  while (stackSize > 0)
+  {
+    Pending cur = stack[--stackSize];
+    Aabb bounds = _nodes[cur.node].bounds;
+    Vector3 nodeSize = bounds.mx - bounds.mn;
+    if (cur.depth == MAX_DEPTH || nodeSize.LengthSquared() < influenceSize.LengthSquared())
+    {
+      _nodes[cur.node].records.push_back(recordIdx);
+      continue;
+    }
+
+    if (!_nodes[cur.node].children)
+    {
+      u32 first = (u32)_nodes.size();
+      _nodes.resize(first + 8);
+      for (int i = 0; i < 8; ++i)
+        _nodes[first + i].bounds = Octant(bounds, i);
+      _nodes[cur.node].children = first;
+    }
+
+    u32 first = _nodes[cur.node].children;
+    for (int i = 0; i < 8; ++i)
+    {
+      if (Overlaps(_nodes[first + i].bounds, influence))
+        stack[stackSize++] = {first + i, cur.depth + 1};
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+size_t IrradianceCache::NumRecords() const
+{
+  tbb::spin_rw_mutex::scoped_lock lock(_mutex, false);
+  return _records.size();
+}
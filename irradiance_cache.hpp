@@ -0,0 +1,79 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "bvh.hpp"
+#include <functional>
+#include <tbb/spin_rw_mutex.h>
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // the irradiance at a point, and how it changes around it
+  struct IrradianceRecord
+  {
+    Vector3 pos;
+    Vector3 normal;
+    Color irradiance;
+    // per color channel, the change with rotation of the normal, and with
+    // translation of the point
+    Vector3 rotGrad[3];
+    Vector3 transGrad[3];
+    // harmonic mean distance to the surfaces seen from pos, clamped
+    float radius;
+  };
+
+  // the light coming in along the ray, and the distance to what it hit (0 for
+  // nothing)
+  typedef std::function<Color(const Ray& r, float* hitDist)> IncomingRadiance;
+
+  //---------------------------------------------------------------------------
+  // Ward's irradiance cache (Ward et al. 1988, "A ray tracing solution for diffuse
+  // interreflection"), with the gradients of Ward and Heckbert 1992. The records are
+  // computed on demand, from a stratified hemisphere of rays, and interpolated
+  // wherever the weight of nearby records is high enough. An octree over the records'
+  // areas of influence finds the candidates. Lookups and inserts can come from any
+  // thread: lookups share a lock, and records are computed outside of it. A record
+  // only depends on its position and normal, but which records get made depends on
+  // the order of the lookups.
+  struct IrradianceCache
+  {
+    // empties the cache, with the octree covering bounds
+    void Init(const Aabb& bounds);
+
+    // the irradiance at pos with normal n, interpolated from the cache, or computed
+    // with radiance and added to it
+    Color Irradiance(const Vector3& pos, const Vector3& n, const IncomingRadiance& radiance);
+    // false if no record is close enough
+    bool Lookup(const Vector3& pos, const Vector3& n, Color* irradiance) const;
+    IrradianceRecord Compute(const Vector3& pos, const Vector3& n, const IncomingRadiance& radiance) const;
+    void Add(const IrradianceRecord& record);
+
+    size_t NumRecords() const;
+
+    // Ward's a, the largest error allowed when interpolating. Lower is more records
+    float accuracy = 0.15f;
+    // records' radii are clamped to these fractions of the bounds' size
+    float minRadius = 0.005f;
+    float maxRadius = 0.1f;
+    // rays per record are thetaStrata * phiStrata
+    int thetaStrata = 10;
+    int phiStrata = 30;
+
+  private:
+    struct Node
+    {
+      Aabb bounds;
+      // index of the first of the 8 children, or 0 for none
+      u32 children = 0;
+      vector<u32> records;
+    };
+
+    // adds the record to the nodes overlapping influence, at the depth where they're
+    // about its size
+    void Insert(u32 nodeIdx, u32 recordIdx, const Aabb& influence);
+
+    vector<Node> _nodes;
+    vector<IrradianceRecord> _records;
+    float _size = 0;
+    mutable tbb::spin_rw_mutex _mutex;
+  };
+}
@@ -0,0 +1,71 @@
+#include "kernel_table.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace pbr;
+
+namespace
+{
+  KernelTable kernels;
+  bool kernelsSelected = false;
+
+  //---------------------------------------------------------------------------
+  bool InitKernels(Isa isa, KernelTable* table)
+  {
+    switch (isa)
+    {
+      case Isa::Scalar: return InitKernelsScalar(table);
+      case Isa::SSE42: return InitKernelsSSE42(table);
+      case Isa::AVX2: return InitKernelsAVX2(table);
+      case Isa::AVX512: return InitKernelsAVX512(table);
+    }
+    return false;
+  }
+
+  //---------------------------------------------------------------------------
+  const char* IsaOverride(int argc, char** argv)
+  {
+    const char* prefix = "--isa=";
+    size_t prefixLen = strlen(prefix);
+    for (int i = 1; i < argc; ++i)
+    {
+      if (strncmp(argv[i], prefix, prefixLen) == 0)
+        return argv[i] + prefixLen;
+    }
+
+    return getenv("PBR_ISA");
+  }
+}
+
+//---------------------------------------------------------------------------
+void pbr::SelectKernels(int argc, char** argv)
+{
+  CpuFeatures features = DetectCpuFeatures();
+  Isa isa = BestIsa(features);
+
+  if (const char* str = IsaOverride(argc, argv))
+  {
+    Isa requested;
+    if (!ParseIsa(str, &requested))
+      fprintf(stderr, "Unknown isa: %s, using %s\n", str, IsaName(isa));
+    else if (!IsaSupported(requested, features))
+      fprintf(stderr, "This cpu doesn't support %s, using %s\n", str, IsaName(isa));
+    else
+      isa = requested;
+  }
+
+  // walk down the levels until we find one that was compiled into this build
+  while (!InitKernels(isa, &kernels))
+    isa = (Isa)((int)isa - 1);
+
+  kernelsSelected = true;
+  printf("kernels: %s (%d wide)\n", IsaName(kernels.isa), kernels.width);
+}
+
+//---------------------------------------------------------------------------
+const KernelTable& pbr::Kernels()
+{
+  assert(kernelsSelected);
+  return kernels;
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "cpu_features.hpp"
+
+namespace pbr
+{
+  // The hot kernels, compiled once per instruction set level (kernels_scalar.cpp,
+  // kernels_sse42.cpp, kernels_avx2.cpp and kernels_avx512.cpp, each built with its
+  // own compiler flags) and picked at startup based on what the cpu supports.
+  //
+  // Code in those translation units must only call things from lane.hpp and
+  // kernels.hpp, which live in a namespace per instruction set. Any other inline
+  // function could be emitted with avx instructions, and the linker is free to pick
+  // that copy for the whole program.
+
+  // entries in the gamma encode table used by toneMapRow, see GammaLut
+  const int GAMMA_LUT_SIZE = 1024;
+
+  // One pass of the edge-avoiding a-trous filter, see denoise.hpp. All the planes
+  // are width * height floats.
+  struct AtrousPass
+  {
+    int width, height;
+    // distance between taps
+    int step;
+    const float* in[3];
+    float* out[3];
+    const float* normal[3];
+    const float* depth;
+    // log2(e) / sigma^2 for each edge stopping function
+    float colorWeight;
+    float normalWeight;
+    float depthWeight;
+  };
+
+  // sample warps for warpBatch, see warp.hpp
+  enum class Warp
+  {
+    ConcentricDisk,
+    CosineHemisphere,
+    UniformSphere,
+    UniformCone,
+    UniformTriangle,
+  };
+
+  struct KernelTable
+  {
+    Isa isa = Isa::Scalar;
+    int width = 1;
+
+    // intersection. Primitives are SoA, padded to a multiple of 16. Returns the index
+    // of the closest hit in (0, tHit) and updates tHit, or returns -1
+    int (*intersectSpheres)(const Ray& ray,
+        const float* cx,
+        const float* cy,
+        const float* cz,
+        const float* radiusSq,
+        int count,
+        float* tHit) = nullptr;
+    int (*intersectPlanes)(const Ray& ray,
+        const float* nx,
+        const float* ny,
+        const float* nz,
+        const float* distance,
+        int count,
+        float* tHit) = nullptr;
+    // returns the position in triIds of the closest hit
+    int (*intersectTris)(const Ray& ray,
+        const float* verts,
+        const u32* indices,
+        const u32* triIds,
+        int count,
+        float* tHit) = nullptr;
+
+    // sampling. Normalized directions from origin through a row of points on the
+    // image plane, start + i * step, optionally offset by a jitter (in units of step
+    // and down) per point
+    void (*cameraRayRow)(const Vector3& origin,
+        const Vector3& start,
+        const Vector3& step,
+        const Vector3& down,
+        const Vector2* jitter,
+        int count,
+        float* dx,
+        float* dy,
+        float* dz) = nullptr;
+    // maps count points (u0, u1) in the unit square through the warp. Directions are
+    // written to x, y, z in the local frame, disk points to x and y only, and triangle
+    // samples as barycentrics. cosMax is only used by the cone. The outputs can be
+    // the same arrays as the inputs.
+    void (*warpBatch)(Warp warp,
+        float cosMax,
+        const float* u0,
+        const float* u1,
+        int count,
+        float* x,
+        float* y,
+        float* z) = nullptr;
+
+    // tone mapping. Sum of log10 of the pixel luminances, clamped to minLuminance
+    double (*logLuminanceSum)(const Color* pixels, int count, float minLuminance) = nullptr;
+    // log2 of the pixel luminances, clamped to minLuminance
+    void (*logLuminanceRow)(const Color* pixels, int count, float minLuminance, float* out) = nullptr;
+    // scale and clamp a row of pixels, and gamma encode through a table indexed by
+    // sqrt(x) * (GAMMA_LUT_SIZE - 1)
+    void (*toneMapRow)(
+        const Color* src, Color32* dst, int count, float scale, const s32* lut) = nullptr;
+
+    // denoising. Filters row y of the pass
+    void (*atrousRow)(const AtrousPass& pass, int y) = nullptr;
+  };
+
+  // Fill the table with the given level, returns false if this build doesn't have it
+  bool InitKernelsScalar(KernelTable* table);
+  bool InitKernelsSSE42(KernelTable* table);
+  bool InitKernelsAVX2(KernelTable* table);
+  bool InitKernelsAVX512(KernelTable* table);
+
+  // Selects the best kernels for the cpu, unless overridden by a "--isa=<name>"
+  // argument or the PBR_ISA environment variable. An override the cpu can't run
+  // falls back to the best supported level.
+  void SelectKernels(int argc, char** argv);
+  const KernelTable& Kernels();
+}
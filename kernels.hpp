@@ -0,0 +1,275 @@
+#pragma once
+#include "lane.hpp"
+
+namespace pbr
+{
+  inline namespace PBR_LANE_NS
+  {
+    // Intersection kernels written once against the lane types, and instantiated at
+    // whatever widths the translation unit was compiled for. Primitives are passed as
+    // SoA arrays, which must be padded to a multiple of N. All kernels return the
+    // index of the closest hit in (0, tHit), and update tHit, or return -1 on a miss.
+
+    //---------------------------------------------------------------------------
+    struct TriangleSoA
+    {
+      // p0 and the edges p1 - p0, p2 - p0, as in IsectTriPre
+      const float* p0[3];
+      const float* e1[3];
+      const float* e2[3];
+    };
+
+    //---------------------------------------------------------------------------
+    template <int N>
+    int ClosestLane(LaneF<N> best, LaneI<N> bestIdx, float* tHit)
+    {
+      float t = ReduceMin(best);
+      if (!(t < *tHit))
+        return -1;
+
+      *tHit = t;
+      u32 bits = (best <= LaneF<N>(t)).Bits();
+      int lane = 0;
+      while (!(bits & (1 << lane)))
+        ++lane;
+      return bestIdx[lane];
+    }
+
+    //---------------------------------------------------------------------------
+    // Same test as Sphere::Intersect, which assumes a normalized ray direction
+    template <int N>
+    int IntersectSpheres(const Ray& ray,
+        const float* cx,
+        const float* cy,
+        const float* cz,
+        const float* radiusSq,
+        int count,
+        float* tHit)
+    {
+      typedef LaneF<N> F;
+      LaneVector3<N> o(ray.o);
+      LaneVector3<N> d(ray.d);
+      F a = Dot(d, d);
+      F best(*tHit);
+      LaneI<N> bestIdx(-1);
+      LaneI<N> idx = LaneI<N>::Iota();
+
+      for (int i = 0; i < count; i += N, idx = idx + LaneI<N>(N))
+      {
+        LaneVector3<N> oc = o - LaneVector3<N>::Load(cx + i, cy + i, cz + i);
+        F b = F(2) * Dot(oc, d);
+        F c = Dot(oc, oc) - F::Load(radiusSq + i);
+        F disc = b * b - F(4) * (a * c);
+        LaneMask<N> valid = disc >= F(0);
+        // only the last batch can be partial
+        if (count - i < N)
+          valid = valid & FirstLanes<N>(count - i);
+        if (!Any(valid))
+          continue;
+
+        F s = Sqrt(Max(disc, F(0)));
+        F t0 = (-b - s) * F(0.5f);
+        F t1 = (-b + s) * F(0.5f);
+        F t = Select(t0 > F(0), t0, t1);
+        valid = valid & (t > F(0)) & (t < best);
+        best = Select(valid, t, best);
+        bestIdx = Select(valid, idx, bestIdx);
+      }
+
+      return ClosestLane<N>(best, bestIdx, tHit);
+    }
+
+    //---------------------------------------------------------------------------
+    // Same test as Plane::Intersect, but only hits in front of the ray origin count
+    template <int N>
+    int IntersectPlanes(const Ray& ray,
+        const float* nx,
+        const float* ny,
+        const float* nz,
+        const float* distance,
+        int count,
+        float* tHit)
+    {
+      typedef LaneF<N> F;
+      LaneVector3<N> o(ray.o);
+      LaneVector3<N> d(ray.d);
+      F best(*tHit);
+      LaneI<N> bestIdx(-1);
+      LaneI<N> idx = LaneI<N>::Iota();
+
+      for (int i = 0; i < count; i += N, idx = idx + LaneI<N>(N))
+      {
+        LaneVector3<N> n = LaneVector3<N>::Load(nx + i, ny + i, nz + i);
+        F vd = Dot(n, d);
+        LaneMask<N> valid = vd < F(0);
+        if (count - i < N)
+          valid = valid & FirstLanes<N>(count - i);
+        if (!Any(valid))
+          continue;
+
+        F t = -(Dot(n, o) + F::Load(distance + i)) / Select(valid, vd, F(-1));
+        valid = valid & (t > F(0)) & (t < best);
+        best = Select(valid, t, best);
+        bestIdx = Select(valid, idx, bestIdx);
+      }
+
+      return ClosestLane<N>(best, bestIdx, tHit);
+    }
+
+    //---------------------------------------------------------------------------
+    // Moller/Trombore against one triangle per lane
+    template <int N>
+    LaneMask<N> RayTriIntersect(const LaneVector3<N>& o,
+        const LaneVector3<N>& d,
+        const LaneVector3<N>& p0,
+        const LaneVector3<N>& e1,
+        const LaneVector3<N>& e2,
+        LaneF<N>* t)
+    {
+      typedef LaneF<N> F;
+      const F eps(1.e-8f);
+
+      LaneVector3<N> q = Cross(d, e2);
+      F a = Dot(e1, q);
+      LaneMask<N> valid = Abs(a) > eps;
+
+      F f = F(1) / Select(valid, a, F(1));
+      LaneVector3<N> s = o - p0;
+      F u = f * Dot(s, q);
+      LaneVector3<N> r = Cross(s, e1);
+      F v = f * Dot(d, r);
+      *t = f * Dot(e2, r);
+
+      return valid & (u >= F(0)) & (v >= F(0)) & (u + v <= F(1));
+    }
+
+    //---------------------------------------------------------------------------
+    template <int N>
+    int RayTriIntersect(const Ray& ray, const TriangleSoA& tris, int count, float* tHit)
+    {
+      typedef LaneF<N> F;
+      const F eps(0.00001f);
+      LaneVector3<N> o(ray.o);
+      LaneVector3<N> d(ray.d);
+      F best(*tHit);
+      LaneI<N> bestIdx(-1);
+      LaneI<N> idx = LaneI<N>::Iota();
+
+      for (int i = 0; i < count; i += N, idx = idx + LaneI<N>(N))
+      {
+        LaneVector3<N> p0 = LaneVector3<N>::Load(tris.p0[0] + i, tris.p0[1] + i, tris.p0[2] + i);
+        LaneVector3<N> e1 = LaneVector3<N>::Load(tris.e1[0] + i, tris.e1[1] + i, tris.e1[2] + i);
+        LaneVector3<N> e2 = LaneVector3<N>::Load(tris.e2[0] + i, tris.e2[1] + i, tris.e2[2] + i);
+
+        F t;
+        LaneMask<N> valid = RayTriIntersect<N>(o, d, p0, e1, e2, &t);
+        if (count - i < N)
+          valid = valid & FirstLanes<N>(count - i);
+        valid = valid & (t >= eps) & (t < best);
+        best = Select(valid, t, best);
+        bestIdx = Select(valid, idx, bestIdx);
+      }
+
+      return ClosestLane<N>(best, bestIdx, tHit);
+    }
+
+    //---------------------------------------------------------------------------
+    // Indexed triangles, gathering the vertices (xyz per vertex) through the index
+    // buffer. Tests the count triangles listed in triIds, and returns the position in
+    // triIds of the closest hit. triIds doesn't need any padding.
+    template <int N>
+    int RayTriIntersect(const Ray& ray,
+        const float* verts,
+        const u32* indices,
+        const u32* triIds,
+        int count,
+        float* tHit)
+    {
+      typedef LaneF<N> F;
+      typedef LaneI<N> I;
+      const F eps(0.00001f);
+      LaneVector3<N> o(ray.o);
+      LaneVector3<N> d(ray.d);
+      F best(*tHit);
+      I bestIdx(-1);
+
+      s32 ids[N];
+      for (int i = 0; i < count; i += N)
+      {
+        // pad the last batch by repeating the final triangle
+        for (int j = 0; j < N; ++j)
+          ids[j] = (s32)triIds[i + j < count ? i + j : count - 1];
+
+        I tri = I::Load(ids) * I(3);
+        const s32* idx = (const s32*)indices;
+        LaneVector3<N> p0 = LaneVector3<N>::Gather(verts, Gather(idx, tri));
+        LaneVector3<N> p1 = LaneVector3<N>::Gather(verts, Gather(idx, tri + I(1)));
+        LaneVector3<N> p2 = LaneVector3<N>::Gather(verts, Gather(idx, tri + I(2)));
+
+        F t;
+        LaneMask<N> valid = RayTriIntersect<N>(o, d, p0, p1 - p0, p2 - p0, &t) & FirstLanes<N>(count - i);
+        valid = valid & (t >= eps) & (t < best);
+        best = Select(valid, t, best);
+        bestIdx = Select(valid, I::Iota() + I(i), bestIdx);
+      }
+
+      return ClosestLane<N>(best, bestIdx, tHit);
+    }
+
+    //---------------------------------------------------------------------------
+    // Sample warps, the same mappings as in warp.hpp with N samples at a time
+    //---------------------------------------------------------------------------
+    template <int N>
+    void ConcentricDisk(LaneF<N> u0, LaneF<N> u1, LaneF<N>* x, LaneF<N>* y)
+    {
+      typedef LaneF<N> F;
+      F a = MulAdd(u0, F(2), F(-1));
+      F b = MulAdd(u1, F(2), F(-1));
+      LaneMask<N> big = Abs(a) > Abs(b);
+      F r = Select(big, a, b);
+      F safeR = Select(Abs(r) > F(0), r, F(1));
+      F s, c;
+      SinCos(F(Pi / 4) * Select(big, b, a) / safeR, &s, &c);
+      *x = r * Select(big, c, s);
+      *y = r * Select(big, s, c);
+    }
+
+    //---------------------------------------------------------------------------
+    template <int N>
+    LaneVector3<N> CosineHemisphere(LaneF<N> u0, LaneF<N> u1)
+    {
+      typedef LaneF<N> F;
+      LaneVector3<N> d;
+      ConcentricDisk(u0, u1, &d.x, &d.y);
+      d.z = Sqrt(Max(F(0), F(1) - d.x * d.x - d.y * d.y));
+      return d;
+    }
+
+    //---------------------------------------------------------------------------
+    template <int N>
+    LaneVector3<N> UniformCone(LaneF<N> u0, LaneF<N> u1, LaneF<N> cosMax)
+    {
+      typedef LaneF<N> F;
+      LaneVector3<N> d;
+      ConcentricDisk(u0, u1, &d.x, &d.y);
+      F oneMinusCos = F(1) - cosMax;
+      d.z = F(1) - (d.x * d.x + d.y * d.y) * oneMinusCos;
+      F s = Sqrt(Max(F(0), oneMinusCos * (F(1) + d.z)));
+      d.x = d.x * s;
+      d.y = d.y * s;
+      return d;
+    }
+
+    //---------------------------------------------------------------------------
+    template <int N>
+    LaneVector3<N> UniformTriangle(LaneF<N> u0, LaneF<N> u1)
+    {
+      typedef LaneF<N> F;
+      LaneMask<N> upper = u1 > u0;
+      F h = Select(upper, u0, u1) * F(0.5f);
+      F b0 = Select(upper, h, u0 - h);
+      F b1 = Select(upper, u1 - h, h);
+      return LaneVector3<N>(b0, b1, F(1) - b0 - b1);
+    }
+  }
+}
@@ -0,0 +1,12 @@
+#include "kernels_impl.hpp"
+
+//---------------------------------------------------------------------------
+bool pbr::InitKernelsAVX2(KernelTable* table)
+{
+#if PBR_LANE_WIDTH_8
+  FillKernelTable<8>(table, Isa::AVX2);
+  return true;
+#else
+  return false;
+#endif
+}
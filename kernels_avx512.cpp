@@ -0,0 +1,12 @@
+#include "kernels_impl.hpp"
+
+//---------------------------------------------------------------------------
+bool pbr::InitKernelsAVX512(KernelTable* table)
+{
+#if PBR_LANE_WIDTH_16
+  FillKernelTable<16>(table, Isa::AVX512);
+  return true;
+#else
+  return false;
+#endif
+}
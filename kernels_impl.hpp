@@ -0,0 +1,302 @@
+// Included once by each of the kernels_<isa>.cpp files, which are compiled with
+// different instruction set flags. Everything here has internal linkage, so the
+// copies can't be mixed up by the linker.
+#include "kernel_table.hpp"
+#include "kernels.hpp"
+
+namespace
+{
+  using namespace pbr;
+
+  //---------------------------------------------------------------------------
+  // store the first count lanes of a, for the tail of a row
+  template <int N, typename L, typename T>
+  void StoreFirst(L a, T* p, int count)
+  {
+    if (count >= N)
+    {
+      a.Store(p);
+      return;
+    }
+
+    T tmp[N];
+    a.Store(tmp);
+    for (int i = 0; i < count; ++i)
+      p[i] = tmp[i];
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  void CameraRayRow(const Vector3& origin,
+      const Vector3& start,
+      const Vector3& step,
+      const Vector3& down,
+      const Vector2* jitter,
+      int count,
+      float* dx,
+      float* dy,
+      float* dz)
+  {
+    typedef LaneF<N> F;
+    typedef LaneI<N> I;
+    LaneVector3<N> o(origin);
+    LaneVector3<N> p0(start);
+    LaneVector3<N> right(step);
+    LaneVector3<N> up(down);
+
+    for (int i = 0; i < count; i += N)
+    {
+      I idx = I::Iota() + I(i);
+      F x = ToFloat(idx);
+      F y(0);
+      if (jitter)
+      {
+        // keep the gather inside the array for the tail
+        I safeIdx = Select(FirstLanes<N>(count - i), idx, I(0));
+        x = x + Gather<N>((const float*)jitter, safeIdx, 2, 0);
+        y = Gather<N>((const float*)jitter, safeIdx, 2, 1);
+      }
+
+      LaneVector3<N> d = p0 + x * right + y * up - o;
+      F invLen = F(1) / Sqrt(Dot(d, d));
+      StoreFirst<N>(d.x * invLen, dx + i, count - i);
+      StoreFirst<N>(d.y * invLen, dy + i, count - i);
+      StoreFirst<N>(d.z * invLen, dz + i, count - i);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // load the first count lanes, padding the rest with the first one
+  template <int N>
+  LaneF<N> LoadFirst(const float* p, int count)
+  {
+    if (count >= N)
+      return LaneF<N>::Load(p);
+
+    float tmp[N];
+    for (int i = 0; i < N; ++i)
+      tmp[i] = p[i < count ? i : 0];
+    return LaneF<N>::Load(tmp);
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  void WarpBatch(Warp warp,
+      float cosMax,
+      const float* u0,
+      const float* u1,
+      int count,
+      float* x,
+      float* y,
+      float* z)
+  {
+    typedef LaneF<N> F;
+    for (int i = 0; i < count; i += N)
+    {
+      F a = LoadFirst<N>(u0 + i, count - i);
+      F b = LoadFirst<N>(u1 + i, count - i);
+      LaneVector3<N> d;
+      switch (warp)
+      {
+        case Warp::ConcentricDisk:
+          ConcentricDisk(a, b, &d.x, &d.y);
+          StoreFirst<N>(d.x, x + i, count - i);
+          StoreFirst<N>(d.y, y + i, count - i);
+          continue;
+        case Warp::CosineHemisphere: d = CosineHemisphere(a, b); break;
+        case Warp::UniformSphere: d = UniformCone(a, b, F(-1)); break;
+        case Warp::UniformCone: d = UniformCone(a, b, F(cosMax)); break;
+        case Warp::UniformTriangle: d = UniformTriangle(a, b); break;
+      }
+      StoreFirst<N>(d.x, x + i, count - i);
+      StoreFirst<N>(d.y, y + i, count - i);
+      StoreFirst<N>(d.z, z + i, count - i);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  double LogLuminanceSum(const Color* pixels, int count, float minLuminance)
+  {
+    typedef LaneF<N> F;
+    typedef LaneI<N> I;
+    const float* base = (const float*)pixels;
+    // log10(x) = log2(x) * log10(2)
+    const F log10Of2(0.30102999566f);
+
+    // accumulate in float lanes over blocks, and in double across blocks
+    const int BLOCK_SIZE = 1024;
+    double res = 0;
+    for (int block = 0; block < count; block += BLOCK_SIZE)
+    {
+      int blockEnd = block + BLOCK_SIZE < count ? block + BLOCK_SIZE : count;
+      F sum(0);
+      for (int i = block; i < blockEnd; i += N)
+      {
+        LaneMask<N> valid = FirstLanes<N>(blockEnd - i);
+        I idx = Select(valid, I::Iota() + I(i), I(0));
+        // ITU-R BT.709 luminance
+        F y = Gather<N>(base, idx, 4, 0) * F(0.2126f) + Gather<N>(base, idx, 4, 1) * F(0.7152f)
+              + Gather<N>(base, idx, 4, 2) * F(0.0722f);
+        F l = Log2(Max(y, F(minLuminance))) * log10Of2;
+        sum = sum + Select(valid, l, F(0));
+      }
+
+      float tmp[N];
+      sum.Store(tmp);
+      for (int i = 0; i < N; ++i)
+        res += tmp[i];
+    }
+    return res;
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  void LogLuminanceRow(const Color* pixels, int count, float minLuminance, float* out)
+  {
+    typedef LaneF<N> F;
+    typedef LaneI<N> I;
+    const float* base = (const float*)pixels;
+
+    for (int i = 0; i < count; i += N)
+    {
+      I idx = Select(FirstLanes<N>(count - i), I::Iota() + I(i), I(0));
+      F y = Gather<N>(base, idx, 4, 0) * F(0.2126f) + Gather<N>(base, idx, 4, 1) * F(0.7152f)
+            + Gather<N>(base, idx, 4, 2) * F(0.0722f);
+      StoreFirst<N>(Log2(Max(y, F(minLuminance))), out + i, count - i);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  void ToneMapRow(const Color* src, Color32* dst, int count, float scale, const s32* lut)
+  {
+    typedef LaneF<N> F;
+    typedef LaneI<N> I;
+    const float* base = (const float*)src;
+    const F s(scale);
+    const F lutScale((float)(GAMMA_LUT_SIZE - 1));
+
+    auto encode = [&](F v) {
+      // the clamp also maps NaNs to 0
+      F c = Min(Max(v * s, F(0)), F(1));
+      return Gather(lut, ToInt(MulAdd(Sqrt(c), lutScale, F(0.5f))));
+    };
+
+    for (int i = 0; i < count; i += N)
+    {
+      I idx = Select(FirstLanes<N>(count - i), I::Iota() + I(i), I(0));
+      I r = encode(Gather<N>(base, idx, 4, 0));
+      I g = encode(Gather<N>(base, idx, 4, 1));
+      I b = encode(Gather<N>(base, idx, 4, 2));
+      // Color32 is r, g, b, a in memory
+      I packed = r | ShiftLeft(g, 8) | ShiftLeft(b, 16) | ShiftLeft(I(0xff), 24);
+      StoreFirst<N>(packed, (s32*)(dst + i), count - i);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // N pixels from a plane, starting at x in row. Lanes past the end of the row, or
+  // outside it when ofs is added, are masked off and read a safe pixel instead.
+  template <int N>
+  LaneF<N> LoadTap(const float* row, int x, int ofs, int width, LaneMask<N>* valid)
+  {
+    typedef LaneI<N> I;
+    if (x + ofs >= 0 && x + ofs + N <= width)
+    {
+      *valid = FirstLanes<N>(width - x);
+      return LaneF<N>::Load(row + x + ofs);
+    }
+
+    I qx = I::Iota() + I(x + ofs);
+    *valid = FirstLanes<N>(width - x) & !(qx < I(0)) & (qx < I(width));
+    return Gather(row, Select(*valid, qx, I(x)));
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  void AtrousRow(const AtrousPass& pass, int y)
+  {
+    typedef LaneF<N> F;
+    // B3 spline weights, for offsets 0, 1 and 2
+    const float h[3] = {3.f / 8, 1.f / 4, 1.f / 16};
+    const int w = pass.width;
+    const size_t rowOfs = (size_t)y * w;
+
+    for (int x = 0; x < w; x += N)
+    {
+      LaneMask<N> valid;
+      LaneVector3<N> c(LoadTap<N>(pass.in[0] + rowOfs, x, 0, w, &valid),
+          LoadTap<N>(pass.in[1] + rowOfs, x, 0, w, &valid),
+          LoadTap<N>(pass.in[2] + rowOfs, x, 0, w, &valid));
+      LaneVector3<N> n(LoadTap<N>(pass.normal[0] + rowOfs, x, 0, w, &valid),
+          LoadTap<N>(pass.normal[1] + rowOfs, x, 0, w, &valid),
+          LoadTap<N>(pass.normal[2] + rowOfs, x, 0, w, &valid));
+      F z = LoadTap<N>(pass.depth + rowOfs, x, 0, w, &valid);
+
+      // the color and depth differences are relative, so the same sigmas work
+      // regardless of brightness and distance
+      F cc = Dot(c, c) + F(1e-4f);
+      F depthWeight = F(pass.depthWeight) / (z * z + F(1e-4f));
+
+      LaneVector3<N> sum(F(0), F(0), F(0));
+      F weightSum(0);
+
+      for (int dy = -2; dy <= 2; ++dy)
+      {
+        int qy = y + dy * pass.step;
+        if (qy < 0 || qy >= pass.height)
+          continue;
+
+        size_t qOfs = (size_t)qy * w;
+        for (int dx = -2; dx <= 2; ++dx)
+        {
+          int ofs = dx * pass.step;
+          LaneVector3<N> qc(LoadTap<N>(pass.in[0] + qOfs, x, ofs, w, &valid),
+              LoadTap<N>(pass.in[1] + qOfs, x, ofs, w, &valid),
+              LoadTap<N>(pass.in[2] + qOfs, x, ofs, w, &valid));
+          LaneVector3<N> qn(LoadTap<N>(pass.normal[0] + qOfs, x, ofs, w, &valid),
+              LoadTap<N>(pass.normal[1] + qOfs, x, ofs, w, &valid),
+              LoadTap<N>(pass.normal[2] + qOfs, x, ofs, w, &valid));
+          F qz = LoadTap<N>(pass.depth + qOfs, x, ofs, w, &valid);
+
+          LaneVector3<N> dc = qc - c;
+          LaneVector3<N> dn = qn - n;
+          F dz = qz - z;
+          F e = MulAdd(Dot(dc, dc) / (cc + Dot(qc, qc)), F(pass.colorWeight),
+              MulAdd(Dot(dn, dn), F(pass.normalWeight), dz * dz * depthWeight));
+          // keeps the weights out of denormals, which are very slow on some cpus
+          e = Min(e, F(64));
+
+          F wgt = F(h[dx < 0 ? -dx : dx] * h[dy < 0 ? -dy : dy]) * Exp2(-e);
+          wgt = Select(valid, wgt, F(0));
+          sum = sum + wgt * qc;
+          weightSum = weightSum + wgt;
+        }
+      }
+
+      // the center tap always has weight, so weightSum > 0
+      F inv = F(1) / weightSum;
+      StoreFirst<N>(sum.x * inv, pass.out[0] + rowOfs + x, w - x);
+      StoreFirst<N>(sum.y * inv, pass.out[1] + rowOfs + x, w - x);
+      StoreFirst<N>(sum.z * inv, pass.out[2] + rowOfs + x, w - x);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  template <int N>
+  void FillKernelTable(KernelTable* table, Isa isa)
+  {
+    table->isa = isa;
+    table->width = N;
+    table->intersectSpheres = &IntersectSpheres<N>;
+    table->intersectPlanes = &IntersectPlanes<N>;
+    table->intersectTris = &RayTriIntersect<N>;
+    table->cameraRayRow = &CameraRayRow<N>;
+    table->warpBatch = &WarpBatch<N>;
+    table->logLuminanceSum = &LogLuminanceSum<N>;
+    table->logLuminanceRow = &LogLuminanceRow<N>;
+    table->toneMapRow = &ToneMapRow<N>;
+    table->atrousRow = &AtrousRow<N>;
+  }
+}
@@ -0,0 +1,9 @@
+#include "kernels_impl.hpp"
+
+//---------------------------------------------------------------------------
+bool pbr::InitKernelsScalar(KernelTable* table)
+{
+  // width 1 is plain C++, and always available
+  FillKernelTable<1>(table, Isa::Scalar);
+  return true;
+}
@@ -0,0 +1,12 @@
+#include "kernels_impl.hpp"
+
+//---------------------------------------------------------------------------
+bool pbr::InitKernelsSSE42(KernelTable* table)
+{
+#if PBR_LANE_WIDTH_4
+  FillKernelTable<4>(table, Isa::SSE42);
+  return true;
+#else
+  return false;
+#endif
+}
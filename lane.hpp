@@ -0,0 +1,622 @@
+#pragma once
+#include "pbr_math.hpp"
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define PBR_LANE_SSE 1
+#endif
+
+// Lane types for writing a kernel once and instantiating it at several widths:
+//  LaneF<N>: N floats, LaneI<N>: N 32-bit ints, LaneMask<N>: N bools
+// Width 1 is plain scalar code and always available. Width 4 needs SSE2, 8 needs
+// AVX2 and 16 needs AVX-512F; the PBR_LANE_WIDTH_* defines say which widths the
+// current translation unit was compiled for.
+
+#define PBR_LANE_WIDTH_1 1
+#if PBR_LANE_SSE
+#define PBR_LANE_WIDTH_4 1
+#endif
+#if defined(__AVX2__)
+#define PBR_LANE_WIDTH_8 1
+#endif
+#if defined(__AVX512F__)
+#define PBR_LANE_WIDTH_16 1
+#endif
+
+// Everything is put in a namespace named after the instruction set, so translation
+// units compiled with different flags (see kernel_table.hpp) don't end up sharing
+// inline functions through the linker.
+#if defined(__AVX512F__)
+#define PBR_LANE_NS lane_avx512
+#elif defined(__AVX2__)
+#define PBR_LANE_NS lane_avx2
+#elif defined(__SSE4_2__)
+#define PBR_LANE_NS lane_sse42
+#elif PBR_LANE_SSE
+#define PBR_LANE_NS lane_sse2
+#else
+#define PBR_LANE_NS lane_scalar
+#endif
+
+namespace pbr
+{
+  inline namespace PBR_LANE_NS
+  {
+    template <int N>
+    struct LaneF;
+    template <int N>
+    struct LaneI;
+    template <int N>
+    struct LaneMask;
+
+    //---------------------------------------------------------------------------
+    // Width 1
+    //---------------------------------------------------------------------------
+    template <>
+    struct LaneMask<1>
+    {
+      LaneMask() {}
+      LaneMask(bool v) : v(v) {}
+      u32 Bits() const { return v ? 1 : 0; }
+      bool v;
+    };
+
+    template <>
+    struct LaneF<1>
+    {
+      LaneF() {}
+      LaneF(float v) : v(v) {}
+      static LaneF Load(const float* p) { return LaneF(*p); }
+      void Store(float* p) const { *p = v; }
+      float operator[](int) const { return v; }
+      float v;
+    };
+
+    template <>
+    struct LaneI<1>
+    {
+      LaneI() {}
+      LaneI(s32 v) : v(v) {}
+      static LaneI Load(const s32* p) { return LaneI(*p); }
+      static LaneI Iota() { return LaneI(0); }
+      void Store(s32* p) const { *p = v; }
+      s32 operator[](int) const { return v; }
+      s32 v;
+    };
+
+    inline LaneMask<1> operator&(LaneMask<1> a, LaneMask<1> b) { return a.v && b.v; }
+    inline LaneMask<1> operator|(LaneMask<1> a, LaneMask<1> b) { return a.v || b.v; }
+    inline LaneMask<1> operator!(LaneMask<1> a) { return !a.v; }
+    inline bool Any(LaneMask<1> m) { return m.v; }
+    inline bool All(LaneMask<1> m) { return m.v; }
+
+    inline LaneF<1> operator+(LaneF<1> a, LaneF<1> b) { return a.v + b.v; }
+    inline LaneF<1> operator-(LaneF<1> a, LaneF<1> b) { return a.v - b.v; }
+    inline LaneF<1> operator*(LaneF<1> a, LaneF<1> b) { return a.v * b.v; }
+    inline LaneF<1> operator/(LaneF<1> a, LaneF<1> b) { return a.v / b.v; }
+    inline LaneF<1> operator-(LaneF<1> a) { return -a.v; }
+    inline LaneMask<1> operator<(LaneF<1> a, LaneF<1> b) { return a.v < b.v; }
+    inline LaneMask<1> operator<=(LaneF<1> a, LaneF<1> b) { return a.v <= b.v; }
+    inline LaneMask<1> operator>(LaneF<1> a, LaneF<1> b) { return a.v > b.v; }
+    inline LaneMask<1> operator>=(LaneF<1> a, LaneF<1> b) { return a.v >= b.v; }
+    inline LaneF<1> MulAdd(LaneF<1> a, LaneF<1> b, LaneF<1> c) { return a.v * b.v + c.v; }
+    inline LaneF<1> Min(LaneF<1> a, LaneF<1> b) { return a.v < b.v ? a.v : b.v; }
+    inline LaneF<1> Max(LaneF<1> a, LaneF<1> b) { return a.v > b.v ? a.v : b.v; }
+    inline LaneF<1> Abs(LaneF<1> a) { return fabsf(a.v); }
+    inline LaneF<1> Sqrt(LaneF<1> a) { return sqrtf(a.v); }
+    inline LaneF<1> Select(LaneMask<1> m, LaneF<1> a, LaneF<1> b) { return m.v ? a.v : b.v; }
+    inline float ReduceMin(LaneF<1> a) { return a.v; }
+    inline LaneF<1> Gather(const float* base, LaneI<1> idx) { return base[idx.v]; }
+
+    inline LaneI<1> operator+(LaneI<1> a, LaneI<1> b) { return a.v + b.v; }
+    inline LaneI<1> operator-(LaneI<1> a, LaneI<1> b) { return a.v - b.v; }
+    inline LaneI<1> operator*(LaneI<1> a, LaneI<1> b) { return a.v * b.v; }
+    inline LaneMask<1> operator==(LaneI<1> a, LaneI<1> b) { return a.v == b.v; }
+    inline LaneMask<1> operator<(LaneI<1> a, LaneI<1> b) { return a.v < b.v; }
+    inline LaneI<1> Select(LaneMask<1> m, LaneI<1> a, LaneI<1> b) { return m.v ? a.v : b.v; }
+    inline LaneI<1> Gather(const s32* base, LaneI<1> idx) { return base[idx.v]; }
+    inline LaneI<1> operator&(LaneI<1> a, LaneI<1> b) { return a.v & b.v; }
+    inline LaneI<1> operator|(LaneI<1> a, LaneI<1> b) { return a.v | b.v; }
+    inline LaneI<1> ShiftLeft(LaneI<1> a, int n) { return (s32)((u32)a.v << n); }
+    inline LaneI<1> ShiftRight(LaneI<1> a, int n) { return a.v >> n; }
+
+    inline LaneF<1> ToFloat(LaneI<1> a) { return (float)a.v; }
+    inline LaneI<1> ToInt(LaneF<1> a) { return (s32)a.v; }
+    inline LaneI<1> AsInt(LaneF<1> a)
+    {
+      s32 i;
+      memcpy(&i, &a.v, sizeof(i));
+      return i;
+    }
+    inline LaneF<1> AsFloat(LaneI<1> a)
+    {
+      float f;
+      memcpy(&f, &a.v, sizeof(f));
+      return f;
+    }
+
+#if PBR_LANE_WIDTH_4
+    //---------------------------------------------------------------------------
+    // Width 4, SSE
+    //---------------------------------------------------------------------------
+    template <>
+    struct LaneMask<4>
+    {
+      LaneMask() {}
+      LaneMask(__m128 v) : v(v) {}
+      u32 Bits() const { return (u32)_mm_movemask_ps(v); }
+      __m128 v;
+    };
+
+    template <>
+    struct LaneF<4>
+    {
+      LaneF() {}
+      LaneF(float f) : v(_mm_set1_ps(f)) {}
+      LaneF(__m128 v) : v(v) {}
+      static LaneF Load(const float* p) { return _mm_loadu_ps(p); }
+      void Store(float* p) const { _mm_storeu_ps(p, v); }
+      float operator[](int i) const
+      {
+        alignas(16) float tmp[4];
+        _mm_store_ps(tmp, v);
+        return tmp[i];
+      }
+      __m128 v;
+    };
+
+    template <>
+    struct LaneI<4>
+    {
+      LaneI() {}
+      LaneI(s32 i) : v(_mm_set1_epi32(i)) {}
+      LaneI(__m128i v) : v(v) {}
+      static LaneI Load(const s32* p) { return _mm_loadu_si128((const __m128i*)p); }
+      static LaneI Iota() { return _mm_setr_epi32(0, 1, 2, 3); }
+      void Store(s32* p) const { _mm_storeu_si128((__m128i*)p, v); }
+      s32 operator[](int i) const
+      {
+        alignas(16) s32 tmp[4];
+        _mm_store_si128((__m128i*)tmp, v);
+        return tmp[i];
+      }
+      __m128i v;
+    };
+
+    inline LaneMask<4> operator&(LaneMask<4> a, LaneMask<4> b) { return _mm_and_ps(a.v, b.v); }
+    inline LaneMask<4> operator|(LaneMask<4> a, LaneMask<4> b) { return _mm_or_ps(a.v, b.v); }
+    inline LaneMask<4> operator!(LaneMask<4> a)
+    {
+      return _mm_xor_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+    }
+    inline bool Any(LaneMask<4> m) { return m.Bits() != 0; }
+    inline bool All(LaneMask<4> m) { return m.Bits() == 0xf; }
+
+    inline LaneF<4> operator+(LaneF<4> a, LaneF<4> b) { return _mm_add_ps(a.v, b.v); }
+    inline LaneF<4> operator-(LaneF<4> a, LaneF<4> b) { return _mm_sub_ps(a.v, b.v); }
+    inline LaneF<4> operator*(LaneF<4> a, LaneF<4> b) { return _mm_mul_ps(a.v, b.v); }
+    inline LaneF<4> operator/(LaneF<4> a, LaneF<4> b) { return _mm_div_ps(a.v, b.v); }
+    inline LaneF<4> operator-(LaneF<4> a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+    inline LaneMask<4> operator<(LaneF<4> a, LaneF<4> b) { return _mm_cmplt_ps(a.v, b.v); }
+    inline LaneMask<4> operator<=(LaneF<4> a, LaneF<4> b) { return _mm_cmple_ps(a.v, b.v); }
+    inline LaneMask<4> operator>(LaneF<4> a, LaneF<4> b) { return _mm_cmpgt_ps(a.v, b.v); }
+    inline LaneMask<4> operator>=(LaneF<4> a, LaneF<4> b) { return _mm_cmpge_ps(a.v, b.v); }
+    inline LaneF<4> MulAdd(LaneF<4> a, LaneF<4> b, LaneF<4> c)
+    {
+#if defined(__FMA__)
+      return _mm_fmadd_ps(a.v, b.v, c.v);
+#else
+      return _mm_add_ps(_mm_mul_ps(a.v, b.v), c.v);
+#endif
+    }
+    inline LaneF<4> Min(LaneF<4> a, LaneF<4> b) { return _mm_min_ps(a.v, b.v); }
+    inline LaneF<4> Max(LaneF<4> a, LaneF<4> b) { return _mm_max_ps(a.v, b.v); }
+    inline LaneF<4> Abs(LaneF<4> a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+    inline LaneF<4> Sqrt(LaneF<4> a) { return _mm_sqrt_ps(a.v); }
+    inline LaneF<4> Select(LaneMask<4> m, LaneF<4> a, LaneF<4> b)
+    {
+#if defined(__SSE4_1__)
+      return _mm_blendv_ps(b.v, a.v, m.v);
+#else
+      return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+#endif
+    }
+    inline float ReduceMin(LaneF<4> a)
+    {
+      __m128 m = _mm_min_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1)));
+      m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+      return _mm_cvtss_f32(m);
+    }
+    inline LaneF<4> Gather(const float* base, LaneI<4> idx)
+    {
+      // no gather instruction before AVX2
+      return _mm_setr_ps(base[idx[0]], base[idx[1]], base[idx[2]], base[idx[3]]);
+    }
+
+    inline LaneI<4> operator+(LaneI<4> a, LaneI<4> b) { return _mm_add_epi32(a.v, b.v); }
+    inline LaneI<4> operator-(LaneI<4> a, LaneI<4> b) { return _mm_sub_epi32(a.v, b.v); }
+    inline LaneI<4> operator*(LaneI<4> a, LaneI<4> b)
+    {
+#if defined(__SSE4_1__)
+      return _mm_mullo_epi32(a.v, b.v);
+#else
+      alignas(16) s32 x[4], y[4];
+      a.Store(x);
+      b.Store(y);
+      return _mm_setr_epi32(x[0] * y[0], x[1] * y[1], x[2] * y[2], x[3] * y[3]);
+#endif
+    }
+    inline LaneMask<4> operator==(LaneI<4> a, LaneI<4> b)
+    {
+      return _mm_castsi128_ps(_mm_cmpeq_epi32(a.v, b.v));
+    }
+    inline LaneMask<4> operator<(LaneI<4> a, LaneI<4> b)
+    {
+      return _mm_castsi128_ps(_mm_cmplt_epi32(a.v, b.v));
+    }
+    inline LaneI<4> Select(LaneMask<4> m, LaneI<4> a, LaneI<4> b)
+    {
+      __m128i mi = _mm_castps_si128(m.v);
+      return _mm_or_si128(_mm_and_si128(mi, a.v), _mm_andnot_si128(mi, b.v));
+    }
+    inline LaneI<4> Gather(const s32* base, LaneI<4> idx)
+    {
+      return _mm_setr_epi32(base[idx[0]], base[idx[1]], base[idx[2]], base[idx[3]]);
+    }
+    inline LaneI<4> operator&(LaneI<4> a, LaneI<4> b) { return _mm_and_si128(a.v, b.v); }
+    inline LaneI<4> operator|(LaneI<4> a, LaneI<4> b) { return _mm_or_si128(a.v, b.v); }
+    inline LaneI<4> ShiftLeft(LaneI<4> a, int n) { return _mm_sll_epi32(a.v, _mm_cvtsi32_si128(n)); }
+    inline LaneI<4> ShiftRight(LaneI<4> a, int n) { return _mm_sra_epi32(a.v, _mm_cvtsi32_si128(n)); }
+
+    inline LaneF<4> ToFloat(LaneI<4> a) { return _mm_cvtepi32_ps(a.v); }
+    inline LaneI<4> ToInt(LaneF<4> a) { return _mm_cvttps_epi32(a.v); }
+    inline LaneI<4> AsInt(LaneF<4> a) { return _mm_castps_si128(a.v); }
+    inline LaneF<4> AsFloat(LaneI<4> a) { return _mm_castsi128_ps(a.v); }
+#endif
+
+#if PBR_LANE_WIDTH_8
+    //---------------------------------------------------------------------------
+    // Width 8, AVX2
+    //---------------------------------------------------------------------------
+    template <>
+    struct LaneMask<8>
+    {
+      LaneMask() {}
+      LaneMask(__m256 v) : v(v) {}
+      u32 Bits() const { return (u32)_mm256_movemask_ps(v); }
+      __m256 v;
+    };
+
+    template <>
+    struct LaneF<8>
+    {
+      LaneF() {}
+      LaneF(float f) : v(_mm256_set1_ps(f)) {}
+      LaneF(__m256 v) : v(v) {}
+      static LaneF Load(const float* p) { return _mm256_loadu_ps(p); }
+      void Store(float* p) const { _mm256_storeu_ps(p, v); }
+      float operator[](int i) const
+      {
+        alignas(32) float tmp[8];
+        _mm256_store_ps(tmp, v);
+        return tmp[i];
+      }
+      __m256 v;
+    };
+
+    template <>
+    struct LaneI<8>
+    {
+      LaneI() {}
+      LaneI(s32 i) : v(_mm256_set1_epi32(i)) {}
+      LaneI(__m256i v) : v(v) {}
+      static LaneI Load(const s32* p) { return _mm256_loadu_si256((const __m256i*)p); }
+      static LaneI Iota() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+      void Store(s32* p) const { _mm256_storeu_si256((__m256i*)p, v); }
+      s32 operator[](int i) const
+      {
+        alignas(32) s32 tmp[8];
+        _mm256_store_si256((__m256i*)tmp, v);
+        return tmp[i];
+      }
+      __m256i v;
+    };
+
+    inline LaneMask<8> operator&(LaneMask<8> a, LaneMask<8> b) { return _mm256_and_ps(a.v, b.v); }
+    inline LaneMask<8> operator|(LaneMask<8> a, LaneMask<8> b) { return _mm256_or_ps(a.v, b.v); }
+    inline LaneMask<8> operator!(LaneMask<8> a)
+    {
+      return _mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+    }
+    inline bool Any(LaneMask<8> m) { return m.Bits() != 0; }
+    inline bool All(LaneMask<8> m) { return m.Bits() == 0xff; }
+
+    inline LaneF<8> operator+(LaneF<8> a, LaneF<8> b) { return _mm256_add_ps(a.v, b.v); }
+    inline LaneF<8> operator-(LaneF<8> a, LaneF<8> b) { return _mm256_sub_ps(a.v, b.v); }
+    inline LaneF<8> operator*(LaneF<8> a, LaneF<8> b) { return _mm256_mul_ps(a.v, b.v); }
+    inline LaneF<8> operator/(LaneF<8> a, LaneF<8> b) { return _mm256_div_ps(a.v, b.v); }
+    inline LaneF<8> operator-(LaneF<8> a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f)); }
+    inline LaneMask<8> operator<(LaneF<8> a, LaneF<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    inline LaneMask<8> operator<=(LaneF<8> a, LaneF<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    inline LaneMask<8> operator>(LaneF<8> a, LaneF<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    inline LaneMask<8> operator>=(LaneF<8> a, LaneF<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+    inline LaneF<8> MulAdd(LaneF<8> a, LaneF<8> b, LaneF<8> c)
+    {
+#if defined(__FMA__)
+      return _mm256_fmadd_ps(a.v, b.v, c.v);
+#else
+      return _mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v);
+#endif
+    }
+    inline LaneF<8> Min(LaneF<8> a, LaneF<8> b) { return _mm256_min_ps(a.v, b.v); }
+    inline LaneF<8> Max(LaneF<8> a, LaneF<8> b) { return _mm256_max_ps(a.v, b.v); }
+    inline LaneF<8> Abs(LaneF<8> a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+    inline LaneF<8> Sqrt(LaneF<8> a) { return _mm256_sqrt_ps(a.v); }
+    inline LaneF<8> Select(LaneMask<8> m, LaneF<8> a, LaneF<8> b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+    inline float ReduceMin(LaneF<8> a)
+    {
+      __m128 m = _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+      m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+      m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+      return _mm_cvtss_f32(m);
+    }
+    inline LaneF<8> Gather(const float* base, LaneI<8> idx) { return _mm256_i32gather_ps(base, idx.v, 4); }
+
+    inline LaneI<8> operator+(LaneI<8> a, LaneI<8> b) { return _mm256_add_epi32(a.v, b.v); }
+    inline LaneI<8> operator-(LaneI<8> a, LaneI<8> b) { return _mm256_sub_epi32(a.v, b.v); }
+    inline LaneI<8> operator*(LaneI<8> a, LaneI<8> b) { return _mm256_mullo_epi32(a.v, b.v); }
+    inline LaneMask<8> operator==(LaneI<8> a, LaneI<8> b)
+    {
+      return _mm256_castsi256_ps(_mm256_cmpeq_epi32(a.v, b.v));
+    }
+    inline LaneMask<8> operator<(LaneI<8> a, LaneI<8> b)
+    {
+      return _mm256_castsi256_ps(_mm256_cmpgt_epi32(b.v, a.v));
+    }
+    inline LaneI<8> Select(LaneMask<8> m, LaneI<8> a, LaneI<8> b)
+    {
+      return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b.v), _mm256_castsi256_ps(a.v), m.v));
+    }
+    inline LaneI<8> Gather(const s32* base, LaneI<8> idx) { return _mm256_i32gather_epi32(base, idx.v, 4); }
+    inline LaneI<8> operator&(LaneI<8> a, LaneI<8> b) { return _mm256_and_si256(a.v, b.v); }
+    inline LaneI<8> operator|(LaneI<8> a, LaneI<8> b) { return _mm256_or_si256(a.v, b.v); }
+    inline LaneI<8> ShiftLeft(LaneI<8> a, int n) { return _mm256_sll_epi32(a.v, _mm_cvtsi32_si128(n)); }
+    inline LaneI<8> ShiftRight(LaneI<8> a, int n) { return _mm256_sra_epi32(a.v, _mm_cvtsi32_si128(n)); }
+
+    inline LaneF<8> ToFloat(LaneI<8> a) { return _mm256_cvtepi32_ps(a.v); }
+    inline LaneI<8> ToInt(LaneF<8> a) { return _mm256_cvttps_epi32(a.v); }
+    inline LaneI<8> AsInt(LaneF<8> a) { return _mm256_castps_si256(a.v); }
+    inline LaneF<8> AsFloat(LaneI<8> a) { return _mm256_castsi256_ps(a.v); }
+#endif
+
+#if PBR_LANE_WIDTH_16
+    //---------------------------------------------------------------------------
+    // Width 16, AVX-512
+    //---------------------------------------------------------------------------
+    template <>
+    struct LaneMask<16>
+    {
+      LaneMask() {}
+      LaneMask(__mmask16 v) : v(v) {}
+      u32 Bits() const { return (u32)v; }
+      __mmask16 v;
+    };
+
+    template <>
+    struct LaneF<16>
+    {
+      LaneF() {}
+      LaneF(float f) : v(_mm512_set1_ps(f)) {}
+      LaneF(__m512 v) : v(v) {}
+      static LaneF Load(const float* p) { return _mm512_loadu_ps(p); }
+      void Store(float* p) const { _mm512_storeu_ps(p, v); }
+      float operator[](int i) const
+      {
+        alignas(64) float tmp[16];
+        _mm512_store_ps(tmp, v);
+        return tmp[i];
+      }
+      __m512 v;
+    };
+
+    template <>
+    struct LaneI<16>
+    {
+      LaneI() {}
+      LaneI(s32 i) : v(_mm512_set1_epi32(i)) {}
+      LaneI(__m512i v) : v(v) {}
+      static LaneI Load(const s32* p) { return _mm512_loadu_si512(p); }
+      static LaneI Iota() { return _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); }
+      void Store(s32* p) const { _mm512_storeu_si512(p, v); }
+      s32 operator[](int i) const
+      {
+        alignas(64) s32 tmp[16];
+        _mm512_store_si512(tmp, v);
+        return tmp[i];
+      }
+      __m512i v;
+    };
+
+    inline LaneMask<16> operator&(LaneMask<16> a, LaneMask<16> b) { return (__mmask16)(a.v & b.v); }
+    inline LaneMask<16> operator|(LaneMask<16> a, LaneMask<16> b) { return (__mmask16)(a.v | b.v); }
+    inline LaneMask<16> operator!(LaneMask<16> a) { return (__mmask16)~a.v; }
+    inline bool Any(LaneMask<16> m) { return m.v != 0; }
+    inline bool All(LaneMask<16> m) { return m.v == 0xffff; }
+
+    inline LaneF<16> operator+(LaneF<16> a, LaneF<16> b) { return _mm512_add_ps(a.v, b.v); }
+    inline LaneF<16> operator-(LaneF<16> a, LaneF<16> b) { return _mm512_sub_ps(a.v, b.v); }
+    inline LaneF<16> operator*(LaneF<16> a, LaneF<16> b) { return _mm512_mul_ps(a.v, b.v); }
+    inline LaneF<16> operator/(LaneF<16> a, LaneF<16> b) { return _mm512_div_ps(a.v, b.v); }
+    inline LaneF<16> operator-(LaneF<16> a) { return _mm512_sub_ps(_mm512_setzero_ps(), a.v); }
+    inline LaneMask<16> operator<(LaneF<16> a, LaneF<16> b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+    inline LaneMask<16> operator<=(LaneF<16> a, LaneF<16> b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+    inline LaneMask<16> operator>(LaneF<16> a, LaneF<16> b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ); }
+    inline LaneMask<16> operator>=(LaneF<16> a, LaneF<16> b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ); }
+    inline LaneF<16> MulAdd(LaneF<16> a, LaneF<16> b, LaneF<16> c) { return _mm512_fmadd_ps(a.v, b.v, c.v); }
+    inline LaneF<16> Min(LaneF<16> a, LaneF<16> b) { return _mm512_min_ps(a.v, b.v); }
+    inline LaneF<16> Max(LaneF<16> a, LaneF<16> b) { return _mm512_max_ps(a.v, b.v); }
+    inline LaneF<16> Abs(LaneF<16> a) { return _mm512_abs_ps(a.v); }
+    inline LaneF<16> Sqrt(LaneF<16> a) { return _mm512_sqrt_ps(a.v); }
+    inline LaneF<16> Select(LaneMask<16> m, LaneF<16> a, LaneF<16> b) { return _mm512_mask_blend_ps(m.v, b.v, a.v); }
+    inline float ReduceMin(LaneF<16> a) { return _mm512_reduce_min_ps(a.v); }
+    inline LaneF<16> Gather(const float* base, LaneI<16> idx) { return _mm512_i32gather_ps(idx.v, base, 4); }
+
+    inline LaneI<16> operator+(LaneI<16> a, LaneI<16> b) { return _mm512_add_epi32(a.v, b.v); }
+    inline LaneI<16> operator-(LaneI<16> a, LaneI<16> b) { return _mm512_sub_epi32(a.v, b.v); }
+    inline LaneI<16> operator*(LaneI<16> a, LaneI<16> b) { return _mm512_mullo_epi32(a.v, b.v); }
+    inline LaneMask<16> operator==(LaneI<16> a, LaneI<16> b) { return _mm512_cmpeq_epi32_mask(a.v, b.v); }
+    inline LaneMask<16> operator<(LaneI<16> a, LaneI<16> b) { return _mm512_cmplt_epi32_mask(a.v, b.v); }
+    inline LaneI<16> Select(LaneMask<16> m, LaneI<16> a, LaneI<16> b) { return _mm512_mask_blend_epi32(m.v, b.v, a.v); }
+    inline LaneI<16> Gather(const s32* base, LaneI<16> idx) { return _mm512_i32gather_epi32(idx.v, base, 4); }
+    inline LaneI<16> operator&(LaneI<16> a, LaneI<16> b) { return _mm512_and_si512(a.v, b.v); }
+    inline LaneI<16> operator|(LaneI<16> a, LaneI<16> b) { return _mm512_or_si512(a.v, b.v); }
+    inline LaneI<16> ShiftLeft(LaneI<16> a, int n) { return _mm512_sll_epi32(a.v, _mm_cvtsi32_si128(n)); }
+    inline LaneI<16> ShiftRight(LaneI<16> a, int n) { return _mm512_sra_epi32(a.v, _mm_cvtsi32_si128(n)); }
+
+    inline LaneF<16> ToFloat(LaneI<16> a) { return _mm512_cvtepi32_ps(a.v); }
+    inline LaneI<16> ToInt(LaneF<16> a) { return _mm512_cvttps_epi32(a.v); }
+    inline LaneI<16> AsInt(LaneF<16> a) { return _mm512_castps_si512(a.v); }
+    inline LaneF<16> AsFloat(LaneI<16> a) { return _mm512_castsi512_ps(a.v); }
+#endif
+
+    //---------------------------------------------------------------------------
+    // Width independent helpers
+    //---------------------------------------------------------------------------
+    template <int N>
+    struct Lane
+    {
+      static const int Width = N;
+      typedef LaneF<N> Float;
+      typedef LaneI<N> Int;
+      typedef LaneMask<N> Mask;
+    };
+
+    // mask of the first count lanes, for partially filled batches
+    template <int N>
+    LaneMask<N> FirstLanes(int count)
+    {
+      return LaneI<N>::Iota() < LaneI<N>(count);
+    }
+
+    template <int N>
+    LaneF<N> Gather(const float* base, LaneI<N> idx, int stride, int component)
+    {
+      return Gather(base, idx * LaneI<N>(stride) + LaneI<N>(component));
+    }
+
+    // only valid for |a| < 2^31
+    template <int N>
+    LaneF<N> Floor(LaneF<N> a)
+    {
+      LaneF<N> t = ToFloat(ToInt(a));
+      return Select(t > a, t - LaneF<N>(1), t);
+    }
+
+    //---------------------------------------------------------------------------
+    // Polynomial approximations, with a relative error around 1e-5. Good enough for
+    // anything that ends up as a display value, but not a replacement for libm.
+    template <int N>
+    LaneF<N> Exp2(LaneF<N> a)
+    {
+      typedef LaneF<N> F;
+      a = Min(Max(a, F(-126)), F(126));
+      F ip = Floor(a);
+      F f = a - ip;
+      // minimax polynomial for 2^f on [0, 1)
+      F p = MulAdd(F(1.8775767e-3f), f, F(8.9893397e-3f));
+      p = MulAdd(p, f, F(5.5826318e-2f));
+      p = MulAdd(p, f, F(2.4015361e-1f));
+      p = MulAdd(p, f, F(6.9315308e-1f));
+      p = MulAdd(p, f, F(9.9999994e-1f));
+      return p * AsFloat(ShiftLeft(ToInt(ip) + LaneI<N>(127), 23));
+    }
+
+    // only defined for a > 0
+    template <int N>
+    LaneF<N> Log2(LaneF<N> a)
+    {
+      typedef LaneF<N> F;
+      typedef LaneI<N> I;
+      I bits = AsInt(a);
+      F e = ToFloat(ShiftRight(bits, 23) - I(127));
+      // mantissa in [1, 2)
+      F m = AsFloat((bits & I(0x007fffff)) | I(0x3f800000));
+      // minimax polynomial for log2(m) / (m - 1)
+      F p = MulAdd(F(-3.4436006e-2f), m, F(3.1821337e-1f));
+      p = MulAdd(p, m, F(-1.2315303f));
+      p = MulAdd(p, m, F(2.5988452f));
+      p = MulAdd(p, m, F(-3.3241990f));
+      p = MulAdd(p, m, F(3.1157899f));
+      return MulAdd(p, m - F(1), e);
+    }
+
+    // only for |a| <= pi/4, where the truncated series are within 4e-7
+    template <int N>
+    void SinCos(LaneF<N> a, LaneF<N>* s, LaneF<N>* c)
+    {
+      typedef LaneF<N> F;
+      F a2 = a * a;
+      F ps = MulAdd(F(-1.9841270e-4f), a2, F(8.3333333e-3f));
+      ps = MulAdd(ps, a2, F(-1.6666667e-1f));
+      *s = MulAdd(ps * a2, a, a);
+      F pc = MulAdd(F(2.4801587e-5f), a2, F(-1.3888889e-3f));
+      pc = MulAdd(pc, a2, F(4.1666667e-2f));
+      pc = MulAdd(pc, a2, F(-0.5f));
+      *c = MulAdd(pc, a2, F(1));
+    }
+
+    //---------------------------------------------------------------------------
+    // Vector3 with a lane per component, so N vectors at a time
+    template <int N>
+    struct LaneVector3
+    {
+      LaneVector3() {}
+      LaneVector3(LaneF<N> x, LaneF<N> y, LaneF<N> z) : x(x), y(y), z(z) {}
+      // broadcast the same vector to all lanes
+      explicit LaneVector3(const Vector3& v) : x(v.x), y(v.y), z(v.z) {}
+
+      static LaneVector3 Load(const float* xs, const float* ys, const float* zs)
+      {
+        return LaneVector3(LaneF<N>::Load(xs), LaneF<N>::Load(ys), LaneF<N>::Load(zs));
+      }
+
+      // gather from an array of packed xyz floats
+      static LaneVector3 Gather(const float* xyz, LaneI<N> idx)
+      {
+        return LaneVector3(pbr::Gather<N>(xyz, idx, 3, 0), pbr::Gather<N>(xyz, idx, 3, 1), pbr::Gather<N>(xyz, idx, 3, 2));
+      }
+
+      LaneF<N> x, y, z;
+    };
+
+    template <int N>
+    LaneVector3<N> operator+(const LaneVector3<N>& a, const LaneVector3<N>& b)
+    {
+      return LaneVector3<N>(a.x + b.x, a.y + b.y, a.z + b.z);
+    }
+
+    template <int N>
+    LaneVector3<N> operator-(const LaneVector3<N>& a, const LaneVector3<N>& b)
+    {
+      return LaneVector3<N>(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+
+    template <int N>
+    LaneVector3<N> operator*(LaneF<N> f, const LaneVector3<N>& v)
+    {
+      return LaneVector3<N>(f * v.x, f * v.y, f * v.z);
+    }
+
+    template <int N>
+    LaneF<N> Dot(const LaneVector3<N>& a, const LaneVector3<N>& b)
+    {
+      return MulAdd(a.x, b.x, MulAdd(a.y, b.y, a.z * b.z));
+    }
+
+    template <int N>
+    LaneVector3<N> Cross(const LaneVector3<N>& a, const LaneVector3<N>& b)
+    {
+      return LaneVector3<N>(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+  }
+}
@@ -0,0 +1,284 @@
+#include <chrono>
+#include "kernels.hpp"
+
+// Benchmarks the lane kernels at every width this was compiled for, against hand
+// written intrinsics versions of the same sphere test. Build with the widest
+// instruction set the machine supports (the lane_bench target uses -march=native).
+//
+// Every kernel is first checked ray by ray against Lane<1>. The compiler is free to
+// fuse multiplies and adds differently in each of them, so rays that graze a sphere
+// can hit in one and miss in another; those are counted, but only other differences
+// fail the run. Timings are the fastest of several runs, as the slower ones mostly
+// measure whatever else the machine was doing.
+
+using namespace pbr;
+
+namespace
+{
+  const int NUM_SPHERES = 256;
+  const int NUM_RAYS = 1 << 16;
+  // relative difference allowed between the hit distances of two kernels
+  const float T_TOLERANCE = 1e-4f;
+  // rays whose discriminant is within this fraction of b^2 graze the sphere
+  const double GRAZING = 1e-4;
+
+  struct Spheres
+  {
+    vector<float> cx, cy, cz, r2;
+  };
+
+  //---------------------------------------------------------------------------
+  double Now()
+  {
+    using namespace std::chrono;
+    return duration<double>(high_resolution_clock::now().time_since_epoch()).count();
+  }
+
+#if PBR_LANE_WIDTH_4
+  //---------------------------------------------------------------------------
+  int IntersectSpheresSSE(const Ray& ray, const Spheres& s, float* tHit)
+  {
+    __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z);
+    __m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 zero = _mm_setzero_ps();
+    __m128 best = _mm_set1_ps(*tHit);
+    __m128i bestIdx = _mm_set1_epi32(-1);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (int i = 0; i < NUM_SPHERES; i += 4)
+    {
+      __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&s.cx[i]));
+      __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&s.cy[i]));
+      __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&s.cz[i]));
+      __m128 b = _mm_mul_ps(_mm_set1_ps(2),
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz)));
+      __m128 c = _mm_sub_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+          _mm_loadu_ps(&s.r2[i]));
+      __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4), _mm_mul_ps(a, c)));
+      __m128 valid = _mm_cmpge_ps(disc, zero);
+      if (_mm_movemask_ps(valid))
+      {
+        __m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 nb = _mm_sub_ps(zero, b);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(nb, sq), _mm_set1_ps(0.5f));
+        __m128 t1 = _mm_mul_ps(_mm_add_ps(nb, sq), _mm_set1_ps(0.5f));
+        __m128 m0 = _mm_cmpgt_ps(t0, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(m0, t0), _mm_andnot_ps(m0, t1));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, best)));
+        best = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, best));
+        __m128i vi = _mm_castps_si128(valid);
+        bestIdx = _mm_or_si128(_mm_and_si128(vi, idx), _mm_andnot_si128(vi, bestIdx));
+      }
+      idx = _mm_add_epi32(idx, _mm_set1_epi32(4));
+    }
+
+    alignas(16) float t[4];
+    alignas(16) s32 ids[4];
+    _mm_store_ps(t, best);
+    _mm_store_si128((__m128i*)ids, bestIdx);
+    int res = -1;
+    for (int i = 0; i < 4; ++i)
+    {
+      if (t[i] < *tHit)
+      {
+        *tHit = t[i];
+        res = ids[i];
+      }
+    }
+    return res;
+  }
+#endif
+
+#if PBR_LANE_WIDTH_8
+  //---------------------------------------------------------------------------
+  int IntersectSpheresAVX2(const Ray& ray, const Spheres& s, float* tHit)
+  {
+    __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y), oz = _mm256_set1_ps(ray.o.z);
+    __m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+    __m256 a = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 best = _mm256_set1_ps(*tHit);
+    __m256i bestIdx = _mm256_set1_epi32(-1);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (int i = 0; i < NUM_SPHERES; i += 8)
+    {
+      __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&s.cx[i]));
+      __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&s.cy[i]));
+      __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&s.cz[i]));
+      __m256 b = _mm256_mul_ps(_mm256_set1_ps(2),
+          _mm256_fmadd_ps(ocx, dx, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocz, dz))));
+      __m256 c = _mm256_sub_ps(_mm256_fmadd_ps(ocx, ocx, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocz, ocz))),
+          _mm256_loadu_ps(&s.r2[i]));
+      __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4), _mm256_mul_ps(a, c)));
+      __m256 valid = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+      if (_mm256_movemask_ps(valid))
+      {
+        __m256 sq = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+        __m256 nb = _mm256_sub_ps(zero, b);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(nb, sq), _mm256_set1_ps(0.5f));
+        __m256 t1 = _mm256_mul_ps(_mm256_add_ps(nb, sq), _mm256_set1_ps(0.5f));
+        __m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, zero, _CMP_GT_OQ));
+        valid = _mm256_and_ps(valid,
+            _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, best, _CMP_LT_OQ)));
+        best = _mm256_blendv_ps(best, t, valid);
+        bestIdx = _mm256_castps_si256(
+            _mm256_blendv_ps(_mm256_castsi256_ps(bestIdx), _mm256_castsi256_ps(idx), valid));
+      }
+      idx = _mm256_add_epi32(idx, _mm256_set1_epi32(8));
+    }
+
+    alignas(32) float t[8];
+    alignas(32) s32 ids[8];
+    _mm256_store_ps(t, best);
+    _mm256_store_si256((__m256i*)ids, bestIdx);
+    int res = -1;
+    for (int i = 0; i < 8; ++i)
+    {
+      if (t[i] < *tHit)
+      {
+        *tHit = t[i];
+        res = ids[i];
+      }
+    }
+    return res;
+  }
+#endif
+
+  //---------------------------------------------------------------------------
+  // IntersectSpheres at a fixed width, so it's called as directly as the hand
+  // written kernels
+  template <int N>
+  struct LaneKernel
+  {
+    int operator()(const Ray& r, float* t) const
+    {
+      return IntersectSpheres<N>(r, s->cx.data(), s->cy.data(), s->cz.data(), s->r2.data(), NUM_SPHERES, t);
+    }
+    const Spheres* s;
+  };
+
+  //---------------------------------------------------------------------------
+  bool Grazes(const Ray& ray, const Spheres& s, int idx)
+  {
+    if (idx < 0)
+      return false;
+    double ocx = (double)ray.o.x - s.cx[idx], ocy = (double)ray.o.y - s.cy[idx], ocz = (double)ray.o.z - s.cz[idx];
+    double b = 2 * (ocx * ray.d.x + ocy * ray.d.y + ocz * ray.d.z);
+    double a = (double)ray.d.x * ray.d.x + (double)ray.d.y * ray.d.y + (double)ray.d.z * ray.d.z;
+    double c = ocx * ocx + ocy * ocy + ocz * ocz - s.r2[idx];
+    return fabs(b * b - 4 * a * c) <= GRAZING * b * b;
+  }
+
+  //---------------------------------------------------------------------------
+  // Compares the hit and distance of every ray against Lane<1>. Returns false if a
+  // ray differs in more than rounding
+  template <typename Fn>
+  bool Compare(const char* name, const vector<Ray>& rays, const Spheres& s, Fn fn)
+  {
+    int numGrazing = 0, numErrors = 0;
+    for (const Ray& r : rays)
+    {
+      float tRef = FLT_MAX, t = FLT_MAX;
+      int ref = IntersectSpheres<1>(r, s.cx.data(), s.cy.data(), s.cz.data(), s.r2.data(), NUM_SPHERES, &tRef);
+      int idx = fn(r, &t);
+      if (idx == ref && (idx < 0 || fabsf(t - tRef) <= T_TOLERANCE * tRef))
+        continue;
+
+      // a grazed sphere can drop out, and let the ray through to the next one
+      if (Grazes(r, s, ref) || Grazes(r, s, idx))
+      {
+        ++numGrazing;
+        continue;
+      }
+
+      if (numErrors++ == 0)
+        printf("%s: hit %d at %g, Lane<1> hit %d at %g\n", name, idx, t, ref, tRef);
+    }
+
+    if (numGrazing || numErrors)
+      printf("%-24s %d grazing rays differ, %d errors\n", name, numGrazing, numErrors);
+    return numErrors == 0;
+  }
+
+  //---------------------------------------------------------------------------
+  template <typename Fn>
+  void Bench(const char* name, const vector<Ray>& rays, Fn fn)
+  {
+    // warm up, and keep a checksum so the work can't be optimized away
+    u64 checksum = 0;
+    for (const Ray& r : rays)
+    {
+      float t = FLT_MAX;
+      checksum += (u32)fn(r, &t);
+    }
+
+    const int numRuns = 10;
+    double best = DBL_MAX;
+    for (int run = 0; run < numRuns; ++run)
+    {
+      double start = Now();
+      for (const Ray& r : rays)
+      {
+        float t = FLT_MAX;
+        checksum += (u32)fn(r, &t);
+      }
+      best = min(best, Now() - start);
+    }
+
+    // only there to keep the work alive
+    volatile u64 sink = checksum;
+    (void)sink;
+    printf("%-24s %8.3f ns/test\n", name, best * 1e9 / ((double)rays.size() * NUM_SPHERES));
+  }
+}
+
+//---------------------------------------------------------------------------
+int main(int, char**)
+{
+  Spheres s;
+  for (int i = 0; i < NUM_SPHERES; ++i)
+  {
+    s.cx.push_back(randf(-50, 50));
+    s.cy.push_back(randf(-50, 50));
+    s.cz.push_back(randf(20, 100));
+    s.r2.push_back(Sq(randf(0.5f, 4)));
+  }
+
+  vector<Ray> rays;
+  for (int i = 0; i < NUM_RAYS; ++i)
+    rays.push_back(Ray(Vector3(0, 0, 0), Normalize(Vector3(randf(-1, 1), randf(-1, 1), 1))));
+
+  // check that all the kernels agree before timing anything
+  bool ok = true;
+#if PBR_LANE_WIDTH_4
+  ok &= Compare("Lane<4>", rays, s, LaneKernel<4>{ &s });
+  ok &= Compare("hand written SSE", rays, s, [&s](const Ray& r, float* t) { return IntersectSpheresSSE(r, s, t); });
+#endif
+#if PBR_LANE_WIDTH_8
+  ok &= Compare("Lane<8>", rays, s, LaneKernel<8>{ &s });
+  ok &= Compare("hand written AVX2", rays, s, [&s](const Ray& r, float* t) { return IntersectSpheresAVX2(r, s, t); });
+#endif
+#if PBR_LANE_WIDTH_16
+  ok &= Compare("Lane<16>", rays, s, LaneKernel<16>{ &s });
+#endif
+  if (!ok)
+    return 1;
+
+  Bench("Lane<1>", rays, LaneKernel<1>{ &s });
+#if PBR_LANE_WIDTH_4
+  Bench("Lane<4>", rays, LaneKernel<4>{ &s });
+  Bench("hand written SSE", rays, [&s](const Ray& r, float* t) { return IntersectSpheresSSE(r, s, t); });
+#endif
+#if PBR_LANE_WIDTH_8
+  Bench("Lane<8>", rays, LaneKernel<8>{ &s });
+  Bench("hand written AVX2", rays, [&s](const Ray& r, float* t) { return IntersectSpheresAVX2(r, s, t); });
+#endif
+#if PBR_LANE_WIDTH_16
+  Bench("Lane<16>", rays, LaneKernel<16>{ &s });
+#endif
+
+  return 0;
+}
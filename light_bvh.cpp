@@ -0,0 +1,350 @@
+#include "light_bvh.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  const u32 NUM_BINS = 12;
+  // past this depth only median splits are made, so the paths to the leaves fit in
+  // the 64 bit trails
+  const u32 MAX_SAH_DEPTH = 40;
+  const float ONE_MINUS_EPSILON = 0.99999994f;
+
+  //---------------------------------------------------------------------------
+  float SafeSqrt(float x) { return sqrtf(max(0.f, x)); }
+  float ClampCos(float x) { return min(1.f, max(-1.f, x)); }
+
+  //---------------------------------------------------------------------------
+  // cos(max(0, a - b)) and sin(max(0, a - b)), from the sines and cosines of a and b
+  float CosSubClamped(float sinA, float cosA, float sinB, float cosB)
+  {
+    return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+  }
+
+  float SinSubClamped(float sinA, float cosA, float sinB, float cosB)
+  {
+    return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+  }
+
+  //---------------------------------------------------------------------------
+  // cosine of the half angle of the cone from p that contains the box
+  float CosSubtended(const Aabb& bounds, const Vector3& p)
+  {
+    Vector3 c = bounds.Center();
+    float radiusSq = (bounds.mx - c).LengthSquared();
+    float distSq = (p - c).LengthSquared();
+    if (distSq < radiusSq)
+      return -1;
+    return SafeSqrt(1 - radiusSq / distSq);
+  }
+
+  //---------------------------------------------------------------------------
+  // v rotated by angle around the unit axis
+  Vector3 Rotate(const Vector3& v, const Vector3& axis, float angle)
+  {
+    float s = sinf(angle);
+    float c = cosf(angle);
+    return v * c + Cross(axis, v) * s + axis * (Dot(axis, v) * (1 - c));
+  }
+
+  //---------------------------------------------------------------------------
+  // measure of the directions the bounds emit into, see Conty Estevez and Kulla,
+  // "Importance Sampling of Many Lights with Adaptive Tree Splitting" (2018)
+  float OrientationMeasure(const LightBounds& b)
+  {
+    float thetaO = acosf(ClampCos(b.cosNormal));
+    float thetaE = acosf(ClampCos(b.cosEmit));
+    float thetaW = min(thetaO + thetaE, Pi);
+    float sinO = SafeSqrt(1 - Sq(b.cosNormal));
+    return 2 * Pi * (1 - b.cosNormal)
+           + Pi / 2 * (2 * thetaW * sinO - cosf(thetaO - 2 * thetaW) - 2 * thetaO * sinO + b.cosNormal);
+  }
+
+  //---------------------------------------------------------------------------
+  float SplitCost(const LightBounds& b)
+  {
+    return b.power * b.bounds.SurfaceArea() * OrientationMeasure(b);
+  }
+}
+
+//---------------------------------------------------------------------------
+float LightBounds::Importance(const Vector3& p, const Vector3& n) const
+{
+  if (power == 0)
+    return 0;
+
+  // distance to the center, but no closer than the bounds' extent, so points
+  // inside or next to them don't blow up
+  Vector3 pc = bounds.Center();
+  float distSq = max((p - pc).LengthSquared(), (bounds.mx - pc).LengthSquared());
+  Vector3 wi = p - pc;
+  float len = wi.Length();
+  wi = len > 0 ? wi / len : axis;
+
+  // the smallest possible angle between an emitter's normal and the direction to
+  // p, given the normal cone and the angle the bounds subtend from p
+  float cosW = Dot(axis, wi);
+  float sinW = SafeSqrt(1 - cosW * cosW);
+  float sinN = SafeSqrt(1 - cosNormal * cosNormal);
+  float cosX = CosSubClamped(sinW, cosW, sinN, cosNormal);
+  float sinX = SinSubClamped(sinW, cosW, sinN, cosNormal);
+  float cosB = CosSubtended(bounds, p);
+  float sinB = SafeSqrt(1 - cosB * cosB);
+  float cosP = CosSubClamped(sinX, cosX, sinB, cosB);
+  if (cosP <= cosEmit)
+    return 0;
+
+  // and the smallest angle between the receiver's normal and the bounds
+  float cosI = -Dot(wi, n);
+  float sinI = SafeSqrt(1 - cosI * cosI);
+  float cosPI = CosSubClamped(sinI, cosI, sinB, cosB);
+  if (cosPI <= 0)
+    return 0;
+
+  return power * cosP * cosPI / distSq;
+}
+
+//---------------------------------------------------------------------------
+LightBounds pbr::Union(const LightBounds& a, const LightBounds& b)
+{
+  if (a.power == 0)
+    return b;
+  if (b.power == 0)
+    return a;
+
+  LightBounds res;
+  res.bounds = a.bounds;
+  res.bounds.Grow(b.bounds);
+  res.power = a.power + b.power;
+  res.cosEmit = min(a.cosEmit, b.cosEmit);
+
+  // the smallest cone containing both normal cones
+  float thetaA = acosf(ClampCos(a.cosNormal));
+  float thetaB = acosf(ClampCos(b.cosNormal));
+  float thetaD = acosf(ClampCos(Dot(a.axis, b.axis)));
+  if (min(thetaD + thetaB, Pi) <= thetaA)
+  {
+    res.axis = a.axis;
+    res.cosNormal = a.cosNormal;
+    return res;
+  }
+  if (min(thetaD + thetaA, Pi) <= thetaB)
+  {
+    res.axis = b.axis;
+    res.cosNormal = b.cosNormal;
+    return res;
+  }
+
+  float thetaO = (thetaA + thetaD + thetaB) / 2;
+  Vector3 rotAxis = Cross(a.axis, b.axis);
+  if (thetaO >= Pi || rotAxis.LengthSquared() == 0)
+  {
+    res.axis = a.axis;
+    res.cosNormal = -1;
+    return res;
+  }
+
+  res.axis = Normalize(Rotate(a.axis, Normalize(rotAxis), thetaO - thetaA));
+  res.cosNormal = cosf(thetaO);
+  return res;
+}
+
+//---------------------------------------------------------------------------
+void LightBvh::Build(const vector<Geo*>& emitters)
+{
+  nodes.clear();
+  lights.clear();
+  _trails.clear();
+
+  vector<LightBounds> bounds;
+  for (Geo* g : emitters)
+  {
+    if (g->type != Geo::Type::Sphere)
+      continue;
+
+    // a sphere emits from normals in every direction, each into its hemisphere
+    Sphere* s = static_cast<Sphere*>(g);
+    Vector3 r(s->radius, s->radius, s->radius);
+    LightBounds b;
+    b.bounds = Aabb(s->center - r, s->center + r);
+    b.power = Luminance(g->material->emissive) * Pi * 4 * Pi * s->radiusSquared;
+    b.cosNormal = -1;
+    b.cosEmit = 0;
+    if (b.power <= 0)
+      continue;
+
+    lights.push_back(g);
+    bounds.push_back(b);
+  }
+
+  if (lights.empty())
+    return;
+
+  vector<u32> order(lights.size());
+  for (u32 i = 0; i < (u32)order.size(); ++i)
+    order[i] = i;
+
+  _trails.resize(lights.size());
+  nodes.reserve(2 * lights.size());
+  BuildRecursive(bounds, order, 0, (u32)lights.size(), 0, 0);
+}
+
+//---------------------------------------------------------------------------
+u32 LightBvh::BuildRecursive(vector<LightBounds>& bounds, vector<u32>& order, u32 start, u32 end, u64 trail, u32 depth)
+{
+  u32 nodeIdx = (u32)nodes.size();
+  nodes.push_back(LightBvhNode());
+
+  if (end - start == 1)
+  {
+    nodes[nodeIdx].bounds = bounds[order[start]];
+    nodes[nodeIdx].offset = order[start];
+    nodes[nodeIdx].leaf = true;
+    _trails[order[start]] = trail;
+    return nodeIdx;
+  }
+
+  Aabb centroidBounds;
+  for (u32 i = start; i < end; ++i)
+    centroidBounds.Grow(bounds[order[i]].bounds.Center());
+
+  Vector3 extent = centroidBounds.mx - centroidBounds.mn;
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+  float axisMin = centroidBounds.mn[axis];
+  float axisExtent = extent[axis];
+
+  u32 mid = start;
+  if (axisExtent > 0 && depth < MAX_SAH_DEPTH)
+  {
+    // binned, with the cost of a child weighted by its power and the spread of its
+    // directions as well as its area
+    LightBounds binBounds[NUM_BINS];
+    float binScale = NUM_BINS / axisExtent * 0.9999f;
+    auto binOf = [&](u32 idx) { return (u32)((bounds[idx].bounds.Center()[axis] - axisMin) * binScale); };
+    for (u32 i = start; i < end; ++i)
+    {
+      u32 b = binOf(order[i]);
+      binBounds[b] = Union(binBounds[b], bounds[order[i]]);
+    }
+
+    float rightCost[NUM_BINS];
+    LightBounds acc;
+    for (u32 i = NUM_BINS - 1; i > 0; --i)
+    {
+      acc = Union(acc, binBounds[i]);
+      rightCost[i] = acc.power > 0 ? SplitCost(acc) : -1;
+    }
+
+    float bestCost = FLT_MAX;
+    u32 bestSplit = 0;
+    acc = LightBounds();
+    for (u32 i = 1; i < NUM_BINS; ++i)
+    {
+      acc = Union(acc, binBounds[i - 1]);
+      if (acc.power == 0 || rightCost[i] < 0)
+        continue;
+      float cost = SplitCost(acc) + rightCost[i];
+      if (cost < bestCost)
+      {
+        bestCost = cost;
+        bestSplit = i;
+      }
+    }
+
+    if (bestSplit > 0)
+      mid = (u32)(std::partition(&order[start], &order[0] + end, [&](u32 idx) { return binOf(idx) < bestSplit; })
+                  - &order[0]);
+  }
+
+  if (mid == start || mid == end)
+  {
+    mid = start + (end - start) / 2;
+    std::nth_element(&order[start],
+        &order[mid],
+        &order[0] + end,
+        [&](u32 a, u32 b)
+        {
+          return bounds[a].bounds.Center()[axis] < bounds[b].bounds.Center()[axis];
+        });
+  }
+
+  BuildRecursive(bounds, order, start, mid, trail, depth + 1);
+  u32 right = BuildRecursive(bounds, order, mid, end, trail | (1ull << depth), depth + 1);
+  nodes[nodeIdx].bounds = Union(nodes[nodeIdx + 1].bounds, nodes[right].bounds);
+  nodes[nodeIdx].offset = right;
+  nodes[nodeIdx].leaf = false;
+  return nodeIdx;
+}
+
+//---------------------------------------------------------------------------
+Geo* LightBvh::Sample(const Vector3& p, const Vector3& n, float u, float* pmf) const
+{
+  if (nodes.empty())
+    return nullptr;
+
+  u32 nodeIdx = 0;
+  float prob = 1;
+  while (!nodes[nodeIdx].leaf)
+  {
+    u32 left = nodeIdx + 1;
+    u32 right = nodes[nodeIdx].offset;
+    float importanceLeft = nodes[left].bounds.Importance(p, n);
+    float importanceRight = nodes[right].bounds.Importance(p, n);
+    if (importanceLeft == 0 && importanceRight == 0)
+      return nullptr;
+
+    // pick a child, and rescale u to [0, 1) for the next level
+    float probLeft = importanceLeft / (importanceLeft + importanceRight);
+    if (u < probLeft)
+    {
+      u = min(u / probLeft, ONE_MINUS_EPSILON);
+      prob *= probLeft;
+      nodeIdx = left;
+    }
+    else
+    {
+      u = min((u - probLeft) / (1 - probLeft), ONE_MINUS_EPSILON);
+      prob *= 1 - probLeft;
+      nodeIdx = right;
+    }
+  }
+
+  // a single emitter still has to be able to reach p
+  if (nodeIdx == 0 && nodes[0].bounds.Importance(p, n) == 0)
+    return nullptr;
+
+  *pmf = prob;
+  return lights[nodes[nodeIdx].offset];
+}
+
+//---------------------------------------------------------------------------
+float LightBvh::Pmf(const Vector3& p, const Vector3& n, const Geo* emitter) const
+{
+  auto it = std::find(lights.begin(), lights.end(), emitter);
+  if (it == lights.end())
+    return 0;
+
+  u64 trail = _trails[it - lights.begin()];
+  u32 nodeIdx = 0;
+  float prob = 1;
+  while (!nodes[nodeIdx].leaf)
+  {
+    u32 left = nodeIdx + 1;
+    u32 right = nodes[nodeIdx].offset;
+    float importanceLeft = nodes[left].bounds.Importance(p, n);
+    float importanceRight = nodes[right].bounds.Importance(p, n);
+    if (importanceLeft == 0 && importanceRight == 0)
+      return 0;
+
+    // the same sums as in Sample, so the two agree exactly
+    float probLeft = importanceLeft / (importanceLeft + importanceRight);
+    bool goRight = (trail & 1) != 0;
+    prob *= goRight ? 1 - probLeft : probLeft;
+    nodeIdx = goRight ? right : left;
+    trail >>= 1;
+  }
+
+  if (nodeIdx == 0 && nodes[0].bounds.Importance(p, n) == 0)
+    return 0;
+  return prob;
+}
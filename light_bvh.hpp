@@ -0,0 +1,63 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "bvh.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // Bounds of a set of emitters: where they are, how much power they give off, and
+  // in which directions. Emission is from surfaces whose normals are within
+  // acos(cosNormal) of axis, and spreads out to acos(cosEmit) from each normal.
+  struct LightBounds
+  {
+    // importance of the bounds for a point p with surface normal n, an estimate of
+    // how much light could reach it. Conservative: 0 means nothing can
+    float Importance(const Vector3& p, const Vector3& n) const;
+
+    Aabb bounds;
+    Vector3 axis = Vector3(0, 0, 1);
+    float power = 0;
+    float cosNormal = 1;
+    float cosEmit = 0;
+  };
+
+  LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+  //---------------------------------------------------------------------------
+  struct LightBvhNode
+  {
+    LightBounds bounds;
+    // for leaves the emitter's index, otherwise the index of the right child. The
+    // left child always directly follows its parent.
+    u32 offset;
+    bool leaf;
+  };
+
+  //---------------------------------------------------------------------------
+  // Hierarchy over the emitters for picking which light to sample at a shading
+  // point. Sampling walks down from the root, choosing a child in proportion to the
+  // importance of its bounds, so the cost is logarithmic in the number of emitters
+  // and lights that are far, dim or facing away are rarely picked. Only spheres
+  // are supported as emitters.
+  struct LightBvh
+  {
+    void Build(const vector<Geo*>& emitters);
+
+    // Picks an emitter for p with normal n, with the probability in pmf. u is a
+    // uniform number in [0, 1). Returns nullptr if no emitter can reach p, or if
+    // the walk ends up in a subtree that can't, so the pmfs can sum to less than 1.
+    Geo* Sample(const Vector3& p, const Vector3& n, float u, float* pmf) const;
+    // probability of Sample picking the emitter
+    float Pmf(const Vector3& p, const Vector3& n, const Geo* emitter) const;
+
+    vector<LightBvhNode> nodes;
+    vector<Geo*> lights;
+
+  private:
+    u32 BuildRecursive(vector<LightBounds>& bounds, vector<u32>& order, u32 start, u32 end, u64 trail, u32 depth);
+
+    // per emitter, its leaf's path from the root, one bit per level starting from the
+    // lowest (1 for right)
+    vector<u64> _trails;
+  };
+}
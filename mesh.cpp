@@ -0,0 +1,201 @@
+#include "mesh.hpp"
+#include <tbb/parallel_for.h>
+
+using namespace pbr;
+
+//---------------------------------------------------------------------------
+Vector3 pbr::TransformPoint(const float* mtx, const Vector3& p)
+{
+  return Vector3(mtx[0] * p.x + mtx[3] * p.y + mtx[6] * p.z + mtx[9],
+      mtx[1] * p.x + mtx[4] * p.y + mtx[7] * p.z + mtx[10],
+      mtx[2] * p.x + mtx[5] * p.y + mtx[8] * p.z + mtx[11]);
+}
+
+//---------------------------------------------------------------------------
+static Aabb BlobBounds(const protocol::MeshBlob& blob)
+{
+  Aabb bounds;
+  if (blob.r > 0)
+  {
+    // use the bounding sphere from the file, so we don't have to touch the verts
+    const float* m = blob.mtx;
+    Vector3 c = TransformPoint(m, Vector3(blob.sx, blob.sy, blob.sz));
+    float scale = sqrtf(max(Sq(m[0]) + Sq(m[1]) + Sq(m[2]),
+        max(Sq(m[3]) + Sq(m[4]) + Sq(m[5]), Sq(m[6]) + Sq(m[7]) + Sq(m[8]))));
+    Vector3 r(blob.r * scale, blob.r * scale, blob.r * scale);
+    bounds = Aabb(c - r, c + r);
+  }
+  else
+  {
+    for (u32 i = 0; i < blob.numVerts; ++i)
+    {
+      const float* v = &blob.verts[i * 3];
+      bounds.Grow(TransformPoint(blob.mtx, Vector3(v[0], v[1], v[2])));
+    }
+  }
+  return bounds;
+}
+
+//---------------------------------------------------------------------------
+void TriMesh::Build(const protocol::MeshBlob& blob, bool precompute)
+{
+  // bake the transform into the verts. The indices are used as is
+  verts.resize(blob.numVerts * 3);
+  tbb::parallel_for(u32(0), blob.numVerts, [&](u32 i)
+  {
+    const float* v = &blob.verts[i * 3];
+    Vector3 p = TransformPoint(blob.mtx, Vector3(v[0], v[1], v[2]));
+    verts[i * 3 + 0] = p.x;
+    verts[i * 3 + 1] = p.y;
+    verts[i * 3 + 2] = p.z;
+  });
+
+  indices = blob.indices;
+  numTris = blob.numIndices / 3;
+
+  // degenerate triangles can't be hit, so they're left out of the BVH
+  vector<u32> tris;
+  tris.reserve(numTris);
+  for (u32 i = 0; i < numTris; ++i)
+  {
+    IsectTri tri = FetchTri(verts.data(), indices, i);
+    if (Cross(tri.p1 - tri.p0, tri.p2 - tri.p0).LengthSquared() > 0)
+      tris.push_back(i);
+  }
+
+  vector<Aabb> triBounds(tris.size());
+  tbb::parallel_for(size_t(0), tris.size(), [&](size_t i)
+  {
+    IsectTri tri = FetchTri(verts.data(), indices, tris[i]);
+    triBounds[i] = Aabb(Min(tri.p0, Min(tri.p1, tri.p2)), Max(tri.p0, Max(tri.p1, tri.p2)));
+  });
+
+  bvh.Build(triBounds);
+  for (u32& idx : bvh.primIndices)
+    idx = tris[idx];
+
+  if (precompute)
+  {
+    // in leaf order, so the triangles of a leaf are next to each other
+    precomputed.resize(bvh.primIndices.size());
+    tbb::parallel_for(size_t(0), precomputed.size(), [&](size_t i)
+    {
+      IsectTri tri = FetchTri(verts.data(), indices, bvh.primIndices[i]);
+      precomputed[i] = { tri.p0, tri.p1 - tri.p0, tri.p2 - tri.p0 };
+    });
+  }
+}
+
+//---------------------------------------------------------------------------
+bool TriMesh::Intersect(const Ray& ray, float tMax, float* t) const
+{
+  const float eps = 0.00001f;
+  bool hit = false;
+  float tt, u, v;
+  auto closer = [&](bool isect, float closest)
+  {
+    if (isect && tt >= eps && tt < closest)
+    {
+      hit = true;
+      closest = tt;
+      *t = tt;
+    }
+    return closest;
+  };
+
+  if (precomputed.empty())
+  {
+    bvh.Traverse(ray, tMax, [&](u32 triIdx, float closest)
+    {
+      bool isect = RayTriIntersect(ray, FetchTri(verts.data(), indices, triIdx), &tt, &u, &v);
+      return closer(isect, closest);
+    });
+  }
+  else
+  {
+    bvh.TraverseSlots(ray, tMax, [&](u32 slot, float closest)
+    {
+      bool isect = RayTriIntersect(ray, precomputed[slot], &tt, &u, &v);
+      return closer(isect, closest);
+    });
+  }
+
+  return hit;
+}
+
+//---------------------------------------------------------------------------
+size_t TriMesh::MemorySize() const
+{
+  // the index buffer belongs to the loader, so isn't counted
+  return sizeof(TriMesh) + verts.size() * sizeof(float) + precomputed.size() * sizeof(IsectTriPre)
+         + bvh.nodes.size() * sizeof(BvhNode) + bvh.primIndices.size() * sizeof(u32);
+}
+
+//---------------------------------------------------------------------------
+MeshScene::~MeshScene()
+{
+  Wait();
+  for (TriMesh* mesh : meshes)
+    delete mesh;
+}
+
+//---------------------------------------------------------------------------
+bool MeshScene::Init(const char* filename, bool precompute)
+{
+  if (!loader.Load(filename))
+    return false;
+
+  // the top-level BVH only needs the mesh bounds, so build it first
+  u32 numMeshes = (u32)loader.meshes.size();
+  vector<Aabb> meshBounds(numMeshes);
+  tbb::parallel_for(u32(0), numMeshes, [&](u32 i)
+  {
+    meshBounds[i] = BlobBounds(*loader.meshes[i]);
+  });
+
+  topLevel.Build(meshBounds, 1);
+
+  meshes.resize(numMeshes);
+  for (u32 i = 0; i < numMeshes; ++i)
+    meshes[i] = new TriMesh();
+
+  // then convert the meshes and build their BVHs in the background
+  for (u32 i = 0; i < numMeshes; ++i)
+  {
+    _tasks.run([this, i, precompute]
+    {
+      meshes[i]->Build(*loader.meshes[i], precompute);
+      meshes[i]->ready.store(true, std::memory_order_release);
+      ++_numReady;
+    });
+  }
+
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void MeshScene::Wait()
+{
+  _tasks.wait();
+}
+
+//---------------------------------------------------------------------------
+bool MeshScene::IntersectClosest(const Ray& ray, float* t) const
+{
+  bool hit = false;
+  topLevel.Traverse(ray, FLT_MAX, [&](u32 meshIdx, float closest)
+  {
+    const TriMesh* mesh = meshes[meshIdx];
+    if (!mesh->ready.load(std::memory_order_acquire))
+      return closest;
+
+    if (mesh->Intersect(ray, closest, t))
+    {
+      hit = true;
+      closest = *t;
+    }
+    return closest;
+  });
+
+  return hit;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <tbb/task_group.h>
+#include "bvh.hpp"
+#include "mesh_loader.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // Fetch triangle triIdx from an indexed vertex/index buffer (xyz per vertex)
+  inline IsectTri FetchTri(const float* verts, const u32* indices, u32 triIdx)
+  {
+    const float* v0 = &verts[indices[triIdx * 3 + 0] * 3];
+    const float* v1 = &verts[indices[triIdx * 3 + 1] * 3];
+    const float* v2 = &verts[indices[triIdx * 3 + 2] * 3];
+    return { Vector3(v0[0], v0[1], v0[2]), Vector3(v1[0], v1[1], v1[2]), Vector3(v2[0], v2[1], v2[2]) };
+  }
+
+  //---------------------------------------------------------------------------
+  // Indexed triangle mesh with the transform baked into world space, and its own
+  // BVH. The index buffer is the one from the blob, so the loader has to outlive
+  // the mesh.
+  struct TriMesh
+  {
+    void Build(const protocol::MeshBlob& blob, bool precompute);
+    bool Intersect(const Ray& ray, float tMax, float* t) const;
+    size_t MemorySize() const;
+
+    vector<float> verts;
+    const u32* indices = nullptr;
+    u32 numTris = 0;
+    // Optional precomputed intersection records, in BVH leaf order and only for the
+    // triangles the BVH holds. They cost an IsectTriPre per triangle on top of the
+    // index triple, and save the 3 vertex gathers per intersection test.
+    vector<IsectTriPre> precomputed;
+    Bvh bvh;
+    // set once the mesh is built and can be intersected
+    std::atomic<bool> ready{ false };
+  };
+
+  //---------------------------------------------------------------------------
+  // All the meshes from a .boba file, with a top-level BVH over them. The per mesh
+  // conversion and BVH builds run as background tasks; Init returns as soon as the
+  // top-level BVH is in place, and meshes that aren't built yet are skipped by
+  // Intersect until they are ready.
+  struct MeshScene
+  {
+    ~MeshScene();
+    // precompute trades memory for speed, see TriMesh::precomputed
+    bool Init(const char* filename, bool precompute = false);
+    // blocks until all the meshes are built
+    void Wait();
+    bool IntersectClosest(const Ray& ray, float* t) const;
+
+    u32 NumReady() const { return _numReady; }
+    u32 NumMeshes() const { return (u32)meshes.size(); }
+
+    MeshLoader loader;
+    vector<TriMesh*> meshes;
+    Bvh topLevel;
+
+  private:
+    tbb::task_group _tasks;
+    std::atomic<u32> _numReady{ 0 };
+  };
+
+  // Transform a point by a blob matrix. mtx is stored as 4 rows of 3 (x, y and z
+  // axis, followed by the translation).
+  Vector3 TransformPoint(const float* mtx, const Vector3& p);
+}
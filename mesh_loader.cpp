@@ -1,73 +1,362 @@
 #include "mesh_loader.hpp"
+#include <atomic>
+#include <float.h>
+#include <tbb/parallel_for.h>
 
 #pragma warning(disable: 4996)
 
 using namespace pbr;
 
 //------------------------------------------------------------------------------
-static bool LoadFile(const char* filename, vector<char>* buf)
+static u64 FileSize(FILE* f)
+{
+#ifdef _WIN32
+  _fseeki64(f, 0, SEEK_END);
+  u64 len = (u64)_ftelli64(f);
+#else
+  fseeko(f, 0, SEEK_END);
+  u64 len = (u64)ftello(f);
+#endif
+  fseek(f, 0, SEEK_SET);
+  return len;
+}
+
+//------------------------------------------------------------------------------
+static bool Seek(FILE* f, u64 ofs)
+{
+#ifdef _WIN32
+  return _fseeki64(f, (s64)ofs, SEEK_SET) == 0;
+#else
+  return fseeko(f, (off_t)ofs, SEEK_SET) == 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// true if [start, start + size) is inside [0, limit), without overflowing
+static bool InRange(u64 start, u64 size, u64 limit)
+{
+  return start <= limit && size <= limit - start;
+}
+
+//------------------------------------------------------------------------------
+// decoded size of one element of a stream, 0 for an unknown type
+static u32 ElementSize(u32 type)
+{
+  using protocol::StreamBlob;
+  switch (type)
+  {
+    case StreamBlob::Verts: return 3 * sizeof(float);
+    case StreamBlob::Normals: return 3 * sizeof(float);
+    case StreamBlob::Uv: return 2 * sizeof(float);
+    case StreamBlob::Indices: return sizeof(u32);
+    default: return 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+// true if every index points at one of the mesh's vertices
+static bool IndicesInRange(const u32* indices, u32 numIndices, u32 numVerts)
+{
+  for (u32 i = 0; i < numIndices; ++i)
+  {
+    if (indices[i] >= numVerts)
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool MeshLoader::Load(const char* filename)
 {
   FILE* f = fopen(filename, "rb");
   if (!f)
     return false;
 
-  fseek(f, 0, SEEK_END);
-  u32 len = (u32)ftell(f);
-  buf->resize(len);
-  fseek(f, 0, SEEK_SET);
-  fread(buf->data(), 1, len, f);
+  u64 fileSize = FileSize(f);
+  char id[4];
+  bool res = false;
+  if (fread(id, 1, 4, f) == 4 && Seek(f, 0))
+  {
+    if (strncmp(id, "boba", 4) == 0)
+      res = LoadV1(f, fileSize);
+    else if (strncmp(id, "bob2", 4) == 0)
+      res = LoadV2(f, fileSize, filename);
+  }
+
   fclose(f);
-  return true;
+  return res;
 }
 
 //------------------------------------------------------------------------------
-bool MeshLoader::Load(const char* filename)
+bool MeshLoader::LoadV1(FILE* f, u64 fileSize)
 {
-  if (!LoadFile(filename, &buf))
+  if (fileSize < sizeof(protocol::SceneBlob) || fileSize > 0xffffffff)
+    return false;
+
+  buf.resize(fileSize);
+  if (fread(buf.data(), 1, fileSize, f) != fileSize)
     return false;
 
   const protocol::SceneBlob* scene = (const protocol::SceneBlob*)&buf[0];
 
-  if (strncmp(scene->id, "boba", 4) != 0)
+  ProcessFixups(scene->fixupOffset);
+
+  return AddBlobs(scene->nullObjectDataStart,
+      scene->meshDataStart,
+      scene->lightDataStart,
+      scene->cameraDataStart,
+      scene->materialDataStart,
+      scene->numNullObjects,
+      scene->numMeshes,
+      scene->numLights,
+      scene->numCameras,
+      scene->numMaterials);
+}
+
+//------------------------------------------------------------------------------
+bool MeshLoader::LoadV2(FILE* f, u64 fileSize, const char* filename)
+{
+  protocol::SceneBlobV2 header;
+  if (fread(&header, 1, sizeof(header), f) != sizeof(header) || header.version != 2)
     return false;
 
-  ProcessFixups(scene->fixupOffset);
+  if (header.compressedDataStart < sizeof(header) || header.compressedDataStart > fileSize || !Seek(f, 0))
+    return false;
+
+  // only the uncompressed part of the file is loaded as is. the compressed streams
+  // are decoded directly from the file
+  buf.resize(header.compressedDataStart);
+  if (fread(buf.data(), 1, buf.size(), f) != buf.size())
+    return false;
+
+  const protocol::SceneBlobV2* scene = (const protocol::SceneBlobV2*)&buf[0];
+  if (!InRange(scene->streamDataStart, (u64)scene->numStreams * sizeof(protocol::StreamBlob), buf.size()))
+    return false;
+
+  if (!ProcessFixups64(scene->fixupOffset))
+    return false;
+
+  if (!AddBlobs(scene->nullObjectDataStart,
+          scene->meshDataStart,
+          scene->lightDataStart,
+          scene->cameraDataStart,
+          scene->materialDataStart,
+          scene->numNullObjects,
+          scene->numMeshes,
+          scene->numLights,
+          scene->numCameras,
+          scene->numMaterials))
+    return false;
+
+  vector<protocol::StreamBlob*> compressed;
+  protocol::StreamBlob* streamBlob = (protocol::StreamBlob*)&buf[scene->streamDataStart];
+  for (u32 i = 0; i < scene->numStreams; ++i, ++streamBlob)
+  {
+    if (!CheckStream(*streamBlob, scene->compressedDataStart, fileSize))
+      return false;
+
+    streams.push_back(streamBlob);
+    if (streamBlob->encoding != protocol::StreamBlob::Raw)
+      compressed.push_back(streamBlob);
+  }
+
+  // decode the compressed streams in parallel, each task with its own file handle
+  decodedStreams.resize(compressed.size());
+  std::atomic<bool> ok(true);
+  tbb::parallel_for(size_t(0), compressed.size(), [&](size_t i)
+  {
+    FILE* streamFile = fopen(filename, "rb");
+    if (!streamFile || !DecodeStream(streamFile, compressed[i], &decodedStreams[i]))
+      ok = false;
+    if (streamFile)
+      fclose(streamFile);
+  });
+
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+// The parts of a stream's checks that don't need the file loaded: that it's the
+// right size for its mesh, and that its data is where its encoding says it goes
+static bool CheckStreamLayout(const protocol::StreamBlob& stream,
+    const protocol::MeshBlob& mesh,
+    u64 compressedDataStart,
+    u64 fileSize)
+{
+  using protocol::StreamBlob;
+
+  u32 elemSize = ElementSize(stream.type);
+  if (elemSize == 0)
+    return false;
+
+  // the stream has to have an element per vertex, or per index
+  if (stream.numElements != (stream.type == StreamBlob::Indices ? mesh.numIndices : mesh.numVerts))
+    return false;
+
+  switch (stream.encoding)
+  {
+    case StreamBlob::Raw:
+      // in the loaded part of the file, 64 byte aligned
+      return InRange(stream.dataStart, stream.dataSize, compressedDataStart) && stream.dataStart % 64 == 0
+             && stream.dataSize >= (u64)stream.numElements * elemSize;
+
+    case StreamBlob::QuantizedPos16:
+      if (stream.type != StreamBlob::Verts && stream.type != StreamBlob::Normals)
+        return false;
+      break;
+
+    case StreamBlob::DeltaIndices:
+      if (stream.type != StreamBlob::Indices)
+        return false;
+      break;
+
+    default:
+      return false;
+  }
+
+  // compressed payloads are after the loaded part
+  return stream.dataStart >= compressedDataStart && InRange(stream.dataStart, stream.dataSize, fileSize);
+}
+
+//------------------------------------------------------------------------------
+// Reads a stream's elements into dst, decoding them if they're compressed. The
+// stream has to have passed CheckStreamLayout
+static bool ReadStream(FILE* f, const protocol::StreamBlob& stream, void* dst)
+{
+  if (!Seek(f, stream.dataStart))
+    return false;
+
+  if (stream.encoding == protocol::StreamBlob::Raw)
+  {
+    size_t size = (size_t)stream.numElements * ElementSize(stream.type);
+    return fread(dst, 1, size, f) == size;
+  }
+
+  StreamDecoder decoder(stream, dst);
+  u8 chunk[64 * 1024];
+  u64 left = stream.dataSize;
+  while (left > 0 && !decoder.Failed())
+  {
+    size_t toRead = (size_t)min<u64>(left, sizeof(chunk));
+    if (fread(chunk, 1, toRead, f) != toRead)
+      return false;
+    decoder.Feed(chunk, toRead);
+    left -= toRead;
+  }
+
+  return !decoder.Failed() && decoder.Done();
+}
+
+//------------------------------------------------------------------------------
+bool MeshLoader::CheckStream(const protocol::StreamBlob& stream, u64 compressedDataStart, u64 fileSize) const
+{
+  using protocol::StreamBlob;
+
+  if (stream.meshIdx >= meshes.size())
+    return false;
+
+  const protocol::MeshBlob* mesh = meshes[stream.meshIdx];
+  if (!CheckStreamLayout(stream, *mesh, compressedDataStart, fileSize))
+    return false;
+
+  if (stream.encoding != StreamBlob::Raw)
+    return true;
+
+  // raw streams are used in place, so they have to be what the mesh points at
+  const void* data = &buf[(size_t)stream.dataStart];
+  switch (stream.type)
+  {
+    case StreamBlob::Verts: return mesh->verts == data;
+    case StreamBlob::Normals: return mesh->normals == data;
+    case StreamBlob::Uv: return mesh->uv == data;
+    default: return mesh->indices == data && IndicesInRange(mesh->indices, mesh->numIndices, mesh->numVerts);
+  }
+}
+
+//------------------------------------------------------------------------------
+bool MeshLoader::DecodeStream(FILE* f, protocol::StreamBlob* stream, AlignedBuffer* dst)
+{
+  using protocol::StreamBlob;
+
+  // CheckStream has vetted the stream
+  protocol::MeshBlob* mesh = meshes[stream->meshIdx];
+  dst->resize((size_t)stream->numElements * ElementSize(stream->type));
+  if (!ReadStream(f, *stream, dst->data()))
+    return false;
+
+  if (stream->type == StreamBlob::Indices && !IndicesInRange((const u32*)dst->data(), stream->numElements, mesh->numVerts))
+    return false;
+
+  switch (stream->type)
+  {
+    case StreamBlob::Verts: mesh->verts = (float*)dst->data(); break;
+    case StreamBlob::Normals: mesh->normals = (float*)dst->data(); break;
+    case StreamBlob::Uv: mesh->uv = (float*)dst->data(); break;
+    case StreamBlob::Indices: mesh->indices = (u32*)dst->data(); break;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool MeshLoader::AddBlobs(u64 nullObjectDataStart,
+    u64 meshDataStart,
+    u64 lightDataStart,
+    u64 cameraDataStart,
+    u64 materialDataStart,
+    u32 numNullObjects,
+    u32 numMeshes,
+    u32 numLights,
+    u32 numCameras,
+    u32 numMaterials)
+{
+  u64 size = buf.size();
+  if (!InRange(nullObjectDataStart, (u64)numNullObjects * sizeof(protocol::NullObjectBlob), size)
+      || !InRange(meshDataStart, (u64)numMeshes * sizeof(protocol::MeshBlob), size)
+      || !InRange(lightDataStart, (u64)numLights * sizeof(protocol::LightBlob), size)
+      || !InRange(cameraDataStart, (u64)numCameras * sizeof(protocol::CameraBlob), size))
+    return false;
 
   // null objects
-  protocol::NullObjectBlob* nullBlob = (protocol::NullObjectBlob*)&buf[scene->nullObjectDataStart];
-  for (u32 i = 0; i < scene->numNullObjects; ++i, ++nullBlob)
+  protocol::NullObjectBlob* nullBlob = (protocol::NullObjectBlob*)&buf[nullObjectDataStart];
+  for (u32 i = 0; i < numNullObjects; ++i, ++nullBlob)
   {
     nullObjects.push_back(nullBlob);
   }
 
   // add meshes
-  protocol::MeshBlob* meshBlob = (protocol::MeshBlob*)&buf[scene->meshDataStart];
-  for (u32 i = 0; i < scene->numMeshes; ++i, ++meshBlob)
+  protocol::MeshBlob* meshBlob = (protocol::MeshBlob*)&buf[meshDataStart];
+  for (u32 i = 0; i < numMeshes; ++i, ++meshBlob)
   {
     meshes.push_back(meshBlob);
   }
 
   // add lights
-  protocol::LightBlob* lightBlob = (protocol::LightBlob*)&buf[scene->lightDataStart];
-  for (u32 i = 0; i < scene->numLights; ++i, ++lightBlob)
+  protocol::LightBlob* lightBlob = (protocol::LightBlob*)&buf[lightDataStart];
+  for (u32 i = 0; i < numLights; ++i, ++lightBlob)
   {
     lights.push_back(lightBlob);
   }
 
   // add cameras
-  protocol::CameraBlob* cameraBlob = (protocol::CameraBlob*)&buf[scene->cameraDataStart];
-  for (u32 i = 0; i < scene->numCameras; ++i, ++cameraBlob)
+  protocol::CameraBlob* cameraBlob = (protocol::CameraBlob*)&buf[cameraDataStart];
+  for (u32 i = 0; i < numCameras; ++i, ++cameraBlob)
   {
     cameras.push_back(cameraBlob);
   }
 
-  // add materials
-  char* ptr = &buf[scene->materialDataStart];
-  for (u32 i = 0; i < scene->numMaterials; ++i)
+  // add materials. They're variable size, so each one's size is checked before
+  // moving on to the next
+  u64 ofs = materialDataStart;
+  for (u32 i = 0; i < numMaterials; ++i)
   {
-    protocol::MaterialBlob* materialBlob = (protocol::MaterialBlob*)ptr;
+    if (!InRange(ofs, sizeof(protocol::MaterialBlob), size))
+      return false;
+    protocol::MaterialBlob* materialBlob = (protocol::MaterialBlob*)&buf[(size_t)ofs];
+    if (materialBlob->blobSize < sizeof(protocol::MaterialBlob) || !InRange(ofs, materialBlob->blobSize, size))
+      return false;
     materials.push_back(materialBlob);
-    ptr += materialBlob->blobSize;
+    ofs += materialBlob->blobSize;
   }
 
   return true;
@@ -82,11 +371,10 @@ void MeshLoader::ProcessFixups(u32 fixupOffset)
   // memory locations
 
   // Note, on 64-bit, we are still limited to 32 bit file sizes and offsets, but
-  // all the fixed up pointers are 64-bit.
+  // all the fixed up pointers are 64-bit. The v2 format (ProcessFixups64) lifts this.
   u32* fixupList = (u32*)&buf[fixupOffset];
   u32 numFixups = *fixupList++;
   intptr_t base = (intptr_t)&buf[0];
-  u32* base32 = (u32*)base;
   for (u32 i = 0; i < numFixups; ++i)
   {
     // get the offset in the file that needs to be adjusted
@@ -98,8 +386,398 @@ void MeshLoader::ProcessFixups(u32 fixupOffset)
   }
 }
 
+//------------------------------------------------------------------------------
+bool MeshLoader::ProcessFixups64(u64 fixupOffset)
+{
+  // Same as ProcessFixups, but with 64-bit count and offsets. The whole list is
+  // checked before anything is fixed up, so a bad file leaves the buffer as it was
+  u64 size = buf.size();
+  if (!InRange(fixupOffset, sizeof(u64), size))
+    return false;
+
+  u64* fixupList = (u64*)&buf[(size_t)fixupOffset];
+  u64 numFixups = *fixupList++;
+  if (numFixups > (size - fixupOffset) / sizeof(u64) - 1)
+    return false;
+
+  for (u64 i = 0; i < numFixups; ++i)
+  {
+    u64 src = fixupList[i];
+    if (!InRange(src, sizeof(u64), size))
+      return false;
+    u64 target;
+    memcpy(&target, &buf[(size_t)src], sizeof(target));
+    if (target >= size)
+      return false;
+  }
+
+  intptr_t base = (intptr_t)&buf[0];
+  for (u64 i = 0; i < numFixups; ++i)
+  {
+    *(intptr_t*)(base + fixupList[i]) += base;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+StreamDecoder::StreamDecoder(const protocol::StreamBlob& stream, void* dst)
+    : _stream(stream), _dst((char*)dst)
+{
+}
+
+//------------------------------------------------------------------------------
+void StreamDecoder::Feed(const u8* data, size_t size)
+{
+  const u8* end = data + size;
+
+  if (_stream.encoding == protocol::StreamBlob::QuantizedPos16)
+  {
+    float* out = (float*)_dst;
+    const float* mn = _stream.quantMin;
+    const float* scale = _stream.quantScale;
+
+    while (data < end && !Done())
+    {
+      // gather a full 6 byte vertex, possibly spanning chunks
+      const u8* src;
+      if (_partialSize == 0 && end - data >= 6)
+      {
+        src = data;
+        data += 6;
+      }
+      else
+      {
+        while (_partialSize < 6 && data < end)
+          _partial[_partialSize++] = *data++;
+        if (_partialSize < 6)
+          break;
+        _partialSize = 0;
+        src = _partial;
+      }
+
+      u16 q[3];
+      memcpy(q, src, sizeof(q));
+      float* v = &out[_numDecoded * 3];
+      v[0] = mn[0] + q[0] * scale[0];
+      v[1] = mn[1] + q[1] * scale[1];
+      v[2] = mn[2] + q[2] * scale[2];
+      ++_numDecoded;
+    }
+  }
+  else if (_stream.encoding == protocol::StreamBlob::DeltaIndices)
+  {
+    u32* out = (u32*)_dst;
+    while (data < end && !Done())
+    {
+      // a u32 takes 5 bytes at most, with only 4 bits used in the last one
+      u8 b = *data++;
+      if (_shift > 28 || (_shift == 28 && (b & 0x70)))
+      {
+        _failed = true;
+        return;
+      }
+      _acc |= (u32)(b & 0x7f) << _shift;
+      _shift += 7;
+      if (b & 0x80)
+        continue;
+
+      // undo the zigzag encoding
+      s32 delta = (s32)(_acc >> 1) ^ -(s32)(_acc & 1);
+      _prev += (u32)delta;
+      out[_numDecoded++] = _prev;
+      _acc = 0;
+      _shift = 0;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+MeshStreamer::~MeshStreamer()
+{
+  if (_file)
+    fclose(_file);
+}
+
+//------------------------------------------------------------------------------
+bool MeshStreamer::Open(const char* filename)
+{
+  _file = fopen(filename, "rb");
+  if (!_file)
+    return false;
+
+  u64 fileSize = FileSize(_file);
+  protocol::SceneBlobV2 header;
+  if (fread(&header, 1, sizeof(header), _file) != sizeof(header) || strncmp(header.id, "bob2", 4) != 0
+      || header.version != 2 || header.compressedDataStart > fileSize)
+    return false;
+
+  u64 loaded = header.compressedDataStart;
+  if (!InRange(header.meshDataStart, (u64)header.numMeshes * sizeof(protocol::MeshBlob), loaded)
+      || !InRange(header.streamDataStart, (u64)header.numStreams * sizeof(protocol::StreamBlob), loaded))
+    return false;
+
+  meshes.resize(header.numMeshes);
+  streams.resize(header.numStreams);
+  if (!Seek(_file, header.meshDataStart)
+      || fread(meshes.data(), sizeof(protocol::MeshBlob), meshes.size(), _file) != meshes.size()
+      || !Seek(_file, header.streamDataStart)
+      || fread(streams.data(), sizeof(protocol::StreamBlob), streams.size(), _file) != streams.size())
+    return false;
+
+  // the pointers are offsets into the file, which are never fixed up
+  for (protocol::MeshBlob& mesh : meshes)
+  {
+    mesh.name = nullptr;
+    mesh.materialGroups = nullptr;
+    mesh.verts = mesh.normals = mesh.uv = nullptr;
+    mesh.indices = nullptr;
+  }
+
+  for (const protocol::StreamBlob& stream : streams)
+  {
+    if (stream.meshIdx >= meshes.size() || !CheckStreamLayout(stream, meshes[stream.meshIdx], loaded, fileSize))
+      return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+bool MeshStreamer::ReadMesh(u32 meshIdx, vector<float>* verts, vector<u32>* indices)
+{
+  using protocol::StreamBlob;
+
+  const protocol::MeshBlob& mesh = meshes[meshIdx];
+  verts->clear();
+  indices->clear();
+  for (const StreamBlob& stream : streams)
+  {
+    if (stream.meshIdx != meshIdx)
+      continue;
+
+    if (stream.type == StreamBlob::Verts)
+    {
+      verts->resize((size_t)mesh.numVerts * 3);
+      if (!ReadStream(_file, stream, verts->data()))
+        return false;
+    }
+    else if (stream.type == StreamBlob::Indices)
+    {
+      indices->resize(mesh.numIndices);
+      if (!ReadStream(_file, stream, indices->data()))
+        return false;
+    }
+  }
+
+  // a mesh without one of the streams has to be empty
+  return verts->size() == (size_t)mesh.numVerts * 3 && indices->size() == mesh.numIndices
+         && IndicesInRange(indices->data(), mesh.numIndices, mesh.numVerts);
+}
+
 //------------------------------------------------------------------------------
 u32 MeshLoader::GetVertexFormat(const protocol::MeshBlob& mesh)
 {
   return (mesh.verts ? VF_POS : 0) | (mesh.normals ? VF_NORMAL : 0) | (mesh.uv ? VF_TEX2_0 : 0);
 }
+
+//------------------------------------------------------------------------------
+// appends size bytes at the next multiple of align, and returns where they went
+static u64 Append(vector<char>* out, const void* data, size_t size, size_t align)
+{
+  size_t ofs = (out->size() + align - 1) & ~(align - 1);
+  out->resize(ofs + size);
+  if (data && size)
+    memcpy(&(*out)[ofs], data, size);
+  return ofs;
+}
+
+//------------------------------------------------------------------------------
+static void EncodeQuantized(const vector<float>& v, protocol::StreamBlob* stream, vector<u8>* payload)
+{
+  u32 numElements = (u32)v.size() / 3;
+  for (int i = 0; i < 3; ++i)
+  {
+    float mn = FLT_MAX, mx = -FLT_MAX;
+    for (u32 j = 0; j < numElements; ++j)
+    {
+      mn = min(mn, v[j * 3 + i]);
+      mx = max(mx, v[j * 3 + i]);
+    }
+    stream->quantMin[i] = numElements ? mn : 0;
+    stream->quantScale[i] = numElements ? (mx - mn) / 65535 : 0;
+  }
+
+  payload->resize((size_t)numElements * 6);
+  for (u32 j = 0; j < numElements; ++j)
+  {
+    u16 q[3];
+    for (int i = 0; i < 3; ++i)
+    {
+      float scale = stream->quantScale[i];
+      float x = scale > 0 ? (v[j * 3 + i] - stream->quantMin[i]) / scale + 0.5f : 0;
+      q[i] = (u16)min(65535.f, max(0.f, x));
+    }
+    memcpy(&(*payload)[j * 6], q, sizeof(q));
+  }
+}
+
+//------------------------------------------------------------------------------
+static void EncodeDeltaIndices(const vector<u32>& indices, vector<u8>* payload)
+{
+  u32 prev = 0;
+  for (u32 idx : indices)
+  {
+    s32 delta = (s32)(idx - prev);
+    u32 zigzag = ((u32)delta << 1) ^ (u32)(delta >> 31);
+    prev = idx;
+    while (zigzag >= 0x80)
+    {
+      payload->push_back((u8)(zigzag | 0x80));
+      zigzag >>= 7;
+    }
+    payload->push_back((u8)zigzag);
+  }
+}
+
+//------------------------------------------------------------------------------
+bool MeshWriter::Write(const char* filename, const vector<MeshData>& meshes)
+{
+  using protocol::StreamBlob;
+
+  // The pointers in the blobs are written as offsets into the file, and listed as
+  // fixups. The mesh blobs go first, and are copied in once their data is placed
+  vector<char> out(sizeof(protocol::SceneBlobV2));
+  vector<u64> fixups;
+  vector<StreamBlob> streams;
+  vector<vector<u8>> payloads(meshes.size() * 4);
+
+  u64 meshDataStart = Append(&out, nullptr, meshes.size() * sizeof(protocol::MeshBlob), 8);
+  for (size_t i = 0; i < meshes.size(); ++i)
+  {
+    const MeshData& src = meshes[i];
+    if (src.verts.size() % 3 || src.normals.size() % 3 || src.uv.size() % 2
+        || (!src.normals.empty() && src.normals.size() != src.verts.size())
+        || (!src.uv.empty() && src.uv.size() / 2 != src.verts.size() / 3))
+      return false;
+
+    protocol::MeshBlob blob;
+    memset(&blob, 0, sizeof(blob));
+    blob.id = (u32)i;
+    blob.numVerts = (u32)src.verts.size() / 3;
+    blob.numIndices = (u32)src.indices.size();
+    blob.numMaterialGroups = (u32)src.materialGroups.size();
+    // identity transform
+    blob.mtx[0] = blob.mtx[4] = blob.mtx[8] = 1;
+
+    u64 blobOfs = meshDataStart + i * sizeof(protocol::MeshBlob);
+    auto setPointer = [&](void* field, u64 target)
+    {
+      memcpy(field, &target, sizeof(target));
+      fixups.push_back(blobOfs + ((char*)field - (char*)&blob));
+    };
+
+    setPointer(&blob.name, Append(&out, src.name, strlen(src.name) + 1, 1));
+    if (!src.materialGroups.empty())
+    {
+      setPointer(&blob.materialGroups,
+          Append(&out, src.materialGroups.data(), src.materialGroups.size() * sizeof(src.materialGroups[0]), 8));
+    }
+
+    // the bounding sphere, around the center of the bounds
+    float mn[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, mx[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (size_t j = 0; j < src.verts.size(); ++j)
+    {
+      mn[j % 3] = min(mn[j % 3], src.verts[j]);
+      mx[j % 3] = max(mx[j % 3], src.verts[j]);
+    }
+    if (blob.numVerts)
+    {
+      blob.sx = (mn[0] + mx[0]) / 2;
+      blob.sy = (mn[1] + mx[1]) / 2;
+      blob.sz = (mn[2] + mx[2]) / 2;
+      for (u32 j = 0; j < blob.numVerts; ++j)
+      {
+        float dx = src.verts[j * 3] - blob.sx, dy = src.verts[j * 3 + 1] - blob.sy, dz = src.verts[j * 3 + 2] - blob.sz;
+        blob.r = max(blob.r, sqrtf(dx * dx + dy * dy + dz * dz));
+      }
+    }
+
+    // Raw streams go in place, 64 byte aligned, and compressed ones are encoded to
+    // go after the rest
+    auto addStream = [&](u32 type, u32 encoding, const void* data, u32 numElements, void* field)
+    {
+      StreamBlob stream;
+      memset(&stream, 0, sizeof(stream));
+      stream.meshIdx = (u32)i;
+      stream.type = type;
+      stream.encoding = encoding;
+      stream.numElements = numElements;
+
+      vector<u8>& payload = payloads[i * 4 + type];
+      if (encoding == StreamBlob::QuantizedPos16)
+        EncodeQuantized(type == StreamBlob::Verts ? src.verts : src.normals, &stream, &payload);
+      else if (encoding == StreamBlob::DeltaIndices)
+        EncodeDeltaIndices(src.indices, &payload);
+      else
+      {
+        stream.dataSize = (u64)numElements * ElementSize(type);
+        stream.dataStart = Append(&out, data, (size_t)stream.dataSize, 64);
+        setPointer(field, stream.dataStart);
+      }
+      stream.dataSize = encoding == StreamBlob::Raw ? stream.dataSize : payload.size();
+      streams.push_back(stream);
+    };
+
+    bool validEncodings = (src.vertsEncoding == StreamBlob::Raw || src.vertsEncoding == StreamBlob::QuantizedPos16)
+                          && (src.indicesEncoding == StreamBlob::Raw || src.indicesEncoding == StreamBlob::DeltaIndices);
+    if (!validEncodings)
+      return false;
+
+    if (!src.verts.empty())
+      addStream(StreamBlob::Verts, src.vertsEncoding, src.verts.data(), blob.numVerts, &blob.verts);
+    if (!src.normals.empty())
+      addStream(StreamBlob::Normals, StreamBlob::Raw, src.normals.data(), blob.numVerts, &blob.normals);
+    if (!src.uv.empty())
+      addStream(StreamBlob::Uv, StreamBlob::Raw, src.uv.data(), blob.numVerts, &blob.uv);
+    if (!src.indices.empty())
+      addStream(StreamBlob::Indices, src.indicesEncoding, src.indices.data(), blob.numIndices, &blob.indices);
+
+    memcpy(&out[(size_t)blobOfs], &blob, sizeof(blob));
+  }
+
+  u64 streamDataStart = Append(&out, nullptr, streams.size() * sizeof(StreamBlob), 8);
+  u64 numFixups = fixups.size();
+  u64 fixupOffset = Append(&out, &numFixups, sizeof(numFixups), 8);
+  Append(&out, fixups.data(), fixups.size() * sizeof(u64), 8);
+
+  // everything up to here is loaded as is, the compressed payloads follow
+  u64 compressedDataStart = Append(&out, nullptr, 0, 64);
+  for (StreamBlob& stream : streams)
+  {
+    if (stream.encoding != StreamBlob::Raw)
+    {
+      const vector<u8>& payload = payloads[stream.meshIdx * 4 + stream.type];
+      stream.dataStart = Append(&out, payload.data(), payload.size(), 1);
+    }
+  }
+  if (!streams.empty())
+    memcpy(&out[(size_t)streamDataStart], streams.data(), streams.size() * sizeof(StreamBlob));
+
+  protocol::SceneBlobV2 header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.id, "bob2", 4);
+  header.version = 2;
+  header.fixupOffset = fixupOffset;
+  header.meshDataStart = meshDataStart;
+  header.streamDataStart = streamDataStart;
+  header.compressedDataStart = compressedDataStart;
+  header.numMeshes = (u32)meshes.size();
+  header.numStreams = (u32)streams.size();
+  memcpy(&out[0], &header, sizeof(header));
+
+  FILE* f = fopen(filename, "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  return fclose(f) == 0 && ok;
+}
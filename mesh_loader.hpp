@@ -1,8 +1,14 @@
 #pragma once
 #include <vector>
 #include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <new>
 
+typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 using namespace std;
 
@@ -27,6 +33,60 @@ namespace protocol
     char data[0];
   };
 
+  // v2 container. All offsets are 64-bit, and vertex/index streams start on
+  // 64 byte boundaries (the loader keeps the same alignment in memory). Streams can
+  // optionally be compressed; compressed payloads live at the end of the file, after
+  // compressedDataStart, and are decoded straight into their final buffers.
+  struct SceneBlobV2
+  {
+    char id[4];
+    u32 version;
+    u64 fixupOffset;
+    u64 nullObjectDataStart;
+    u64 meshDataStart;
+    u64 lightDataStart;
+    u64 cameraDataStart;
+    u64 materialDataStart;
+    u64 streamDataStart;
+    u64 compressedDataStart;
+    u32 numNullObjects;
+    u32 numMeshes;
+    u32 numLights;
+    u32 numCameras;
+    u32 numMaterials;
+    u32 numStreams;
+  };
+
+  struct StreamBlob
+  {
+    enum Type
+    {
+      Verts,
+      Normals,
+      Uv,
+      Indices,
+    };
+
+    enum Encoding
+    {
+      // uncompressed, and the mesh pointer is fixed up like any other pointer
+      Raw,
+      // 3 x u16 per vertex, dequantized as quantMin + q * quantScale
+      QuantizedPos16,
+      // zigzag varint encoded delta to the previous index
+      DeltaIndices,
+    };
+
+    u32 meshIdx;
+    u32 type;
+    u32 encoding;
+    u32 numElements;
+    u64 dataStart;
+    u64 dataSize;
+    float quantMin[3];
+    float quantScale[3];
+  };
+
   struct BlobBase
   {
     const char* name;
@@ -99,6 +159,77 @@ namespace pbr
 {
   struct Mesh;
 
+  //------------------------------------------------------------------------------
+  template <typename T, size_t Alignment>
+  struct AlignedAllocator
+  {
+    typedef T value_type;
+    template <typename U>
+    struct rebind
+    {
+      typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n)
+    {
+      void* ptr = nullptr;
+#ifdef _WIN32
+      ptr = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+      if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0)
+        ptr = nullptr;
+#endif
+      if (!ptr)
+        throw std::bad_alloc();
+      return (T*)ptr;
+    }
+
+    void deallocate(T* ptr, size_t)
+    {
+#ifdef _WIN32
+      _aligned_free(ptr);
+#else
+      free(ptr);
+#endif
+    }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+  };
+
+  typedef vector<char, AlignedAllocator<char, 64>> AlignedBuffer;
+
+  //------------------------------------------------------------------------------
+  // Incremental decoder for a compressed stream. The encoded payload can be fed in
+  // chunks of any size, so the whole compressed stream never has to be in memory.
+  struct StreamDecoder
+  {
+    StreamDecoder(const protocol::StreamBlob& stream, void* dst);
+    void Feed(const u8* data, size_t size);
+    bool Done() const { return _numDecoded == _stream.numElements; }
+    // set on a malformed payload, after which nothing more is decoded
+    bool Failed() const { return _failed; }
+
+    const protocol::StreamBlob& _stream;
+    char* _dst;
+    u32 _numDecoded = 0;
+
+    // partial element carried over between chunks
+    u8 _partial[6];
+    u32 _partialSize = 0;
+
+    // delta index state
+    u32 _prev = 0;
+    u32 _acc = 0;
+    u32 _shift = 0;
+
+    bool _failed = false;
+  };
+
   enum VertexFlags
   {
     VF_POS      = 1 << 0,
@@ -112,13 +243,74 @@ namespace pbr
 
     bool Load(const char* filename);
     void ProcessFixups(u32 fixupOffset);
+    // false if the list, or any pointer it fixes up, is outside the buffer
+    bool ProcessFixups64(u64 fixupOffset);
 
     vector<protocol::MeshBlob*> meshes;
     vector<protocol::NullObjectBlob*> nullObjects;
     vector<protocol::CameraBlob*> cameras;
     vector<protocol::LightBlob*> lights;
     vector<protocol::MaterialBlob*> materials;
-    vector<char> buf;
+    vector<protocol::StreamBlob*> streams;
+    AlignedBuffer buf;
+    // backing storage for the decoded compressed streams
+    vector<AlignedBuffer> decodedStreams;
+
+  private:
+    bool LoadV1(FILE* f, u64 fileSize);
+    bool LoadV2(FILE* f, u64 fileSize, const char* filename);
+    bool DecodeStream(FILE* f, protocol::StreamBlob* stream, AlignedBuffer* dst);
+    bool CheckStream(const protocol::StreamBlob& stream, u64 compressedDataStart, u64 fileSize) const;
+    // false if the blobs don't fit in the buffer
+    bool AddBlobs(u64 nullObjectDataStart,
+        u64 meshDataStart,
+        u64 lightDataStart,
+        u64 cameraDataStart,
+        u64 materialDataStart,
+        u32 numNullObjects,
+        u32 numMeshes,
+        u32 numLights,
+        u32 numCameras,
+        u32 numMaterials);
+  };
+
+  //------------------------------------------------------------------------------
+  // Reads a v2 file a mesh at a time, for scenes that don't fit in memory. Only the
+  // mesh blobs and the stream table are loaded, with the pointers in the blobs left
+  // null, and ReadMesh reads a mesh's positions and indices from the file when
+  // they're wanted. v1 files can't be streamed.
+  struct MeshStreamer
+  {
+    ~MeshStreamer();
+    bool Open(const char* filename);
+    // false if the mesh's streams are missing or broken
+    bool ReadMesh(u32 meshIdx, vector<float>* verts, vector<u32>* indices);
+
+    vector<protocol::MeshBlob> meshes;
+    vector<protocol::StreamBlob> streams;
+
+  private:
+    FILE* _file = nullptr;
   };
 
+  //------------------------------------------------------------------------------
+  // Writes meshes as a v2 file, with each mesh's positions and indices stored with
+  // the encoding it asks for. Lights, cameras and materials aren't written.
+  struct MeshWriter
+  {
+    struct MeshData
+    {
+      const char* name = "";
+      vector<float> verts;
+      vector<float> normals;
+      vector<float> uv;
+      vector<u32> indices;
+      vector<protocol::MeshBlob::MaterialGroup> materialGroups;
+      // StreamBlob::Encoding, normals and uvs are always raw
+      u32 vertsEncoding = protocol::StreamBlob::Raw;
+      u32 indicesEncoding = protocol::StreamBlob::Raw;
+    };
+
+    static bool Write(const char* filename, const vector<MeshData>& meshes);
+  };
 }
@@ -1,197 +1,453 @@
-#if 0
-#include <tbb/tbb.h>
 #include "pbr_math.hpp"
 #include "pbr.hpp"
+#include "buffer.hpp"
+#include "progressive.hpp"
+#include "kernel_table.hpp"
+#include "warp.hpp"
+#include "light_bvh.hpp"
+#include "reservoir.hpp"
+#include "irradiance_cache.hpp"
+#include "guiding.hpp"
+#include <tbb/parallel_for.h>
 
 using namespace pbr;
-extern Vector2u windowSize;
 extern vector<Geo*> objects;
 extern vector<Geo*> emitters;
-extern vector<IsectTri> tris;
+extern bool IntersectMeshes(const Ray& r, float* t);
+extern void IntersectMeshesBatch(const Ray* rays, u32 numRays, float* t);
 extern bool Intersect(const Ray& r, HitRec* hitRec);
 
+// rays leaving a surface start this far off it, so they don't hit it again
+const float RAY_OFFSET = 1e-3f;
+// emitters picked per diffuse hit, out of the light bvh
+const int NUM_LIGHT_SAMPLES = 2;
+LightBvh lightBvh;
+DirectLightResampler resampler;
+// the first bounce's indirect diffuse light comes from the cache, when it's on
+IrradianceCache irradianceCache;
+bool cacheIndirect = false;
+// learns where the indirect light comes from, and sends diffuse bounces there
+SDTree sdTree;
+bool guiding = false;
+// guided bounces per path whose light is recorded, any past them aren't
+const int MAX_GUIDED_VERTICES = 16;
+// bounces before russian roulette can end a path, and the most it can have
+int minDepth = 3;
+int maxDepth = 20;
+
 //---------------------------------------------------------------------------
-Color Radiance(const Ray& r, int depth, bool emit = true)
+// a guided bounce, waiting for the light found past it to be recorded
+struct GuidedVertex
 {
-  Color res(0,0,0);
+  u32 leaf;
+  Vector3 d;
+  float pdf;
+  // the path's throughput just past the vertex, which the light found further on
+  // is divided by to get what came in along d
+  Color throughput;
+  Color li;
+};
 
-  for (const IsectTri& tri : tris)
+//---------------------------------------------------------------------------
+void AddLight(const Color& light, Color* res, GuidedVertex* guided, int numGuided)
+{
+  *res += light;
+  for (int i = 0; i < numGuided; ++i)
   {
-    float t, u, v;
-    if (RayTriIntersect(r, tri, &t, &u, &v))
-      return Color(0.5f, 0.5f, 0.5f);
+    GuidedVertex& v = guided[i];
+    v.li += Color(v.throughput.x > 0 ? light.x / v.throughput.x : 0,
+        v.throughput.y > 0 ? light.y / v.throughput.y : 0,
+        v.throughput.z > 0 ? light.z / v.throughput.z : 0);
   }
+}
 
-  HitRec hitRec;
-  if (!Intersect(r, &hitRec))
-    return res;
+//---------------------------------------------------------------------------
+// A loop over the bounces, carrying the path's throughput. aov, if given, gets the
+// first hit. direct, if given, is the first hit's resampled direct light, used
+// instead of sampling the light bvh. firstMeshT, if given, is r's closest mesh hit
+// traced with the rest of its batch, FLT_MAX for a miss
+Color Radiance(const Ray& r,
+    int depth,
+    bool emit = true,
+    AovSample* aov = nullptr,
+    const Reservoir* direct = nullptr,
+    const float* firstMeshT = nullptr)
+{
+  Color res(0,0,0);
+  Color throughput(1,1,1);
+  Ray ray = r;
+  GuidedVertex guided[MAX_GUIDED_VERTICES];
+  int numGuided = 0;
+
+  for (;;)
+  {
+    float meshT = firstMeshT ? *firstMeshT : FLT_MAX;
+    bool meshHit = firstMeshT ? meshT < FLT_MAX : IntersectMeshes(ray, &meshT);
+    firstMeshT = nullptr;
+    if (meshHit)
+    {
+      // the meshes have no normals or materials yet
+      if (aov)
+        aov->depth = meshT;
+      AddLight(throughput * Color(0.5f, 0.5f, 0.5f), &res, guided, numGuided);
+      break;
+    }
 
-  Vector3 x = hitRec.pos;
-  Vector3 n = hitRec.normal;
-  Vector3 nl =  (Dot(r.d, n) < 0 ? 1.f : -1.f) * n;
-  Normalize(nl);
-  Material* mat = hitRec.material;
+    HitRec hitRec;
+    if (!Intersect(ray, &hitRec))
+      break;
 
-  // Choose either diff or spec
-  float diffP = mat->diffuse.Max3();
-  float specP = mat->specular.Max3();
-  float diffR = Randf() * (diffP + specP);
+    if (aov)
+    {
+      aov->depth = hitRec.t;
+      aov->normal = hitRec.normal;
+      aov->albedo = hitRec.material->diffuse;
+      aov->materialId = hitRec.material->id;
+      aov->objectId = hitRec.geo->id;
+      aov = nullptr;
+    }
 
-  bool diffuse = diffR < diffP;
+    Vector3 x = hitRec.pos;
+    Vector3 n = hitRec.normal;
+    Vector3 nl =  (Dot(ray.d, n) < 0 ? 1.f : -1.f) * n;
+    Normalize(nl);
+    Material* mat = hitRec.material;
 
-  Color col = diffuse ? mat->diffuse : mat->specular;
-  Color emitCol = emit ? mat->emissive : Color(0,0,0);
-  ++depth;
+    // emission is counted once, whichever lobe carries on
+    if (emit)
+      AddLight(throughput * mat->emissive, &res, guided, numGuided);
 
-  // Russian roulette based on max specular component
-  float p = mat->specular.Max3();
+    // Choose either diff or spec
+    float diffP = mat->diffuse.Max3();
+    float specP = mat->specular.Max3();
+    if (diffP + specP <= 0)
+      break;
+    float diffR = Randf() * (diffP + specP);
 
-  if (depth > 5 || p == 0.f)
-  {
-    float r = Randf();
-    if (r < p && depth < 20)
-      col *= (1 / p);
-    else
-      return emitCol;
-  }
+    bool diffuse = diffR < diffP;
 
-  if (diffuse)
-  {
-    // diffuse
-    diffP = diffP / (diffP + specP);
-
-    float r1 = (float)(2 * M_PI*Randf());
-    float r2 = Randf();
-    float r2s = sqrtf(r2);
-    Vector3 w = nl, u, v;
-    CreateCoordinateSystem(w, &u, &v);
-    Vector3 d = Normalize((u*cos(r1)*r2s + v*sin(r1)*r2s + w*sqrt(1 - r2)));
-
-    Color e(0,0,0);
-    // sample the emitters
-    for (Geo* g : emitters)
+    Color col = diffuse ? mat->diffuse : mat->specular;
+    ++depth;
+
+    if (diffuse)
     {
-      if (g->type != Geo::Type::Sphere)
-        continue;
-      Sphere* s = static_cast<Sphere*>(g);
-
-      // Sample a point on the emitter (this assumes spherical emitters)
-      // See Realistic Ray Tracing, pp 197
-      Vector3 sw = Normalize(s->center - x), su, sv;
-      CreateCoordinateSystem(sw, &su, &sv);
-      float dist = (x - s->center).LengthSquared();
-      float cos_a_max = dist <= s->radiusSquared ? 0 : sqrtf(1 - s->radiusSquared / dist);
-      float eps1 = Randf();
-      float eps2 = Randf();
-      float cos_a = 1 - eps1 + eps1*cos_a_max;
-      float sin_a = sqrtf(1 - cos_a*cos_a);
-      float phi = (float)(2 * M_PI*eps2);
-      Vector3 l = Normalize(su*cos(phi)*sin_a + sv*sin(phi)*sin_a + sw*cos_a);
-
-      // shadow ray
-      HitRec shadowHit;
-      if (Intersect(Ray(x, l), &shadowHit) && shadowHit.geo == g)
+      // diffuse
+      diffP = diffP / (diffP + specP);
+      Color weight = col / diffP;
+
+      Vector3 d = Normalize(ToFrame(CosineHemisphere(Randf2()), nl));
+
+      Color e(0,0,0);
+      if (direct)
+      {
+        // a single shadow ray towards the reservoir's sample
+        const LightSample& ls = direct->sample;
+        HitRec shadowHit;
+        if (ls.light && Intersect(Ray(x + nl * RAY_OFFSET, Normalize(ls.pos - x)), &shadowHit) && shadowHit.geo == ls.light)
+        {
+          ShadingPoint sp;
+          sp.pos = x;
+          sp.normal = nl;
+          sp.diffuse = col;
+          e = UnshadowedLight(sp, ls) * direct->W;
+        }
+      }
+
+      // sample the emitters, picking them out of the light bvh by how much they
+      // could contribute here
+      for (int i = 0; i < (direct ? 0 : NUM_LIGHT_SAMPLES); ++i)
+      {
+        float pmf;
+        Geo* g = lightBvh.Sample(x, nl, Randf(), &pmf);
+        if (!g)
+          break;
+        Sphere* s = static_cast<Sphere*>(g);
+
+        // Sample a point on the emitter (this assumes spherical emitters)
+        // See Realistic Ray Tracing, pp 197
+        Vector3 sw = Normalize(s->center - x);
+        float dist = (x - s->center).LengthSquared();
+        float cos_a_max = dist <= s->radiusSquared ? 0 : sqrtf(1 - s->radiusSquared / dist);
+        Vector3 l = Normalize(ToFrame(UniformCone(Randf2(), cos_a_max), sw));
+
+        // shadow ray
+        HitRec shadowHit;
+        if (Intersect(Ray(x + nl * RAY_OFFSET, l), &shadowHit) && shadowHit.geo == g)
+        {
+          Material* sm = s->material;
+
+          // omega = pdf (rrt, 198)
+          float omega = (float)(2 * M_PI*(1 - cos_a_max));
+          // 1/pi for brdf (rrt, 165)
+          e = e + (col * sm->emissive * Dot(l, nl) * omega) * (float)M_1_PI / (pmf * NUM_LIGHT_SAMPLES);
+        }
+      }
+      AddLight(throughput * e / diffP, &res, guided, numGuided);
+      direct = nullptr;
+
+      if (cacheIndirect && depth == 1)
       {
-        Material* sm = s->material;
+        // The cache's rays go a bounce deeper, so they don't look it up themselves.
+        // It stands in for the rest of the path
+        Color irradiance = irradianceCache.Irradiance(x, nl, [depth, nl](const Ray& ray, float* hitDist)
+        {
+          AovSample hit;
+          Color res = Radiance(Ray(ray.o + nl * RAY_OFFSET, ray.d), depth, false, &hit);
+          *hitDist = hit.depth;
+          return res;
+        });
+        AddLight(throughput * weight * irradiance * (float)M_1_PI, &res, guided, numGuided);
+        break;
+      }
+
+      if (guiding)
+      {
+        // one-sample mis between the cosine lobe and the leaf's learnt distribution
+        u32 leaf = sdTree.Leaf(x);
+        if (Randf() >= sdTree.bsdfFraction)
+        {
+          float guidePdf;
+          d = sdTree.Sample(leaf, Randf2(), &guidePdf);
+        }
+        float cosTheta = Dot(d, nl);
+        float pdf = sdTree.bsdfFraction * max(0.f, cosTheta) * (float)M_1_PI
+                    + (1 - sdTree.bsdfFraction) * sdTree.Pdf(leaf, d);
+        if (cosTheta <= 0 || pdf <= 0)
+          break;
+        throughput = throughput * weight * (cosTheta * (float)M_1_PI / pdf);
 
-        // omega = pdf (rrt, 198)
-        float omega = (float)(2 * M_PI*(1 - cos_a_max));
-        // 1/pi for brdf (rrt, 165)
-        e = e + (col * sm->emissive * Dot(l, nl) * omega) * (float)M_1_PI;
+        // the light found from here on is recorded, less emission, as light
+        // sampling already counts it
+        if (numGuided < MAX_GUIDED_VERTICES && sdTree.Training())
+          guided[numGuided++] = GuidedVertex{leaf, d, pdf, throughput, Color(0, 0, 0)};
       }
+      else
+      {
+        throughput = throughput * weight;
+      }
+
+      ray = Ray(x + nl * RAY_OFFSET, d);
+      emit = false;
+    }
+    else
+    {
+      // spec
+      specP = specP / (diffP + specP);
+      throughput = throughput * col / specP;
+      ray = Ray(x + nl * RAY_OFFSET, ray.d - n * 2 * Dot(n, ray.d));
+      emit = true;
+      // the resampled light is for the first hit, not wherever the reflection lands
+      direct = nullptr;
+    }
+
+    // Russian roulette on the throughput, so paths carrying little light end early,
+    // and the survivors are weighed up to make up for them
+    if (depth >= maxDepth)
+      break;
+    if (depth >= minDepth)
+    {
+      float survive = min(1.f, throughput.Max3());
+      if (Randf() >= survive)
+        break;
+      throughput /= survive;
     }
-    return (emitCol + e + col * Radiance(Ray(x, d), depth, false)) / diffP;
   }
-  else
+
+  for (int i = 0; i < numGuided; ++i)
+    sdTree.Record(guided[i].leaf, guided[i].d, Luminance(guided[i].li) / guided[i].pdf);
+
+  return res;
+}
+
+//---------------------------------------------------------------------------
+// bounds of the spheres, padded. The planes are infinite, records on them outside
+// of this just aren't as quick to find
+Aabb SceneBounds()
+{
+  Aabb res;
+  for (Geo* g : objects)
   {
-    // spec
-    specP = specP / (diffP + specP);
-    return (mat->emissive + col * Radiance(Ray(x, r.d - n * 2 * Dot(n, r.d)), depth)) / specP;
+    if (g->type != Geo::Type::Sphere)
+      continue;
+    Sphere* s = static_cast<Sphere*>(g);
+    Vector3 r(s->radius, s->radius, s->radius);
+    res.Grow(Aabb(s->center - r, s->center + r));
   }
+
+  if (res.IsEmpty())
+    return Aabb(Vector3(-100, -100, -100), Vector3(100, 100, 100));
+  Vector3 pad = (res.mx - res.mn) * 0.1f;
+  return Aabb(res.mn - pad, res.mx + pad);
+}
+
+//---------------------------------------------------------------------------
+// the hit Radiance shades first, for resampling its direct light. meshT is r's
+// closest mesh hit, FLT_MAX for a miss
+ShadingPoint FirstHit(const Ray& r, float meshT)
+{
+  ShadingPoint sp;
+  HitRec hitRec;
+  if (meshT < FLT_MAX || !Intersect(r, &hitRec))
+    return sp;
+
+  sp.pos = hitRec.pos;
+  sp.normal = Dot(r.d, hitRec.normal) < 0 ? hitRec.normal : -hitRec.normal;
+  sp.diffuse = hitRec.material->diffuse;
+  sp.depth = hitRec.t;
+  return sp;
 }
 
-struct ScanlineRender
+//---------------------------------------------------------------------------
+// Renders numPasses passes of one path per pixel into acc, the same way
+// RayTraceProgressive does, so the passes can be checkpointed and merged. Each pass
+// first resamples the direct light at its first hits, if enabled, and ends a pass
+// of the path guiding's training
+void PathTrace(const Camera& cam, const RenderSettings& settings, Accumulator* acc, u32 numPasses, Buffer* buffer)
 {
-  ScanlineRender(
-    const Camera& camera,
-    const Vector3& tmp,
-    float xInc,
-    float yInc, Color* buffer,
-    const RenderSettings& settings,
-    Vector2* samples)
-      : cam(camera), tmp(tmp), xInc(xInc), yInc(yInc), buffer(buffer), settings(settings), samples(samples)
+  ImagePlane plane = MakeImagePlane(cam, *buffer);
+  const KernelTable& kernels = Kernels();
+  bool aovs = buffer->aovs != 0;
+
+  // quick to build, so it's always for the current emitters
+  lightBvh.Build(emitters);
+
+  // the records stay valid from frame to frame, as long as the scene doesn't change
+  cacheIndirect = settings.irradianceCache;
+  if (cacheIndirect && irradianceCache.NumRecords() == 0)
+    irradianceCache.Init(SceneBounds());
+
+  minDepth = settings.minDepth;
+  maxDepth = settings.maxDepth;
+
+  // training carries on over the passes, then the learnt tree is kept
+  guiding = settings.pathGuiding;
+  if (guiding && sdTree.IsEmpty())
+    sdTree.Init(SceneBounds());
+
+  // The camera rays for a tile at the pass's jitter, in row order, and their closest
+  // mesh hits. The meshes are traced as one batch, so the out of core clusters the
+  // tile needs are paged in once each, rather than as each ray gets to them
+  auto tileRays = [&](const Tile& tile, u32 absPass, vector<Ray>* rays, vector<float>* meshT)
   {
-  }
+    int tileWidth = tile.x1 - tile.x0;
+    vector<float> dx(tileWidth), dy(tileWidth), dz(tileWidth);
+    vector<Vector2> jitter(tileWidth);
+    rays->clear();
+    for (int y = tile.y0; y < tile.y1; ++y)
+    {
+      for (int x = 0; x < tileWidth; ++x)
+        jitter[x] = PassJitter(acc->seed, (u32)(y * buffer->width + tile.x0 + x), absPass);
 
-  void operator()(const tbb::blocked_range<int> &r) const
+      kernels.cameraRayRow(cam.frame.origin,
+          plane.p + Vector3(tile.x0 * plane.xInc, y * plane.yInc, 0),
+          Vector3(plane.xInc, 0, 0),
+          Vector3(0, plane.yInc, 0),
+          jitter.data(),
+          tileWidth,
+          dx.data(),
+          dy.data(),
+          dz.data());
+
+      for (int x = 0; x < tileWidth; ++x)
+        rays->push_back(Ray(cam.frame.origin, Vector3(dx[x], dy[x], dz[x])));
+    }
+
+    meshT->resize(rays->size());
+    IntersectMeshesBatch(rays->data(), (u32)rays->size(), meshT->data());
+  };
+
+  // show the tiles that were resumed from a checkpoint
+  tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
   {
-    u32 numSamples = settings.numSamples;
-    numSamples = 1;
+    if (acc->tilePasses[tileIdx] == 0)
+      return;
+    acc->Resolve(tileIdx, buffer);
+    buffer->TileDone(tileIdx);
+  });
 
-    // r contains the scan lines to process
-    Color* pp = &buffer[r.begin() * windowSize.x];
-    Vector3 p;
-    Vector3 tmp2 = tmp;
-    tmp2.y += yInc * r.begin();
+  // the aovs aren't checkpointed, so their means start with this call's passes
+  vector<u32> startPasses = acc->tilePasses;
 
-    for (int y = r.begin(); y < r.end(); ++y)
-    {
-      p = tmp2;
+  for (u32 pass = acc->MinPasses(); pass < numPasses; ++pass)
+  {
+    u32 absPass = acc->firstPass + pass;
 
-      for (u32 x = 0; x < windowSize.x; ++x)
+    if (settings.resampleDirect)
+    {
+      // Every pixel's reservoir has to be done before the neighbours can be merged.
+      // They're for the hits of this pass's camera rays, and draw from their own
+      // sequence, so the paths' random numbers don't depend on them
+      resampler.BeginFrame(cam, buffer->width, buffer->height);
+      tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
       {
-        // TODO: all the samples are uniform over the whole pixel. Try a stratisfied approach
-        Color col(0,0,0);
-        for (u32 i = 0; i < numSamples; ++i)
+        Tile tile = buffer->GetTile(tileIdx);
+        int tileWidth = tile.x1 - tile.x0;
+        vector<Ray> rays;
+        vector<float> meshT;
+        tileRays(tile, absPass, &rays, &meshT);
+        for (int y = tile.y0; y < tile.y1; ++y)
         {
-          // construct ray from eye pos through the image plane
-          Vector2 ofs = samples[(sampleIdx++) & 0xff];
-          Ray r(cam.frame.origin, Normalize((p + Vector3(ofs.x * xInc, ofs.y * yInc, 0)) - cam.frame.origin));
-
-          col += Radiance(r, 0);
+          for (int x = 0; x < tileWidth; ++x)
+          {
+            size_t i = (size_t)(y - tile.y0) * tileWidth + x;
+            SeedThreadRng(~acc->seed, (u32)(y * buffer->width + tile.x0 + x), absPass);
+            resampler.Sample(tile.x0 + x, y, FirstHit(rays[i], meshT[i]), lightBvh);
+          }
+        }
+      });
+      tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
+      {
+        Tile tile = buffer->GetTile(tileIdx);
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+          for (int x = tile.x0; x < tile.x1; ++x)
+          {
+            SeedThreadRng(~acc->seed, (u32)(y * buffer->width + x), absPass);
+            resampler.Reuse(x, y);
+          }
         }
+      });
+    }
 
-        *pp++ = col / (float)numSamples;
+    tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
+    {
+      if (acc->tilePasses[tileIdx] != pass)
+        return;
+
+      Tile tile = buffer->GetTile(tileIdx);
+      int tileWidth = tile.x1 - tile.x0;
+      vector<Ray> rays;
+      vector<float> meshT;
+      tileRays(tile, absPass, &rays, &meshT);
+
+      for (int y = tile.y0; y < tile.y1; ++y)
+      {
+        for (int x = 0; x < tileWidth; ++x)
+        {
+          size_t i = (size_t)(y - tile.y0) * tileWidth + x;
+          size_t idx = (size_t)y * buffer->width + tile.x0 + x;
+          SeedThreadRng(acc->seed, (u32)idx, absPass);
+          AovSample aov;
+          Color col = Radiance(rays[i],
+              0,
+              true,
+              &aov,
+              settings.resampleDirect ? &resampler.Final(tile.x0 + x, y) : nullptr,
+              &meshT[i]);
+          acc->AddSample(idx, col);
+          aov.sampleCount = acc->count[idx];
 
-        p.x += xInc;
+          if (aovs)
+            buffer->AddAovs(tile.x0 + x, y, aov, pass - startPasses[tileIdx] + 1);
+        }
       }
-    }
-  }
 
-  const Camera& cam;
-  Vector3 tmp;
-  float xInc, yInc;
-  Color* buffer;
-  Vector2* samples;
-  RenderSettings settings;
-  mutable u32 sampleIdx = 0;
-};
+      acc->tilePasses[tileIdx] = pass + 1;
+      acc->Resolve(tileIdx, buffer);
+      buffer->TileDone(tileIdx);
+    });
 
-//---------------------------------------------------------------------------
-void PathTrace(const Camera& cam, const RenderSettings& settings, Color* buffer)
-{
-  // Compute size of the image plane. This is the plane at distance d from the
-  // camera that we will shoot rays through (without AA, one ray per pixel).
-  // The size of the image plane depends on 'd' and the camera fov. For the y
-  // size, the aspect ratio also matters.
-  float halfWidth = cam.dist * tanf(cam.fov / 2);
-  float imagePlaneWidth = 2 * halfWidth;
-  float imagePlaneHeight = imagePlaneWidth * windowSize.y / windowSize.x;
-
-  float xInc = imagePlaneWidth / (windowSize.x - 1);
-  float yInc = -imagePlaneHeight / (windowSize.y - 1);
-
-  PoissonSampler sampler;
-  sampler.Init(256);
-  Vector2 samples[256];
-  for (int i = 0; i < 256; ++i)
-    samples[i] = sampler.NextSample();
-
-  // top left corner
-  Vector3 p(cam.frame.origin - halfWidth * cam.frame.right + imagePlaneHeight / 2 * cam.frame.up + cam.dist * cam.frame.dir);
-
-  tbb::parallel_for(tbb::blocked_range<int>(0, windowSize.y),
-    ScanlineRender(cam, p, xInc, yInc, buffer, settings, samples),
-    tbb::auto_partitioner());
+    if (guiding)
+      sdTree.EndPass();
+  }
 }
-#endif
\ No newline at end of file
@@ -2,7 +2,15 @@
 #include "pbr_math.hpp"
 #include "imgui/imgui.h"
 #include "imgui_impl_glfw.h"
-#include "mesh_loader.hpp"
+#include "mesh.hpp"
+#include "cluster.hpp"
+#include "kernel_table.hpp"
+#include "postprocess.hpp"
+#include "buffer.hpp"
+#include "display.hpp"
+#include "denoise.hpp"
+#include "image_io.hpp"
+#include "progressive.hpp"
 #include <stdio.h>
 #include "glfw3/GLFW/glfw3.h"
 
@@ -12,39 +20,39 @@ Vector2u windowSize;
 vector<Geo*> objects;
 vector<Geo*> emitters;
 
-void PathTrace(const Camera& cam, const RenderSettings& settings, Color* buffer);
-void RayTrace(const Camera& cam, Color* buffer);
+void PathTrace(const Camera& cam, const RenderSettings& settings, Accumulator* acc, u32 numPasses, Buffer* buffer);
+void RayTrace(const Camera& cam, Buffer* buffer);
+void RayTraceProgressive(const Camera& cam, Accumulator* acc, u32 numPasses, Buffer* buffer);
 
 int MAX_DEPTH = 3;
 
-// guess of average screen maximum brightness
-const float DISPLAY_LUMINANCE_MAX = 200.0f;
-
-// ITU-R BT.709 standard RGB luminance weighting
-const Vector3 RGB_LUMINANCE(0.2126f, 0.7152f, 0.0722f);
-
-// ITU-R BT.709 standard gamma
-const float GAMMA_ENCODE = 0.45f;
-
-struct Buffer
-{
-  Buffer(int width, int height) : width(width), height(height), buffer(new Color[width*height]) {}
-  ~Buffer() { delete [] buffer; }
-  Buffer(const Buffer&) = delete;
-  Buffer& operator=(Buffer&) = delete;
-
-  int width, height;
-  Color* buffer;
-};
-
 Buffer* backbuffer;
+Buffer* denoised;
+Buffer* aovView;
+Accumulator accumulator;
+Denoiser denoiser;
+AutoExposure autoExposure;
+DirtyTiles dirtyTiles;
+DisplayEncoder display;
 
-vector<IsectTri> tris;
+MeshScene meshScene;
+ClusterScene clusterScene;
+
+// memory budget for resident clusters in out-of-core mode
+const size_t CLUSTER_MEMORY_BUDGET = 512 * 1024 * 1024;
+const u32 MAX_TRIS_PER_CLUSTER = 4096;
 
 //---------------------------------------------------------------------------
 void Init()
 {
   backbuffer = new Buffer(windowSize.x, windowSize.y);
+  denoised = new Buffer(windowSize.x, windowSize.y);
+  aovView = new Buffer(windowSize.x, windowSize.y);
+  autoExposure.Init(*backbuffer);
+  dirtyTiles.Init(*backbuffer);
+  backbuffer->listeners.push_back(&autoExposure);
+  backbuffer->listeners.push_back(&dirtyTiles);
+  display.Init(backbuffer->width, backbuffer->height, GAMMA_ENCODE);
 
   float lumScale = 1.f;
   Color ballDiffuse(0.1f, 0.4f, 0.4f);
@@ -57,26 +65,23 @@ void Init()
   Color zero(0, 0, 0);
 
 #define LOAD_MESH 0
+#define OUT_OF_CORE 0
 
 #if LOAD_MESH
-  MeshLoader loader;
-  loader.Load("gfx/crystals_flat.boba");
-
-  for (const protocol::MeshBlob* meshBlob : loader.meshes)
+#if OUT_OF_CORE
+  // the page file only has to be built once, after that the scene is never loaded
+  // in full
+  const char* pageFile = "gfx/crystals_flat.clusters";
+  if (!clusterScene.Open(pageFile, CLUSTER_MEMORY_BUDGET))
   {
-    for (u32 i = 0; i < meshBlob->numIndices; i += 3)
-    {
-      u32 idx0 = meshBlob->indices[i + 0];
-      u32 idx1 = meshBlob->indices[i + 1];
-      u32 idx2 = meshBlob->indices[i + 2];
-
-      Vector3 p0 = { meshBlob->verts[idx0 * 3 + 0], meshBlob->verts[idx0 * 3 + 1], meshBlob->verts[idx0 * 3 + 2] };
-      Vector3 p1 = { meshBlob->verts[idx1 * 3 + 0], meshBlob->verts[idx1 * 3 + 1], meshBlob->verts[idx1 * 3 + 2] };
-      Vector3 p2 = { meshBlob->verts[idx2 * 3 + 0], meshBlob->verts[idx2 * 3 + 1], meshBlob->verts[idx2 * 3 + 2] };
-
-      tris.push_back({ p0, p1, p2 });
-    }
+    if (ClusterScene::Build("gfx/crystals_flat.boba", pageFile, MAX_TRIS_PER_CLUSTER))
+      clusterScene.Open(pageFile, CLUSTER_MEMORY_BUDGET);
   }
+#else
+  // returns once the top-level BVH is built, the meshes themselves are converted
+  // in the background and show up as they finish
+  meshScene.Init("gfx/crystals_flat.boba");
+#endif
 
 #else
 #if 1
@@ -119,6 +124,7 @@ void Init()
   Geo* plane = new Plane(Vector3(0, 1, 0), 0);
   plane->material = new Material(planeDiffuse, planeSpec, zero);
   objects.push_back(plane);
+  AssignIds(objects);
 
   for (Geo* g : objects)
   {
@@ -132,69 +138,44 @@ void Init()
 //---------------------------------------------------------------------------
 void Close()
 {
-  free(backbuffer);
+  delete backbuffer;
+  delete denoised;
+  delete aovView;
 }
 
 //---------------------------------------------------------------------------
-float CalculateToneMapping(Color* pixels)
+bool Intersect(const Ray& r, HitRec* hitRec)
 {
-  // calculate estimate of world-adaptation luminance
-  // as log mean luminance of scene
-  float eps = (float)(1e-4);
-  float adaptLuminance = eps;
-  u32 numPixels = windowSize.x * windowSize.y;
-  float sumOfLogs = 0.0;
-  for (u32 i = 0; i < numPixels; ++i)
+  bool hit = false;
+  for (Geo* obj : objects)
   {
-    const float Y = pixels[i].r * RGB_LUMINANCE.x + pixels[i].g * RGB_LUMINANCE.y + pixels[i].b * RGB_LUMINANCE.z;
-    // clamp luminance to a perceptual minimum
-    sumOfLogs += log10f(max(eps, Y));
+    hit |= obj->Intersect(r, hitRec);
   }
-
-  adaptLuminance = powf(10.0f, sumOfLogs / (float)numPixels);
-
-  // make scale-factor from:
-  // ratio of minimum visible differences in luminance, in display-adapted
-  // and world-adapted perception (discluding the constant that cancelled),
-  // divided by display max to yield a [0,1] range
-  const float a = 1.219f + powf(DISPLAY_LUMINANCE_MAX * 0.25f, 0.4f);
-  const float b = 1.219f + powf(adaptLuminance, 0.4f);
-
-  return powf(a / b, 2.5f) / DISPLAY_LUMINANCE_MAX;
+  return hit;
 }
 
 //---------------------------------------------------------------------------
-void BufferToTexture(Buffer* buffer, bool doToneMapping, u8* dest)
+bool IntersectMeshes(const Ray& r, float* t)
 {
-  vector<Color32> buf(windowSize.x * windowSize.y);
-  float toneMap = doToneMapping ? CalculateToneMapping(buffer->buffer) : 1;
-
-  Color* pp = buffer->buffer;
-  for (u32 y = 0; y < windowSize.y; ++y)
-  {
-    for (u32 x = 0; x < windowSize.x; ++x)
-    {
-      const Color &col = *pp++;
-      buf[y * windowSize.x + x].r = (u8)(Clamp(powf(col.r * toneMap, GAMMA_ENCODE)) * 255);
-      buf[y * windowSize.x + x].g = (u8)(Clamp(powf(col.g * toneMap, GAMMA_ENCODE)) * 255);
-      buf[y * windowSize.x + x].b = (u8)(Clamp(powf(col.b * toneMap, GAMMA_ENCODE)) * 255);
-      buf[y * windowSize.x + x].a = 255;
-    }
-  }
-
-  memcpy(dest, buf.data(), windowSize.x * windowSize.y * 4);
-//  texture->update((const sf::Uint8*)buf.data());
+#if OUT_OF_CORE
+  return clusterScene.IntersectClosest(r, t);
+#else
+  return meshScene.IntersectClosest(r, t);
+#endif
 }
 
 //---------------------------------------------------------------------------
-bool Intersect(const Ray& r, HitRec* hitRec)
+void IntersectMeshesBatch(const Ray* rays, u32 numRays, float* t)
 {
-  bool hit = false;
-  for (Geo* obj : objects)
+#if OUT_OF_CORE
+  clusterScene.IntersectBatch(rays, numRays, t);
+#else
+  for (u32 i = 0; i < numRays; ++i)
   {
-    hit |= obj->Intersect(r, hitRec);
+    if (!meshScene.IntersectClosest(rays[i], &t[i]))
+      t[i] = FLT_MAX;
   }
-  return hit;
+#endif
 }
 
 //---------------------------------------------------------------------------
@@ -216,30 +197,282 @@ bool IntersectClosest(const Ray& r, HitRec* hitRec)
   return closest != FLT_MAX;
 }
 
+//---------------------------------------------------------------------------
+void Denoise()
+{
+  denoiser.Run(*backbuffer, denoised);
+  // the denoised buffer isn't rendered a tile at a time, so it's all new
+  dirtyTiles.MarkAll();
+}
+
+//---------------------------------------------------------------------------
+void Render(const Camera& cam, const RenderSettings& settings)
+{
+  // the planes are only allocated for what's enabled, so the rest cost nothing
+  backbuffer->EnableAovs(settings.aovs | settings.aovView | (settings.denoise ? (u32)AOV_DENOISE_GUIDES : 0u));
+
+  if (settings.pathTrace)
+  {
+    // without a pass count, the passes start over on every render
+    if (settings.passes == 0)
+      accumulator.Init(*backbuffer, 0, 0, settings.variance);
+    PathTrace(cam, settings, &accumulator, settings.passes > 0 ? settings.passes : settings.numSamples, backbuffer);
+  }
+  else if (settings.passes > 0)
+    RayTraceProgressive(cam, &accumulator, settings.passes, backbuffer);
+  else
+    RayTrace(cam, backbuffer);
+  if (settings.denoise)
+    Denoise();
+  if (settings.aovView)
+  {
+    VisualizeAov(*backbuffer, settings.aovView, aovView);
+    dirtyTiles.MarkAll();
+  }
+}
+
+//---------------------------------------------------------------------------
+const char* FindArg(int argc, char** argv, const char* prefix)
+{
+  size_t prefixLen = strlen(prefix);
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], prefix, prefixLen) == 0)
+      return argv[i] + prefixLen;
+  }
+  return nullptr;
+}
+
+//---------------------------------------------------------------------------
+// what batch mode writes, any of them can be null
+struct OutputFiles
+{
+  const char* hdr = nullptr;
+  const char* ldr = nullptr;
+  const char* checkpoint = nullptr;
+  const char* film = nullptr;
+};
+
+//---------------------------------------------------------------------------
+bool WriteImages(const Buffer& buffer, const OutputFiles& files, float scale)
+{
+  bool ok = true;
+  if (files.hdr)
+  {
+    PfmWriter pfm;
+    ok &= pfm.Open(files.hdr, buffer.width, buffer.height);
+    pfm.WriteAll(buffer);
+    ok &= pfm.Close();
+  }
+
+  if (files.ldr)
+  {
+    GammaLut lut;
+    lut.Init(GAMMA_ENCODE);
+    ok &= WritePpm(files.ldr, buffer, scale, lut);
+  }
+
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+bool RenderToFile(const Camera& cam, const RenderSettings& settings, const OutputFiles& files)
+{
+  // a progressive render carries on from the checkpoint, if there is a usable one
+  Checkpointer checkpointer;
+  bool checkpoint = settings.passes > 0 && files.checkpoint;
+  if (settings.passes > 0)
+  {
+    accumulator.Init(*backbuffer, 0, settings.firstPass, settings.variance);
+    if (checkpoint)
+    {
+      checkpointer.interval = settings.checkpointInterval;
+      if (!checkpointer.Open(files.checkpoint, *backbuffer, &accumulator, true))
+      {
+        fprintf(stderr, "Unable to open %s\n", files.checkpoint);
+        return false;
+      }
+      if (checkpointer.numResumed > 0)
+        printf("Resuming %d tiles from %s\n", checkpointer.numResumed, files.checkpoint);
+      backbuffer->listeners.push_back(&checkpointer);
+    }
+  }
+
+  // the hdr image is written as the tiles finish, instead of after the render. The
+  // denoiser doesn't go through the tiles, so its output is written at the end
+  PfmWriter pfm;
+  bool streamHdr = files.hdr && !settings.denoise;
+  if (streamHdr)
+  {
+    if (!pfm.Open(files.hdr, backbuffer->width, backbuffer->height))
+    {
+      fprintf(stderr, "Unable to open %s\n", files.hdr);
+      return false;
+    }
+    backbuffer->listeners.push_back(&pfm);
+  }
+
+  Render(cam, settings);
+
+  bool ok = true;
+  if (streamHdr)
+  {
+    backbuffer->listeners.pop_back();
+    ok &= pfm.Close();
+  }
+
+  if (checkpoint)
+  {
+    backbuffer->listeners.pop_back();
+    ok &= checkpointer.Close();
+  }
+
+  if (settings.passes > 0 && files.film)
+    ok &= SaveFilm(files.film, accumulator);
+
+  OutputFiles images = files;
+  if (streamHdr)
+    images.hdr = nullptr;
+  float scale = settings.toneMapping ? autoExposure.Update(0, false) : 1;
+  ok &= WriteImages(settings.denoise ? *denoised : *backbuffer, images, scale);
+
+  if (!ok)
+    fprintf(stderr, "Error writing the output\n");
+  return ok;
+}
+
 //---------------------------------------------------------------------------
 static void error_callback(int error, const char* description)
 {
   fprintf(stderr, "Error %d: %s\n", error, description);
 }
 
-void UpdateTexture(GLuint& texture, const char* buf, int w, int h)
+//---------------------------------------------------------------------------
+void UpdateTexture(GLuint& texture, const DisplayEncoder& display, const Tile& rect)
 {
-  if (texture != 0){
+  if (texture != 0)
+  {
+    // only upload the rows and columns that changed
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, buf);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, display.width);
+    glTexSubImage2D(GL_TEXTURE_2D,
+        0,
+        rect.x0,
+        rect.y0,
+        rect.x1 - rect.x0,
+        rect.y1 - rect.y0,
+        GL_RGBA,
+        GL_UNSIGNED_BYTE,
+        display.pixels.data() + rect.y0 * display.width + rect.x0);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
   }
-  else {
+  else
+  {
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, 4, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, buf);
+    glTexImage2D(GL_TEXTURE_2D, 0, 4, display.width, display.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, display.pixels.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   }
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 }
 
 
-int main(int, char**)
+int main(int argc, char** argv)
 {
+  // pick the kernels for this cpu before anything uses them
+  SelectKernels(argc, argv);
+
+  Camera cam;
+  cam.fov = DegToRad(60);
+  cam.dist = 1;
+  cam.LookAt(Vector3(5, 5, -10), Vector3(0, 1, 0), Vector3(0, 0, 30));
+
+  // batch mode: render once to --output (pfm) and/or --output-ldr (ppm), without a
+  // window. --passes accumulates that many jittered passes, starting at --first-pass.
+  // With --checkpoint they're saved as they go, and picked up again if the job is
+  // restarted, and --film saves the sums so renders of other passes can be merged in.
+  // --path-trace uses the path tracer, with --samples= paths per pixel if there are no
+  // passes. Its --irradiance-cache and --path-guiding don't give the same samples
+  // again, so they can't be checkpointed or merged
+  OutputFiles files;
+  files.hdr = FindArg(argc, argv, "--output=");
+  files.ldr = FindArg(argc, argv, "--output-ldr=");
+  files.checkpoint = FindArg(argc, argv, "--checkpoint=");
+  files.film = FindArg(argc, argv, "--film=");
+  bool toneMapping = FindArg(argc, argv, "--tonemap") != nullptr;
+
+  // --merge: combine the films given as the other arguments into --film, and the images
+  if (FindArg(argc, argv, "--merge"))
+  {
+    vector<const char*> inputs;
+    for (int i = 1; i < argc; ++i)
+    {
+      if (strncmp(argv[i], "--", 2) != 0)
+        inputs.push_back(argv[i]);
+    }
+
+    Accumulator merged;
+    if (!MergeFilms(inputs, &merged))
+      return 1;
+
+    // exposed the same way as a single job, so merging doesn't change the image
+    Buffer buffer(merged.width, merged.height, merged.tileSize);
+    AutoExposure exposure;
+    exposure.Init(buffer);
+    for (int i = 0; i < buffer.NumTiles(); ++i)
+    {
+      merged.Resolve(i, &buffer);
+      exposure.TileDone(buffer, i);
+    }
+
+    float scale = toneMapping ? exposure.Update(0, false) : 1;
+    bool ok = WriteImages(buffer, files, scale);
+    if (files.film)
+      ok &= SaveFilm(files.film, merged);
+    return ok ? 0 : 1;
+  }
+
+  if (files.hdr || files.ldr || files.film)
+  {
+    windowSize = { 512, 512 };
+    Init();
+    RenderSettings settings;
+    settings.toneMapping = toneMapping;
+    settings.denoise = FindArg(argc, argv, "--denoise") != nullptr;
+    settings.variance = FindArg(argc, argv, "--variance") != nullptr;
+    settings.pathTrace = FindArg(argc, argv, "--path-trace") != nullptr;
+    if (const char* samples = FindArg(argc, argv, "--samples="))
+      settings.numSamples = atoi(samples);
+    settings.resampleDirect = FindArg(argc, argv, "--resample-direct") != nullptr;
+    settings.irradianceCache = FindArg(argc, argv, "--irradiance-cache") != nullptr;
+    settings.pathGuiding = FindArg(argc, argv, "--path-guiding") != nullptr;
+    if (const char* minDepth = FindArg(argc, argv, "--min-depth="))
+      settings.minDepth = atoi(minDepth);
+    if (const char* maxDepth = FindArg(argc, argv, "--max-depth="))
+      settings.maxDepth = atoi(maxDepth);
+    if (const char* passes = FindArg(argc, argv, "--passes="))
+      settings.passes = atoi(passes);
+    if (const char* firstPass = FindArg(argc, argv, "--first-pass="))
+      settings.firstPass = atoi(firstPass);
+    if (const char* interval = FindArg(argc, argv, "--checkpoint-interval="))
+      settings.checkpointInterval = (float)atof(interval);
+
+    // Which cache records exist depends on which threads got where first, and the
+    // guiding tree is learnt from all the passes before, and isn't saved. Either way a
+    // resumed or merged render wouldn't match the one it stands in for
+    if ((settings.irradianceCache || settings.pathGuiding) && (files.checkpoint || files.film))
+    {
+      fprintf(stderr, "%s can't be used with --checkpoint or --film\n",
+              settings.irradianceCache ? "--irradiance-cache" : "--path-guiding");
+      Close();
+      return 1;
+    }
+
+    bool ok = RenderToFile(cam, settings, files);
+    Close();
+    return ok ? 0 : 1;
+  }
+
   // Setup window
   glfwSetErrorCallback(error_callback);
   if (!glfwInit())
@@ -264,40 +497,63 @@ int main(int, char**)
 
   Init();
 
-  Camera cam;
-  cam.fov = DegToRad(60);
-  cam.dist = 1;
-  cam.LookAt(Vector3(5, 5, -10), Vector3(0, 1, 0), Vector3(0, 0, 30));
-
-  vector<u8> buf(windowSize.x*windowSize.y * 4, 0);
-  RayTrace(cam, backbuffer->buffer);
+  RenderSettings settings;
+  Render(cam, settings);
+  // index into the view combo, 0 is the image and the rest are AovFlags bits
+  int view = 0;
 
   //  RayTrace(cam);
   ImVec4 clear_color = ImColor(114, 144, 154);
 
-  RenderSettings settings;
-
   // Main loop
+  GLuint textureId = 0;
+  double lastTime = glfwGetTime();
   while (!glfwWindowShouldClose(window))
   {
-    vector<u8> buf(windowSize.x*windowSize.y * 4);
-    BufferToTexture(backbuffer, settings.toneMapping, buf.data());
-
-    GLuint textureId = 0;
-    UpdateTexture(textureId, (const char*)buf.data(), windowSize.x, windowSize.y);
+    double now = glfwGetTime();
+    float dt = (float)(now - lastTime);
+    lastTime = now;
+
+    // the exposure is kept up to date as tiles finish, so this doesn't scan the buffer,
+    // and only tiles that changed (or all of them, if the exposure did) get encoded
+    float toneMap = settings.toneMapping ? autoExposure.Update(dt, settings.adaptExposure) : 1;
+    Tile changed;
+    const Buffer* shown = settings.aovView ? aovView : settings.denoise ? denoised : backbuffer;
+    if (display.Update(*shown, &dirtyTiles, settings.aovView ? 1 : toneMap, &changed))
+      UpdateTexture(textureId, display, changed);
 
     glfwPollEvents();
     ImGui_ImplGlfw_NewFrame();
 
     ImGui::Begin("MangeTracer");
 
+    ImGui::Text("kernels: %s (%d wide)", IsaName(Kernels().isa), Kernels().width);
     ImGui::Checkbox("tonemapping", &settings.toneMapping);
-    ImGui::DragInt("samples", &settings.numSamples);
-    if (ImGui::Button("GO!"))
+    ImGui::Checkbox("exposure adaptation", &settings.adaptExposure);
+    if (ImGui::Checkbox("denoise", &settings.denoise))
     {
-      //PathTrace(cam, settings, backbuffer->buffer);
-      RayTrace(cam, backbuffer->buffer);
+      // the guides are only rendered while denoising is on
+      if (settings.denoise)
+        Render(cam, settings);
+      else
+        dirtyTiles.MarkAll();
     }
+    // the view needs its AOV, so switching re-renders
+    if (ImGui::Combo("view", &view, "image\0depth\0normal\0albedo\0material id\0object id\0sample count\0"))
+    {
+      settings.aovView = view ? 1u << (view - 1) : 0;
+      Render(cam, settings);
+      dirtyTiles.MarkAll();
+    }
+    ImGui::Checkbox("path tracer", &settings.pathTrace);
+    ImGui::DragInt("samples", &settings.numSamples);
+    ImGui::Checkbox("resampled direct light", &settings.resampleDirect);
+    ImGui::Checkbox("irradiance cache", &settings.irradianceCache);
+    ImGui::Checkbox("path guiding", &settings.pathGuiding);
+    ImGui::DragInt("min depth", &settings.minDepth, 1, 1, 64);
+    ImGui::DragInt("max depth", &settings.maxDepth, 1, 1, 64);
+    if (ImGui::Button("GO!"))
+      Render(cam, settings);
 
     ImGui::Image((ImTextureID)textureId, ImVec2((float)windowSize.x, (float)windowSize.y));
     ImGui::End();
@@ -311,6 +567,7 @@ int main(int, char**)
   }
 
   // Cleanup
+  glDeleteTextures(1, &textureId);
   ImGui_ImplGlfw_Shutdown();
   glfwTerminate();
 
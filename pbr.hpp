@@ -4,6 +4,41 @@
 struct RenderSettings
 {
   bool toneMapping = false;
+  // ease the exposure towards the target, instead of jumping to it
+  bool adaptExposure = false;
   int numSamples = 32;
+  // render with the path tracer instead of the ray tracer. Without passes it
+  // accumulates numSamples of them
+  bool pathTrace = false;
+  // path tracer: resample the first hits' direct light across pixels and frames,
+  // instead of sampling the light bvh at each
+  bool resampleDirect = false;
+  // path tracer: interpolate the first bounce's indirect diffuse light from an
+  // irradiance cache. The records depend on the threads' timing, so these renders
+  // can't be checkpointed or merged
+  bool irradianceCache = false;
+  // path tracer: learn the incoming light over the passes, and guide the diffuse
+  // bounces with it. The learnt tree isn't saved, so these renders can't be
+  // checkpointed or merged either
+  bool pathGuiding = false;
+  // path tracer: bounces before russian roulette can end a path, and the most a
+  // path can have
+  int minDepth = 3;
+  int maxDepth = 20;
+  // filter the image with the first hit guides once it's done
+  bool denoise = false;
+  // AovFlags to render, on top of any the denoiser needs
+  u32 aovs = 0;
+  // single AovFlags bit to show instead of the image, or 0
+  u32 aovView = 0;
+  // jittered passes to accumulate, one sample per pixel each. 0 renders a single
+  // sample through the pixel corners
+  int passes = 0;
+  // number of the first pass, for splitting a frame's passes over several jobs
+  int firstPass = 0;
+  // accumulate the squared samples too
+  bool variance = false;
+  // seconds between checkpoints of a progressive render
+  float checkpointInterval = 30;
 };
 
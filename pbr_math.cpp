@@ -1,9 +1,244 @@
 #include "pbr_math.hpp"
+#include "kernel_table.hpp"
+#include "warp.hpp"
 #include <algorithm>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
 using namespace std;
 
 namespace pbr
 {
+  namespace
+  {
+    const u32 POISSON_CACHE_MAGIC = 0x50534e50; // 'PNSP'
+    const u32 POISSON_CACHE_VERSION = 1;
+    const u64 POISSON_SEED = 0x9e3779b97f4a7c15ull;
+    // candidates tried around a point before it's retired
+    const int BRIDSON_CANDIDATES = 30;
+
+    std::mutex poissonCacheMutex;
+    map<u32, vector<Vector2>> poissonCache;
+
+    //---------------------------------------------------------------------------
+    void Shuffle(vector<Vector2>* v, Pcg32* rng)
+    {
+      for (size_t i = v->size(); i > 1; --i)
+        swap((*v)[i - 1], (*v)[rng->Next() % i]);
+    }
+
+    //---------------------------------------------------------------------------
+    // Copies count entries of a sample table to xs and ys, starting at *idx and
+    // wrapping around, and advances *idx. Copies whole runs up to the end of the
+    // table, so there's no modulo per sample.
+    void CopySamples(const vector<Vector2>& table, u32* idx, u32 count, float* xs, float* ys)
+    {
+      u32 size = (u32)table.size();
+      assert(size > 0);
+      u32 i = *idx;
+      while (count > 0)
+      {
+        u32 run = min(count, size - i);
+        const Vector2* src = table.data() + i;
+        for (u32 j = 0; j < run; ++j)
+        {
+          xs[j] = src[j].x;
+          ys[j] = src[j].y;
+        }
+        xs += run;
+        ys += run;
+        count -= run;
+        i += run;
+        if (i == size)
+          i = 0;
+      }
+      *idx = i;
+    }
+
+    //---------------------------------------------------------------------------
+    float TorusDistSq(const Vector2& a, const Vector2& b)
+    {
+      float dx = fabsf(a.x - b.x);
+      float dy = fabsf(a.y - b.y);
+      dx = min(dx, 1 - dx);
+      dy = min(dy, 1 - dy);
+      return dx * dx + dy * dy;
+    }
+
+    //---------------------------------------------------------------------------
+    // Bridson, "Fast Poisson disk sampling in arbitrary dimensions" (2007). Points
+    // in [0, 1) at least radius apart, on a torus so the set tiles without seams.
+    // The background grid has at most one point per cell, so each candidate only
+    // checks a fixed neighbourhood and the whole thing is linear in the point count.
+    void BridsonPoisson(float radius, Pcg32* rng, vector<Vector2>* points)
+    {
+      int gridSize = max(1, (int)ceilf(sqrtf(2.f) / radius));
+      int span = (int)ceilf(radius * gridSize);
+      vector<int> grid(gridSize * gridSize, -1);
+      vector<int> active;
+      points->clear();
+
+      auto cellIdx = [&](const Vector2& p)
+      {
+        int x = min((int)(p.x * gridSize), gridSize - 1);
+        int y = min((int)(p.y * gridSize), gridSize - 1);
+        return x + y * gridSize;
+      };
+
+      auto addPoint = [&](const Vector2& p)
+      {
+        grid[cellIdx(p)] = (int)points->size();
+        active.push_back((int)points->size());
+        points->push_back(p);
+      };
+
+      auto isFree = [&](const Vector2& p)
+      {
+        int cx = min((int)(p.x * gridSize), gridSize - 1);
+        int cy = min((int)(p.y * gridSize), gridSize - 1);
+        for (int y = cy - span; y <= cy + span; ++y)
+        {
+          int wy = (y + gridSize) % gridSize;
+          for (int x = cx - span; x <= cx + span; ++x)
+          {
+            int other = grid[(x + gridSize) % gridSize + wy * gridSize];
+            if (other != -1 && TorusDistSq(p, (*points)[other]) < radius * radius)
+              return false;
+          }
+        }
+        return true;
+      };
+
+      addPoint(Vector2(rng->NextFloat(), rng->NextFloat()));
+      while (!active.empty())
+      {
+        u32 i = rng->Next() % active.size();
+        Vector2 p = (*points)[active[i]];
+
+        bool found = false;
+        for (int k = 0; k < BRIDSON_CANDIDATES && !found; ++k)
+        {
+          // uniform over the annulus between radius and 2 * radius
+          float r = radius * sqrtf(1 + 3 * rng->NextFloat());
+          float phi = 2 * Pi * rng->NextFloat();
+          float x = p.x + r * cosf(phi);
+          float y = p.y + r * sinf(phi);
+          Vector2 c(x - floorf(x), y - floorf(y));
+          // floor can round up to 1 for tiny negative values
+          c.x = c.x < 1 ? c.x : 0;
+          c.y = c.y < 1 ? c.y : 0;
+
+          if (isFree(c))
+          {
+            addPoint(c);
+            found = true;
+          }
+        }
+
+        if (!found)
+        {
+          active[i] = active.back();
+          active.pop_back();
+        }
+      }
+    }
+
+    //---------------------------------------------------------------------------
+    // exactly numSamples poisson points in [-1, 1]
+    void GeneratePoisson(u32 numSamples, vector<Vector2>* samples)
+    {
+      Pcg32 rng(POISSON_SEED, numSamples);
+
+      // Bridson fills the square until no more points fit, which for a given radius
+      // gives about DENSITY / radius^2 points. Estimate the radius from that, and
+      // shrink it until there are enough, then drop the extras at random. Each try
+      // shrinks the radius by at least 1%, so it always gets there
+      float density = 0.7f;
+      vector<Vector2> points;
+      while (numSamples > 0)
+      {
+        float radius = sqrtf(density / numSamples);
+        BridsonPoisson(radius, &rng, &points);
+        if (points.size() >= numSamples)
+          break;
+        density = min(0.98f * points.size() * radius * radius, 0.98f * density);
+      }
+
+      Shuffle(&points, &rng);
+      points.resize(numSamples);
+
+      samples->resize(points.size());
+      for (size_t i = 0; i < points.size(); ++i)
+        (*samples)[i] = Vector2(2 * points[i].x - 1, 2 * points[i].y - 1);
+    }
+
+    //---------------------------------------------------------------------------
+    // The tables are only kept on disk if PBR_CACHE_DIR is set. Returns an empty
+    // string if it isn't
+    string PoissonCacheFile(u32 numSamples)
+    {
+      const char* dir = getenv("PBR_CACHE_DIR");
+      if (!dir || !*dir)
+        return string();
+      char name[64];
+      sprintf(name, "poisson_%u.bin", numSamples);
+      return string(dir) + "/" + name;
+    }
+
+    //---------------------------------------------------------------------------
+    bool LoadPoissonCache(u32 numSamples, vector<Vector2>* samples)
+    {
+      string filename = PoissonCacheFile(numSamples);
+      FILE* f = filename.empty() ? nullptr : fopen(filename.c_str(), "rb");
+      if (!f)
+        return false;
+
+      u32 header[3];
+      bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == POISSON_CACHE_MAGIC
+                && header[1] == POISSON_CACHE_VERSION && header[2] == numSamples;
+      if (ok)
+      {
+        samples->resize(header[2]);
+        ok = fread(samples->data(), sizeof(Vector2), samples->size(), f) == samples->size();
+      }
+      fclose(f);
+      return ok;
+    }
+
+    //---------------------------------------------------------------------------
+    void SavePoissonCache(u32 numSamples, const vector<Vector2>& samples)
+    {
+      string filename = PoissonCacheFile(numSamples);
+      if (filename.empty())
+        return;
+
+      const char* dir = getenv("PBR_CACHE_DIR");
+#ifdef _WIN32
+      _mkdir(dir);
+#else
+      mkdir(dir, 0755);
+#endif
+
+      // write to a temp file and rename it, so a reader never sees half a table
+      string tmp = filename + ".tmp";
+      FILE* f = fopen(tmp.c_str(), "wb");
+      if (!f)
+        return;
+
+      u32 header[3] = {POISSON_CACHE_MAGIC, POISSON_CACHE_VERSION, (u32)samples.size()};
+      bool ok = fwrite(header, sizeof(header), 1, f) == 1
+                && fwrite(samples.data(), sizeof(Vector2), samples.size(), f) == samples.size();
+      ok &= fclose(f) == 0;
+      if (ok)
+      {
+        remove(filename.c_str());
+        ok = rename(tmp.c_str(), filename.c_str()) == 0;
+      }
+      if (!ok)
+        remove(tmp.c_str());
+    }
+  }
+
   //---------------------------------------------------------------------------
   void Camera::LookAt(const Vector3& pos, const Vector3& up, const Vector3& target)
   {
@@ -44,18 +279,45 @@ namespace pbr
   }
 
   //---------------------------------------------------------------------------
-  Vector3 RayInHemisphere(const Vector3& n)
+  Pcg32& ThreadRng()
+  {
+    static thread_local Pcg32 rng;
+    return rng;
+  }
+
+  //---------------------------------------------------------------------------
+  void SeedThreadRng(u64 seed, u32 pixel, u32 pass)
   {
-    while (true)
+    ThreadRng().Seed(MixBits(seed ^ MixBits(((u64)pass << 32) | pixel)), pixel);
+  }
+
+  //---------------------------------------------------------------------------
+  void AssignIds(const vector<Geo*>& objects)
+  {
+    // materials can be shared, so they get the id of the first object using them
+    vector<Material*> materials;
+    for (size_t i = 0; i < objects.size(); ++i)
     {
-      float x = -1 + 2 * Randf();
-      float y = -1 + 2 * Randf();
-      float z = -1 + 2 * Randf();
-      if (Sq(x) + Sq(y) + Sq(z) < 1)
-        return Faceforward(Normalize(Vector3(x, y, z)), n);
+      Geo* g = objects[i];
+      g->id = (u32)i;
+      if (!g->material)
+        continue;
+
+      auto it = find(materials.begin(), materials.end(), g->material);
+      if (it == materials.end())
+      {
+        g->material->id = (u32)materials.size();
+        materials.push_back(g->material);
+      }
     }
   }
 
+  //---------------------------------------------------------------------------
+  Vector3 RayInHemisphere(const Vector3& n)
+  {
+    return Faceforward(UniformSphere(Randf2()), n);
+  }
+
   //---------------------------------------------------------------------------
   bool Sphere::Intersect(const Ray& ray, HitRec* rec)
   {
@@ -114,51 +376,97 @@ namespace pbr
   }
 
   //---------------------------------------------------------------------------
-  Vector2 RandomSampler::NextSample() { return Vector2(randf(-1.f, 1.f), randf(-1.f, 1.f)); }
+  void Sampler::NextSamples(u32 count, float* xs, float* ys)
+  {
+    for (u32 i = 0; i < count; ++i)
+    {
+      Vector2 s = NextSample();
+      xs[i] = s.x;
+      ys[i] = s.y;
+    }
+  }
 
   //---------------------------------------------------------------------------
-  Vector2 RandomSampler::NextDiskSample()
+  void Sampler::NextDiskSamples(u32 count, float* xs, float* ys)
   {
-    while (true)
+    for (u32 i = 0; i < count; ++i)
     {
-      Vector2 v(randf(-1.f, 1.f), randf(-1.f, 1.f));
-      float r = v.Length();
-      if (r <= 1.f)
-        return v;
+      Vector2 s = NextDiskSample();
+      xs[i] = s.x;
+      ys[i] = s.y;
     }
   }
 
   //---------------------------------------------------------------------------
-  UniformSampler::UniformSampler() : _idx(0) {}
+  Vector2 RandomSampler::NextSample()
+  {
+    float x = 2 * Randf() - 1;
+    float y = 2 * Randf() - 1;
+    return Vector2(x, y);
+  }
 
-  void UniformSampler::Init(u32 numSamples)
+  //---------------------------------------------------------------------------
+  Vector2 RandomSampler::NextDiskSample() { return ConcentricDisk(Randf2()); }
+
+  //---------------------------------------------------------------------------
+  void RandomSampler::NextSamples(u32 count, float* xs, float* ys)
+  {
+    Pcg32& rng = ThreadRng();
+    for (u32 i = 0; i < count; ++i)
+    {
+      xs[i] = 2 * rng.NextFloat() - 1;
+      ys[i] = 2 * rng.NextFloat() - 1;
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  void RandomSampler::NextDiskSamples(u32 count, float* xs, float* ys)
   {
-    int s = (int)sqrt(numSamples);
+    Pcg32& rng = ThreadRng();
+    for (u32 i = 0; i < count; ++i)
+    {
+      xs[i] = rng.NextFloat();
+      ys[i] = rng.NextFloat();
+    }
+    // warped in place
+    Kernels().warpBatch(Warp::ConcentricDisk, 0, xs, ys, (int)count, xs, ys, nullptr);
+  }
 
-    float y = -1.f;
-    float inc = 2.f / s;
-    int idx = 0;
-    _samples.resize(numSamples);
+  //---------------------------------------------------------------------------
+  UniformSampler::UniformSampler() : _idx(0) {}
 
-    for (int i = 0; i < s; ++i)
+  void UniformSampler::Init(u32 numSamples)
+  {
+    // a square grid when numSamples is a square. Otherwise the samples are spread
+    // over the rows as evenly as possible, so none are left over
+    u32 rows = max(1u, (u32)(sqrtf((float)numSamples) + 0.5f));
+    _samples.clear();
+    _samples.reserve(numSamples);
+    _idx = 0;
+
+    for (u32 i = 0; i < rows; ++i)
     {
-      float x = -1.f;
-      for (int j = 0; j < s; ++j)
-      {
-        _samples[idx++] = Vector2(x, y);
-        x += inc;
-      }
-      y += inc;
+      u32 cols = (u32)(((u64)(i + 1) * numSamples) / rows - ((u64)i * numSamples) / rows);
+      float y = -1.f + i * 2.f / rows;
+      for (u32 j = 0; j < cols; ++j)
+        _samples.push_back(Vector2(-1.f + j * 2.f / cols, y));
     }
   }
 
   Vector2 UniformSampler::NextSample()
   {
     u32 tmp = _idx;
-    _idx = (_idx + 1) % (u32)_samples.size();
+    if (++_idx == _samples.size())
+      _idx = 0;
     return _samples[tmp];
   }
 
+  //---------------------------------------------------------------------------
+  void UniformSampler::NextSamples(u32 count, float* xs, float* ys)
+  {
+    CopySamples(_samples, &_idx, count, xs, ys);
+  }
+
   Vector2 UniformSampler::NextDiskSample() { return Vector2(0, 0); }
 
   //---------------------------------------------------------------------------
@@ -167,48 +475,39 @@ namespace pbr
   //---------------------------------------------------------------------------
   void PoissonSampler::Init(u32 numSamples)
   {
-    s64 subCellsX = numSamples * 4;
-    s64 subCellsY = numSamples * 4;
-
-    // 2d space is divided into sqrt(numSamples) grid cells, and each grid cell further
-    // divided into 4x4 cells
-    vector<float> d(subCellsX * subCellsY);
-
-    for (s64 i = 1; i < subCellsY; ++i)
+    // the tables only depend on the count, so they're generated once per process,
+    // and kept on disk between runs if there's a PBR_CACHE_DIR
     {
-      for (s64 j = 1; j < subCellsX; ++j)
+      std::lock_guard<std::mutex> lock(poissonCacheMutex);
+      auto it = poissonCache.find(numSamples);
+      if (it == poissonCache.end())
       {
-        // calc T value for current cell
-        float t = (4 * d[(j - 1) + (i)*subCellsX] + d[(j - 1) + (i - 1) * subCellsX]
-                      + 2 * d[(j) + (i - 1) * subCellsX]
-                      + d[(j + 1) + (i - 1) * subCellsX])
-                  / 8;
-        t += randf(1.f / 16 - 1.f / 64, 1.f / 16 + 1.f / 64);
-
-        // determine if the current cell should have a pixel
-        float s = t < 0.5f ? 0.f : 1.f;
-        d[j + i * subCellsX] = t - s;
-
-        if (s > 0)
+        vector<Vector2> samples;
+        if (!LoadPoissonCache(numSamples, &samples))
         {
-          float x = -1 + 2 * ((j - 1) / (float)(subCellsX - 2));
-          float y = -1 + 2 * ((i - 1) / (float)(subCellsY - 2));
-          _samples.push_back({x, y});
+          GeneratePoisson(numSamples, &samples);
+          SavePoissonCache(numSamples, samples);
         }
+        it = poissonCache.insert(make_pair(numSamples, samples)).first;
       }
+      _samples = it->second;
     }
 
-    random_shuffle(_samples.begin(), _samples.end());
+    _idx = 0;
+    _idxDisk = 0;
     MapSamplesToUnitDisk();
   }
 
   //---------------------------------------------------------------------------
   void PoissonSampler::MapSamplesToUnitDisk()
   {
-    // from "Ray Tracing from the Ground Up", page 123
-    for (u32 i = 0; i < _diskSamples.size(); ++i)
+    // from "Ray Tracing from the Ground Up", page 123. The samples are already in
+    // [-1, 1]
+    _diskSamples.clear();
+    _diskSamples.reserve(_samples.size());
+    for (u32 i = 0; i < _samples.size(); ++i)
     {
-      Vector2 s = 2.f * _samples[i] - Vector2(-1, -1);
+      const Vector2& s = _samples[i];
       float r, phi;
 
       if (s.x > -s.y)
@@ -242,7 +541,9 @@ namespace pbr
       _diskSamples.push_back({r * cosf(phi), r * sinf(phi)});
     }
 
-    random_shuffle(_diskSamples.begin(), _diskSamples.end());
+    // in a different order, so the square and disk sequences aren't correlated
+    Pcg32 rng(POISSON_SEED, _diskSamples.size());
+    Shuffle(&_diskSamples, &rng);
   }
 
   //---------------------------------------------------------------------------
@@ -250,7 +551,7 @@ namespace pbr
   {
     // todo: make this thread safe
     u32 tmp = _idx;
-    _idx = (_idx + 1) % _samples.size();
+    _idx = tmp + 1 == _samples.size() ? 0 : tmp + 1;
     return _samples[tmp];
   }
 
@@ -258,46 +559,73 @@ namespace pbr
   Vector2 PoissonSampler::NextDiskSample()
   {
     u32 tmp = _idxDisk;
-    _idxDisk = (_idxDisk + 1) % _diskSamples.size();
+    if (++_idxDisk == _diskSamples.size())
+      _idxDisk = 0;
     return _diskSamples[tmp];
   }
 
   //---------------------------------------------------------------------------
-  bool RayTriIntersect(const Ray& ray, const IsectTri& tri, float* t, float* u, float* v)
+  void PoissonSampler::NextSamples(u32 count, float* xs, float* ys)
   {
-    // Moller/Trombore
+    u32 idx = _idx;
+    CopySamples(_samples, &idx, count, xs, ys);
+    _idx = idx;
+  }
 
-    const float eps = -1.e5;
+  //---------------------------------------------------------------------------
+  void PoissonSampler::NextDiskSamples(u32 count, float* xs, float* ys)
+  {
+    CopySamples(_diskSamples, &_idxDisk, count, xs, ys);
+  }
 
-    const Vector3& d = ray.d;
-    const Vector3& o = ray.o;
+  namespace
+  {
+    //---------------------------------------------------------------------------
+    bool RayTriIntersectEdges(const Ray& ray, const Vector3& p0, const Vector3& e1, const Vector3& e2, float* t, float* u, float* v)
+    {
+      // Moller/Trombore
 
-    Vector3 e1 = tri.p1 - tri.p0;
-    Vector3 e2 = tri.p2 - tri.p0;
+      const float eps = 1.e-8f;
 
-    // note, this can be written as e1 . (rd x e2 ) = rd . (e2 x e1), so we
-    // can precompute the cross product
-    Vector3 q = Cross(d, e2);
-    float a = Dot(e1, q);
+      const Vector3& d = ray.d;
+      const Vector3& o = ray.o;
 
-    if (fabs(a) <= eps)
-      return false;
+      // note, this can be written as e1 . (rd x e2 ) = rd . (e2 x e1), so we
+      // can precompute the cross product
+      Vector3 q = Cross(d, e2);
+      float a = Dot(e1, q);
 
-    float f = 1 / a;
-    Vector3 s = o - tri.p0;
+      if (fabs(a) <= eps)
+        return false;
 
-    *u = f * Dot(s, q);
-    if (*u < 0.f)
-      return false;
+      float f = 1 / a;
+      Vector3 s = o - p0;
+
+      *u = f * Dot(s, q);
+      if (*u < 0.f)
+        return false;
 
-    Vector3 r = Cross(s, e1);
+      Vector3 r = Cross(s, e1);
 
-    *v = f * Dot(d, r);
-    if (*v < 0.f || *u + *v > 1.f)
-      return false;
+      *v = f * Dot(d, r);
+      if (*v < 0.f || *u + *v > 1.f)
+        return false;
 
-    *t = f * Dot(e2, r);
+      *t = f * Dot(e2, r);
 
-    return true;
+      return true;
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  bool RayTriIntersect(const Ray& ray, const IsectTri& tri, float* t, float* u, float* v)
+  {
+    return RayTriIntersectEdges(ray, tri.p0, tri.p1 - tri.p0, tri.p2 - tri.p0, t, u, v);
+  }
+
+  //---------------------------------------------------------------------------
+  bool RayTriIntersect(const Ray& ray, const IsectTriPre& tri, float* t, float* u, float* v)
+  {
+    return RayTriIntersectEdges(ray, Vector3(tri.p0), Vector3(tri.e1), Vector3(tri.e2), t, u, v);
   }
 }
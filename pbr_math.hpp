@@ -4,6 +4,24 @@
 #include <atomic>
 #include "precompiled.hpp"
 
+// Vector3 and Vector4 are backed by SSE or NEON registers when available. Build
+// with PBR_SIMD=0 to use the scalar reference implementation instead.
+#ifndef PBR_SIMD
+#define PBR_SIMD 1
+#endif
+
+#if PBR_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define PBR_SIMD_SSE 1
+#define PBR_SIMD_VECTORS 1
+#elif PBR_SIMD && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define PBR_SIMD_NEON 1
+#define PBR_SIMD_VECTORS 1
+#else
+#define PBR_SIMD_VECTORS 0
+#endif
+
 namespace pbr
 {
   // Note, uses left-handed coordinate system
@@ -80,6 +98,280 @@ namespace pbr
 
   inline Vector2 operator*(float f, const Vector2& v) { return v * f; }
 
+#if PBR_SIMD_VECTORS
+  //---------------------------------------------------------------------------
+  // 4-wide float helpers used by the SIMD backed vector types. Vector3 keeps its
+  // w lane at 0, but nothing here relies on it.
+  namespace simd
+  {
+#if PBR_SIMD_SSE
+    typedef __m128 Vec4f;
+
+    inline Vec4f Set(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+    inline Vec4f Splat(float f) { return _mm_set1_ps(f); }
+    inline Vec4f Add(Vec4f a, Vec4f b) { return _mm_add_ps(a, b); }
+    inline Vec4f Sub(Vec4f a, Vec4f b) { return _mm_sub_ps(a, b); }
+    inline Vec4f Mul(Vec4f a, Vec4f b) { return _mm_mul_ps(a, b); }
+    inline Vec4f Min(Vec4f a, Vec4f b) { return _mm_min_ps(a, b); }
+    inline Vec4f Max(Vec4f a, Vec4f b) { return _mm_max_ps(a, b); }
+    inline Vec4f Neg(Vec4f a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+
+    // 1 / f, or 0 if f is 0
+    inline Vec4f SafeRcp(float f)
+    {
+      __m128 ff = _mm_set_ss(f);
+      __m128 r = _mm_and_ps(_mm_div_ss(_mm_set_ss(1.f), ff), _mm_cmpneq_ss(ff, _mm_setzero_ps()));
+      return _mm_shuffle_ps(r, r, 0);
+    }
+
+    inline float Dot3(Vec4f a, Vec4f b)
+    {
+      __m128 m = _mm_mul_ps(a, b);
+      __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+      __m128 z = _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+      return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+    }
+
+    inline Vec4f Cross3(Vec4f a, Vec4f b)
+    {
+      __m128 aYzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+      __m128 bYzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+      __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYzx), _mm_mul_ps(aYzx, b));
+      return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+    }
+
+    // 1 / sqrt(f) from the hardware estimate plus one Newton-Raphson step, or 0 if f is 0
+    inline Vec4f SafeRsqrt(float f)
+    {
+      __m128 ff = _mm_set_ss(f);
+      __m128 r = _mm_rsqrt_ss(ff);
+      __m128 rr = _mm_mul_ss(_mm_mul_ss(ff, r), r);
+      r = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), r), _mm_sub_ss(_mm_set_ss(3.f), rr));
+      r = _mm_and_ps(r, _mm_cmpgt_ss(ff, _mm_setzero_ps()));
+      return _mm_shuffle_ps(r, r, 0);
+    }
+
+    inline bool HasNaNs(Vec4f a, int mask) { return (_mm_movemask_ps(_mm_cmpunord_ps(a, a)) & mask) != 0; }
+#else
+    typedef float32x4_t Vec4f;
+
+    inline Vec4f Set(float x, float y, float z, float w)
+    {
+      float tmp[4] = { x, y, z, w };
+      return vld1q_f32(tmp);
+    }
+    inline Vec4f Splat(float f) { return vdupq_n_f32(f); }
+    inline Vec4f Add(Vec4f a, Vec4f b) { return vaddq_f32(a, b); }
+    inline Vec4f Sub(Vec4f a, Vec4f b) { return vsubq_f32(a, b); }
+    inline Vec4f Mul(Vec4f a, Vec4f b) { return vmulq_f32(a, b); }
+    inline Vec4f Min(Vec4f a, Vec4f b) { return vminq_f32(a, b); }
+    inline Vec4f Max(Vec4f a, Vec4f b) { return vmaxq_f32(a, b); }
+    inline Vec4f Neg(Vec4f a) { return vnegq_f32(a); }
+
+    inline Vec4f SafeRcp(float f) { return vdupq_n_f32(f != 0 ? 1 / f : 0); }
+
+    inline float Dot3(Vec4f a, Vec4f b)
+    {
+      float32x4_t m = vmulq_f32(a, b);
+      return vgetq_lane_f32(m, 0) + vgetq_lane_f32(m, 1) + vgetq_lane_f32(m, 2);
+    }
+
+    inline Vec4f Cross3(Vec4f a, Vec4f b)
+    {
+      float l[4], r[4];
+      vst1q_f32(l, a);
+      vst1q_f32(r, b);
+      return Set(l[1] * r[2] - l[2] * r[1], l[2] * r[0] - l[0] * r[2], l[0] * r[1] - l[1] * r[0], 0);
+    }
+
+    inline Vec4f SafeRsqrt(float f)
+    {
+      float32x2_t ff = vdup_n_f32(f);
+      float32x2_t r = vrsqrte_f32(ff);
+      r = vmul_f32(r, vrsqrts_f32(vmul_f32(ff, r), r));
+      return vdupq_n_f32(f > 0 ? vget_lane_f32(r, 0) : 0);
+    }
+
+    inline bool HasNaNs(Vec4f a, int mask)
+    {
+      float tmp[4];
+      vst1q_f32(tmp, a);
+      for (int i = 0; i < 4; ++i)
+      {
+        if ((mask & (1 << i)) && isnan(tmp[i]))
+          return true;
+      }
+      return false;
+    }
+#endif
+  }
+
+  //---------------------------------------------------------------------------
+  struct Vector3
+  {
+    Vector3() {}
+    Vector3(float x, float y, float z) : v(simd::Set(x, y, z, 0)) { assert(!HasNaNs()); }
+    explicit Vector3(simd::Vec4f v) : v(v) {}
+
+    float operator[](int i) const
+    {
+      assert(i >= 0 && i < 3);
+      return (&x)[i];
+    }
+    float& operator[](int i)
+    {
+      assert(i >= 0 && i < 3);
+      return (&x)[i];
+    }
+
+    Vector3 operator+(const Vector3& rhs) const { return Vector3(simd::Add(v, rhs.v)); }
+    Vector3& operator+=(const Vector3& rhs)
+    {
+      v = simd::Add(v, rhs.v);
+      return *this;
+    }
+
+    Vector3 operator-(const Vector3& rhs) const { return Vector3(simd::Sub(v, rhs.v)); }
+    Vector3& operator-=(const Vector3& rhs)
+    {
+      v = simd::Sub(v, rhs.v);
+      return *this;
+    }
+
+    Vector3 operator*(float f) const { return Vector3(simd::Mul(v, simd::Splat(f))); }
+    Vector3& operator*=(float f)
+    {
+      v = simd::Mul(v, simd::Splat(f));
+      return *this;
+    }
+
+    Vector3 operator/(float f) const { return Vector3(simd::Mul(v, simd::SafeRcp(f))); }
+    Vector3& operator/=(float f)
+    {
+      v = simd::Mul(v, simd::SafeRcp(f));
+      return *this;
+    }
+
+    Vector3 operator-() const { return Vector3(simd::Neg(v)); }
+
+    float LengthSquared() const { return simd::Dot3(v, v); }
+    float Length() const { return sqrtf(LengthSquared()); }
+
+    bool HasNaNs() const { return simd::HasNaNs(v, 7); }
+    float Max() const;
+    union
+    {
+      simd::Vec4f v;
+      struct
+      {
+        float x, y, z, w;
+      };
+    };
+  };
+
+  //---------------------------------------------------------------------------
+  inline Vector3 operator*(float f, const Vector3& v) { return v * f; }
+
+  inline float Dot(const Vector3& lhs, const Vector3& rhs) { return simd::Dot3(lhs.v, rhs.v); }
+
+  inline Vector3 Cross(const Vector3& lhs, const Vector3& rhs)
+  {
+    return Vector3(simd::Cross3(lhs.v, rhs.v));
+  }
+
+  inline Vector3 Min(const Vector3& lhs, const Vector3& rhs)
+  {
+    return Vector3(simd::Min(lhs.v, rhs.v));
+  }
+
+  inline Vector3 Max(const Vector3& lhs, const Vector3& rhs)
+  {
+    return Vector3(simd::Max(lhs.v, rhs.v));
+  }
+
+  inline float Sq(float x) { return x * x; }
+
+  inline Vector3 Normalize(const Vector3& v)
+  {
+    return Vector3(simd::Mul(v.v, simd::SafeRsqrt(v.LengthSquared())));
+  }
+
+  //---------------------------------------------------------------------------
+  struct Vector4
+  {
+    Vector4() {}
+    Vector4(float x, float y, float z, float w = 1) : v(simd::Set(x, y, z, w)) { assert(!HasNaNs()); }
+    Vector4(const Vector3& v, float w) : v(simd::Set(v.x, v.y, v.z, w)) { assert(!HasNaNs()); }
+    explicit Vector4(simd::Vec4f v) : v(v) {}
+
+    float operator[](int i) const
+    {
+      assert(i >= 0 && i < 4);
+      return (&x)[i];
+    }
+    float& operator[](int i)
+    {
+      assert(i >= 0 && i < 4);
+      return (&x)[i];
+    }
+
+    Vector4 operator+(const Vector4& rhs) const { return Vector4(simd::Add(v, rhs.v)); }
+    Vector4& operator+=(const Vector4& rhs)
+    {
+      v = simd::Add(v, rhs.v);
+      return *this;
+    }
+
+    Vector4 operator-(const Vector4& rhs) const { return Vector4(simd::Sub(v, rhs.v)); }
+    Vector4& operator-=(const Vector4& rhs)
+    {
+      v = simd::Sub(v, rhs.v);
+      return *this;
+    }
+
+    Vector4 operator*(float f) const { return Vector4(simd::Mul(v, simd::Splat(f))); }
+    Vector4& operator*=(float f)
+    {
+      v = simd::Mul(v, simd::Splat(f));
+      return *this;
+    }
+
+    Vector4 operator/(float f) const { return Vector4(simd::Mul(v, simd::SafeRcp(f))); }
+    Vector4& operator/=(float f)
+    {
+      v = simd::Mul(v, simd::SafeRcp(f));
+      return *this;
+    }
+
+    bool HasNaNs() const { return simd::HasNaNs(v, 15); }
+    float Max() const;
+    float Max3() const;
+    union
+    {
+      simd::Vec4f v;
+      struct
+      {
+        float x;
+        float y;
+        float z;
+        float w;
+      };
+      struct
+      {
+        float r;
+        float g;
+        float b;
+        float a;
+      };
+    };
+  };
+
+  inline Vector4 operator*(float f, const Vector4& v) { return v * f; }
+  inline Vector4 operator*(const Vector4& lhs, const Vector4& rhs)
+  {
+    return Vector4(simd::Mul(lhs.v, rhs.v));
+  }
+#else
   //---------------------------------------------------------------------------
   struct Vector3
   {
@@ -88,12 +380,12 @@ namespace pbr
 
     float operator[](int i) const
     {
-      assert(i >= 0 && i < 2);
+      assert(i >= 0 && i < 3);
       return (&x)[i];
     }
     float& operator[](int i)
     {
-      assert(i >= 0 && i < 2);
+      assert(i >= 0 && i < 3);
       return (&x)[i];
     }
 
@@ -126,9 +418,7 @@ namespace pbr
 
     Vector3 operator/(float f) const
     {
-      if (f == 0)
-        return Vector3(0, 0, 0);
-      float r = 1 / f;
+      float r = f != 0 ? 1 / f : 0;
       return Vector3(r * x, r * y, r * z);
     }
 
@@ -163,9 +453,23 @@ namespace pbr
         lhs.x * rhs.y - lhs.y * rhs.x);
   }
 
+  inline Vector3 Min(const Vector3& lhs, const Vector3& rhs)
+  {
+    return Vector3(min(lhs.x, rhs.x), min(lhs.y, rhs.y), min(lhs.z, rhs.z));
+  }
+
+  inline Vector3 Max(const Vector3& lhs, const Vector3& rhs)
+  {
+    return Vector3(max(lhs.x, rhs.x), max(lhs.y, rhs.y), max(lhs.z, rhs.z));
+  }
+
   inline float Sq(float x) { return x * x; }
 
-  inline Vector3 Normalize(const Vector3& v) { return v / v.Length(); }
+  inline Vector3 Normalize(const Vector3& v)
+  {
+    float len2 = v.LengthSquared();
+    return v * (len2 > 0 ? 1 / sqrtf(len2) : 0);
+  }
 
   //---------------------------------------------------------------------------
   struct Vector4
@@ -176,12 +480,12 @@ namespace pbr
 
     float operator[](int i) const
     {
-      assert(i >= 0 && i < 3);
+      assert(i >= 0 && i < 4);
       return (&x)[i];
     }
     float& operator[](int i)
     {
-      assert(i >= 0 && i < 3);
+      assert(i >= 0 && i < 4);
       return (&x)[i];
     }
 
@@ -223,9 +527,7 @@ namespace pbr
 
     Vector4 operator/(float f) const
     {
-      if (f == 0)
-        return Vector4(0, 0, 0, 0);
-      float r = 1 / f;
+      float r = f != 0 ? 1 / f : 0;
       return Vector4(r * x, r * y, r * z, r * w);
     }
 
@@ -262,8 +564,24 @@ namespace pbr
   {
     return Vector4(lhs.x * rhs.x, lhs.y * rhs.y, lhs.z * rhs.z, lhs.w * rhs.w);
   }
+#endif
+
+  //---------------------------------------------------------------------------
+  // Vector3 is 16 bytes when it's SIMD backed. Geometry that's stored in bulk keeps
+  // its points in these instead, and loads them into a Vector3 to compute with.
+  struct PackedVector3
+  {
+    PackedVector3() {}
+    PackedVector3(const Vector3& v) : x(v.x), y(v.y), z(v.z) {}
+    explicit operator Vector3() const { return Vector3(x, y, z); }
+    float x, y, z;
+  };
+
   typedef Vector4 Color;
 
+  // Rec. 709 luminance
+  inline float Luminance(const Color& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
   Vector3 RayInHemisphere(const Vector3& n);
   //---------------------------------------------------------------------------
   struct Ray
@@ -319,6 +637,8 @@ namespace pbr
     Color emissive;
     Color diffuse;
     Color specular;
+    // written to the material id AOV
+    u32 id = 0;
   };
 
   //  //---------------------------------------------------------------------------
@@ -353,8 +673,13 @@ namespace pbr
     virtual bool Intersect(const Ray& ray, HitRec* rec) = 0;
     Material* material = nullptr;
     Type type;
+    // written to the object id AOV
+    u32 id = 0;
   };
 
+  // numbers the objects, and their materials in the order they're first seen
+  void AssignIds(const vector<Geo*>& objects);
+
   //---------------------------------------------------------------------------
   struct Sphere : public Geo
   {
@@ -389,15 +714,77 @@ namespace pbr
   }
 
   //---------------------------------------------------------------------------
-  inline float Randf() { return rand() / (float)RAND_MAX; }
+  // PCG32 (O'Neill 2014), 64 bits of state and a 32 bit output. Different streams
+  // give independent sequences for the same seed.
+  struct Pcg32
+  {
+    // constexpr, so tables can be generated at compile time
+    constexpr Pcg32() {}
+    constexpr Pcg32(u64 seed, u64 stream) { Seed(seed, stream); }
+
+    constexpr void Seed(u64 seed, u64 stream)
+    {
+      state = 0;
+      inc = (stream << 1) | 1;
+      Next();
+      state += seed;
+      Next();
+    }
+
+    constexpr u32 Next()
+    {
+      u64 old = state;
+      state = old * 6364136223846793005ull + inc;
+      u32 xorShifted = (u32)(((old >> 18) ^ old) >> 27);
+      u32 rot = (u32)(old >> 59);
+      return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+
+    // [0, 1), from the top 24 bits so every value is exact
+    constexpr float NextFloat() { return (Next() >> 8) * (1.f / (1 << 24)); }
+
+    u64 state = 0x853c49e6748fea9bull;
+    u64 inc = 0xda3e39cb94b95bdbull;
+  };
+
+  // splitmix64 finalizer, for turning structured seeds into well mixed ones
+  constexpr u64 MixBits(u64 v)
+  {
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+    return v ^ (v >> 31);
+  }
+
+  // The calling thread's generator. Progressive renders reseed it per pixel and
+  // pass, so the samples don't depend on which thread rendered what.
+  Pcg32& ThreadRng();
+  void SeedThreadRng(u64 seed, u32 pixel, u32 pass);
+
+  inline float Randf() { return ThreadRng().NextFloat(); }
+
+  // x is drawn before y. Vector2(Randf(), Randf()) leaves the order to the compiler,
+  // so the same seed could give different images between builds
+  inline Vector2 Randf2()
+  {
+    float x = Randf();
+    float y = Randf();
+    return Vector2(x, y);
+  }
 
   //---------------------------------------------------------------------------
+  // Samples in [-1..1], [-1..1], or in the unit disk. NextSamples and NextDiskSamples
+  // fill count samples at a time as separate x and y arrays, for a whole pixel or
+  // tile per call. NextSamples gives the same sequence as calling NextSample count
+  // times. NextDiskSamples maps the same points, but the batch warp's polynomial
+  // sin and cos can put them a few ulps (under 1e-6) from NextDiskSample's.
   struct Sampler
   {
     virtual ~Sampler() {}
     virtual void Init(u32 numSamples){};
     virtual Vector2 NextSample() = 0;
     virtual Vector2 NextDiskSample() = 0;
+    virtual void NextSamples(u32 count, float* xs, float* ys);
+    virtual void NextDiskSamples(u32 count, float* xs, float* ys);
   };
 
   //---------------------------------------------------------------------------
@@ -405,6 +792,8 @@ namespace pbr
   {
     virtual Vector2 NextSample();
     virtual Vector2 NextDiskSample();
+    virtual void NextSamples(u32 count, float* xs, float* ys);
+    virtual void NextDiskSamples(u32 count, float* xs, float* ys);
   };
 
   struct UniformSampler : public Sampler
@@ -413,19 +802,25 @@ namespace pbr
     virtual void Init(u32 numSamples);
     virtual Vector2 NextSample();
     virtual Vector2 NextDiskSample();
+    virtual void NextSamples(u32 count, float* xs, float* ys);
 
     vector<Vector2> _samples;
     u32 _idx;
   };
 
   //---------------------------------------------------------------------------
-  // Returns points in [0..1], [0..1] distributed in a Poisson distribution
+  // Returns points in [-1..1], [-1..1] with a Poisson disk distribution. The tables
+  // are generated in linear time, and cached in memory, so only the first Init for a
+  // count in a process does any work. With PBR_CACHE_DIR set, they're also kept on
+  // disk there between runs.
   struct PoissonSampler : public Sampler
   {
     PoissonSampler();
     virtual void Init(u32 numSamples);
     virtual Vector2 NextSample();
     virtual Vector2 NextDiskSample();
+    virtual void NextSamples(u32 count, float* xs, float* ys);
+    virtual void NextDiskSamples(u32 count, float* xs, float* ys);
 
     void MapSamplesToUnitDisk();
 
@@ -436,10 +831,20 @@ namespace pbr
   };
 
   //---------------------------------------------------------------------------
+  // only ever built on the fly from the vertices, so it's kept in Vector3s
   struct IsectTri
   {
     Vector3 p0, p1, p2;
   };
 
+  // triangle with the edges precomputed, for when memory is less of a concern than
+  // intersection speed. These are stored per triangle, so they're packed
+  struct IsectTriPre
+  {
+    PackedVector3 p0, e1, e2;
+  };
+  static_assert(sizeof(IsectTriPre) == 36, "IsectTriPre should be packed");
+
   bool RayTriIntersect(const Ray& ray, const IsectTri& tri, float* t, float* u, float* v);
+  bool RayTriIntersect(const Ray& ray, const IsectTriPre& tri, float* t, float* u, float* v);
 }
\ No newline at end of file
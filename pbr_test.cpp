@@ -0,0 +1,1155 @@
+#include <functional>
+#include "pbr_math.hpp"
+#include "pbr.hpp"
+#include "mesh_loader.hpp"
+#include "cluster.hpp"
+#include "mesh.hpp"
+#include "display.hpp"
+#include "kernel_table.hpp"
+#include "light_bvh.hpp"
+#include "reservoir.hpp"
+#include "irradiance_cache.hpp"
+#include "guiding.hpp"
+#include "denoise.hpp"
+#include "progressive.hpp"
+#include "warp.hpp"
+#include <tbb/parallel_for.h>
+#include <thread>
+
+// Headless checks of the renderer's parts that dist_test doesn't cover. Built as
+// the pbr_test target:
+//
+//  pbr_test [--only=<check name>] [--isa=<name>]
+//
+// Exits with 1 if any check fails.
+
+using namespace pbr;
+
+// the scene the path tracer renders, which pbr.cpp keeps for the renderer
+vector<Geo*> objects;
+vector<Geo*> emitters;
+void PathTrace(const Camera& cam, const RenderSettings& settings, Accumulator* acc, u32 numPasses, Buffer* buffer);
+
+//---------------------------------------------------------------------------
+bool Intersect(const Ray& r, HitRec* hitRec)
+{
+  bool hit = false;
+  for (Geo* obj : objects)
+    hit |= obj->Intersect(r, hitRec);
+  return hit;
+}
+
+//---------------------------------------------------------------------------
+bool IntersectMeshes(const Ray&, float*)
+{
+  return false;
+}
+
+//---------------------------------------------------------------------------
+void IntersectMeshesBatch(const Ray*, u32 numRays, float* t)
+{
+  std::fill(t, t + numRays, FLT_MAX);
+}
+
+namespace
+{
+  // scratch files for the checks that go through the disk, in the working directory
+  const char* TEMP_FILE = "pbr_test.tmp";
+  const char* TEMP_PAGE_FILE = "pbr_test.clusters";
+
+  //---------------------------------------------------------------------------
+  // prints what should have held when cond doesn't, and returns cond
+  bool Expect(const char* what, bool cond)
+  {
+    if (!cond)
+      printf("  %s\n", what);
+    return cond;
+  }
+
+  //---------------------------------------------------------------------------
+  vector<char> ReadFile(const char* filename)
+  {
+    vector<char> res;
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+      return res;
+    fseek(f, 0, SEEK_END);
+    res.resize((size_t)ftell(f));
+    fseek(f, 0, SEEK_SET);
+    if (fread(res.data(), 1, res.size(), f) != res.size())
+      res.clear();
+    fclose(f);
+    return res;
+  }
+
+  //---------------------------------------------------------------------------
+  bool WriteFile(const char* filename, const vector<char>& data)
+  {
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // A grid of n x n vertices, with 2 material groups of triangles
+  MeshWriter::MeshData GridMesh(const char* name, int n)
+  {
+    MeshWriter::MeshData mesh;
+    mesh.name = name;
+    for (int y = 0; y < n; ++y)
+    {
+      for (int x = 0; x < n; ++x)
+      {
+        float fx = (float)x / (n - 1), fy = (float)y / (n - 1);
+        mesh.verts.insert(mesh.verts.end(), {fx * 10 - 5, sinf(fx * 6) * cosf(fy * 5), fy * 7 + 100});
+        mesh.normals.insert(mesh.normals.end(), {0, 1, 0});
+        mesh.uv.insert(mesh.uv.end(), {fx, fy});
+      }
+    }
+
+    for (int y = 0; y + 1 < n; ++y)
+    {
+      for (int x = 0; x + 1 < n; ++x)
+      {
+        u32 i = y * n + x;
+        mesh.indices.insert(mesh.indices.end(), {i, i + 1, i + n, i + 1, i + n + 1, i + n});
+      }
+    }
+
+    u32 half = (u32)mesh.indices.size() / 6 * 3;
+    mesh.materialGroups.push_back({0, 0, half});
+    mesh.materialGroups.push_back({1, half, (u32)mesh.indices.size() - half});
+    return mesh;
+  }
+
+  //---------------------------------------------------------------------------
+  bool SameMesh(const MeshWriter::MeshData& src, const protocol::MeshBlob& mesh, float posTolerance)
+  {
+    if (strcmp(mesh.name, src.name) != 0 || mesh.numVerts * 3 != src.verts.size()
+        || mesh.numIndices != src.indices.size() || mesh.numMaterialGroups != src.materialGroups.size())
+      return false;
+
+    for (size_t i = 0; i < src.materialGroups.size(); ++i)
+    {
+      if (memcmp(&mesh.materialGroups[i], &src.materialGroups[i], sizeof(src.materialGroups[i])) != 0)
+        return false;
+    }
+
+    for (size_t i = 0; i < src.verts.size(); ++i)
+    {
+      if (fabsf(mesh.verts[i] - src.verts[i]) > posTolerance)
+        return false;
+    }
+
+    return memcmp(mesh.normals, src.normals.data(), src.normals.size() * sizeof(float)) == 0
+           && memcmp(mesh.uv, src.uv.data(), src.uv.size() * sizeof(float)) == 0
+           && memcmp(mesh.indices, src.indices.data(), src.indices.size() * sizeof(u32)) == 0;
+  }
+
+  //---------------------------------------------------------------------------
+  // Writes a v2 file with raw and compressed streams, and checks it loads back as it
+  // was. Then breaks copies of it in the ways the loader has to catch.
+  bool CheckMeshRoundTrip()
+  {
+    using protocol::StreamBlob;
+
+    vector<MeshWriter::MeshData> meshes;
+    meshes.push_back(GridMesh("raw", 17));
+    meshes.push_back(GridMesh("compressed", 33));
+    meshes[1].vertsEncoding = StreamBlob::QuantizedPos16;
+    meshes[1].indicesEncoding = StreamBlob::DeltaIndices;
+
+    if (!MeshWriter::Write(TEMP_FILE, meshes))
+    {
+      printf("  unable to write %s\n", TEMP_FILE);
+      return false;
+    }
+
+    bool ok = true;
+    {
+      MeshLoader loader;
+      if (!loader.Load(TEMP_FILE) || loader.meshes.size() != 2)
+      {
+        printf("  the written file doesn't load\n");
+        remove(TEMP_FILE);
+        return false;
+      }
+
+      // quantized positions are within half a step of the 16 bit grid
+      float step = 0;
+      for (int i = 0; i < 3; ++i)
+        step = max(step, loader.streams[4]->quantScale[i]);
+      bool same = SameMesh(meshes[0], *loader.meshes[0], 0);
+      same &= SameMesh(meshes[1], *loader.meshes[1], step * 0.5f + 1e-5f);
+
+      for (const StreamBlob* stream : loader.streams)
+      {
+        if (stream->encoding == StreamBlob::Raw && stream->dataStart % 64 != 0)
+          same = false;
+      }
+      for (const protocol::MeshBlob* mesh : loader.meshes)
+      {
+        for (const void* p : {(const void*)mesh->verts, (const void*)mesh->normals, (const void*)mesh->uv, (const void*)mesh->indices})
+          same &= ((uintptr_t)p & 63) == 0;
+      }
+      ok &= Expect("the loaded meshes don't match what was written", same);
+    }
+
+    // Broken copies of the file. Each has to be rejected
+    vector<char> file = ReadFile(TEMP_FILE);
+    protocol::SceneBlobV2 header;
+    memcpy(&header, file.data(), sizeof(header));
+    auto streamAt = [&](vector<char>& data, int idx)
+    {
+      return (StreamBlob*)&data[(size_t)header.streamDataStart + idx * sizeof(StreamBlob)];
+    };
+    int deltaStream = -1;
+    for (u32 i = 0; i < header.numStreams; ++i)
+    {
+      if (streamAt(file, i)->encoding == StreamBlob::DeltaIndices)
+        deltaStream = (int)i;
+    }
+
+    struct Corruption
+    {
+      const char* name;
+      std::function<void(vector<char>& data)> apply;
+    };
+    const Corruption corruptions[] = {
+      { "truncated", [&](vector<char>& data) { data.resize(data.size() / 2); } },
+      { "stream table outside the file",
+          [&](vector<char>& data) { ((protocol::SceneBlobV2*)data.data())->streamDataStart = data.size(); } },
+      { "fixups outside the file",
+          [&](vector<char>& data) { ((protocol::SceneBlobV2*)data.data())->fixupOffset = ~0ull - 4; } },
+      { "fixup pointing outside the file",
+          [&](vector<char>& data)
+          {
+            u64 fixup = *(u64*)&data[(size_t)header.fixupOffset + 8];
+            *(u64*)&data[(size_t)fixup] = data.size() * 2;
+          } },
+      { "unaligned raw stream",
+          [&](vector<char>& data)
+          {
+            // the mesh's pointer moves along with the stream, so only the alignment is off
+            protocol::MeshBlob* mesh = (protocol::MeshBlob*)&data[(size_t)header.meshDataStart];
+            u64 ofs;
+            memcpy(&ofs, &mesh->verts, sizeof(ofs));
+            ofs += 4;
+            memcpy(&mesh->verts, &ofs, sizeof(ofs));
+            streamAt(data, 0)->dataStart += 4;
+          } },
+      { "stream longer than its mesh", [&](vector<char>& data) { streamAt(data, 0)->numElements += 1; } },
+      { "compressed stream past the end", [&](vector<char>& data) { streamAt(data, deltaStream)->dataSize += 1; } },
+      { "raw index past the last vertex",
+          [&](vector<char>& data)
+          {
+            const protocol::MeshBlob* mesh = (const protocol::MeshBlob*)&data[(size_t)header.meshDataStart];
+            for (u32 i = 0; i < header.numStreams; ++i)
+            {
+              StreamBlob* stream = streamAt(data, i);
+              if (stream->meshIdx == 0 && stream->type == StreamBlob::Indices)
+                memcpy(&data[(size_t)stream->dataStart + 8], &mesh->numVerts, sizeof(u32));
+            }
+          } },
+      // the first delta is 0, so this moves every index along by 63, and the last
+      // ones past the end
+      { "decoded index past the last vertex",
+          [&](vector<char>& data) { data[(size_t)streamAt(data, deltaStream)->dataStart] = 0x7e; } },
+    };
+
+    for (const Corruption& corruption : corruptions)
+    {
+      vector<char> broken = file;
+      corruption.apply(broken);
+      MeshLoader loader;
+      if (!WriteFile(TEMP_FILE, broken) || loader.Load(TEMP_FILE))
+      {
+        printf("  loaded a file with %s\n", corruption.name);
+        ok = false;
+      }
+    }
+
+    remove(TEMP_FILE);
+
+    // The varint limits, on the decoder directly as no mesh has enough vertices
+    // for indices this big. 0x7fffffff then 0 are deltas that need all 5 bytes,
+    // both ways
+    const u8 deltas[] = {0xfe, 0xff, 0xff, 0xff, 0x0f, 0xfd, 0xff, 0xff, 0xff, 0x0f};
+    auto decode = [](const vector<u8>& payload, u32* indices)
+    {
+      StreamBlob stream;
+      memset(&stream, 0, sizeof(stream));
+      stream.type = StreamBlob::Indices;
+      stream.encoding = StreamBlob::DeltaIndices;
+      stream.numElements = 2;
+      StreamDecoder decoder(stream, indices);
+      // a byte at a time, so every varint spans chunks
+      for (u8 b : payload)
+        decoder.Feed(&b, 1);
+      return !decoder.Failed() && decoder.Done();
+    };
+
+    u32 indices[2];
+    vector<u8> payload(deltas, deltas + sizeof(deltas));
+    ok &= Expect("5 byte varints don't decode", decode(payload, indices) && indices[0] == 0x7fffffff && indices[1] == 0);
+
+    // one more continuation byte than a u32 can need
+    vector<u8> overlong = payload;
+    overlong.back() |= 0x80;
+    overlong.push_back(0);
+    // bits past the 32nd
+    vector<u8> overflow = payload;
+    overflow.back() |= 0x10;
+    ok &= Expect("decoded a varint longer than 32 bits", !decode(overlong, indices) && !decode(overflow, indices));
+
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // Rays straight down onto a GridMesh, covering all of it
+  vector<Ray> GridRays(int raysPerSide)
+  {
+    vector<Ray> rays;
+    for (int y = 0; y < raysPerSide; ++y)
+    {
+      for (int x = 0; x < raysPerSide; ++x)
+      {
+        float fx = (x + 0.5f) / raysPerSide, fy = (y + 0.5f) / raysPerSide;
+        rays.push_back(Ray(Vector3(fx * 10 - 5, 10, fy * 7 + 100), Vector3(0, -1, 0)));
+      }
+    }
+    return rays;
+  }
+
+  //---------------------------------------------------------------------------
+  // The precomputed triangles are kept in leaf order, and only for the triangles in
+  // the BVH, so they have to give the same hits as the indexed ones
+  bool CheckTriMesh()
+  {
+    vector<MeshWriter::MeshData> meshes;
+    meshes.push_back(GridMesh("grid", 65));
+    // degenerate triangles, which are left out of the BVH
+    u32 numTris = (u32)meshes[0].indices.size() / 3;
+    meshes[0].indices.insert(meshes[0].indices.end(), {0, 0, 1, 5, 5, 5, 7, 8, 7});
+    meshes[0].materialGroups.back().numIndices += 9;
+
+    MeshLoader loader;
+    bool ok = MeshWriter::Write(TEMP_FILE, meshes) && loader.Load(TEMP_FILE);
+    remove(TEMP_FILE);
+    if (!ok)
+    {
+      printf("  unable to write and load the mesh\n");
+      return false;
+    }
+
+    TriMesh indexed, precomputed;
+    indexed.Build(*loader.meshes[0], false);
+    precomputed.Build(*loader.meshes[0], true);
+    if (precomputed.bvh.primIndices.size() != numTris || precomputed.precomputed.size() != numTris)
+    {
+      printf("  %d triangles in the BVH, %d precomputed, expected %d\n",
+          (int)precomputed.bvh.primIndices.size(), (int)precomputed.precomputed.size(), (int)numTris);
+      return false;
+    }
+
+    for (const Ray& ray : GridRays(128))
+    {
+      float t0 = -1, t1 = -1;
+      bool hit0 = indexed.Intersect(ray, FLT_MAX, &t0);
+      bool hit1 = precomputed.Intersect(ray, FLT_MAX, &t1);
+      if (!hit0 || !hit1 || fabsf(t0 - t1) > 1e-4f)
+      {
+        printf("  hits differ: %d at %g, %d at %g\n", hit0, t0, hit1, t1);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+  // Traces the same rays from many threads through a cache that only has room for a
+  // few clusters, so they keep getting evicted from under each other, and compares
+  // the hits against a cache that holds them all.
+  bool TraceClusters(const char* pageFile)
+  {
+    ClusterScene all, few;
+    if (!all.Open(pageFile, ~(size_t)0))
+    {
+      printf("  unable to open the page file\n");
+      return false;
+    }
+
+    vector<Ray> rays = GridRays(256);
+
+    vector<float> expected(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i)
+    {
+      if (!all.IntersectClosest(rays[i], &expected[i]))
+      {
+        printf("  ray %d misses the grid\n", (int)i);
+        return false;
+      }
+    }
+
+    size_t budget = all.cache.memoryUsed / all.clusters.size() * 4;
+    if (!few.Open(pageFile, budget))
+      return false;
+
+    bool same = true;
+    vector<float> t(rays.size());
+    for (int round = 0; round < 4; ++round)
+    {
+      std::fill(t.begin(), t.end(), -1.f);
+      tbb::parallel_for(size_t(0), rays.size(), [&](size_t i)
+      {
+        // scattered order, so the threads don't walk the clusters in step
+        size_t idx = (i * 7919 + round * 104729) % rays.size();
+        float tt;
+        if (few.IntersectClosest(rays[idx], &tt))
+          t[idx] = tt;
+      });
+
+      same &= t == expected;
+    }
+
+    bool ok = Expect("hits through the small cache differ", same);
+    if (few.cache.numEvictions == 0 || few.cache.memoryUsed > budget)
+    {
+      printf("  %d evictions, %d of %d bytes used\n",
+          (int)few.cache.numEvictions, (int)few.cache.memoryUsed, (int)budget);
+      ok = false;
+    }
+
+    // The same rays as tile sized batches, from many threads. Then all of them as
+    // one batch through a cache that starts out empty: every cluster is needed,
+    // and should be paged in exactly once
+    const size_t BATCH_SIZE = 256;
+    vector<float> batchT(rays.size());
+    tbb::parallel_for(size_t(0), rays.size() / BATCH_SIZE, [&](size_t batch)
+    {
+      few.IntersectBatch(&rays[batch * BATCH_SIZE], (u32)BATCH_SIZE, &batchT[batch * BATCH_SIZE]);
+    });
+
+    ClusterScene cold;
+    if (!cold.Open(pageFile, budget))
+      return false;
+    vector<float> coldT(rays.size());
+    cold.IntersectBatch(rays.data(), (u32)rays.size(), coldT.data());
+
+    ok &= Expect("batched hits differ", batchT == expected && coldT == expected);
+    if (cold.cache.numLoads != cold.clusters.size())
+    {
+      printf("  %d loads for a batch over %d clusters\n", (int)cold.cache.numLoads, (int)cold.clusters.size());
+      ok = false;
+    }
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  bool CheckClusterCache()
+  {
+    // built a mesh at a time from the file, half of it compressed
+    vector<MeshWriter::MeshData> meshes;
+    meshes.push_back(GridMesh("grid", 129));
+    meshes.push_back(GridMesh("compressed", 65));
+    meshes[1].vertsEncoding = protocol::StreamBlob::QuantizedPos16;
+    meshes[1].indicesEncoding = protocol::StreamBlob::DeltaIndices;
+    bool built = MeshWriter::Write(TEMP_FILE, meshes) && ClusterScene::Build(TEMP_FILE, TEMP_PAGE_FILE, 256);
+    remove(TEMP_FILE);
+    if (!built)
+    {
+      printf("  unable to build the page file\n");
+      return false;
+    }
+
+    bool ok = TraceClusters(TEMP_PAGE_FILE);
+    remove(TEMP_PAGE_FILE);
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  bool SameTile(const Tile& a, const Tile& b)
+  {
+    return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+  }
+
+  //---------------------------------------------------------------------------
+  // Only the tiles the renderer reports get re-encoded, and the changed rect covers
+  // just those. Frames without any new tiles don't touch the pixels.
+  bool CheckDisplayEncoder()
+  {
+    // not a multiple of the tile size, so the last row and column are partial
+    Buffer buffer(100, 70);
+    DirtyTiles dirtyTiles;
+    dirtyTiles.Init(buffer);
+    buffer.listeners.push_back(&dirtyTiles);
+    DisplayEncoder display;
+    display.Init(buffer.width, buffer.height, GAMMA_ENCODE);
+
+    auto fill = [&](int tileIdx, float value)
+    {
+      Tile tile = buffer.GetTile(tileIdx);
+      for (int y = tile.y0; y < tile.y1; ++y)
+      {
+        for (int x = tile.x0; x < tile.x1; ++x)
+          buffer.Row(y)[x] = Color(value, value, value);
+      }
+      buffer.TileDone(tileIdx);
+    };
+
+    bool ok = true;
+
+    Tile changed;
+    Tile all = { 0, 0, buffer.width, buffer.height };
+    ok &= Expect("the first update should encode everything",
+        display.Update(buffer, &dirtyTiles, 1, &changed) && SameTile(changed, all));
+    ok &= Expect("an idle frame should be a no-op", !display.Update(buffer, &dirtyTiles, 1, &changed));
+
+    // reported twice, but only encoded once
+    vector<Color32> before = display.pixels;
+    fill(5, 1);
+    fill(5, 1);
+    vector<int> tiles;
+    dirtyTiles.Take(&tiles);
+    ok &= Expect("a tile done twice should only be taken once", tiles.size() == 1 && tiles[0] == 5);
+    fill(5, 1);
+    ok &= Expect("a new tile should be the changed rect",
+        display.Update(buffer, &dirtyTiles, 1, &changed) && SameTile(changed, buffer.GetTile(5)));
+
+    Tile tile = buffer.GetTile(5);
+    int numChanged = 0, numOutside = 0;
+    for (int y = 0; y < buffer.height; ++y)
+    {
+      for (int x = 0; x < buffer.width; ++x)
+      {
+        size_t i = (size_t)y * buffer.width + x;
+        bool inside = x >= tile.x0 && x < tile.x1 && y >= tile.y0 && y < tile.y1;
+        bool differs = memcmp(&display.pixels[i], &before[i], sizeof(Color32)) != 0;
+        numChanged += inside && differs;
+        numOutside += !inside && differs;
+      }
+    }
+    ok &= Expect("only the new tile's pixels should change",
+        numChanged == (tile.x1 - tile.x0) * (tile.y1 - tile.y0) && numOutside == 0);
+    ok &= Expect("an idle frame should be a no-op", !display.Update(buffer, &dirtyTiles, 1, &changed));
+
+    // the changed rect is the bounds of all the new tiles, including the partial corner
+    fill(0, 0.5f);
+    fill(buffer.NumTiles() - 1, 0.5f);
+    ok &= Expect("the changed rect should bound the new tiles",
+        display.Update(buffer, &dirtyTiles, 1, &changed) && SameTile(changed, all));
+
+    dirtyTiles.MarkAll();
+    ok &= Expect("MarkAll should re-encode everything",
+        display.Update(buffer, &dirtyTiles, 1, &changed) && SameTile(changed, all));
+    ok &= Expect("a new scale should re-encode everything",
+        display.Update(buffer, &dirtyTiles, 2, &changed) && SameTile(changed, all));
+    ok &= Expect("an idle frame should be a no-op", !display.Update(buffer, &dirtyTiles, 2, &changed));
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // Sphere emitters of varying size and brightness, scattered around a box, and some
+  // that don't emit and so shouldn't be in the light bvh
+  struct LightScene
+  {
+    LightScene(int numLights, const Aabb& box, float maxRadius)
+    {
+      Pcg32 rng(1, 0);
+      auto randf = [&](float mn, float mx) { return mn + (mx - mn) * rng.NextFloat(); };
+
+      // reserved up front, as the spheres point at the materials
+      materials.reserve(numLights);
+      spheres.reserve(numLights);
+      for (int i = 0; i < numLights; ++i)
+      {
+        float e = i % 5 == 4 ? 0 : randf(0.5f, 20);
+        materials.push_back(Material(Color(0.5f, 0.5f, 0.5f), Color(0, 0, 0), Color(e, e * 0.5f, e * 0.25f)));
+        Vector3 center(randf(box.mn.x, box.mx.x), randf(box.mn.y, box.mx.y), randf(box.mn.z, box.mx.z));
+        spheres.push_back(Sphere(center, randf(0.1f, 1) * maxRadius));
+        spheres.back().material = &materials.back();
+      }
+
+      for (Sphere& s : spheres)
+        emitters.push_back(&s);
+    }
+
+    vector<Material> materials;
+    vector<Sphere> spheres;
+    vector<Geo*> emitters;
+  };
+
+  //---------------------------------------------------------------------------
+  // At a spread of shading points, sampling the light bvh with stratified numbers
+  // should pick each emitter as often as Pmf says, and Sample should return the
+  // same pmf. The pmf sums to 1, less the chance of the walk ending in a subtree
+  // that can't reach the point, and every emitter that can light the point has to
+  // be picked sometimes
+  bool CheckLightBvh()
+  {
+    const int NUM_POINTS = 64;
+    const int NUM_SAMPLES = 1 << 16;
+    const float TOLERANCE = 1e-3f;
+
+    LightScene scene(57, Aabb(Vector3(-10, 0, -10), Vector3(10, 10, 10)), 1);
+    LightBvh bvh;
+    bvh.Build(scene.emitters);
+
+    size_t numEmitting = 0;
+    for (const Sphere& s : scene.spheres)
+      numEmitting += s.material->emissive.Max3() > 0;
+    if (bvh.lights.size() != numEmitting)
+    {
+      printf("  %d of %d emitters in the bvh\n", (int)bvh.lights.size(), (int)numEmitting);
+      return false;
+    }
+
+    // stops at the first point that's off, as the rest usually are too
+    Pcg32 rng(2, 0);
+    vector<int> picked(scene.spheres.size());
+    bool ok = true;
+    for (int i = 0; i < NUM_POINTS && ok; ++i)
+    {
+      // half of them on a floor under the lights, the rest anywhere, facing anywhere
+      Vector3 p(rng.NextFloat() * 30 - 15, i < NUM_POINTS / 2 ? -1 : rng.NextFloat() * 12 - 1, rng.NextFloat() * 30 - 15);
+      Vector3 n = i < NUM_POINTS / 2 ? Vector3(0, 1, 0) : UniformSphere(Vector2(rng.NextFloat(), rng.NextFloat()));
+
+      std::fill(picked.begin(), picked.end(), 0);
+      int numPicked = 0;
+      bool samplePmfs = true;
+      for (int k = 0; k < NUM_SAMPLES; ++k)
+      {
+        float pmf;
+        Geo* g = bvh.Sample(p, n, (k + 0.5f) / NUM_SAMPLES, &pmf);
+        if (!g)
+          continue;
+        samplePmfs &= fabsf(pmf - bvh.Pmf(p, n, g)) <= TOLERANCE * pmf;
+        ++picked[static_cast<Sphere*>(g) - &scene.spheres[0]];
+        ++numPicked;
+      }
+
+      float sum = 0;
+      bool inRange = true, onlyEmitters = true, frequencies = true, canLightPicked = true;
+      for (size_t j = 0; j < scene.spheres.size(); ++j)
+      {
+        const Sphere& s = scene.spheres[j];
+        float pmf = bvh.Pmf(p, n, &s);
+        float freq = (float)picked[j] / NUM_SAMPLES;
+        sum += pmf;
+        inRange &= pmf >= 0 && pmf <= 1;
+        onlyEmitters &= pmf == 0 || s.material->emissive.Max3() > 0;
+        frequencies &= fabsf(freq - pmf) < TOLERANCE;
+
+        // some of the sphere is above p's tangent plane
+        bool canLight = s.material->emissive.Max3() > 0 && Dot(s.center - p, n) > -s.radius * 0.99f;
+        canLightPicked &= !canLight || pmf > 0;
+      }
+
+      ok &= Expect("Sample's pmf doesn't match Pmf", samplePmfs);
+      ok &= Expect("pmf out of range", inRange);
+      ok &= Expect("pmf for a sphere that doesn't emit", onlyEmitters);
+      ok &= Expect("sampling frequency doesn't match the pmf", frequencies);
+      ok &= Expect("an emitter that can light the point is never picked", canLightPicked);
+      ok &= Expect("pmf doesn't sum to the chance of a sample", fabsf(sum - (float)numPicked / NUM_SAMPLES) < TOLERANCE);
+      ok &= Expect("pmf sums to more than 1", numPicked == 0 || sum <= 1 + TOLERANCE);
+      if (!ok)
+        printf("  at point %d\n", i);
+    }
+
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // A wall lit by a few hundred spheres in front of it, without occlusion, so the
+  // direct light at each pixel's hit has a closed form. Over the frames, the
+  // resampled estimate should average out to it, and each frame should be much
+  // less noisy than a single light bvh sample, and get better as the history builds
+  bool CheckDirectLightResampler()
+  {
+    const int SIZE = 48;
+    const int NUM_FRAMES = 32;
+    const float WALL_Z = 10;
+
+    LightScene scene(300, Aabb(Vector3(-6, -6, 2), Vector3(6, 6, 8)), 0.3f);
+    LightBvh bvh;
+    bvh.Build(scene.emitters);
+
+    Camera cam;
+    cam.fov = DegToRad(60);
+    cam.dist = 1;
+    cam.LookAt(Vector3(0, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, WALL_Z));
+    Buffer buffer(SIZE, SIZE);
+    ImagePlane plane = MakeImagePlane(cam, buffer);
+
+    // the hits through the pixel centers, and their exact direct light: a sphere of
+    // radiance le wholly above the horizon gives le * (r / d)^2 * cos theta
+    vector<ShadingPoint> points(SIZE * SIZE);
+    vector<float> reference(SIZE * SIZE);
+    for (int y = 0; y < SIZE; ++y)
+    {
+      for (int x = 0; x < SIZE; ++x)
+      {
+        Vector3 d = Normalize(plane.p + Vector3(x * plane.xInc, y * plane.yInc, 0) - cam.frame.origin);
+        ShadingPoint& sp = points[y * SIZE + x];
+        sp.depth = WALL_Z / d.z;
+        sp.pos = cam.frame.origin + d * sp.depth;
+        sp.normal = Vector3(0, 0, -1);
+        sp.diffuse = Color(0.5f, 0.5f, 0.5f);
+
+        Color e(0, 0, 0);
+        for (const Sphere& s : scene.spheres)
+        {
+          Vector3 l = s.center - sp.pos;
+          float distSq = l.LengthSquared();
+          e += sp.diffuse * s.material->emissive * (s.radiusSquared / distSq * Dot(l, sp.normal) / sqrtf(distSq));
+        }
+        reference[y * SIZE + x] = Luminance(e);
+      }
+    }
+
+    auto relativeRmse = [&](const vector<float>& estimate)
+    {
+      double err = 0, ref = 0;
+      for (size_t i = 0; i < estimate.size(); ++i)
+      {
+        err += Sq(estimate[i] - reference[i]);
+        ref += Sq(reference[i]);
+      }
+      return (float)sqrt(err / ref);
+    };
+
+    // one light bvh pick and a point on it, as the path tracer does without resampling
+    vector<float> single(SIZE * SIZE);
+    for (int i = 0; i < SIZE * SIZE; ++i)
+    {
+      const ShadingPoint& sp = points[i];
+      SeedThreadRng(1, i, 0);
+      float pmf;
+      Sphere* s = static_cast<Sphere*>(bvh.Sample(sp.pos, sp.normal, Randf(), &pmf));
+      if (!s)
+        continue;
+      Vector3 sw = Normalize(s->center - sp.pos);
+      float cosMax = sqrtf(1 - s->radiusSquared / (s->center - sp.pos).LengthSquared());
+      Vector3 l = Normalize(ToFrame(UniformCone(Randf2(), cosMax), sw));
+      single[i] = Luminance(sp.diffuse * s->material->emissive) * Dot(l, sp.normal) * (1 - cosMax) * 2 / pmf;
+    }
+    float singleRmse = relativeRmse(single);
+
+    DirectLightResampler resampler;
+    vector<float> estimate(SIZE * SIZE);
+    vector<double> sum(SIZE * SIZE);
+    float firstRmse = 0, lastRmse = 0;
+    for (int frame = 0; frame < NUM_FRAMES; ++frame)
+    {
+      resampler.BeginFrame(cam, SIZE, SIZE);
+      for (int i = 0; i < SIZE * SIZE; ++i)
+      {
+        SeedThreadRng(2, i, frame);
+        resampler.Sample(i % SIZE, i / SIZE, points[i], bvh);
+      }
+      for (int i = 0; i < SIZE * SIZE; ++i)
+      {
+        SeedThreadRng(3, i, frame);
+        resampler.Reuse(i % SIZE, i / SIZE);
+      }
+
+      for (int i = 0; i < SIZE * SIZE; ++i)
+      {
+        const Reservoir& r = resampler.Final(i % SIZE, i / SIZE);
+        estimate[i] = r.sample.light ? Luminance(UnshadowedLight(points[i], r.sample)) * r.W : 0;
+        sum[i] += estimate[i];
+      }
+      (frame == 0 ? firstRmse : lastRmse) = relativeRmse(estimate);
+    }
+
+    double meanEstimate = 0, meanReference = 0;
+    for (int i = 0; i < SIZE * SIZE; ++i)
+    {
+      meanEstimate += sum[i] / NUM_FRAMES;
+      meanReference += reference[i];
+    }
+    float bias = (float)(meanEstimate / meanReference - 1);
+
+    bool ok = true;
+    ok &= Expect("the resampled light should average out to the reference", fabsf(bias) < 0.01f);
+    ok &= Expect("the first frame should be well under the noise of one light bvh sample", firstRmse < 0.75f * singleRmse);
+    ok &= Expect("the history should lower the noise", lastRmse < 0.5f * firstRmse);
+    if (!ok)
+      printf("  bias %.4f, relative rmse %.3f first frame, %.3f last, %.3f for one light bvh sample\n", bias, firstRmse, lastRmse, singleRmse);
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // Irradiance on a plane under a sphere light, which has a closed form, looked up
+  // over a grid from several threads at once. Most lookups should be interpolated
+  // from a few records, and still be close to the exact value
+  bool CheckIrradianceCache()
+  {
+    const int GRID_SIZE = 400;
+    const float EXTENT = 4;
+
+    Material material(Color(0, 0, 0), Color(0, 0, 0), Color(1, 1, 1));
+    Sphere light(Vector3(0, 3, 0), 1);
+    light.material = &material;
+
+    // the plane doesn't see itself, so only the light gives any radiance
+    IncomingRadiance radiance = [&](const Ray& r, float* hitDist)
+    {
+      HitRec hitRec;
+      *hitDist = light.Intersect(r, &hitRec) ? hitRec.t : 0;
+      return *hitDist > 0 ? material.emissive : Color(0, 0, 0);
+    };
+
+    // enough rays per record that their own noise doesn't hide the interpolation's
+    // error, at the default strata the light only covers a handful of them
+    IrradianceCache cache;
+    cache.thetaStrata = 40;
+    cache.phiStrata = 120;
+    cache.Init(Aabb(Vector3(-EXTENT, -0.5f, -EXTENT), Vector3(EXTENT, 4.5f, EXTENT)));
+
+    // the sphere is wholly above the plane, so the irradiance is pi * (r / d)^2 * cos theta
+    vector<float> error(GRID_SIZE * GRID_SIZE);
+    tbb::parallel_for(0, GRID_SIZE * GRID_SIZE, [&](int i)
+    {
+      Vector3 pos(((i % GRID_SIZE) + 0.5f) / GRID_SIZE * 2 * EXTENT - EXTENT, 0, ((i / GRID_SIZE) + 0.5f) / GRID_SIZE * 2 * EXTENT - EXTENT);
+      Vector3 l = light.center - pos;
+      float distSq = l.LengthSquared();
+      float exact = Pi * light.radiusSquared / distSq * l.y / sqrtf(distSq);
+
+      SeedThreadRng(1, i, 0);
+      Color e = cache.Irradiance(pos, Vector3(0, 1, 0), radiance);
+      error[i] = fabsf(e.x - exact) / exact;
+    });
+
+    double errorSum = 0;
+    float maxError = 0;
+    for (float e : error)
+    {
+      errorSum += e;
+      maxError = max(maxError, e);
+    }
+    float meanError = (float)(errorSum / error.size());
+    size_t numRecords = cache.NumRecords();
+
+    // a record doesn't depend on the pixel that asked for it, nor changes the
+    // pixel's own samples
+    Vector3 pos(0.5f, 0, -1.25f);
+    SeedThreadRng(1, 0, 0);
+    IrradianceRecord a = cache.Compute(pos, Vector3(0, 1, 0), radiance);
+    float nextA = Randf();
+    SeedThreadRng(1, 1, 0);
+    IrradianceRecord b = cache.Compute(pos, Vector3(0, 1, 0), radiance);
+    SeedThreadRng(1, 0, 0);
+    float nextPixel = Randf();
+
+    bool ok = true;
+    ok &= Expect("the interpolated irradiance should be close to the exact one", meanError < 0.03f);
+    ok &= Expect("no lookup should be far off", maxError < 0.15f);
+    ok &= Expect("most lookups should be interpolated", numRecords > 0 && numRecords < error.size() / 50);
+    ok &= Expect("a record should only depend on where it is", a.irradiance.x == b.irradiance.x
+                 && a.rotGrad[1].x == b.rotGrad[1].x && a.transGrad[2].z == b.transGrad[2].z && a.radius == b.radius);
+    ok &= Expect("computing a record should leave the pixel's samples alone", nextA == nextPixel);
+    if (!ok)
+      printf("  %d records for %d lookups, mean error %.4f, max %.4f\n", (int)numRecords, (int)error.size(), meanError, maxError);
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // The paths record into the guiding trees from every render thread at once, so
+  // no record may get lost. The values are 1 or 1/2, so the sums are exact whatever
+  // order they're added in, and recording from several threads has to give bit for
+  // bit the trees a single thread does. Plain threads rather than tbb, so they
+  // overlap even on a single core, where they need to run for a good number of time
+  // slices to get preempted in the middle of an update
+  bool CheckGuidingRecord()
+  {
+    const int NUM_THREADS = 8;
+    const int NUM_RECORDS = 1 << 16;
+    const int NUM_REPEATS = 32;
+
+    // mostly around +z, so the refined tree is a few levels deep there
+    Pcg32 rng(3, 0);
+    vector<Vector3> dirs(NUM_RECORDS);
+    vector<float> values(NUM_RECORDS);
+    for (int i = 0; i < NUM_RECORDS; ++i)
+    {
+      Vector2 u(rng.NextFloat(), rng.NextFloat());
+      dirs[i] = i % 4 ? UniformCone(u, 0.8f) : UniformSphere(u);
+      values[i] = rng.Next() & 1 ? 1 : 0.5f;
+    }
+
+    auto recordAll = [&](int numThreads, const std::function<void(int)>& record)
+    {
+      vector<std::thread> threads;
+      for (int t = 0; t < numThreads; ++t)
+      {
+        threads.push_back(std::thread([&, t]
+        {
+          for (int j = 0; j < NUM_REPEATS; ++j)
+          {
+            for (int i = t; i < NUM_RECORDS; i += numThreads)
+              record(i);
+          }
+        }));
+      }
+      for (std::thread& thread : threads)
+        thread.join();
+    };
+
+    bool ok = true;
+
+    // a directional tree, refined from a first pass so the records go several levels down
+    DTree seed;
+    for (int i = 0; i < NUM_RECORDS / 16; ++i)
+      seed.Record(dirs[i], values[i]);
+    DTree serial = seed.Refined(0.01f, 20);
+    DTree parallel = serial;
+    ok &= Expect("the refined tree should be subdivided", serial.nodes.size() > 16);
+
+    recordAll(1, [&](int i) { serial.Record(dirs[i], values[i]); });
+    recordAll(NUM_THREADS, [&](int i) { parallel.Record(dirs[i], values[i]); });
+    bool same = serial.nodes.size() == parallel.nodes.size();
+    for (size_t i = 0; same && i < serial.nodes.size(); ++i)
+    {
+      for (int q = 0; q < 4; ++q)
+        same &= serial.nodes[i].sum[q] == parallel.nodes[i].sum[q];
+    }
+    ok &= Expect("a directional tree recorded from several threads should match one recorded from one", same);
+
+    // A spatial tree, with the split threshold just under the number of records, so
+    // it only splits if the count didn't lose any. The split halves it, on x
+    Aabb bounds(Vector3(-1, -1, -1), Vector3(1, 1, 1));
+    SDTree serialTree, parallelTree;
+    for (SDTree* tree : { &serialTree, &parallelTree })
+    {
+      tree->spatialThreshold = NUM_RECORDS * NUM_REPEATS - 1;
+      tree->Init(bounds);
+    }
+    recordAll(1, [&](int i) { serialTree.Record(0, dirs[i], values[i]); });
+    recordAll(NUM_THREADS, [&](int i) { parallelTree.Record(0, dirs[i], values[i]); });
+    serialTree.EndPass();
+    parallelTree.EndPass();
+
+    Vector3 left(-0.5f, 0, 0), right(0.5f, 0, 0);
+    ok &= Expect("a spatial tree recorded from several threads should count every path",
+        parallelTree.Leaf(left) != parallelTree.Leaf(right));
+    bool samePdf = true;
+    for (int i = 0; i < 1024; ++i)
+    {
+      Vector3 dir = UniformSphere(Vector2(rng.NextFloat(), rng.NextFloat()));
+      samePdf &= serialTree.Pdf(serialTree.Leaf(left), dir) == parallelTree.Pdf(parallelTree.Leaf(left), dir);
+    }
+    ok &= Expect("a spatial tree recorded from several threads should learn what one recorded from one does", samePdf);
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  // White furnace: the camera inside a sphere that emits 1 and reflects albedo of
+  // it, so every path should see 1 / (1 - albedo) in the end, however the albedo is
+  // split between the lobes. Rendered through PathTrace, with the russian roulette
+  // on and a max depth that cuts off a negligible tail, and with the irradiance
+  // cache and path guiding. The resampled direct light isn't, as its candidates
+  // can't come from an emitter around the point. With a low max depth, a diffuse
+  // path adds up albedo^i to i = max depth, as the light at the last vertex is
+  // still sampled
+  bool CheckFurnace()
+  {
+    const int NUM_PASSES = 64;
+    const float TOLERANCE = 0.01f;
+
+    struct Setup
+    {
+      const char* name;
+      float diffuse;
+      float specular;
+      int minDepth;
+      int maxDepth;
+      bool irradianceCache;
+      bool pathGuiding;
+    };
+    const Setup setups[] = {
+      { "diffuse", 0.8f, 0, 3, 64, false, false },
+      { "specular", 0, 0.8f, 3, 64, false, false },
+      { "mixed", 0.5f, 0.3f, 3, 64, false, false },
+      { "low albedo", 0.2f, 0.1f, 3, 64, false, false },
+      { "roulette from the start", 0.8f, 0, 1, 64, false, false },
+      { "two bounces", 0.8f, 0, 3, 2, false, false },
+      { "guided", 0.5f, 0.3f, 3, 64, false, true },
+      { "cached", 0.8f, 0, 3, 64, true, false },
+    };
+
+    Material material(Color(0, 0, 0), Color(0, 0, 0), Color(1, 1, 1));
+    Sphere furnace(Vector3(0, 0, 0), 10);
+    furnace.material = &material;
+    objects.assign(1, &furnace);
+    emitters.assign(1, &furnace);
+
+    Camera cam;
+    cam.fov = DegToRad(60);
+    cam.dist = 1;
+    cam.LookAt(Vector3(1, 2, 3), Vector3(0, 1, 0), Vector3(0, 0, 10));
+    Buffer buffer(32, 32);
+
+    bool ok = true;
+    for (const Setup& setup : setups)
+    {
+      material.diffuse = Color(setup.diffuse, setup.diffuse, setup.diffuse);
+      material.specular = Color(setup.specular, setup.specular, setup.specular);
+      RenderSettings settings;
+      settings.pathTrace = true;
+      settings.irradianceCache = setup.irradianceCache;
+      settings.pathGuiding = setup.pathGuiding;
+      settings.minDepth = setup.minDepth;
+      settings.maxDepth = setup.maxDepth;
+
+      Accumulator acc;
+      acc.Init(buffer, 0);
+      PathTrace(cam, settings, &acc, NUM_PASSES, &buffer);
+
+      double sum = 0;
+      for (int y = 0; y < buffer.height; ++y)
+      {
+        for (int x = 0; x < buffer.width; ++x)
+          sum += buffer.Row(y)[x].x;
+      }
+      float mean = (float)(sum / (buffer.width * buffer.height));
+      float albedo = setup.diffuse + setup.specular;
+      float expected = (1 - powf(albedo, (float)setup.maxDepth + 1)) / (1 - albedo);
+      if (fabsf(mean / expected - 1) >= TOLERANCE)
+      {
+        printf("  %s: %.4f instead of %.4f\n", setup.name, mean, expected);
+        ok = false;
+      }
+    }
+
+    objects.clear();
+    emitters.clear();
+    return ok;
+  }
+
+  //---------------------------------------------------------------------------
+  double RelativeRmse(const Buffer& a, const Buffer& reference)
+  {
+    double err = 0, ref = 0;
+    for (int i = 0; i < a.width * a.height; ++i)
+    {
+      for (int c = 0; c < 3; ++c)
+      {
+        err += Sq(a.buffer[i][c] - reference.buffer[i][c]);
+        ref += Sq(reference.buffer[i][c]);
+      }
+    }
+    return sqrt(err / ref);
+  }
+
+  //---------------------------------------------------------------------------
+  // Colored balls on a floor under a sphere light, path traced at 4 samples per
+  // pixel, with the guides. Denoised, it should be clearly closer to a 256 sample
+  // render than the input was, and the guides should be what keeps the edges:
+  // filtering on the color alone should do worse. The lamp is above the frame and
+  // nothing is shiny, as a few pixels of lamp or highlight would swamp the error
+  // with aliasing that no filter removes
+  bool CheckDenoiser()
+  {
+    const int NUM_PASSES = 4;
+    const int NUM_REFERENCE_PASSES = 256;
+
+    Color zero(0, 0, 0);
+    Material floor(Color(0.6f, 0.6f, 0.6f), zero, zero);
+    Material red(Color(0.7f, 0.1f, 0.1f), zero, zero);
+    Material blue(Color(0.1f, 0.2f, 0.7f), zero, zero);
+    Material white(Color(0.8f, 0.8f, 0.8f), zero, zero);
+    Material lamp(zero, zero, Color(20, 20, 20));
+    Plane plane(Vector3(0, 1, 0), 0);
+    Sphere balls[] = { Sphere(Vector3(-3, 1.5f, 8), 1.5f), Sphere(Vector3(0, 1, 6), 1), Sphere(Vector3(3, 2, 9), 2),
+      Sphere(Vector3(0, 12, 4), 2) };
+    plane.material = &floor;
+    balls[0].material = &red;
+    balls[1].material = &white;
+    balls[2].material = &blue;
+    balls[3].material = &lamp;
+    objects = { &plane, &balls[0], &balls[1], &balls[2], &balls[3] };
+    emitters = { &balls[3] };
+    AssignIds(objects);
+
+    Camera cam;
+    cam.fov = DegToRad(60);
+    cam.dist = 1;
+    cam.LookAt(Vector3(0, 4, -4), Vector3(0, 1, 0), Vector3(0, 1, 8));
+    RenderSettings settings;
+    settings.pathTrace = true;
+
+    // different seeds, so the reference's first passes aren't the noisy render's
+    Buffer noisy(96, 64), reference(96, 64), denoised(96, 64), flat(96, 64), flatDenoised(96, 64);
+    noisy.EnableAovs(AOV_DENOISE_GUIDES);
+    Accumulator acc;
+    acc.Init(noisy, 0);
+    PathTrace(cam, settings, &acc, NUM_PASSES, &noisy);
+    acc.Init(reference, 1);
+    PathTrace(cam, settings, &acc, NUM_REFERENCE_PASSES, &reference);
+
+    Denoiser denoiser;
+    denoiser.Run(noisy, &denoised);
+    memcpy(flat.buffer, noisy.buffer, sizeof(Color) * noisy.width * noisy.height);
+    denoiser.Run(flat, &flatDenoised);
+
+    double noisyRmse = RelativeRmse(noisy, reference);
+    double denoisedRmse = RelativeRmse(denoised, reference);
+    double flatRmse = RelativeRmse(flatDenoised, reference);
+
+    bool ok = true;
+    ok &= Expect("denoising should lower the error by more than 15%", denoisedRmse < 0.85 * noisyRmse);
+    ok &= Expect("the guides should lower the error", denoisedRmse < flatRmse);
+    if (!ok)
+      printf("  relative rmse %.4f noisy, %.4f denoised, %.4f denoised without guides\n", noisyRmse, denoisedRmse, flatRmse);
+
+    objects.clear();
+    emitters.clear();
+    return ok;
+  }
+}
+
+//---------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  SelectKernels(argc, argv);
+
+  const char* only = nullptr;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "--only=", 7) == 0)
+      only = argv[i] + 7;
+  }
+
+  struct Check
+  {
+    const char* name;
+    std::function<bool()> run;
+  };
+  const Check checks[] = {
+    { "mesh round trip", CheckMeshRoundTrip },
+    { "tri mesh", CheckTriMesh },
+    { "cluster cache", CheckClusterCache },
+    { "display encoder", CheckDisplayEncoder },
+    { "light bvh", CheckLightBvh },
+    { "direct light resampler", CheckDirectLightResampler },
+    { "irradiance cache", CheckIrradianceCache },
+    { "guiding record", CheckGuidingRecord },
+    { "furnace", CheckFurnace },
+    { "denoiser", CheckDenoiser },
+  };
+
+  bool ok = true;
+  for (const Check& check : checks)
+  {
+    if (only && strcmp(only, check.name) != 0)
+      continue;
+    bool res = check.run();
+    printf("%-32s %s\n", check.name, res ? "ok" : "FAILED");
+    ok &= res;
+  }
+
+  return ok ? 0 : 1;
+}
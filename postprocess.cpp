@@ -0,0 +1,246 @@
+#include "postprocess.hpp"
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+using namespace pbr;
+
+namespace
+{
+  // guess of average screen maximum brightness
+  const float DISPLAY_LUMINANCE_MAX = 200.0f;
+
+  // clamp luminance to a perceptual minimum
+  const float MIN_LUMINANCE = 1e-4f;
+
+  // pixels per task for the luminance reduction
+  const int LUMINANCE_GRAIN_SIZE = 16 * 1024;
+
+  //---------------------------------------------------------------------------
+  Color IdColor(u32 id)
+  {
+    if (id == INVALID_ID)
+      return Color(0, 0, 0);
+
+    // integer hash, so neighbouring ids get unrelated colors
+    id ^= id >> 16;
+    id *= 0x7feb352d;
+    id ^= id >> 15;
+    id *= 0x846ca68b;
+    id ^= id >> 16;
+    return Color((id & 0xff) / 255.f, ((id >> 8) & 0xff) / 255.f, ((id >> 16) & 0xff) / 255.f);
+  }
+}
+
+//---------------------------------------------------------------------------
+void GammaLut::Init(float g)
+{
+  gamma = g;
+  for (int i = 0; i < GAMMA_LUT_SIZE; ++i)
+  {
+    float s = i / (float)(GAMMA_LUT_SIZE - 1);
+    table[i] = (s32)(Clamp(powf(s * s, gamma)) * 255);
+  }
+}
+
+//---------------------------------------------------------------------------
+float pbr::LogAverageLuminance(const Color* pixels, int count)
+{
+  if (count == 0)
+    return MIN_LUMINANCE;
+
+  // each task sums its range in the kernel, and the partial sums are combined in
+  // double, so the result doesn't drift with the image size
+  const KernelTable& kernels = Kernels();
+  double sumOfLogs = tbb::parallel_reduce(tbb::blocked_range<int>(0, count, LUMINANCE_GRAIN_SIZE),
+      0.0,
+      [&](const tbb::blocked_range<int>& r, double sum)
+      {
+        return sum + kernels.logLuminanceSum(pixels + r.begin(), (int)r.size(), MIN_LUMINANCE);
+      },
+      [](double a, double b) { return a + b; });
+
+  return (float)pow(10.0, sumOfLogs / count);
+}
+
+//---------------------------------------------------------------------------
+float pbr::ToneMapScale(float adaptLuminance)
+{
+  // make scale-factor from:
+  // ratio of minimum visible differences in luminance, in display-adapted
+  // and world-adapted perception (discluding the constant that cancelled),
+  // divided by display max to yield a [0,1] range
+  const float a = 1.219f + powf(DISPLAY_LUMINANCE_MAX * 0.25f, 0.4f);
+  const float b = 1.219f + powf(adaptLuminance, 0.4f);
+
+  return powf(a / b, 2.5f) / DISPLAY_LUMINANCE_MAX;
+}
+
+//---------------------------------------------------------------------------
+void pbr::EncodeDisplay(const Color* src,
+    int width,
+    int height,
+    float scale,
+    const GammaLut& lut,
+    Color32* dest)
+{
+  const KernelTable& kernels = Kernels();
+  tbb::parallel_for(tbb::blocked_range<int>(0, height),
+      [&](const tbb::blocked_range<int>& r)
+      {
+        for (int y = r.begin(); y != r.end(); ++y)
+        {
+          size_t ofs = (size_t)y * width;
+          kernels.toneMapRow(src + ofs, dest + ofs, width, scale, lut.table);
+        }
+      });
+}
+
+//---------------------------------------------------------------------------
+bool pbr::VisualizeAov(const Buffer& src, u32 aov, Buffer* dst)
+{
+  assert(src.width == dst->width && src.height == dst->height);
+  if (!src.HasAov(aov))
+    return false;
+
+  u32 maxCount = 1;
+  if (aov == AOV_SAMPLE_COUNT)
+    maxCount = max(maxCount, *max_element(src.sampleCount.begin(), src.sampleCount.end()));
+
+  int width = src.width;
+  tbb::parallel_for(0, src.height, [&](int y)
+  {
+    for (int x = 0; x < width; ++x)
+    {
+      size_t idx = (size_t)y * width + x;
+      Color c(0, 0, 0);
+      switch (aov)
+      {
+        case AOV_DEPTH:
+          // squash the depth into [0, 1), with the near range getting most of it
+          c = Color(1, 1, 1) * (src.depth[idx] / (src.depth[idx] + 10.f));
+          break;
+        case AOV_NORMAL:
+          c = Color(src.normal[0][idx], src.normal[1][idx], src.normal[2][idx]) * 0.5f
+              + Color(0.5f, 0.5f, 0.5f);
+          break;
+        case AOV_ALBEDO:
+          c = Color(src.albedo[0][idx], src.albedo[1][idx], src.albedo[2][idx]);
+          break;
+        case AOV_MATERIAL_ID: c = IdColor(src.materialId[idx]); break;
+        case AOV_OBJECT_ID: c = IdColor(src.objectId[idx]); break;
+        case AOV_SAMPLE_COUNT:
+          c = Color(1, 1, 1) * ((float)src.sampleCount[idx] / maxCount);
+          break;
+      }
+      c.w = 1;
+      dst->buffer[idx] = c;
+    }
+  });
+
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void AutoExposure::Init(const Buffer& buffer)
+{
+  tiles.clear();
+  tiles.resize(buffer.NumTiles());
+  memset(counts, 0, sizeof(counts));
+  memset(sums, 0, sizeof(sums));
+  adapted = false;
+}
+
+//---------------------------------------------------------------------------
+void AutoExposure::TileDone(const Buffer& buffer, int tileIdx)
+{
+  Tile tile = buffer.GetTile(tileIdx);
+  int tileWidth = tile.x1 - tile.x0;
+  const KernelTable& kernels = Kernels();
+
+  // build the new histogram for the tile outside the lock
+  TileHistogram hist;
+  vector<float> row(tileWidth);
+  const float binScale = NUM_BINS / (float)(MAX_LOG2 - MIN_LOG2);
+  for (int y = tile.y0; y < tile.y1; ++y)
+  {
+    kernels.logLuminanceRow(buffer.Row(y) + tile.x0, tileWidth, MIN_LUMINANCE, row.data());
+    for (int x = 0; x < tileWidth; ++x)
+    {
+      int bin = min(max((int)((row[x] - MIN_LOG2) * binScale), 0), NUM_BINS - 1);
+      hist.bins[bin].count++;
+      hist.bins[bin].sumLog2 += row[x];
+    }
+  }
+
+  // swap it with the old one, and update the totals by the difference
+  tbb::spin_mutex::scoped_lock lock(mutex);
+  TileHistogram& old = tiles[tileIdx];
+  for (int i = 0; i < NUM_BINS; ++i)
+  {
+    counts[i] = counts[i] + hist.bins[i].count - old.bins[i].count;
+    sums[i] += (double)hist.bins[i].sumLog2 - old.bins[i].sumLog2;
+  }
+  old = hist;
+}
+
+//---------------------------------------------------------------------------
+float AutoExposure::TargetLog2Luminance() const
+{
+  u64 binCounts[NUM_BINS];
+  double binSums[NUM_BINS];
+  {
+    tbb::spin_mutex::scoped_lock lock(mutex);
+    memcpy(binCounts, counts, sizeof(counts));
+    memcpy(binSums, sums, sizeof(sums));
+  }
+
+  u64 total = 0;
+  for (int i = 0; i < NUM_BINS; ++i)
+    total += binCounts[i];
+
+  if (total == 0)
+    return log2f(MIN_LUMINANCE);
+
+  // average over the pixels between the percentiles, taking partial bins at the ends
+  double lo = lowPercentile * total;
+  double hi = highPercentile * total;
+  double acc = 0;
+  double sum = 0;
+  double weight = 0;
+  for (int i = 0; i < NUM_BINS; ++i)
+  {
+    if (binCounts[i] == 0)
+      continue;
+
+    double start = acc;
+    acc += binCounts[i];
+    double inside = min(acc, hi) - max(start, lo);
+    if (inside <= 0)
+      continue;
+
+    // use the mean of the bin for the pixels that are included
+    sum += inside * binSums[i] / binCounts[i];
+    weight += inside;
+  }
+
+  return weight > 0 ? (float)(sum / weight) : log2f(MIN_LUMINANCE);
+}
+
+//---------------------------------------------------------------------------
+float AutoExposure::Update(float dt, bool adapt)
+{
+  float target = TargetLog2Luminance();
+  if (!adapt || !adapted)
+  {
+    adaptedLog2 = target;
+    adapted = true;
+  }
+  else
+  {
+    // exponential decay towards the target, in stops so brightening and darkening
+    // take the same time
+    adaptedLog2 += (target - adaptedLog2) * (1 - expf(-dt * adaptationSpeed));
+  }
+
+  return ToneMapScale(exp2f(adaptedLog2));
+}
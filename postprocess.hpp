@@ -0,0 +1,88 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "kernel_table.hpp"
+#include "buffer.hpp"
+#include <tbb/spin_mutex.h>
+
+namespace pbr
+{
+  // ITU-R BT.709 standard gamma
+  const float GAMMA_ENCODE = 0.45f;
+
+  //---------------------------------------------------------------------------
+  // 8-bit gamma encode of [0, 1], indexed by sqrt(x) so more of the table goes to
+  // the dark end of the range, where the curve is steepest
+  struct GammaLut
+  {
+    void Init(float gamma);
+    float gamma = 0;
+    s32 table[GAMMA_LUT_SIZE];
+  };
+
+  // log-average luminance of the image, as an estimate of the world adaptation level
+  float LogAverageLuminance(const Color* pixels, int count);
+
+  // scale factor that maps the adaptation luminance to the display range
+  float ToneMapScale(float adaptLuminance);
+
+  // scale the pixels, and gamma encode them straight into dest
+  void EncodeDisplay(const Color* src,
+      int width,
+      int height,
+      float scale,
+      const GammaLut& lut,
+      Color32* dest);
+
+  // writes a false color view of one of src's AOVs into dst, which must be the
+  // same size. Returns false if the AOV isn't enabled
+  bool VisualizeAov(const Buffer& src, u32 aov, Buffer* dst);
+
+  //---------------------------------------------------------------------------
+  // Exposure from a histogram of log luminance, that's updated as tiles finish. Each
+  // tile keeps its own histogram, so a re-rendered tile replaces its old counts
+  // instead of adding to them. Getting the exposure only touches the bins, so the
+  // per frame cost doesn't depend on the resolution.
+  struct AutoExposure : public TileListener
+  {
+    static const int NUM_BINS = 128;
+    // log2 luminance range covered by the bins, anything outside is clamped
+    static const int MIN_LOG2 = -14;
+    static const int MAX_LOG2 = 10;
+
+    void Init(const Buffer& buffer);
+    virtual void TileDone(const Buffer& buffer, int tileIdx);
+
+    // log2 of the average luminance, skipping the darkest and brightest pixels
+    float TargetLog2Luminance() const;
+
+    // moves the adapted luminance towards the target, and returns the tone map scale.
+    // Without adaptation (or on the first call) it jumps straight to the target
+    float Update(float dt, bool adapt);
+
+    // fraction of the pixels at either end of the histogram to ignore
+    float lowPercentile = 0.05f;
+    float highPercentile = 0.95f;
+    // rate of adaptation, per second
+    float adaptationSpeed = 1.5f;
+
+    struct Bin
+    {
+      u32 count = 0;
+      float sumLog2 = 0;
+    };
+
+    struct TileHistogram
+    {
+      Bin bins[NUM_BINS];
+    };
+
+    vector<TileHistogram> tiles;
+    // sum of the tile histograms
+    u64 counts[NUM_BINS];
+    double sums[NUM_BINS];
+    mutable tbb::spin_mutex mutex;
+
+    float adaptedLog2 = 0;
+    bool adapted = false;
+  };
+}
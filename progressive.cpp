@@ -0,0 +1,622 @@
+#include "progressive.hpp"
+#include "sample_patterns.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  const u32 CHECKPOINT_MAGIC = 0x43524250; // 'PBRC'
+  const u32 CHECKPOINT_VERSION = 2;
+  const u32 FILM_MAGIC = 0x46524250; // 'PBRF'
+  const u32 FILM_VERSION = 1;
+
+  const u32 FLAG_VARIANCE = 1 << 0;
+
+  const u32 PASS_PATTERN_SIZE = 256;
+
+  const double FIXED_ONE = (double)(1ll << ACCUM_FIXED_BITS);
+
+  struct CheckpointHeader
+  {
+    u32 magic;
+    u32 version;
+    s32 width;
+    s32 height;
+    s32 tileSize;
+    s32 numTiles;
+    u64 seed;
+    u32 firstPass;
+    u32 flags;
+  };
+
+  // Each tile has a slot of the same size, so tiles can be rewritten in place. After
+  // the header come the sums, the squared sums if enabled, and the counts, with the
+  // tile's rows packed together.
+  struct SlotHeader
+  {
+    u32 passes;
+    u32 checksum;
+  };
+
+  struct FilmHeader
+  {
+    u32 magic;
+    u32 version;
+    s32 width;
+    s32 height;
+    s32 tileSize;
+    u32 flags;
+    u64 seed;
+    u32 firstPass;
+    u32 numPasses;
+  };
+
+  //---------------------------------------------------------------------------
+  bool Seek(FILE* f, u64 ofs)
+  {
+#ifdef _WIN32
+    return _fseeki64(f, (s64)ofs, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)ofs, SEEK_SET) == 0;
+#endif
+  }
+
+  //---------------------------------------------------------------------------
+  u32 Checksum(u32 passes, const u8* data, size_t len)
+  {
+    // fnv-1a
+    u32 hash = 2166136261u ^ passes;
+    for (size_t i = 0; i < len; ++i)
+      hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+  }
+
+  //---------------------------------------------------------------------------
+  int NumTiles(const Accumulator& acc)
+  {
+    return ((acc.width + acc.tileSize - 1) / acc.tileSize)
+           * ((acc.height + acc.tileSize - 1) / acc.tileSize);
+  }
+
+  //---------------------------------------------------------------------------
+  bool IsComplete(const Accumulator& acc)
+  {
+    for (u32 passes : acc.tilePasses)
+    {
+      if (passes != acc.tilePasses[0])
+        return false;
+    }
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+  size_t TileDataSize(const Accumulator& acc)
+  {
+    size_t tilePixels = (size_t)acc.tileSize * acc.tileSize;
+    size_t sums = tilePixels * 3 * sizeof(s64);
+    return sums * (acc.hasVariance ? 2 : 1) + tilePixels * sizeof(u32);
+  }
+
+  //---------------------------------------------------------------------------
+  // copies a tile's rows out of a plane with channels values per pixel, packing them
+  // together
+  template <typename T>
+  void PackRows(const vector<T>& plane, int width, int channels, const Tile& tile, u8* dst)
+  {
+    size_t rowSize = (size_t)(tile.x1 - tile.x0) * channels * sizeof(T);
+    for (int y = tile.y0; y < tile.y1; ++y)
+    {
+      memcpy(dst, &plane[((size_t)y * width + tile.x0) * channels], rowSize);
+      dst += rowSize;
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  template <typename T>
+  void UnpackRows(const u8* src, int width, int channels, const Tile& tile, vector<T>* plane)
+  {
+    size_t rowSize = (size_t)(tile.x1 - tile.x0) * channels * sizeof(T);
+    for (int y = tile.y0; y < tile.y1; ++y)
+    {
+      memcpy(&(*plane)[((size_t)y * width + tile.x0) * channels], src, rowSize);
+      src += rowSize;
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // the planes of a tile in slot layout, each with room for a full tile
+  void PackTile(const Accumulator& acc, const Tile& tile, u8* data)
+  {
+    size_t sumsSize = (size_t)acc.tileSize * acc.tileSize * 3 * sizeof(s64);
+    PackRows(acc.sum, acc.width, 3, tile, data);
+    data += sumsSize;
+    if (acc.hasVariance)
+    {
+      PackRows(acc.sumSq, acc.width, 3, tile, data);
+      data += sumsSize;
+    }
+    PackRows(acc.count, acc.width, 1, tile, data);
+  }
+
+  //---------------------------------------------------------------------------
+  void UnpackTile(const u8* data, const Tile& tile, Accumulator* acc)
+  {
+    size_t sumsSize = (size_t)acc->tileSize * acc->tileSize * 3 * sizeof(s64);
+    UnpackRows(data, acc->width, 3, tile, &acc->sum);
+    data += sumsSize;
+    if (acc->hasVariance)
+    {
+      UnpackRows(data, acc->width, 3, tile, &acc->sumSq);
+      data += sumsSize;
+    }
+    UnpackRows(data, acc->width, 1, tile, &acc->count);
+  }
+
+  //---------------------------------------------------------------------------
+  template <typename T>
+  bool WritePlane(const vector<T>& plane, FILE* f)
+  {
+    return fwrite(plane.data(), sizeof(T), plane.size(), f) == plane.size();
+  }
+
+  //---------------------------------------------------------------------------
+  template <typename T>
+  bool ReadPlane(FILE* f, vector<T>* plane)
+  {
+    return fread(plane->data(), sizeof(T), plane->size(), f) == plane->size();
+  }
+
+  //---------------------------------------------------------------------------
+  bool ReadFilmHeader(const char* filename, FilmHeader* header)
+  {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+      return false;
+
+    bool ok = fread(header, sizeof(*header), 1, f) == 1 && header->magic == FILM_MAGIC
+              && header->version == FILM_VERSION;
+    fclose(f);
+    return ok;
+  }
+}
+
+//---------------------------------------------------------------------------
+ImagePlane pbr::MakeImagePlane(const Camera& cam, const Buffer& buffer)
+{
+  // Compute size of the image plane. This is the plane at distance d from the
+  // camera that we will shoot rays through (without AA, one ray per pixel).
+  // The size of the image plane depends on 'd' and the camera fov. For the y
+  // size, the aspect ratio also matters.
+
+  float halfWidth = cam.dist * tanf(cam.fov / 2);
+  float imagePlaneWidth = 2 * halfWidth;
+  float imagePlaneHeight = imagePlaneWidth * buffer.height / buffer.width;
+
+  ImagePlane plane;
+  plane.xInc = imagePlaneWidth / (buffer.width - 1);
+  plane.yInc = -imagePlaneHeight / (buffer.height - 1);
+  plane.p = cam.frame.origin - halfWidth * cam.frame.right + imagePlaneHeight / 2 * cam.frame.up
+            + cam.dist * cam.frame.dir;
+  return plane;
+}
+
+//---------------------------------------------------------------------------
+Vector2 pbr::PassJitter(u64 seed, u32 pixel, u32 absPass)
+{
+  // The passes step through a multi-jittered pattern, so a pixel's samples are
+  // stratified, and each pixel shifts the pattern by its own amount (changed every
+  // time the pattern wraps) so neighbours don't match
+  const SamplePattern<PASS_PATTERN_SIZE>& passPattern =
+      BakedPattern<PatternType::MultiJittered, PASS_PATTERN_SIZE>::table;
+  u32 patternIdx = absPass % PASS_PATTERN_SIZE;
+  u64 shift = MixBits(seed ^ MixBits(((u64)(absPass / PASS_PATTERN_SIZE) << 32) | pixel));
+  float jx = passPattern.x[patternIdx] * 0.5f + 0.5f + (shift & 0xffffff) * (1.f / (1 << 24));
+  float jy = passPattern.y[patternIdx] * 0.5f + 0.5f + ((shift >> 24) & 0xffffff) * (1.f / (1 << 24));
+  return Vector2(jx - floorf(jx) - 0.5f, jy - floorf(jy) - 0.5f);
+}
+
+//---------------------------------------------------------------------------
+void Accumulator::Init(const Buffer& buffer, u64 s, u32 first, bool variance)
+{
+  width = buffer.width;
+  height = buffer.height;
+  tileSize = buffer.tileSize;
+  seed = s;
+  firstPass = first;
+  hasVariance = variance;
+
+  size_t numPixels = (size_t)width * height;
+  sum.assign(numPixels * 3, 0);
+  if (hasVariance)
+    sumSq.assign(numPixels * 3, 0);
+  else
+    vector<s64>().swap(sumSq);
+  count.assign(numPixels, 0);
+  tilePasses.assign(buffer.NumTiles(), 0);
+}
+
+//---------------------------------------------------------------------------
+void Accumulator::AddSample(size_t idx, const Color& c)
+{
+  // rounded to fixed point first, after that the adds are exact
+  s64* s = &sum[idx * 3];
+  for (int i = 0; i < 3; ++i)
+    s[i] += llround(c[i] * FIXED_ONE);
+
+  if (hasVariance)
+  {
+    s64* sq = &sumSq[idx * 3];
+    for (int i = 0; i < 3; ++i)
+      sq[i] += llround((double)c[i] * c[i] * FIXED_ONE);
+  }
+
+  ++count[idx];
+}
+
+//---------------------------------------------------------------------------
+Color Accumulator::Mean(size_t idx) const
+{
+  if (count[idx] == 0)
+    return Color(0, 0, 0, 0);
+
+  const s64* s = &sum[idx * 3];
+  double scale = 1.0 / (FIXED_ONE * count[idx]);
+  return Color((float)(s[0] * scale), (float)(s[1] * scale), (float)(s[2] * scale), 1);
+}
+
+//---------------------------------------------------------------------------
+Color Accumulator::Variance(size_t idx) const
+{
+  u32 n = count[idx];
+  if (!hasVariance || n < 2)
+    return Color(0, 0, 0, 0);
+
+  const s64* s = &sum[idx * 3];
+  const s64* sq = &sumSq[idx * 3];
+  Color res(0, 0, 0, 0);
+  for (int i = 0; i < 3; ++i)
+  {
+    double mean = s[i] / (FIXED_ONE * n);
+    double meanSq = sq[i] / (FIXED_ONE * n);
+    res[i] = (float)max(0.0, (meanSq - mean * mean) * n / (n - 1));
+  }
+  return res;
+}
+
+//---------------------------------------------------------------------------
+void Accumulator::ResetTile(const Buffer& buffer, int tileIdx)
+{
+  Tile tile = buffer.GetTile(tileIdx);
+  for (int y = tile.y0; y < tile.y1; ++y)
+  {
+    size_t ofs = (size_t)y * width;
+    fill(sum.begin() + (ofs + tile.x0) * 3, sum.begin() + (ofs + tile.x1) * 3, 0);
+    if (hasVariance)
+      fill(sumSq.begin() + (ofs + tile.x0) * 3, sumSq.begin() + (ofs + tile.x1) * 3, 0);
+    fill(count.begin() + ofs + tile.x0, count.begin() + ofs + tile.x1, 0);
+  }
+  tilePasses[tileIdx] = 0;
+}
+
+//---------------------------------------------------------------------------
+void Accumulator::Resolve(int tileIdx, Buffer* buffer) const
+{
+  Tile tile = buffer->GetTile(tileIdx);
+  for (int y = tile.y0; y < tile.y1; ++y)
+  {
+    Color* dst = buffer->Row(y);
+    for (int x = tile.x0; x < tile.x1; ++x)
+      dst[x] = Mean((size_t)y * width + x);
+  }
+}
+
+//---------------------------------------------------------------------------
+u32 Accumulator::MinPasses() const
+{
+  return tilePasses.empty() ? 0 : *min_element(tilePasses.begin(), tilePasses.end());
+}
+
+//---------------------------------------------------------------------------
+bool Accumulator::Merge(const Accumulator& other)
+{
+  if (other.width != width || other.height != height || other.tileSize != tileSize
+      || other.seed != seed || other.hasVariance != hasVariance || !IsComplete(*this)
+      || !IsComplete(other))
+    return false;
+
+  // the pass ranges have to line up, or some passes would be missing or counted twice
+  u32 passes = MinPasses();
+  u32 otherPasses = other.MinPasses();
+  if (other.firstPass + otherPasses == firstPass)
+    firstPass = other.firstPass;
+  else if (other.firstPass != firstPass + passes)
+    return false;
+
+  for (size_t i = 0; i < sum.size(); ++i)
+    sum[i] += other.sum[i];
+  for (size_t i = 0; i < sumSq.size(); ++i)
+    sumSq[i] += other.sumSq[i];
+  for (size_t i = 0; i < count.size(); ++i)
+    count[i] += other.count[i];
+  tilePasses.assign(tilePasses.size(), passes + otherPasses);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+bool pbr::SaveFilm(const char* filename, const Accumulator& acc)
+{
+  if (!IsComplete(acc))
+    return false;
+
+  FILE* f = fopen(filename, "wb");
+  if (!f)
+    return false;
+
+  FilmHeader header = {FILM_MAGIC,
+      FILM_VERSION,
+      acc.width,
+      acc.height,
+      acc.tileSize,
+      acc.hasVariance ? FLAG_VARIANCE : 0,
+      acc.seed,
+      acc.firstPass,
+      acc.MinPasses()};
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && WritePlane(acc.count, f)
+            && WritePlane(acc.sum, f) && (!acc.hasVariance || WritePlane(acc.sumSq, f));
+  ok &= fclose(f) == 0;
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+bool pbr::LoadFilm(const char* filename, Accumulator* acc)
+{
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    return false;
+
+  FilmHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != FILM_MAGIC
+      || header.version != FILM_VERSION || header.width <= 0 || header.height <= 0
+      || header.tileSize <= 0)
+  {
+    fclose(f);
+    return false;
+  }
+
+  acc->width = header.width;
+  acc->height = header.height;
+  acc->tileSize = header.tileSize;
+  acc->seed = header.seed;
+  acc->firstPass = header.firstPass;
+  acc->hasVariance = (header.flags & FLAG_VARIANCE) != 0;
+
+  size_t numPixels = (size_t)acc->width * acc->height;
+  acc->count.resize(numPixels);
+  acc->sum.resize(numPixels * 3);
+  acc->sumSq.resize(acc->hasVariance ? numPixels * 3 : 0);
+  acc->tilePasses.assign(NumTiles(*acc), header.numPasses);
+
+  bool ok = ReadPlane(f, &acc->count) && ReadPlane(f, &acc->sum)
+            && (!acc->hasVariance || ReadPlane(f, &acc->sumSq));
+  fclose(f);
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+bool pbr::MergeFilms(const vector<const char*>& filenames, Accumulator* merged)
+{
+  // sort by the first pass, so each film follows on from the ones before it
+  vector<std::pair<u32, const char*>> films;
+  for (const char* filename : filenames)
+  {
+    FilmHeader header;
+    if (!ReadFilmHeader(filename, &header))
+    {
+      fprintf(stderr, "Unable to read film %s\n", filename);
+      return false;
+    }
+    films.push_back(std::make_pair(header.firstPass, filename));
+  }
+  std::sort(films.begin(), films.end());
+
+  // only one film besides the result is loaded at a time
+  Accumulator film;
+  for (size_t i = 0; i < films.size(); ++i)
+  {
+    if (!LoadFilm(films[i].second, i == 0 ? merged : &film))
+    {
+      fprintf(stderr, "Unable to read film %s\n", films[i].second);
+      return false;
+    }
+
+    if (i > 0 && !merged->Merge(film))
+    {
+      fprintf(stderr, "Film %s doesn't follow on from the others\n", films[i].second);
+      return false;
+    }
+  }
+
+  return !films.empty();
+}
+
+//---------------------------------------------------------------------------
+Checkpointer::~Checkpointer()
+{
+  Close();
+}
+
+//---------------------------------------------------------------------------
+bool Checkpointer::Open(const char* filename, const Buffer& buffer, Accumulator* acc, bool resume)
+{
+  Close();
+
+  _buffer = &buffer;
+  _acc = acc;
+  _slotSize = sizeof(SlotHeader) + TileDataSize(*acc);
+  _staged.assign(buffer.NumTiles(), vector<u8>());
+  _pending.clear();
+  _failed = false;
+  _lastFlush = std::chrono::steady_clock::now();
+  numResumed = 0;
+
+  if (resume)
+  {
+    _file = fopen(filename, "r+b");
+    if (_file && Load())
+      return true;
+
+    if (_file)
+      fclose(_file);
+  }
+
+  _file = fopen(filename, "w+b");
+  return _file && Create();
+}
+
+//---------------------------------------------------------------------------
+bool Checkpointer::Create()
+{
+  CheckpointHeader header = {CHECKPOINT_MAGIC,
+      CHECKPOINT_VERSION,
+      _buffer->width,
+      _buffer->height,
+      _buffer->tileSize,
+      _buffer->NumTiles(),
+      _acc->seed,
+      _acc->firstPass,
+      _acc->hasVariance ? FLAG_VARIANCE : 0};
+
+  if (fwrite(&header, sizeof(header), 1, _file) != 1)
+    return false;
+
+  // size the file, the zeroed slots fail their checksum so they're never loaded
+  u8 zero = 0;
+  return Seek(_file, SlotOffset(_buffer->NumTiles()) - 1) && fwrite(&zero, 1, 1, _file) == 1
+      && fflush(_file) == 0;
+}
+
+//---------------------------------------------------------------------------
+bool Checkpointer::Load()
+{
+  CheckpointHeader header;
+  if (fread(&header, sizeof(header), 1, _file) != 1 || header.magic != CHECKPOINT_MAGIC
+      || header.version != CHECKPOINT_VERSION || header.width != _buffer->width
+      || header.height != _buffer->height || header.tileSize != _buffer->tileSize
+      || header.numTiles != _buffer->NumTiles() || header.firstPass != _acc->firstPass
+      || (header.flags & FLAG_VARIANCE) != (_acc->hasVariance ? FLAG_VARIANCE : 0))
+    return false;
+
+  // the saved samples only line up with the seed they were made with
+  _acc->seed = header.seed;
+
+  vector<u8> slot(_slotSize);
+  for (int i = 0; i < _buffer->NumTiles(); ++i)
+  {
+    _acc->ResetTile(*_buffer, i);
+
+    if (!Seek(_file, SlotOffset(i)) || fread(slot.data(), 1, _slotSize, _file) != _slotSize)
+      continue;
+
+    SlotHeader slotHeader;
+    memcpy(&slotHeader, slot.data(), sizeof(slotHeader));
+    const u8* data = slot.data() + sizeof(SlotHeader);
+    if (slotHeader.checksum != Checksum(slotHeader.passes, data, _slotSize - sizeof(SlotHeader)))
+      continue;
+
+    UnpackTile(data, _buffer->GetTile(i), _acc);
+    _acc->tilePasses[i] = slotHeader.passes;
+    ++numResumed;
+  }
+
+  return true;
+}
+
+//---------------------------------------------------------------------------
+bool Checkpointer::Close()
+{
+  if (!_file)
+    return !_failed;
+
+  _tasks->wait();
+  Flush();
+  _failed |= fclose(_file) != 0;
+  _file = nullptr;
+  return !_failed;
+}
+
+//---------------------------------------------------------------------------
+u64 Checkpointer::SlotOffset(int tileIdx) const
+{
+  return sizeof(CheckpointHeader) + (u64)tileIdx * _slotSize;
+}
+
+//---------------------------------------------------------------------------
+void Checkpointer::TileDone(const Buffer& buffer, int tileIdx)
+{
+  if (!_file)
+    return;
+
+  // the tile's sums only change on the thread that just finished it, so they can be
+  // copied without a lock
+  vector<u8> slot(_slotSize, 0);
+  u8* data = slot.data() + sizeof(SlotHeader);
+  PackTile(*_acc, buffer.GetTile(tileIdx), data);
+
+  SlotHeader header;
+  header.passes = _acc->tilePasses[tileIdx];
+  header.checksum = Checksum(header.passes, data, _slotSize - sizeof(SlotHeader));
+  memcpy(slot.data(), &header, sizeof(header));
+
+  bool startFlush = false;
+  {
+    std::lock_guard<std::mutex> lock(_stageMutex);
+    if (_staged[tileIdx].empty())
+      _pending.push_back(tileIdx);
+    _staged[tileIdx].swap(slot);
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - _lastFlush > std::chrono::duration<float>(interval) && !_flushing)
+    {
+      _lastFlush = now;
+      _flushing = true;
+      startFlush = true;
+    }
+  }
+
+  // the render threads carry on while the tiles are written
+  if (startFlush)
+  {
+    _tasks->run([this]
+    {
+      Flush();
+      _flushing = false;
+    });
+  }
+}
+
+//---------------------------------------------------------------------------
+void Checkpointer::Flush()
+{
+  // take the staged tiles, so the lock isn't held while writing
+  vector<int> tiles;
+  vector<vector<u8>> slots;
+  {
+    std::lock_guard<std::mutex> lock(_stageMutex);
+    tiles.swap(_pending);
+    slots.resize(tiles.size());
+    for (size_t i = 0; i < tiles.size(); ++i)
+      slots[i].swap(_staged[tiles[i]]);
+  }
+
+  if (tiles.empty())
+    return;
+
+  std::lock_guard<std::mutex> lock(_fileMutex);
+  for (size_t i = 0; i < tiles.size(); ++i)
+  {
+    if (!Seek(_file, SlotOffset(tiles[i])) || fwrite(slots[i].data(), 1, _slotSize, _file) != _slotSize)
+      _failed = true;
+  }
+  _failed |= fflush(_file) != 0;
+}
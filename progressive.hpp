@@ -0,0 +1,132 @@
+#pragma once
+#include "buffer.hpp"
+#include <tbb/task_group.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace pbr
+{
+  // fractional bits of the accumulated sums
+  const int ACCUM_FIXED_BITS = 24;
+
+  //---------------------------------------------------------------------------
+  // Running sums for a render done in passes, on the tile grid of the buffer it's
+  // shown in. The samples for a pixel in a given pass come from a generator seeded by
+  // (seed, pixel, pass), see SeedThreadRng, so there is no sampler state to save: a
+  // tile can carry on from any pass, and a resumed render ends up bit identical to
+  // one that was never stopped (as long as it uses the same kernels).
+  //
+  // The sums are fixed point, so adding them up is exact and doesn't depend on the
+  // order. That lets renders of separate pass ranges be merged into exactly what a
+  // single render of all the passes would have given.
+  struct Accumulator
+  {
+    // passes are numbered from firstPass, so different jobs can render different
+    // ranges of the same frame
+    void Init(const Buffer& buffer, u64 seed, u32 firstPass = 0, bool variance = false);
+    void AddSample(size_t idx, const Color& c);
+    Color Mean(size_t idx) const;
+    // unbiased per channel variance of the samples, if enabled
+    Color Variance(size_t idx) const;
+
+    // clears the sums and counts of a tile
+    void ResetTile(const Buffer& buffer, int tileIdx);
+    // writes the mean of the tile's pixels
+    void Resolve(int tileIdx, Buffer* buffer) const;
+    // the lowest number of passes any tile has done
+    u32 MinPasses() const;
+
+    // Adds the samples of a render of the same frame, whose passes must pick up
+    // where ours end (or end where ours start). Both must be complete, ie. have
+    // every tile at the same pass.
+    bool Merge(const Accumulator& other);
+
+    int width = 0;
+    int height = 0;
+    int tileSize = 0;
+    u64 seed = 0;
+    u32 firstPass = 0;
+    bool hasVariance = false;
+    // rgb per pixel, in ACCUM_FIXED_BITS fixed point
+    vector<s64> sum;
+    // sum of the squared samples, rgb per pixel, if hasVariance
+    vector<s64> sumSq;
+    vector<u32> count;
+    // passes each tile has finished
+    vector<u32> tilePasses;
+  };
+
+  // A finished accumulator as a compact binary file: the header, then the counts, sums
+  // and optional squared sums as planes. Only complete accumulators can be saved.
+  bool SaveFilm(const char* filename, const Accumulator& acc);
+  bool LoadFilm(const char* filename, Accumulator* acc);
+
+  // loads the films and merges them in pass order, see Accumulator::Merge
+  bool MergeFilms(const vector<const char*>& filenames, Accumulator* merged);
+
+  //---------------------------------------------------------------------------
+  // the plane at distance d from the camera that the rays are shot through
+  struct ImagePlane
+  {
+    // top left corner
+    Vector3 p;
+    float xInc, yInc;
+  };
+
+  ImagePlane MakeImagePlane(const Camera& cam, const Buffer& buffer);
+
+  // The pixel's sample offset in a pass, in [-0.5, 0.5) pixels. It only depends on
+  // the pixel and the pass, so a resumed render jitters the same way
+  Vector2 PassJitter(u64 seed, u32 pixel, u32 absPass);
+
+  //---------------------------------------------------------------------------
+  // Periodically saves the accumulator to disk while the render carries on. Register
+  // it as a listener on the buffer; when a tile finishes its sums are copied aside,
+  // and once the interval has passed a background task writes the copied tiles in
+  // place in the file. Each tile has a checksum, so a tile that was being written
+  // when the job was killed is rendered again instead of being loaded torn.
+  struct Checkpointer : public TileListener
+  {
+    ~Checkpointer();
+
+    // Opens the checkpoint file for acc, which renders into buffer. If resume is set
+    // and the file matches the buffer's size and tiles, the saved tiles are loaded
+    // into acc (along with the seed) and the render can carry on from there.
+    // Otherwise a new file is started.
+    bool Open(const char* filename, const Buffer& buffer, Accumulator* acc, bool resume);
+    // writes out everything that's pending, and closes the file
+    bool Close();
+
+    virtual void TileDone(const Buffer& buffer, int tileIdx);
+
+    // seconds between saves
+    float interval = 30;
+    // number of tiles that were loaded by Open
+    int numResumed = 0;
+
+  private:
+    void Flush();
+    bool Create();
+    bool Load();
+    u64 SlotOffset(int tileIdx) const;
+
+    const Buffer* _buffer = nullptr;
+    Accumulator* _acc = nullptr;
+    FILE* _file = nullptr;
+    size_t _slotSize = 0;
+
+    // tile records waiting to be written, in slot layout
+    vector<vector<u8>> _staged;
+    vector<int> _pending;
+    std::mutex _stageMutex;
+    std::mutex _fileMutex;
+
+    // held by pointer, as its destructor can throw and TileListener's can't
+    std::unique_ptr<tbb::task_group> _tasks{ new tbb::task_group };
+    std::atomic<bool> _flushing{ false };
+    std::chrono::steady_clock::time_point _lastFlush;
+    bool _failed = false;
+  };
+}
@@ -1,69 +1,154 @@
 #include "pbr_math.hpp"
 #include "scene.hpp"
+#include "kernel_table.hpp"
+#include "buffer.hpp"
+#include "progressive.hpp"
+#include <tbb/parallel_for.h>
 
 using namespace pbr;
 extern Vector2u windowSize;
 
 Scene scene;
 
+namespace
+{
+  //---------------------------------------------------------------------------
+  Color Shade(const Ray& r, AovSample* aov)
+  {
+    Vector3 lightPos = Vector3{20, 20, 0};
+
+    HitRec closest;
+    if (!scene.IntersectClosest(r, &closest))
+      return Color(0.1f, 0.1f, 0.1f);
+
+    Vector3 n = closest.normal;
+    const Material* m = closest.material;
+    Vector3 ll = Normalize(lightPos - closest.pos);
+
+    aov->depth = closest.t;
+    aov->normal = n;
+    aov->albedo = m->diffuse;
+    aov->materialId = m->id;
+    aov->objectId = closest.geo->id;
+
+    return Dot(n, ll) * m->diffuse;
+  }
+}
+
 //---------------------------------------------------------------------------
-void RayTrace(const Camera& cam, Color* buffer)
+void RayTrace(const Camera& cam, Buffer* buffer)
 {
   scene.Init();
 
-  // Compute size of the image plane. This is the plane at distance d from the
-  // camera that we will shoot rays through (without AA, one ray per pixel).
-  // The size of the image plane depends on 'd' and the camera fov. For the y
-  // size, the aspect ratio also matters.
+  ImagePlane plane = MakeImagePlane(cam, *buffer);
+  const KernelTable& kernels = Kernels();
+  bool aovs = buffer->aovs != 0;
 
-  float halfWidth = cam.dist * tanf(cam.fov / 2);
-  float imagePlaneWidth = 2 * halfWidth;
-  float imagePlaneHeight = imagePlaneWidth * windowSize.y / windowSize.x;
+  tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
+  {
+    Tile tile = buffer->GetTile(tileIdx);
+    int tileWidth = tile.x1 - tile.x0;
+    vector<float> dx(tileWidth), dy(tileWidth), dz(tileWidth);
 
-  float xInc = imagePlaneWidth / (windowSize.x - 1);
-  float yInc = -imagePlaneHeight / (windowSize.y - 1);
+    for (int y = tile.y0; y < tile.y1; ++y)
+    {
+      // ray directions from the eye pos through the image plane, a row at a time
+      kernels.cameraRayRow(cam.frame.origin,
+          plane.p + Vector3(tile.x0 * plane.xInc, y * plane.yInc, 0),
+          Vector3(plane.xInc, 0, 0),
+          Vector3(0, plane.yInc, 0),
+          nullptr,
+          tileWidth,
+          dx.data(),
+          dy.data(),
+          dz.data());
+
+      Color* pp = buffer->Row(y) + tile.x0;
+      for (int x = 0; x < tileWidth; ++x)
+      {
+        AovSample aov;
+        aov.sampleCount = 1;
+        *pp++ = Shade(Ray(cam.frame.origin, Vector3(dx[x], dy[x], dz[x])), &aov);
 
-//  PoissonSampler sampler;
-//  sampler.Init(64);
+        if (aovs)
+          buffer->SetAovs(tile.x0 + x, y, aov);
+      }
+    }
 
-  // top left corner
-  Vector3 p(cam.frame.origin - halfWidth * cam.frame.right + imagePlaneHeight/2 * cam.frame.up + cam.dist * cam.frame.dir);
-  Vector3 tmp = p;
+    buffer->TileDone(tileIdx);
+  });
+}
 
-  Color* pp = buffer;
+//---------------------------------------------------------------------------
+void RayTraceProgressive(const Camera& cam, Accumulator* acc, u32 numPasses, Buffer* buffer)
+{
+  scene.Init();
 
-  Vector3 lightPos = Vector3{20, 20, 0};
+  ImagePlane plane = MakeImagePlane(cam, *buffer);
+  const KernelTable& kernels = Kernels();
+  bool aovs = buffer->aovs != 0;
 
-  for (u32 y = 0; y < windowSize.y; ++y)
+  // show the tiles that were resumed from a checkpoint
+  tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
   {
-    p = tmp;
-    for (u32 x = 0; x < windowSize.x; ++x)
+    if (acc->tilePasses[tileIdx] == 0)
+      return;
+    acc->Resolve(tileIdx, buffer);
+    buffer->TileDone(tileIdx);
+  });
+
+  // the aovs aren't checkpointed, so their means start with this call's passes
+  vector<u32> startPasses = acc->tilePasses;
+
+  // a pass over all the tiles at a time, so the whole image refines together. Tiles
+  // that were resumed further along sit out until the rest catch up
+  for (u32 pass = acc->MinPasses(); pass < numPasses; ++pass)
+  {
+    tbb::parallel_for(0, buffer->NumTiles(), [&](int tileIdx)
     {
-      Color col(0,0,0);
+      if (acc->tilePasses[tileIdx] != pass)
+        return;
 
-      // construct ray from eye pos through the image plane
-      Ray r(cam.frame.origin, Normalize(p - cam.frame.origin));
+      Tile tile = buffer->GetTile(tileIdx);
+      int tileWidth = tile.x1 - tile.x0;
+      vector<float> dx(tileWidth), dy(tileWidth), dz(tileWidth);
+      vector<Vector2> jitter(tileWidth);
 
-      HitRec closest;
-      if (scene.IntersectClosest(r, &closest))
-      {
-        Vector3 n = closest.normal;
-        const Material* m = closest.material;
-        Vector3 ll = Normalize(lightPos - closest.pos);
-        col += Dot(n, ll) * m->diffuse;
-      }
-      else
+      for (int y = tile.y0; y < tile.y1; ++y)
       {
-        col += Color(0.1f, 0.1f, 0.1f);
-      }
+        // one sample per pixel per pass, at an offset that only depends on the pixel
+        // and the pass
+        u32 absPass = acc->firstPass + pass;
+        for (int x = 0; x < tileWidth; ++x)
+          jitter[x] = PassJitter(acc->seed, (u32)(y * buffer->width + tile.x0 + x), absPass);
+
+        kernels.cameraRayRow(cam.frame.origin,
+            plane.p + Vector3(tile.x0 * plane.xInc, y * plane.yInc, 0),
+            Vector3(plane.xInc, 0, 0),
+            Vector3(0, plane.yInc, 0),
+            jitter.data(),
+            tileWidth,
+            dx.data(),
+            dy.data(),
+            dz.data());
+
+        for (int x = 0; x < tileWidth; ++x)
+        {
+          size_t idx = (size_t)y * buffer->width + tile.x0 + x;
+          AovSample aov;
+          acc->AddSample(idx, Shade(Ray(cam.frame.origin, Vector3(dx[x], dy[x], dz[x])), &aov));
+          aov.sampleCount = acc->count[idx];
 
-      *pp++ = col;
+          if (aovs)
+            buffer->AddAovs(tile.x0 + x, y, aov, pass - startPasses[tileIdx] + 1);
+        }
+      }
 
-      p.x += xInc;
-    }
-    tmp.y += yInc;
+      acc->tilePasses[tileIdx] = pass + 1;
+      acc->Resolve(tileIdx, buffer);
+      buffer->TileDone(tileIdx);
+    });
   }
-
 }
 
 #if 0
@@ -0,0 +1,254 @@
+#include "reservoir.hpp"
+#include "warp.hpp"
+
+using namespace pbr;
+
+namespace
+{
+  //---------------------------------------------------------------------------
+  // A point on the part of the sphere visible from p, picked uniformly by solid
+  // angle, with its pdf by area. False if p is inside the sphere.
+  bool SampleSphere(const Sphere* s, const Vector3& p, const Vector2& u, LightSample* res, float* pdfArea)
+  {
+    Vector3 oc = p - s->center;
+    float distSq = oc.LengthSquared();
+    if (distSq <= s->radiusSquared)
+      return false;
+
+    float cosMax = sqrtf(1 - s->radiusSquared / distSq);
+    Vector3 d = Normalize(ToFrame(UniformCone(u, cosMax), Normalize(s->center - p)));
+
+    // where d meets the sphere. Directions grazing the rim can just miss it, and
+    // get the closest point instead
+    float b = Dot(oc, d);
+    float t = -b - sqrtf(max(0.f, b * b - (distSq - s->radiusSquared)));
+    res->light = const_cast<Sphere*>(s);
+    res->pos = p + d * t;
+    res->normal = Normalize(res->pos - s->center);
+
+    float cosLight = max(-Dot(res->normal, d), 1e-4f);
+    *pdfArea = UniformConePdf(cosMax) * cosLight / (t * t);
+    return true;
+  }
+}
+
+//---------------------------------------------------------------------------
+Color pbr::UnshadowedLight(const ShadingPoint& sp, const LightSample& s)
+{
+  Vector3 l = s.pos - sp.pos;
+  float distSq = l.LengthSquared();
+  if (distSq == 0)
+    return Color(0, 0, 0);
+
+  float invDist = 1 / sqrtf(distSq);
+  float cosSurface = Dot(sp.normal, l) * invDist;
+  float cosLight = -Dot(s.normal, l) * invDist;
+  if (cosSurface <= 0 || cosLight <= 0)
+    return Color(0, 0, 0);
+
+  return sp.diffuse * s.light->material->emissive * (cosSurface * cosLight / distSq * (float)M_1_PI);
+}
+
+//---------------------------------------------------------------------------
+float pbr::TargetPdf(const ShadingPoint& sp, const LightSample& s)
+{
+  return s.light ? Luminance(UnshadowedLight(sp, s)) : 0;
+}
+
+//---------------------------------------------------------------------------
+bool Reservoir::Update(const LightSample& s, float w, float sTargetPdf, float u)
+{
+  weightSum += w;
+  if (w <= 0 || u * weightSum >= w)
+    return false;
+
+  sample = s;
+  targetPdf = sTargetPdf;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void DirectLightResampler::BeginFrame(const Camera& cam, int width, int height)
+{
+  _hasHistory = width == _width && height == _height && !_temporal.empty();
+  _width = width;
+  _height = height;
+  _prevCam = _cam;
+  _cam = cam;
+
+  // the history is from before the spatial merge, so the neighbours' samples
+  // aren't fed back in, where they'd be counted again the next frame
+  std::swap(_points, _prevPoints);
+  std::swap(_temporal, _prevTemporal);
+  size_t numPixels = (size_t)width * height;
+  _points.resize(numPixels);
+  _temporal.resize(numPixels);
+  _final.resize(numPixels);
+}
+
+//---------------------------------------------------------------------------
+void DirectLightResampler::Sample(int x, int y, const ShadingPoint& sp, const LightBvh& lights)
+{
+  size_t idx = (size_t)y * _width + x;
+  _points[idx] = sp;
+
+  Reservoir r;
+  if (sp.depth == 0)
+  {
+    _temporal[idx] = r;
+    return;
+  }
+
+  // resampled importance sampling, with the bvh's picks as the source
+  for (int i = 0; i < numCandidates; ++i)
+  {
+    float pmf;
+    Geo* g = lights.Sample(sp.pos, sp.normal, Randf(), &pmf);
+    LightSample s;
+    float pdfArea;
+    Vector2 u = Randf2();
+    if (!g || !SampleSphere(static_cast<Sphere*>(g), sp.pos, u, &s, &pdfArea))
+      continue;
+
+    float p = TargetPdf(sp, s);
+    r.Update(s, p / (pmf * pdfArea * numCandidates), p, Randf());
+  }
+  r.m = (float)numCandidates;
+  r.Finalize();
+
+  int prevX, prevY;
+  if (_hasHistory && Reproject(sp.pos, &prevX, &prevY))
+  {
+    size_t prevIdx = (size_t)prevY * _width + prevX;
+    if (Similar(sp, _prevPoints[prevIdx]))
+    {
+      const Reservoir& prev = _prevTemporal[prevIdx];
+      const ShadingPoint* points[] = {&sp, &_prevPoints[prevIdx]};
+      const Reservoir* reservoirs[] = {&r, &prev};
+      float m[] = {r.m, min(prev.m, maxHistory * numCandidates)};
+      r = Merge(points, reservoirs, m, 2);
+    }
+  }
+
+  _temporal[idx] = r;
+}
+
+//---------------------------------------------------------------------------
+void DirectLightResampler::Reuse(int x, int y)
+{
+  size_t idx = (size_t)y * _width + x;
+  const ShadingPoint& sp = _points[idx];
+  const Reservoir& own = _temporal[idx];
+  if (sp.depth == 0)
+  {
+    _final[idx] = own;
+    return;
+  }
+
+  const int MAX_MERGED = 16;
+  const ShadingPoint* points[MAX_MERGED] = {&sp};
+  const Reservoir* reservoirs[MAX_MERGED] = {&own};
+  float m[MAX_MERGED] = {own.m};
+  int count = 1;
+  for (int i = 0; i < numNeighbours && count < MAX_MERGED; ++i)
+  {
+    Vector2 d = ConcentricDisk(Randf2()) * neighbourRadius;
+    int nx = x + (int)floorf(d.x + 0.5f);
+    int ny = y + (int)floorf(d.y + 0.5f);
+    if (nx < 0 || nx >= _width || ny < 0 || ny >= _height || (nx == x && ny == y))
+      continue;
+
+    size_t nIdx = (size_t)ny * _width + nx;
+    if (!Similar(sp, _points[nIdx]))
+      continue;
+
+    // A neighbour is credited with a frame's candidates at most, whatever its
+    // history. Its sample was picked for somewhere else, so it's worth less here
+    // than the pixel's own
+    points[count] = &_points[nIdx];
+    reservoirs[count] = &_temporal[nIdx];
+    m[count] = min(_temporal[nIdx].m, (float)numCandidates);
+    ++count;
+  }
+  _final[idx] = Merge(points, reservoirs, m, count);
+}
+
+//---------------------------------------------------------------------------
+Reservoir DirectLightResampler::Merge(
+    const ShadingPoint* const* points, const Reservoir* const* reservoirs, const float* m, int count) const
+{
+  // Pairwise mis (Bitterli 2022), with the pixel's own reservoir as the
+  // canonical one. Each of the others is weighed against a share of the canonical
+  // one only, so a neighbour with different lighting can't take over samples the
+  // pixel picks well itself
+  const ShadingPoint& sp = *points[0];
+  const Reservoir& canonical = *reservoirs[0];
+  int numOthers = count - 1;
+  float mCanonical = numOthers > 0 ? m[0] / numOthers : m[0];
+  float mTotal = 0;
+  for (int i = 0; i < count; ++i)
+    mTotal += m[i];
+
+  Reservoir res;
+  res.m = mTotal;
+  if (mTotal == 0)
+    return res;
+
+  float misCanonical = numOthers > 0 ? 0 : 1;
+  for (int i = 1; i < count; ++i)
+  {
+    // the pair's share of the merge
+    float share = (mCanonical + m[i]) / mTotal;
+
+    // the canonical sample, as if it could have come from the neighbour
+    if (canonical.sample.light)
+    {
+      float pNeighbour = m[i] * TargetPdf(*points[i], canonical.sample);
+      float pCanonical = mCanonical * canonical.targetPdf;
+      misCanonical += share * pCanonical / (pCanonical + pNeighbour);
+    }
+
+    // and the neighbour's sample, as if it could have come from the pixel
+    const Reservoir& r = *reservoirs[i];
+    if (!r.sample.light || r.W == 0)
+      continue;
+    float p = TargetPdf(sp, r.sample);
+    float pNeighbour = m[i] * r.targetPdf;
+    float pCanonical = mCanonical * p;
+    float mis = share * pNeighbour / (pCanonical + pNeighbour);
+    res.Update(r.sample, mis * p * r.W, p, Randf());
+  }
+
+  if (canonical.sample.light && canonical.W > 0)
+    res.Update(canonical.sample, misCanonical * canonical.targetPdf * canonical.W, canonical.targetPdf, Randf());
+  res.Finalize();
+  return res;
+}
+
+//---------------------------------------------------------------------------
+bool DirectLightResampler::Similar(const ShadingPoint& a, const ShadingPoint& b) const
+{
+  // within 25 degrees, and 10% of the depth
+  return a.depth > 0 && b.depth > 0 && Dot(a.normal, b.normal) > 0.9f && fabsf(a.depth - b.depth) < 0.1f * a.depth;
+}
+
+//---------------------------------------------------------------------------
+bool DirectLightResampler::Reproject(const Vector3& pos, int* x, int* y) const
+{
+  // the image plane as the renderer sets it up, for last frame's camera
+  const Frame& frame = _prevCam.frame;
+  Vector3 v = pos - frame.origin;
+  float z = Dot(v, frame.dir);
+  if (z <= 0)
+    return false;
+
+  float halfWidth = _prevCam.dist * tanf(_prevCam.fov / 2);
+  float imagePlaneWidth = 2 * halfWidth;
+  float imagePlaneHeight = imagePlaneWidth * _height / _width;
+  float px = Dot(v, frame.right) * _prevCam.dist / z;
+  float py = Dot(v, frame.up) * _prevCam.dist / z;
+
+  *x = (int)floorf((px + halfWidth) * (_width - 1) / imagePlaneWidth + 0.5f);
+  *y = (int)floorf((imagePlaneHeight / 2 - py) * (_height - 1) / imagePlaneHeight + 0.5f);
+  return *x >= 0 && *x < _width && *y >= 0 && *y < _height;
+}
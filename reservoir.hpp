@@ -0,0 +1,103 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "light_bvh.hpp"
+
+namespace pbr
+{
+  //---------------------------------------------------------------------------
+  // a point on an emitter's surface
+  struct LightSample
+  {
+    Geo* light = nullptr;
+    Vector3 pos;
+    Vector3 normal;
+  };
+
+  //---------------------------------------------------------------------------
+  // a pixel's first hit, as far as its direct light goes
+  struct ShadingPoint
+  {
+    Vector3 pos;
+    // facing the eye
+    Vector3 normal;
+    Color diffuse;
+    // distance from the eye, 0 if nothing was hit
+    float depth = 0;
+  };
+
+  // diffuse brdf * emitted radiance * geometry term, for s lighting sp, unshadowed
+  Color UnshadowedLight(const ShadingPoint& sp, const LightSample& s);
+  // the luminance of the unshadowed light, what the resampling aims for
+  float TargetPdf(const ShadingPoint& sp, const LightSample& s);
+
+  //---------------------------------------------------------------------------
+  // Weighted reservoir sampling (Chao 1982) over light samples: a stream of
+  // candidates goes in, and the one kept is picked in proportion to their weights.
+  // Once finalized, sample's light times W estimates the direct light at the
+  // reservoir's point.
+  struct Reservoir
+  {
+    // adds a candidate with resampling weight w, which already includes its mis
+    // weight. u is uniform in [0, 1). Returns true if the candidate replaced the
+    // current sample
+    bool Update(const LightSample& s, float w, float sTargetPdf, float u);
+    // turns the sum of weights into W
+    void Finalize() { W = targetPdf > 0 ? weightSum / targetPdf : 0; }
+
+    LightSample sample;
+    // of sample, at the reservoir's point
+    float targetPdf = 0;
+    float weightSum = 0;
+    float W = 0;
+    // the number of candidates it stands for, its confidence when merged
+    float m = 0;
+  };
+
+  //---------------------------------------------------------------------------
+  // Reservoir-based spatiotemporal importance resampling of the direct light at
+  // each pixel's first hit (Bitterli et al. 2020, "Spatiotemporal reservoir
+  // resampling for real-time ray tracing with dynamic direct lighting"). Each
+  // frame a pixel resamples candidates from the light bvh, then merges in its
+  // reservoir from the last frame, found by reprojecting the hit, and those of a
+  // few neighbours with similar hits. Each final reservoir stands for thousands of
+  // candidates, so one shadow ray towards its sample gives low noise direct light.
+  //
+  // The merges use pairwise mis weights over the merged pixels' target pdfs, so
+  // neighbours whose lighting differs don't bias the result. Visibility isn't part
+  // of the target, so the only shadow ray is the one for the final sample;
+  // neighbours with dissimilar hits are skipped.
+  struct DirectLightResampler
+  {
+    // moves this frame's reservoirs into the history, and resizes for the new frame
+    void BeginFrame(const Camera& cam, int width, int height);
+    // picks the pixel's initial sample, and merges in its history
+    void Sample(int x, int y, const ShadingPoint& sp, const LightBvh& lights);
+    // merges in the neighbours. Call once Sample is done for all the pixels
+    void Reuse(int x, int y);
+    const Reservoir& Final(int x, int y) const { return _final[(size_t)y * _width + x]; }
+
+    // light bvh candidates per pixel and frame
+    int numCandidates = 32;
+    int numNeighbours = 4;
+    // in pixels
+    float neighbourRadius = 10;
+    // the history is credited with at most this many frames' worth of candidates,
+    // so it can't take over when the lighting changes
+    float maxHistory = 20;
+
+  private:
+    // the reservoirs, for the points with the confidences in m, merged into one for
+    // points[0]
+    Reservoir Merge(const ShadingPoint* const* points, const Reservoir* const* reservoirs, const float* m, int count) const;
+    bool Similar(const ShadingPoint& a, const ShadingPoint& b) const;
+    // where pos was on screen last frame, false if it was off screen
+    bool Reproject(const Vector3& pos, int* x, int* y) const;
+
+    int _width = 0, _height = 0;
+    Camera _cam, _prevCam;
+    bool _hasHistory = false;
+    vector<ShadingPoint> _points, _prevPoints;
+    // after the temporal merge, and after the spatial one
+    vector<Reservoir> _temporal, _final, _prevTemporal;
+  };
+}
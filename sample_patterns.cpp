@@ -0,0 +1,33 @@
+#include "sample_patterns.hpp"
+
+using namespace pbr;
+using namespace pbr::patterns;
+
+namespace
+{
+  const u64 PATTERN_SEED = 0x2545f4914f6cdd1dull;
+  const u32 BLUE_NOISE_CANDIDATES = 32;
+
+  // evaluated by the compiler, the tables below are plain copies of these, so they
+  // end up as initialized data
+  constexpr SamplePattern<16> stratified16 = MakeStratified<16>(PATTERN_SEED);
+  constexpr SamplePattern<64> stratified64 = MakeStratified<64>(PATTERN_SEED);
+  constexpr SamplePattern<256> stratified256 = MakeStratified<256>(PATTERN_SEED);
+  constexpr SamplePattern<16> multiJittered16 = MakeMultiJittered<16>((u32)PATTERN_SEED);
+  constexpr SamplePattern<64> multiJittered64 = MakeMultiJittered<64>((u32)PATTERN_SEED);
+  constexpr SamplePattern<256> multiJittered256 = MakeMultiJittered<256>((u32)PATTERN_SEED);
+  constexpr SamplePattern<16> blueNoise16 = MakeBlueNoise<16, BLUE_NOISE_CANDIDATES>(PATTERN_SEED);
+  constexpr SamplePattern<64> blueNoise64 = MakeBlueNoise<64, BLUE_NOISE_CANDIDATES>(PATTERN_SEED);
+}
+
+namespace pbr
+{
+  template <> const SamplePattern<16> BakedPattern<PatternType::Stratified, 16>::table = stratified16;
+  template <> const SamplePattern<64> BakedPattern<PatternType::Stratified, 64>::table = stratified64;
+  template <> const SamplePattern<256> BakedPattern<PatternType::Stratified, 256>::table = stratified256;
+  template <> const SamplePattern<16> BakedPattern<PatternType::MultiJittered, 16>::table = multiJittered16;
+  template <> const SamplePattern<64> BakedPattern<PatternType::MultiJittered, 64>::table = multiJittered64;
+  template <> const SamplePattern<256> BakedPattern<PatternType::MultiJittered, 256>::table = multiJittered256;
+  template <> const SamplePattern<16> BakedPattern<PatternType::BlueNoise, 16>::table = blueNoise16;
+  template <> const SamplePattern<64> BakedPattern<PatternType::BlueNoise, 64>::table = blueNoise64;
+}
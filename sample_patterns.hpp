@@ -0,0 +1,265 @@
+#pragma once
+#include "pbr_math.hpp"
+#include "kernel_table.hpp"
+#include "warp.hpp"
+#include <string.h>
+
+namespace pbr
+{
+  // Sample patterns generated at compile time and stored in the binary, so they cost
+  // nothing at startup. The generators are constexpr templates, but they're only
+  // instantiated in sample_patterns.cpp, which bakes the tables; everything else
+  // gets at them through BakedPattern.
+
+  //---------------------------------------------------------------------------
+  // N points in [-1..1], [-1..1], as separate x and y arrays
+  template <u32 N>
+  struct SamplePattern
+  {
+    float x[N];
+    float y[N];
+  };
+
+  enum class PatternType
+  {
+    // one jittered point per cell of a sqrt(N) x sqrt(N) grid, in cell order
+    Stratified,
+    // Kensler's correlated multi-jittered points, stratified on the grid and in
+    // each dimension, in shuffled order
+    MultiJittered,
+    // Mitchell's best candidate points on the torus, so the pattern tiles. Any
+    // prefix of the table is evenly spread too
+    BlueNoise,
+  };
+
+  namespace patterns
+  {
+    //---------------------------------------------------------------------------
+    constexpr u32 Isqrt(u32 n)
+    {
+      u32 r = 0;
+      while ((r + 1) * (r + 1) <= n)
+        ++r;
+      return r;
+    }
+
+    //---------------------------------------------------------------------------
+    // Kensler, "Correlated Multi-Jittered Sampling" (2013). A random permutation of
+    // [0, l) picked by p, that can be evaluated one element at a time.
+    constexpr u32 Permute(u32 i, u32 l, u32 p)
+    {
+      u32 w = l - 1;
+      w |= w >> 1;
+      w |= w >> 2;
+      w |= w >> 4;
+      w |= w >> 8;
+      w |= w >> 16;
+      do
+      {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+      } while (i >= l);
+      return (i + p) % l;
+    }
+
+    //---------------------------------------------------------------------------
+    // [0, 1) hashed from i and p
+    constexpr float HashFloat(u32 i, u32 p)
+    {
+      i ^= p;
+      i ^= i >> 17;
+      i ^= i >> 10;
+      i *= 0xb36534e5u;
+      i ^= i >> 12;
+      i ^= i >> 21;
+      i *= 0x93fc4795u;
+      i ^= 0xdf6e307fu;
+      i ^= i >> 17;
+      i *= 1 | p >> 18;
+      return (i >> 8) * (1.f / (1 << 24));
+    }
+
+    //---------------------------------------------------------------------------
+    constexpr float TorusDistSq(float ax, float ay, float bx, float by)
+    {
+      float dx = ax > bx ? ax - bx : bx - ax;
+      float dy = ay > by ? ay - by : by - ay;
+      dx = dx > 0.5f ? 1 - dx : dx;
+      dy = dy > 0.5f ? 1 - dy : dy;
+      return dx * dx + dy * dy;
+    }
+
+    //---------------------------------------------------------------------------
+    template <u32 N>
+    constexpr SamplePattern<N> MakeStratified(u64 seed)
+    {
+      static_assert(Isqrt(N) * Isqrt(N) == N, "stratified patterns need a square count");
+      const u32 s = Isqrt(N);
+      SamplePattern<N> res{};
+      Pcg32 rng(seed, N);
+      for (u32 i = 0; i < N; ++i)
+      {
+        float jx = rng.NextFloat();
+        float jy = rng.NextFloat();
+        res.x[i] = (i % s + jx) * 2 / s - 1;
+        res.y[i] = (i / s + jy) * 2 / s - 1;
+      }
+      return res;
+    }
+
+    //---------------------------------------------------------------------------
+    template <u32 N>
+    constexpr SamplePattern<N> MakeMultiJittered(u32 seed)
+    {
+      static_assert(Isqrt(N) * Isqrt(N) == N, "multi-jittered patterns need a square count");
+      const u32 m = Isqrt(N);
+      SamplePattern<N> res{};
+      for (u32 i = 0; i < N; ++i)
+      {
+        u32 s = Permute(i, N, seed * 0x51633e2du);
+        u32 sx = Permute(s % m, m, seed * 0xa511e9b3u);
+        u32 sy = Permute(s / m, m, seed * 0x63d83595u);
+        float jx = HashFloat(s, seed * 0xa399d265u);
+        float jy = HashFloat(s, seed * 0x711ad6a5u);
+        res.x[i] = (s % m + (sy + jx) / m) * 2 / m - 1;
+        res.y[i] = (s / m + (sx + jy) / m) * 2 / m - 1;
+      }
+      return res;
+    }
+
+    //---------------------------------------------------------------------------
+    // Each new point is the candidate furthest from the ones already placed. The
+    // candidate count is fixed rather than growing with the table, which keeps the
+    // compile time quadratic; the spacing is still close to Poisson disk.
+    template <u32 N, u32 Candidates>
+    constexpr SamplePattern<N> MakeBlueNoise(u64 seed)
+    {
+      SamplePattern<N> res{};
+      Pcg32 rng(seed, N);
+      for (u32 i = 0; i < N; ++i)
+      {
+        float bestDist = -1;
+        for (u32 c = 0; c < Candidates; ++c)
+        {
+          float cx = rng.NextFloat();
+          float cy = rng.NextFloat();
+          float dist = 2;
+          for (u32 j = 0; j < i; ++j)
+          {
+            float d = TorusDistSq(cx, cy, res.x[j], res.y[j]);
+            dist = d < dist ? d : dist;
+          }
+          if (dist > bestDist)
+          {
+            bestDist = dist;
+            res.x[i] = cx;
+            res.y[i] = cy;
+          }
+        }
+      }
+
+      for (u32 i = 0; i < N; ++i)
+      {
+        res.x[i] = res.x[i] * 2 - 1;
+        res.y[i] = res.y[i] * 2 - 1;
+      }
+      return res;
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  // The baked tables. Each pattern comes in 16, 64 and 256 points, except blue noise
+  // which stops at 64, as best candidate is quadratic and 256 points would go past
+  // the compilers' constexpr evaluation limits.
+  template <PatternType Type, u32 N>
+  struct BakedPattern
+  {
+    static const SamplePattern<N> table;
+  };
+
+  template <> const SamplePattern<16> BakedPattern<PatternType::Stratified, 16>::table;
+  template <> const SamplePattern<64> BakedPattern<PatternType::Stratified, 64>::table;
+  template <> const SamplePattern<256> BakedPattern<PatternType::Stratified, 256>::table;
+  template <> const SamplePattern<16> BakedPattern<PatternType::MultiJittered, 16>::table;
+  template <> const SamplePattern<64> BakedPattern<PatternType::MultiJittered, 64>::table;
+  template <> const SamplePattern<256> BakedPattern<PatternType::MultiJittered, 256>::table;
+  template <> const SamplePattern<16> BakedPattern<PatternType::BlueNoise, 16>::table;
+  template <> const SamplePattern<64> BakedPattern<PatternType::BlueNoise, 64>::table;
+
+  //---------------------------------------------------------------------------
+  // Sampler over a baked pattern, cycling through the table. Init is a no-op, the
+  // count is the template's.
+  template <PatternType Type, u32 N>
+  struct BakedSampler : public Sampler
+  {
+    virtual Vector2 NextSample()
+    {
+      const SamplePattern<N>& p = BakedPattern<Type, N>::table;
+      u32 i = Advance(&_idx, 1);
+      return Vector2(p.x[i], p.y[i]);
+    }
+
+    virtual Vector2 NextDiskSample()
+    {
+      const SamplePattern<N>& p = BakedPattern<Type, N>::table;
+      u32 i = Advance(&_idxDisk, 1);
+      return ConcentricDisk(Vector2(p.x[i] * 0.5f + 0.5f, p.y[i] * 0.5f + 0.5f));
+    }
+
+    virtual void NextSamples(u32 count, float* xs, float* ys) { Copy(&_idx, count, xs, ys); }
+
+    virtual void NextDiskSamples(u32 count, float* xs, float* ys)
+    {
+      Copy(&_idxDisk, count, xs, ys);
+      for (u32 i = 0; i < count; ++i)
+      {
+        xs[i] = xs[i] * 0.5f + 0.5f;
+        ys[i] = ys[i] * 0.5f + 0.5f;
+      }
+      Kernels().warpBatch(Warp::ConcentricDisk, 0, xs, ys, (int)count, xs, ys, nullptr);
+    }
+
+  private:
+    // returns the current index, and moves it on by count (at most what's left)
+    static u32 Advance(u32* idx, u32 count)
+    {
+      u32 res = *idx;
+      *idx = res + count == N ? 0 : res + count;
+      return res;
+    }
+
+    void Copy(u32* idx, u32 count, float* xs, float* ys)
+    {
+      const SamplePattern<N>& p = BakedPattern<Type, N>::table;
+      while (count > 0)
+      {
+        u32 run = min(count, N - *idx);
+        u32 i = Advance(idx, run);
+        memcpy(xs, p.x + i, run * sizeof(float));
+        memcpy(ys, p.y + i, run * sizeof(float));
+        xs += run;
+        ys += run;
+        count -= run;
+      }
+    }
+
+    u32 _idx = 0;
+    u32 _idxDisk = 0;
+  };
+}
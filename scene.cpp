@@ -1,10 +1,15 @@
 #include "scene.hpp"
+#include "kernel_table.hpp"
 
 using namespace pbr;
 
 //---------------------------------------------------------------------------
 void Scene::Init()
 {
+  // RayTrace calls this every frame
+  if (!objects.empty())
+    return;
+
   float lumScale = 1.f;
   Color ballDiffuse(0.1f, 0.4f, 0.4f);
   Color ballSpec(0.2f, 0.2f, 0.2f);
@@ -37,29 +42,88 @@ void Scene::Init()
   Geo* plane = new Plane(Vector3(0, 1, 0), 0);
   plane->material = new Material(planeDiffuse, planeSpec, zero);
   objects.push_back(plane);
+  AssignIds(objects);
 
   for (Geo* g : objects)
   {
     if (g->material->emissive.Max3() > 0)
       emitters.push_back(g);
   }
+
+  BuildPackets();
 }
 
 //---------------------------------------------------------------------------
-bool Scene::IntersectClosest(const Ray& r, HitRec* hitRec)
+void Scene::BuildPackets()
 {
-  float closest = FLT_MAX;
-  float eps = 0.00001f;
-  for (Geo* obj : objects)
+  spheres = SpherePacket();
+  planes = PlanePacket();
+
+  for (Geo* g : objects)
   {
-    if (obj->Intersect(r, hitRec))
+    if (g->type == Geo::Type::Sphere)
     {
-      if (hitRec->t < closest && hitRec->t >= eps)
-      {
-        closest = hitRec->t;
-      }
+      Sphere* s = static_cast<Sphere*>(g);
+      spheres.cx.push_back(s->center.x);
+      spheres.cy.push_back(s->center.y);
+      spheres.cz.push_back(s->center.z);
+      spheres.radiusSq.push_back(s->radiusSquared);
+      spheres.geos.push_back(g);
+    }
+    else
+    {
+      Plane* p = static_cast<Plane*>(g);
+      planes.nx.push_back(p->normal.x);
+      planes.ny.push_back(p->normal.y);
+      planes.nz.push_back(p->normal.z);
+      planes.distance.push_back(p->distance);
+      planes.geos.push_back(g);
     }
   }
 
-  return closest != FLT_MAX;
+  // the kernels mask off the padding, so it just has to be readable
+  const size_t PAD = 16;
+  size_t numSpheres = (spheres.geos.size() + PAD - 1) & ~(PAD - 1);
+  for (vector<float>* v : {&spheres.cx, &spheres.cy, &spheres.cz, &spheres.radiusSq})
+    v->resize(numSpheres, 0);
+
+  size_t numPlanes = (planes.geos.size() + PAD - 1) & ~(PAD - 1);
+  for (vector<float>* v : {&planes.nx, &planes.ny, &planes.nz, &planes.distance})
+    v->resize(numPlanes, 0);
+}
+
+//---------------------------------------------------------------------------
+bool Scene::IntersectClosest(const Ray& r, HitRec* hitRec)
+{
+  const KernelTable& kernels = Kernels();
+
+  float closest = FLT_MAX;
+  Geo* geo = nullptr;
+
+  int idx = kernels.intersectSpheres(r,
+      spheres.cx.data(),
+      spheres.cy.data(),
+      spheres.cz.data(),
+      spheres.radiusSq.data(),
+      (int)spheres.geos.size(),
+      &closest);
+  if (idx != -1)
+    geo = spheres.geos[idx];
+
+  idx = kernels.intersectPlanes(r,
+      planes.nx.data(),
+      planes.ny.data(),
+      planes.nz.data(),
+      planes.distance.data(),
+      (int)planes.geos.size(),
+      &closest);
+  if (idx != -1)
+    geo = planes.geos[idx];
+
+  if (!geo)
+    return false;
+
+  // let the closest object fill in the rest of the hit record
+  hitRec->t = FLT_MAX;
+  return geo->Intersect(r, hitRec);
 }
@@ -10,5 +10,19 @@ namespace pbr
 
     vector<Geo*> objects;
     vector<Geo*> emitters;
+
+    // SoA copies of the spheres and planes for the wide kernels, padded to a
+    // multiple of the widest kernel
+    void BuildPackets();
+    struct SpherePacket
+    {
+      vector<float> cx, cy, cz, radiusSq;
+      vector<Geo*> geos;
+    } spheres;
+    struct PlanePacket
+    {
+      vector<float> nx, ny, nz, distance;
+      vector<Geo*> geos;
+    } planes;
   };
 }
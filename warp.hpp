@@ -0,0 +1,95 @@
+#pragma once
+#include "pbr_math.hpp"
+
+namespace pbr
+{
+  // Warps from the unit square to the usual sampling domains. Each one is a direct
+  // mapping, so a sample costs the same every time and stratification of the input
+  // points carries over to the output. Directions are in a local frame with z as the
+  // pole, see ToFrame. The batch forms are in the kernel table (warpBatch), and use
+  // the same mappings.
+  //
+  // dist_test checks each warp against its pdf with a chi-square test, and the batch
+  // forms against the scalar ones. A new warp needs an entry in its WarpChecks.
+
+  //---------------------------------------------------------------------------
+  // Shirley and Chiu's concentric map to the unit disk
+  inline Vector2 ConcentricDisk(const Vector2& u)
+  {
+    float a = 2 * u.x - 1;
+    float b = 2 * u.y - 1;
+
+    // the wedges where |a| > |b| map a to the radius, the others b
+    bool big = fabsf(a) > fabsf(b);
+    float r = big ? a : b;
+    float t = r == 0 ? 0 : (Pi / 4) * (big ? b : a) / r;
+    float s = sinf(t);
+    float c = cosf(t);
+    // in the second set of wedges the angle is pi/2 - t
+    return big ? Vector2(r * c, r * s) : Vector2(r * s, r * c);
+  }
+
+  //---------------------------------------------------------------------------
+  // Malley's method, the concentric disk projected up to the hemisphere
+  inline Vector3 CosineHemisphere(const Vector2& u)
+  {
+    Vector2 d = ConcentricDisk(u);
+    return Vector3(d.x, d.y, sqrtf(max(0.f, 1 - d.x * d.x - d.y * d.y)));
+  }
+
+  //---------------------------------------------------------------------------
+  // Uniform over the cap of directions within acos(cosMax) of the pole. The disk's
+  // squared radius maps linearly to 1 - cos(theta), which keeps it area preserving
+  // without needing the angle.
+  inline Vector3 UniformCone(const Vector2& u, float cosMax)
+  {
+    Vector2 d = ConcentricDisk(u);
+    float r2 = d.x * d.x + d.y * d.y;
+    float z = 1 - r2 * (1 - cosMax);
+    // sin(theta) / r
+    float s = sqrtf(max(0.f, (1 - cosMax) * (1 + z)));
+    return Vector3(d.x * s, d.y * s, z);
+  }
+
+  //---------------------------------------------------------------------------
+  inline Vector3 UniformSphere(const Vector2& u) { return UniformCone(u, -1); }
+
+  inline Vector3 UniformHemisphere(const Vector2& u) { return UniformCone(u, 0); }
+
+  //---------------------------------------------------------------------------
+  // Heitz's low distortion map from the square to the triangle. Returns barycentrics
+  // (b0, b1, b2), for the point b0 * p0 + b1 * p1 + b2 * p2.
+  inline Vector3 UniformTriangle(const Vector2& u)
+  {
+    float b0, b1;
+    if (u.y > u.x)
+    {
+      b0 = u.x * 0.5f;
+      b1 = u.y - b0;
+    }
+    else
+    {
+      b1 = u.y * 0.5f;
+      b0 = u.x - b1;
+    }
+    return Vector3(b0, b1, 1 - b0 - b1);
+  }
+
+  //---------------------------------------------------------------------------
+  // Densities of the warps, per unit area or solid angle
+  inline float ConcentricDiskPdf() { return 1 / Pi; }
+  inline float CosineHemispherePdf(float cosTheta) { return cosTheta > 0 ? cosTheta / Pi : 0; }
+  inline float UniformConePdf(float cosMax) { return 1 / (2 * Pi * (1 - cosMax)); }
+  inline float UniformSpherePdf() { return 1 / (4 * Pi); }
+  inline float UniformHemispherePdf() { return 1 / (2 * Pi); }
+  inline float UniformTrianglePdf(float area) { return 1 / area; }
+
+  //---------------------------------------------------------------------------
+  // local direction in a frame with n as the pole
+  inline Vector3 ToFrame(const Vector3& local, const Vector3& n)
+  {
+    Vector3 u, v;
+    CreateCoordinateSystem(n, &u, &v);
+    return local.x * u + local.y * v + local.z * n;
+  }
+}